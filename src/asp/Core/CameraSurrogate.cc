@@ -0,0 +1,531 @@
+// __BEGIN_LICENSE__
+//  Copyright (c) 2009-2013, United States Government as represented by the
+//  Administrator of the National Aeronautics and Space Administration. All
+//  rights reserved.
+//
+//  The NGT platform is licensed under the Apache License, Version 2.0 (the
+//  "License"); you may not use this file except in compliance with the
+//  License. You may obtain a copy of the License at
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+// __END_LICENSE__
+
+
+
+#include <vw/Core/Exception.h>
+#include <vw/Core/Log.h>
+#include <vw/Math/Vector.h>
+#include <asp/Core/CameraSurrogate.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <limits>
+#include <sstream>
+
+using namespace vw;
+
+namespace {
+
+  // The coarse grids have up to 2^COARSE_LEVEL cells per axis. Their
+  // cells are refined by doubling, up to 2^MAX_LEVEL parts per axis.
+  const int COARSE_LEVEL     = 3;
+  const int MAX_RAY_LEVEL    = 7;
+  const int MAX_GROUND_LEVEL = 6;
+  const int MAX_HEIGHT_LAYERS = 33;
+
+  const double NaN = std::numeric_limits<double>::quiet_NaN();
+
+  // Bilinear interpolation in a row-major grid, allowing a bit of
+  // extrapolation beyond the edge cells.
+  template <class T>
+  T interp_grid( std::vector<T> const& grid, Vector2i const& dims,
+                 int offset, double x, double y ) {
+    int i = std::min( std::max( int(floor(x)), 0 ), dims.x() - 2 );
+    int j = std::min( std::max( int(floor(y)), 0 ), dims.y() - 2 );
+    double fx = x - i, fy = y - j;
+    size_t k = offset + size_t(j) * dims.x() + i;
+    return (1-fy) * ( (1-fx) * grid[k]            + fx * grid[k+1] ) +
+              fy  * ( (1-fx) * grid[k+dims.x()]   + fx * grid[k+dims.x()+1] );
+  }
+
+  double angle_between( Vector3 const& a, Vector3 const& b ) {
+    double c = dot_prod( a, b ) / ( norm_2(a) * norm_2(b) );
+    return acos( std::min( std::max( c, -1.0 ), 1.0 ) );
+  }
+
+  // Intersect a ray with the datum ellipsoid raised by the given
+  // height. Returns false if they do not meet.
+  bool ellipsoid_intersection( cartography::Datum const& datum, double height,
+                               Vector3 const& ctr, Vector3 const& dir,
+                               Vector3 & xyz ) {
+    double a = datum.semi_major_axis() + height;
+    double b = datum.semi_minor_axis() + height;
+    // Scale z so the ellipsoid becomes a sphere of radius a
+    Vector3 c( ctr[0], ctr[1], ctr[2] * a / b );
+    Vector3 d( dir[0], dir[1], dir[2] * a / b );
+    double A = dot_prod(d,d), B = 2 * dot_prod(c,d), C = dot_prod(c,c) - a*a;
+    double disc = B*B - 4*A*C;
+    if ( disc < 0 )
+      return false;
+    double t = ( -B - sqrt(disc) ) / ( 2*A );
+    if ( t < 0 )
+      return false;
+    xyz = ctr + t * dir;
+    return true;
+  }
+
+  int nodes_for_level( int level, int size ) {
+    return std::min( 1 << level, std::max( size - 1, 1 ) ) + 1;
+  }
+
+  // The cell of a grid of num_cells holding x, given in cell units,
+  // and where x is in that cell.
+  int cell_index( double x, int num_cells, double & frac ) {
+    int i = std::min( std::max( int(floor(x)), 0 ), num_cells - 1 );
+    frac = x - i;
+    return i;
+  }
+
+  // Where a cell divided into n parts per axis is checked: at the
+  // centers and edge midpoints of the parts, in units of parts. The
+  // edges matter, as an error there is as large as at the centers.
+  std::vector<Vector2> check_points( int n ) {
+    std::vector<Vector2> points;
+    for ( int v = 0; v <= 2*n; v++ )
+      for ( int u = 0; u <= 2*n; u++ )
+        if ( u % 2 == 1 || v % 2 == 1 )
+          points.push_back( Vector2(u, v) / 2.0 );
+    return points;
+  }
+
+  Vector<double, 6> camera_ray( camera::CameraModel const& camera, Vector2 const& pix ) {
+    Vector<double, 6> ray;
+    subvector( ray, 0, 3 ) = camera.camera_center(pix);
+    subvector( ray, 3, 3 ) = camera.pixel_to_vector(pix);
+    return ray;
+  }
+
+} // end anonymous namespace
+
+asp::CameraSurrogate::CameraSurrogate( camera::CameraModel const& camera,
+                                       Vector2i const& image_size,
+                                       double tolerance ) :
+  m_ray_error(0), m_ground_error(0) {
+  Vector2 mid = (Vector2(image_size) - Vector2(1,1)) / 2.0;
+  build_ray_grid( camera, image_size, tolerance,
+                  norm_2( camera.camera_center(mid) ) );
+}
+
+asp::CameraSurrogate::CameraSurrogate( camera::CameraModel const& camera,
+                                       Vector2i const& image_size,
+                                       double tolerance,
+                                       cartography::Datum const& datum,
+                                       Vector2 const& height_range ) :
+  m_ray_error(0), m_datum(datum), m_ground_error(0) {
+
+  // Measure ray errors at the distance of the ground
+  Vector2 mid = (Vector2(image_size) - Vector2(1,1)) / 2.0;
+  Vector3 ctr = camera.camera_center(mid), xyz;
+  double range = norm_2(ctr);
+  if ( ellipsoid_intersection( datum, (height_range[0] + height_range[1]) / 2,
+                               ctr, camera.pixel_to_vector(mid), xyz ) )
+    range = norm_2( xyz - ctr );
+
+  build_ray_grid   ( camera, image_size, tolerance, range );
+  build_ground_grid( camera, image_size, tolerance, height_range );
+}
+
+void asp::CameraSurrogate::build_ray_grid( camera::CameraModel const& camera,
+                                           Vector2i const& image_size,
+                                           double tolerance, double range ) {
+  VW_ASSERT( image_size.x() > 0 && image_size.y() > 0 && tolerance > 0,
+             ArgumentErr() << "CameraSurrogate: invalid image size or tolerance.\n" );
+
+  // The angle subtended by a pixel, to express errors in pixels
+  Vector2 mid = (Vector2(image_size) - Vector2(1,1)) / 2.0;
+  Vector3 mid_dir = camera.pixel_to_vector(mid);
+  double pixel_angle = std::max( angle_between( mid_dir, camera.pixel_to_vector(mid + Vector2(1,0)) ),
+                                 angle_between( mid_dir, camera.pixel_to_vector(mid + Vector2(0,1)) ) );
+  if ( !(pixel_angle > 0) )
+    vw_throw( ArgumentErr() << "CameraSurrogate: could not measure the pixel angle.\n" );
+
+  m_ray_cells = Vector2i( nodes_for_level( COARSE_LEVEL, image_size.x() ) - 1,
+                          nodes_for_level( COARSE_LEVEL, image_size.y() ) - 1 );
+  m_ray_step  = Vector2( std::max( image_size.x() - 1, 1 ) / double(m_ray_cells.x()),
+                         std::max( image_size.y() - 1, 1 ) / double(m_ray_cells.y()) );
+  m_ray_grid.assign( m_ray_cells.x() * m_ray_cells.y(), Cell<RayT>() );
+  m_ray_error = 0;
+  size_t num_nodes = 0;
+  for ( int j = 0; j < m_ray_cells.y(); j++ )
+    for ( int i = 0; i < m_ray_cells.x(); i++ ) {
+      Cell<RayT> & cell = m_ray_grid[j * m_ray_cells.x() + i];
+      Vector2 corner = elem_prod( Vector2(i,j), m_ray_step );
+      for ( ; ; cell.level++ ) {
+        int n = 1 << cell.level;
+        Vector2 part = m_ray_step / n;
+        cell.nodes.resize( (n+1) * (n+1) );
+        for ( int b = 0; b <= n; b++ )
+          for ( int a = 0; a <= n; a++ )
+            cell.nodes[b * (n+1) + a] = camera_ray( camera, corner + elem_prod( Vector2(a,b), part ) );
+
+        // Both the center and the direction error show up in the
+        // point at ground range.
+        double error = 0;
+        std::vector<Vector2> points = check_points(n);
+        for ( size_t k = 0; k < points.size(); k++ ) {
+          Vector2 pix = corner + elem_prod( points[k], part );
+          Vector3 ctr = camera.camera_center(pix);
+          Vector3 dir = camera.pixel_to_vector(pix);
+          RayT interp = interp_grid( cell.nodes, Vector2i(n+1, n+1), 0,
+                                     points[k].x(), points[k].y() );
+          Vector3 interp_ctr = subvector(interp, 0, 3), interp_dir = subvector(interp, 3, 3);
+          Vector3 approx = interp_ctr + range * normalize(interp_dir);
+          error = std::max( error, angle_between( dir, approx - ctr ) / pixel_angle );
+        }
+
+        if ( error <= tolerance ) {
+          m_ray_error = std::max( m_ray_error, error );
+          break;
+        }
+        // Finer than a pixel the camera is not smooth enough to be
+        // interpolated, so there is no point going on.
+        bool at_pixel_spacing = part.x() <= 1.0 && part.y() <= 1.0;
+        if ( at_pixel_spacing || cell.level >= MAX_RAY_LEVEL )
+          vw_throw( ArgumentErr() << "CameraSurrogate: could not reach a ray error of "
+                    << tolerance << " pixels in the cell at pixel " << corner
+                    << ", the best was " << error << ".\n" );
+      }
+      num_nodes += cell.nodes.size();
+    }
+  vw_out(DebugMessage,"asp") << "CameraSurrogate: ray grid of " << m_ray_cells
+                             << " cells with " << num_nodes << " nodes, max error "
+                             << m_ray_error << " pixels.\n";
+}
+
+void asp::CameraSurrogate::build_ground_grid( camera::CameraModel const& camera,
+                                              Vector2i const& image_size,
+                                              double tolerance,
+                                              Vector2 const& height_range ) {
+  VW_ASSERT( height_range[0] <= height_range[1],
+             ArgumentErr() << "CameraSurrogate: invalid height range.\n" );
+
+  // Find the footprint by casting rays from pixels across the image.
+  // The longitudes are unwrapped around the first one found, so a
+  // footprint across the antimeridian does not span the globe.
+  const int num_samples = 17;
+  m_ground_box = BBox2();
+  double ref_lon = NaN;
+  for ( int j = 0; j < num_samples; j++ )
+    for ( int i = 0; i < num_samples; i++ ) {
+      Vector2 pix( (image_size.x() - 1) * i / double(num_samples - 1),
+                   (image_size.y() - 1) * j / double(num_samples - 1) );
+      for ( int h = 0; h < 2; h++ ) {
+        Vector3 xyz;
+        if ( !ellipsoid_intersection( m_datum, height_range[h], camera.camera_center(pix),
+                                      camera.pixel_to_vector(pix), xyz ) )
+          continue;
+        Vector2 ll = subvector( m_datum.cartesian_to_geodetic(xyz), 0, 2 );
+        if ( ref_lon != ref_lon )
+          ref_lon = ll[0];
+        ll[0] -= 360 * round( ( ll[0] - ref_lon ) / 360 );
+        m_ground_box.grow( ll );
+      }
+    }
+  if ( m_ground_box.empty() )
+    vw_throw( ArgumentErr() << "CameraSurrogate: the camera does not see the datum.\n" );
+  // Margin, so points just outside the image can still be projected
+  m_ground_box.expand( 0.05 * std::max( m_ground_box.width(), m_ground_box.height() ) );
+
+  Vector2 image_margin( 0.05 * image_size.x(), 0.05 * image_size.y() );
+  BBox2 checked_pixels( -image_margin, Vector2(image_size) + image_margin );
+
+  m_ground_cells = Vector2i( 1 << COARSE_LEVEL, 1 << COARSE_LEVEL );
+  m_ground_step  = elem_quot( m_ground_box.size(), Vector2(m_ground_cells) );
+  m_ground_grid.assign( m_ground_cells.x() * m_ground_cells.y(), Cell<Vector2>() );
+
+  // The heights are refined for all cells at once, keeping the level
+  // each cell reached so far.
+  int num_layers = 2;
+  while ( true ) {
+    m_heights.resize( num_layers );
+    for ( int k = 0; k < num_layers; k++ )
+      m_heights[k] = height_range[0] + (height_range[1] - height_range[0]) * k / (num_layers - 1);
+
+    double horiz_error = 0, vert_error = 0;
+    size_t num_nodes = 0;
+    for ( int j = 0; j < m_ground_cells.y(); j++ )
+      for ( int i = 0; i < m_ground_cells.x(); i++ ) {
+        Cell<Vector2> & cell = m_ground_grid[j * m_ground_cells.x() + i];
+        Vector2 corner = m_ground_box.min() + elem_prod( Vector2(i,j), m_ground_step );
+        double cell_horiz_error, cell_vert_error;
+        for ( ; ; cell.level++ ) {
+          int n = 1 << cell.level;
+          Vector2 part = m_ground_step / n;
+          size_t layer_size = size_t(n+1) * (n+1);
+          cell.nodes.resize( layer_size * num_layers );
+          for ( int k = 0; k < num_layers; k++ )
+            for ( int b = 0; b <= n; b++ )
+              for ( int a = 0; a <= n; a++ ) {
+                Vector2 ll = corner + elem_prod( Vector2(a,b), part );
+                Vector2 & pix = cell.nodes[k * layer_size + b * (n+1) + a];
+                try {
+                  pix = camera.point_to_pixel
+                    ( m_datum.geodetic_to_cartesian( Vector3( ll[0], ll[1], m_heights[k] ) ) );
+                } catch ( const camera::PointToPixelErr& ) {
+                  pix = Vector2( NaN, NaN );
+                }
+              }
+
+          // Horizontal error at the check points of each layer, and
+          // vertical error at the nodes halfway between layers.
+          std::vector<Vector2> points = check_points(n), nodes;
+          for ( int b = 0; b <= n; b++ )
+            for ( int a = 0; a <= n; a++ )
+              nodes.push_back( Vector2(a,b) );
+          cell_horiz_error = 0;
+          cell_vert_error  = 0;
+          for ( int k = 0; k < 2 * num_layers - 1; k++ ) {
+            bool between_layers = (k % 2 == 1);
+            double height = height_range[0] + (height_range[1] - height_range[0]) * k / (2.0 * num_layers - 2);
+            std::vector<Vector2> const& where = between_layers ? nodes : points;
+            for ( size_t q = 0; q < where.size(); q++ ) {
+              Vector2 ll = corner + elem_prod( where[q], part );
+              Vector2 exact, approx;
+              try {
+                exact = camera.point_to_pixel
+                  ( m_datum.geodetic_to_cartesian( Vector3( ll[0], ll[1], height ) ) );
+              } catch ( const camera::PointToPixelErr& ) {
+                continue;
+              }
+              approx = cell_ground_pixel( cell, where[q], height );
+              if ( !checked_pixels.contains(exact) || approx != approx )
+                continue;
+              double & error = between_layers ? cell_vert_error : cell_horiz_error;
+              error = std::max( error, norm_2( exact - approx ) );
+            }
+          }
+
+          if ( cell_horiz_error <= tolerance )
+            break;
+          if ( cell.level >= MAX_GROUND_LEVEL )
+            vw_throw( ArgumentErr() << "CameraSurrogate: could not reach a ground error of "
+                      << tolerance << " pixels, the best was " << cell_horiz_error << ".\n" );
+        }
+        horiz_error = std::max( horiz_error, cell_horiz_error );
+        vert_error  = std::max( vert_error,  cell_vert_error  );
+        num_nodes  += cell.nodes.size();
+      }
+    m_ground_error = std::max( horiz_error, vert_error );
+
+    if ( vert_error <= tolerance ) {
+      vw_out(DebugMessage,"asp") << "CameraSurrogate: ground grid of " << m_ground_cells
+                                 << " cells with " << num_nodes << " nodes in "
+                                 << num_layers << " heights, max error "
+                                 << m_ground_error << " pixels.\n";
+      break;
+    }
+    if ( num_layers >= MAX_HEIGHT_LAYERS )
+      vw_throw( ArgumentErr() << "CameraSurrogate: could not reach a ground error of "
+                << tolerance << " pixels, the best was " << m_ground_error << ".\n" );
+    num_layers = 2 * num_layers - 1;
+  }
+}
+
+Vector2 asp::CameraSurrogate::cell_ground_pixel( Cell<Vector2> const& cell,
+                                                 Vector2 const& pos, double height ) const {
+  // Linear in height between the two nearest layers
+  int num_layers = m_heights.size();
+  double height_step = ( m_heights.back() - m_heights.front() ) / (num_layers - 1);
+  double z = height_step > 0 ? ( height - m_heights.front() ) / height_step : 0.0;
+  int k = std::min( std::max( int(floor(z)), 0 ), num_layers - 2 );
+  double fz = z - k;
+
+  int n = 1 << cell.level;
+  size_t layer_size = size_t(n+1) * (n+1);
+  Vector2 p0 = interp_grid( cell.nodes, Vector2i(n+1, n+1), k * layer_size, pos.x(), pos.y() );
+  Vector2 p1 = interp_grid( cell.nodes, Vector2i(n+1, n+1), (k+1) * layer_size, pos.x(), pos.y() );
+  return (1 - fz) * p0 + fz * p1;
+}
+
+Vector2 asp::CameraSurrogate::ground_pixel( Vector3 const& llh ) const {
+  double x = ( llh[0] - m_ground_box.min().x() ) / m_ground_step.x();
+  double y = ( llh[1] - m_ground_box.min().y() ) / m_ground_step.y();
+  if ( !( x >= 0 && y >= 0 && x <= m_ground_cells.x() && y <= m_ground_cells.y() ) )
+    return Vector2( NaN, NaN );
+
+  double fx, fy;
+  int i = cell_index( x, m_ground_cells.x(), fx );
+  int j = cell_index( y, m_ground_cells.y(), fy );
+  Cell<Vector2> const& cell = m_ground_grid[j * m_ground_cells.x() + i];
+  int n = 1 << cell.level;
+  return cell_ground_pixel( cell, Vector2( fx * n, fy * n ), llh[2] );
+}
+
+Vector2 asp::CameraSurrogate::point_to_pixel( Vector3 const& point ) const {
+  if ( !has_ground_grid() )
+    vw_throw( camera::PointToPixelErr() << "CameraSurrogate: no ground grid was built.\n" );
+
+  Vector3 llh = m_datum.cartesian_to_geodetic(point);
+  // Bring the longitude to the range of the grid
+  while ( llh[0] < m_ground_box.min().x() && llh[0] + 360 <= m_ground_box.max().x() )
+    llh[0] += 360;
+  while ( llh[0] > m_ground_box.max().x() && llh[0] - 360 >= m_ground_box.min().x() )
+    llh[0] -= 360;
+
+  Vector2 pix = ground_pixel(llh);
+  if ( pix != pix )
+    vw_throw( camera::PointToPixelErr() << "CameraSurrogate: point is outside the ground grid.\n" );
+  return pix;
+}
+
+asp::CameraSurrogate::RayT asp::CameraSurrogate::ray_at( Vector2 const& pix ) const {
+  double fx, fy;
+  int i = cell_index( pix.x() / m_ray_step.x(), m_ray_cells.x(), fx );
+  int j = cell_index( pix.y() / m_ray_step.y(), m_ray_cells.y(), fy );
+  Cell<RayT> const& cell = m_ray_grid[j * m_ray_cells.x() + i];
+  int n = 1 << cell.level;
+  return interp_grid( cell.nodes, Vector2i(n+1, n+1), 0, fx * n, fy * n );
+}
+
+Vector3 asp::CameraSurrogate::pixel_to_vector( Vector2 const& pix ) const {
+  Vector3 dir = subvector( ray_at(pix), 3, 3 );
+  return normalize(dir);
+}
+
+Vector3 asp::CameraSurrogate::camera_center( Vector2 const& pix ) const {
+  return subvector( ray_at(pix), 0, 3 );
+}
+
+// File format, all in text:
+//   CameraSurrogate 2
+//   ray <cells x> <cells y> <step x> <step y> <error>
+//   for each cell, row-major:
+//     <level>
+//     <center xyz> <direction xyz>         one line per node
+//   ground <0 or 1>
+// and if there is a ground grid:
+//   <datum name>, <spheroid name>, <meridian name>   one per line
+//   <semi-major> <semi-minor> <meridian offset>
+//   <lon min> <lat min> <lon max> <lat max> <cells x> <cells y> <error>
+//   <num heights> <heights>
+//   for each cell, row-major:
+//     <level>
+//     <pixel xy>                           one line per node, layer by layer
+void asp::CameraSurrogate::write( std::string const& filename ) const {
+  std::ofstream ofs( filename.c_str() );
+  if ( !ofs.good() )
+    vw_throw( IOErr() << "Unable to open for writing: " << filename << "\n" );
+  ofs.precision(17);
+
+  ofs << "CameraSurrogate 2\n";
+  ofs << "ray " << m_ray_cells.x() << " " << m_ray_cells.y() << " "
+      << m_ray_step.x() << " " << m_ray_step.y() << " " << m_ray_error << "\n";
+  for ( size_t c = 0; c < m_ray_grid.size(); c++ ) {
+    std::vector<RayT> const& nodes = m_ray_grid[c].nodes;
+    ofs << m_ray_grid[c].level << "\n";
+    for ( size_t k = 0; k < nodes.size(); k++ )
+      ofs << nodes[k][0] << " " << nodes[k][1] << " " << nodes[k][2] << " "
+          << nodes[k][3] << " " << nodes[k][4] << " " << nodes[k][5] << "\n";
+  }
+
+  ofs << "ground " << has_ground_grid() << "\n";
+  if ( !has_ground_grid() )
+    return;
+  ofs << m_datum.name() << "\n" << m_datum.spheroid_name() << "\n"
+      << m_datum.meridian_name() << "\n";
+  ofs << m_datum.semi_major_axis() << " " << m_datum.semi_minor_axis() << " "
+      << m_datum.meridian_offset() << "\n";
+  ofs << m_ground_box.min().x() << " " << m_ground_box.min().y() << " "
+      << m_ground_box.max().x() << " " << m_ground_box.max().y() << " "
+      << m_ground_cells.x() << " " << m_ground_cells.y() << " " << m_ground_error << "\n";
+  ofs << m_heights.size();
+  for ( size_t k = 0; k < m_heights.size(); k++ )
+    ofs << " " << m_heights[k];
+  ofs << "\n";
+  for ( size_t c = 0; c < m_ground_grid.size(); c++ ) {
+    std::vector<Vector2> const& nodes = m_ground_grid[c].nodes;
+    ofs << m_ground_grid[c].level << "\n";
+    for ( size_t k = 0; k < nodes.size(); k++ )
+      ofs << nodes[k][0] << " " << nodes[k][1] << "\n";
+  }
+}
+
+asp::CameraSurrogate::CameraSurrogate( std::string const& filename ) :
+  m_ray_error(0), m_ground_error(0) {
+  std::ifstream ifs( filename.c_str() );
+  std::string tag;
+  int version = 0;
+  if ( !(ifs >> tag >> version) || tag != "CameraSurrogate" || version != 2 )
+    vw_throw( IOErr() << "Not a camera surrogate file: " << filename << "\n" );
+
+  ifs >> tag >> m_ray_cells[0] >> m_ray_cells[1] >> m_ray_step[0] >> m_ray_step[1]
+      >> m_ray_error;
+  if ( !ifs.good() || m_ray_cells[0] < 1 || m_ray_cells[1] < 1 )
+    vw_throw( IOErr() << "Failed to read camera surrogate: " << filename << "\n" );
+  m_ray_grid.resize( size_t(m_ray_cells[0]) * m_ray_cells[1] );
+  for ( size_t c = 0; c < m_ray_grid.size() && ifs.good(); c++ ) {
+    Cell<RayT> & cell = m_ray_grid[c];
+    ifs >> cell.level;
+    if ( cell.level < 0 || cell.level > MAX_RAY_LEVEL )
+      vw_throw( IOErr() << "Failed to read camera surrogate: " << filename << "\n" );
+    int n = 1 << cell.level;
+    cell.nodes.resize( (n+1) * (n+1) );
+    for ( size_t k = 0; k < cell.nodes.size(); k++ )
+      for ( int d = 0; d < 6; d++ )
+        ifs >> cell.nodes[k][d];
+  }
+
+  bool has_ground = false;
+  ifs >> tag >> has_ground;
+  if ( has_ground ) {
+    std::string name, spheroid, meridian;
+    double a, b, offset;
+    ifs >> std::ws;
+    std::getline( ifs, name );
+    std::getline( ifs, spheroid );
+    std::getline( ifs, meridian );
+    ifs >> a >> b >> offset;
+    m_datum = cartography::Datum( name, spheroid, meridian, a, b, offset );
+
+    Vector2 lo, hi;
+    ifs >> lo[0] >> lo[1] >> hi[0] >> hi[1]
+        >> m_ground_cells[0] >> m_ground_cells[1] >> m_ground_error;
+    size_t num_layers = 0;
+    ifs >> num_layers;
+    if ( !ifs.good() || m_ground_cells[0] < 1 || m_ground_cells[1] < 1 ||
+         num_layers < 2 || num_layers > size_t(MAX_HEIGHT_LAYERS) )
+      vw_throw( IOErr() << "Failed to read camera surrogate: " << filename << "\n" );
+    m_ground_box  = BBox2( lo, hi );
+    m_ground_step = elem_quot( m_ground_box.size(), Vector2(m_ground_cells) );
+    m_heights.resize( num_layers );
+    for ( size_t k = 0; k < num_layers; k++ )
+      ifs >> m_heights[k];
+
+    m_ground_grid.resize( size_t(m_ground_cells[0]) * m_ground_cells[1] );
+    for ( size_t c = 0; c < m_ground_grid.size() && ifs.good(); c++ ) {
+      Cell<Vector2> & cell = m_ground_grid[c];
+      ifs >> cell.level;
+      if ( cell.level < 0 || cell.level > MAX_GROUND_LEVEL )
+        vw_throw( IOErr() << "Failed to read camera surrogate: " << filename << "\n" );
+      int n = 1 << cell.level;
+      cell.nodes.resize( size_t(n+1) * (n+1) * num_layers );
+      for ( size_t k = 0; k < cell.nodes.size(); k++ ) {
+        // NaN does not round trip through streams
+        std::string x, y;
+        ifs >> x >> y;
+        cell.nodes[k] = Vector2( x.find("nan") != std::string::npos ? NaN : atof(x.c_str()),
+                                 y.find("nan") != std::string::npos ? NaN : atof(y.c_str()) );
+      }
+    }
+  }
+
+  if ( !ifs.good() )
+    vw_throw( IOErr() << "Failed to read camera surrogate: " << filename << "\n" );
+}
@@ -0,0 +1,128 @@
+// __BEGIN_LICENSE__
+//  Copyright (c) 2009-2013, United States Government as represented by the
+//  Administrator of the National Aeronautics and Space Administration. All
+//  rights reserved.
+//
+//  The NGT platform is licensed under the Apache License, Version 2.0 (the
+//  "License"); you may not use this file except in compliance with the
+//  License. You may obtain a copy of the License at
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+// __END_LICENSE__
+
+
+
+/// \file CameraSurrogate.h
+///
+/// An interpolating stand-in for an expensive or non-reentrant camera
+/// model. The camera is sampled once, at construction, on a grid of
+/// pixels (ray origin and direction) and optionally on a grid of
+/// ground points (lon, lat, height -> pixel). Later queries are
+/// answered by bilinear interpolation on these grids. Each cell of a
+/// coarse grid is refined on its own until the interpolation error,
+/// measured against the original camera at the centers and edge
+/// midpoints of its parts, is within the requested tolerance, or
+/// construction fails. So the samples go where the camera needs them.
+///
+/// A built surrogate never changes and does not refer to the original
+/// camera, so it may be shared freely between threads.
+
+#ifndef __ASP_CORE_CAMERA_SURROGATE_H__
+#define __ASP_CORE_CAMERA_SURROGATE_H__
+
+#include <vw/Math/Vector.h>
+#include <vw/Math/BBox.h>
+#include <vw/Camera/CameraModel.h>
+#include <vw/Cartography/Datum.h>
+
+#include <string>
+#include <vector>
+
+namespace asp {
+
+  class CameraSurrogate : public vw::camera::CameraModel {
+  public:
+
+    /// Build only the ray grid. point_to_pixel() is then unavailable.
+    /// This is enough for triangulation. The tolerance is in pixels.
+    CameraSurrogate( vw::camera::CameraModel const& camera,
+                     vw::Vector2i const& image_size,
+                     double tolerance );
+
+    /// Build both grids. The ground grid covers the footprint of the
+    /// image on the datum, for heights above it in height_range.
+    CameraSurrogate( vw::camera::CameraModel const& camera,
+                     vw::Vector2i const& image_size,
+                     double tolerance,
+                     vw::cartography::Datum const& datum,
+                     vw::Vector2 const& height_range );
+
+    /// Read a surrogate saved with write().
+    explicit CameraSurrogate( std::string const& filename );
+
+    virtual ~CameraSurrogate() {}
+    virtual std::string type() const { return "Surrogate"; }
+
+    virtual vw::Vector2 point_to_pixel ( vw::Vector3 const& point ) const;
+    virtual vw::Vector3 pixel_to_vector( vw::Vector2 const& pix   ) const;
+    virtual vw::Vector3 camera_center  ( vw::Vector2 const& pix   ) const;
+
+    void write( std::string const& filename ) const;
+
+    bool has_ground_grid() const { return !m_ground_grid.empty(); }
+
+    /// The largest interpolation error found at the check points when
+    /// the surrogate was built, in pixels.
+    double ray_error   () const { return m_ray_error;    }
+    double ground_error() const { return m_ground_error; }
+
+  private:
+    // A cell of a coarse grid, divided into 2^level parts along each
+    // axis. The nodes are row-major, and for the ground grid there is
+    // one such layer of nodes per height.
+    template <class T>
+    struct Cell {
+      int level;
+      std::vector<T> nodes;
+      Cell(): level(0) {}
+    };
+    typedef vw::Vector<double, 6> RayT; // center, then direction
+
+    // Ray grid, with cell (i,j) starting at pixel (i,j)*m_ray_step
+    vw::Vector2i m_ray_cells;
+    vw::Vector2  m_ray_step;
+    std::vector< Cell<RayT> > m_ray_grid;
+    double m_ray_error;
+
+    // Ground grid, with cell (i,j) starting at lon-lat
+    // m_ground_box.min() + (i,j)*m_ground_step, and layers at
+    // m_heights. Node pixels that could not be computed are NaN.
+    vw::cartography::Datum m_datum;
+    vw::BBox2    m_ground_box;
+    vw::Vector2i m_ground_cells;
+    vw::Vector2  m_ground_step;
+    std::vector<double> m_heights;
+    std::vector< Cell<vw::Vector2> > m_ground_grid;
+    double m_ground_error;
+
+    void build_ray_grid( vw::camera::CameraModel const& camera,
+                         vw::Vector2i const& image_size, double tolerance,
+                         double range );
+    void build_ground_grid( vw::camera::CameraModel const& camera,
+                            vw::Vector2i const& image_size, double tolerance,
+                            vw::Vector2 const& height_range );
+    RayT ray_at( vw::Vector2 const& pix ) const;
+    vw::Vector2 ground_pixel( vw::Vector3 const& llh ) const;
+    // At a position in a ground cell, in units of its parts
+    vw::Vector2 cell_ground_pixel( Cell<vw::Vector2> const& cell,
+                                   vw::Vector2 const& pos, double height ) const;
+  };
+
+} // namespace asp
+
+#endif//__ASP_CORE_CAMERA_SURROGATE_H__
@@ -151,6 +151,17 @@ double asp::get_rounding_error(vw::Vector3 const& shift, double rounding_error){
     return rounding_error;
 }
 
+void asp::report_quantize_stats(QuantizeStats const& stats){
+  if (stats.num_invalidated > 0)
+    vw::vw_out(vw::WarningMessage) << "Invalidated " << stats.num_invalidated
+                                   << " point(s) too far from the cloud center "
+                                   << "to be quantized.\n";
+  if (stats.num_clamped > 0)
+    vw::vw_out(vw::WarningMessage) << "Clamped the triangulation error of "
+                                   << stats.num_clamped << " point(s) "
+                                   << "to fit in the quantized cloud.\n";
+}
+
 // Run a system command and append the output to a given file
 void asp::run_cmd_app_to_file(std::string cmd, std::string file){
   std::string full_cmd;
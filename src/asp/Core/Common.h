@@ -29,10 +29,15 @@
 #include <vw/FileIO/DiskImageResourceGDAL.h>
 #include <vw/FileIO/DiskImageView.h>
 #include <vw/FileIO/DiskImageUtils.h>
+#include <vw/Core/Thread.h>
 #include <vw/Math/Vector.h>
 #include <vw/Image/ImageViewRef.h>
 #include <vw/Cartography/GeoReference.h>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
 #include <map>
+#include <sstream>
 #include <string>
 
 namespace asp {
@@ -306,6 +311,85 @@ namespace asp {
   // Note: We use this constant in the python code as well
   const std::string POINT_OFFSET = "POINT_OFFSET";
 
+  // If present, the point cloud channels are integers which must be
+  // multiplied by this value. Also used in the python code.
+  const std::string POINT_SCALE = "POINT_SCALE";
+
+  /// The points of a cloud which did not fit in an int32 when quantized
+  struct QuantizeStats {
+    vw::Mutex mutex;
+    size_t num_invalidated; // made invalid, too far from the cloud center
+    size_t num_clamped;     // kept, with the error clamped
+    QuantizeStats(): num_invalidated(0), num_clamped(0) {}
+  };
+
+  // Divide the pixels by a scale and round them to integers. A point
+  // too far from the cloud center to fit in an int32 is made invalid,
+  // that is, all zero, while too large an error in the remaining
+  // channels is clamped, so one outlier does not abort the writing.
+  // These are counted in the stats, if given.
+  template <class VecT>
+  struct QuantizePixels: public vw::ReturnFixedType< vw::Vector<vw::int32, vw::math::VectorSize<VecT>::value> > {
+    typedef vw::Vector<vw::int32, vw::math::VectorSize<VecT>::value> result_type;
+    double m_scale;
+    boost::shared_ptr<QuantizeStats> m_stats;
+    QuantizePixels(double scale, boost::shared_ptr<QuantizeStats> stats):
+      m_scale(scale), m_stats(stats){
+      VW_ASSERT( m_scale > 0.0,
+                 vw::ArgumentErr() << "Quantization scale must be positive.");
+    }
+    result_type operator() (VecT const& pt) const {
+      const double max_val = std::numeric_limits<vw::int32>::max();
+      result_type result;
+      bool clamped = false;
+      for (size_t c = 0; c < pt.size(); c++){
+        double val = round(pt[c]/m_scale);
+        if (!(std::abs(val) <= max_val)){
+          if (c < 3 || val != val){
+            if (m_stats){
+              vw::Mutex::Lock lock(m_stats->mutex);
+              m_stats->num_invalidated++;
+            }
+            return result_type();
+          }
+          val = (val > 0) ? max_val : -max_val;
+          clamped = true;
+        }
+        result[c] = vw::int32(val);
+      }
+      if (clamped && m_stats){
+        vw::Mutex::Lock lock(m_stats->mutex);
+        m_stats->num_clamped++;
+      }
+      return result;
+    }
+  };
+  template <class ImageT>
+  vw::UnaryPerPixelView<ImageT, QuantizePixels<typename ImageT::pixel_type> >
+  inline quantize_pixels( vw::ImageViewBase<ImageT> const& image, double scale,
+                          boost::shared_ptr<QuantizeStats> stats
+                          = boost::shared_ptr<QuantizeStats>() ) {
+    return vw::UnaryPerPixelView<ImageT, QuantizePixels<typename ImageT::pixel_type> >
+      ( image.impl(), QuantizePixels<typename ImageT::pixel_type>(scale, stats) );
+  }
+
+  // Warn about the points which did not fit when quantizing
+  void report_quantize_stats( QuantizeStats const& stats );
+
+  // Multiply the pixels by a scale.
+  template <class VecT>
+  struct ScalePixels: public vw::ReturnFixedType<VecT> {
+    double m_scale;
+    ScalePixels(double scale):m_scale(scale){}
+    VecT operator() (VecT const& pt) const { return m_scale*pt; }
+  };
+  template <class ImageT>
+  vw::UnaryPerPixelView<ImageT, ScalePixels<typename ImageT::pixel_type> >
+  inline scale_pixels( vw::ImageViewBase<ImageT> const& image, double scale ) {
+    return vw::UnaryPerPixelView<ImageT, ScalePixels<typename ImageT::pixel_type> >
+      ( image.impl(), ScalePixels<typename ImageT::pixel_type>(scale) );
+  }
+
   // Given a point cloud with n channels, return the first m channels.
   // We must have 1 <= m <= n <= 6.
   // If the image was written by subtracting a shift, put that shift
@@ -314,7 +398,7 @@ namespace asp {
   vw::ImageViewRef< vw::Vector<double, m> > read_cloud(std::string const& filename){
     
     vw::Vector3 shift;
-    std::string shift_str;
+    std::string shift_str, scale_str;
     boost::shared_ptr<vw::DiskImageResource> rsrc
       ( new vw::DiskImageResourceGDAL(filename) );
     if (vw::cartography::read_header_string(*rsrc.get(), POINT_OFFSET, shift_str)){
@@ -325,6 +409,13 @@ namespace asp {
     vw::ImageViewRef< vw::Vector<double, m> > out_image
       = vw::read_channels<m, double>(filename, 0);
 
+    // Undo the quantization, if any
+    if (vw::cartography::read_header_string(*rsrc.get(), POINT_SCALE, scale_str)){
+      double scale = atof(scale_str.c_str());
+      if (scale > 0)
+        out_image = scale_pixels(out_image, scale);
+    }
+
     // Add the shift back to the first several channels.
     if (shift != vw::Vector3())
       out_image = subtract_shift(out_image, -shift);
@@ -381,6 +472,62 @@ namespace asp {
 
   }
 
+  // Make the resource for a quantized point cloud. Horizontal
+  // differencing lets the compressor exploit that neighboring points
+  // are close to each other.
+  template <class ImageT>
+  vw::DiskImageResourceGDAL*
+  build_quantized_gdal_rsrc( const std::string &filename,
+                             vw::ImageViewBase<ImageT> const& image,
+                             vw::Vector3 const& shift, double scale,
+                             BaseOptions const& opt ) {
+    vw::DiskImageResourceGDAL::Options gdal_options = opt.gdal_options;
+    if (gdal_options["COMPRESS"] == "LZW" || gdal_options["COMPRESS"] == "DEFLATE")
+      gdal_options["PREDICTOR"] = "2";
+    vw::DiskImageResourceGDAL* rsrc =
+      new vw::DiskImageResourceGDAL(filename, image.impl().format(),
+                                    opt.raster_tile_size, gdal_options);
+    std::ostringstream oss;
+    oss.precision(17);
+    oss << scale;
+    vw::cartography::write_header_string(*rsrc, POINT_OFFSET, vec_to_str(shift));
+    vw::cartography::write_header_string(*rsrc, POINT_SCALE, oss.str());
+    return rsrc;
+  }
+
+  // Block write a point cloud while subtracting a given value from
+  // all pixels and storing the result as integer multiples of the
+  // rounding error. asp::read_cloud() undoes this. This is the same
+  // precision as block_write_approx_gdal_image(), in less space.
+  template <class ImageT>
+  void block_write_quantized_gdal_image( const std::string &filename,
+                                         vw::Vector3 const& shift,
+                                         double rounding_error,
+                                         vw::ImageViewBase<ImageT> const& image,
+                                         BaseOptions const& opt,
+                                         vw::ProgressCallback const& progress_callback
+                                         = vw::ProgressCallback::dummy_instance() ) {
+
+    // Without a shift values would not fit in integers
+    if (norm_2(shift) == 0){
+      block_write_approx_gdal_image(filename, shift, rounding_error, image,
+                                    opt, progress_callback);
+      return;
+    }
+
+    double scale = get_rounding_error(shift, rounding_error);
+    boost::shared_ptr<QuantizeStats> stats( new QuantizeStats );
+    boost::scoped_ptr<vw::DiskImageResourceGDAL>
+      rsrc( build_quantized_gdal_rsrc( filename,
+                                       quantize_pixels(image.impl(), scale),
+                                       shift, scale, opt ) );
+    vw::block_write_image( *rsrc,
+                           quantize_pixels(subtract_shift(image.impl(), shift),
+                                           scale, stats),
+                           progress_callback );
+    report_quantize_stats(*stats);
+  }
+
   // Write image using a single thread while subtracting a given value
   // from all pixels and casting the result to float.
   template <class ImageT>
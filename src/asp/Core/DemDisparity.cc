@@ -22,13 +22,15 @@
 #include <vw/Image/ImageView.h>
 #include <vw/Image/Transform.h>
 #include <vw/Image/MaskViews.h>
+#include <vw/Image/Algorithms.h>
 #include <vw/FileIO/DiskImageView.h>
 #include <vw/Camera/CameraModel.h>
-#include <vw/Cartography/CameraBBox.h>
 #include <vw/Stereo/DisparityMap.h>
 #include <vw/InterestPoint/MatrixIO.h>
 #include <asp/Core/StereoSettings.h>
 #include <asp/Core/DemDisparity.h>
+#include <asp/Core/DemRayCaster.h>
+#include <asp/Core/SampleLattice.h>
 
 #include <boost/filesystem/operations.hpp>
 namespace fs = boost::filesystem;
@@ -50,7 +52,87 @@ namespace asp {
     bool            m_do_align;
     Matrix<double>  m_align_left_matrix, m_align_right_matrix;
     int             m_pixel_sample;
+    int             m_lattice_spacing;
     ImageView<PixelMask<Vector2i> > & m_disparity_spread;
+    // For the rough location of each tile on the DEM
+    boost::shared_ptr<DemRayCaster> m_coarse_caster;
+
+    // The center and the half-width of the range of disparities at a
+    // pixel of the low-resolution left image.
+    bool exact_disparity(DemRayCaster const& caster, Vector2 const& left_lowres_pix,
+                         Vector2 & disp, Vector2 & spread) const {
+
+      Vector2 left_fullres_pix = elem_quot(left_lowres_pix, m_downsample_scale);
+      if (m_do_align){
+        // Need to go to the image pixel in the untransformed image
+        left_fullres_pix = HomographyTransform(m_align_left_matrix).reverse(left_fullres_pix);
+      }
+
+      Vector3 left_camera_ctr, left_camera_vec, xyz;
+      try {
+        left_camera_ctr = m_left_camera_model->camera_center(left_fullres_pix);
+        left_camera_vec = m_left_camera_model->pixel_to_vector(left_fullres_pix);
+      } catch (...) {
+        return false;
+      }
+      if ( !caster.intersect(left_camera_ctr, left_camera_vec, xyz) ) return false;
+
+      // Since our DEM is only known approximately, the true
+      // intersection point of the ray coming from the left camera
+      // with the DEM could be anywhere within m_dem_error from
+      // xyz. Use that to get an estimate of the disparity
+      // error.
+
+      BBox2f search_range;
+      double bias[] = {-1.0, 1.0, 0.0};
+      int success[] = {0, 0, 0};
+
+      for (int k = 0; k < 3; k++){
+
+        Vector2 right_fullres_pix;
+        try {
+          right_fullres_pix = m_right_camera_model->point_to_pixel(xyz + bias[k]*m_dem_error*left_camera_vec);
+        } catch (...) {
+          continue;
+        }
+        if (m_do_align){
+          right_fullres_pix = HomographyTransform(m_align_right_matrix).forward(right_fullres_pix);
+        }
+
+        Vector2 right_lowres_pix = elem_prod(right_fullres_pix, m_downsample_scale);
+        search_range.grow(right_lowres_pix - left_lowres_pix);
+        success[k] = 1;
+
+        // If the disparities at the endpoints of the range were successful,
+        // don't bother with the middle estimate.
+        if (k == 1 && success[0] && success[1]) break;
+      }
+
+      if (!success[0] && !success[1] && !success[2]) return false;
+      if (search_range == BBox2f(0,0,0,0)) return false;
+
+      disp   = (search_range.min() + search_range.max())/2.0;
+      spread = (search_range.max() - search_range.min())/2.0;
+      return true;
+    }
+
+    // The disparity and its spread at sample (i, j) of a tile, which
+    // is at pixel origin + pixel_sample*(i, j), for the lattice.
+    struct SampleDisparity {
+      DemDisparity const& view;
+      DemRayCaster const& caster;
+      Vector2i origin;
+      SampleDisparity(DemDisparity const& view_, DemRayCaster const& caster_,
+                      Vector2i const& origin_):
+        view(view_), caster(caster_), origin(origin_){}
+      bool operator()(int i, int j, Vector4 & value) const {
+        Vector2 pix(origin.x() + view.m_pixel_sample*i, origin.y() + view.m_pixel_sample*j);
+        Vector2 disp, spread;
+        if (!view.exact_disparity(caster, pix, disp, spread)) return false;
+        value = Vector4(disp.x(), disp.y(), spread.x(), spread.y());
+        return true;
+      }
+    };
 
   public:
     DemDisparity( ImageViewBase<ImageT> const& left_image,
@@ -61,7 +143,8 @@ namespace asp {
                   boost::shared_ptr<camera::CameraModel> right_camera_model,
                   bool do_align,
                   Matrix<double> const& align_left_matrix, Matrix<double> const& align_right_matrix,
-                  int pixel_sample, ImageView<PixelMask<Vector2i> > & disparity_spread)
+                  int pixel_sample, int lattice_spacing,
+                  ImageView<PixelMask<Vector2i> > & disparity_spread)
       :m_left_image(left_image.impl()),
        m_dem_error(dem_error),
        m_dem_georef(dem_georef),
@@ -73,7 +156,9 @@ namespace asp {
        m_align_left_matrix(align_left_matrix),
        m_align_right_matrix(align_right_matrix),
        m_pixel_sample(pixel_sample),
-       m_disparity_spread(disparity_spread){}
+       m_lattice_spacing(lattice_spacing),
+       m_disparity_spread(disparity_spread),
+       m_coarse_caster(subsampled_dem_ray_caster(dem, dem_georef, 1024)){}
 
     // Image View interface
     typedef PixelMask<Vector2i> pixel_type;
@@ -106,19 +191,11 @@ namespace asp {
         }
       }
 
-      double height_error_tol = std::max(m_dem_error/4.0, 1.0); // height error in meters
-      double max_abs_tol      = height_error_tol/4.0; // abs cost function change b/w iterations
-      double max_rel_tol      = 1e-14;                // rel cost function change b/w iterations
-      int    num_max_iter     = 50;
-      bool   treat_nodata_as_zero = false;
-
-      Vector3 prev_xyz;
-
       // Estimate the DEM region we expect to use and crop it into an
       // ImageView.  This will make the algorithm much faster than
       // accessing individual DEM pixels from disk. To do that, find
       // the pixel values on a small set of points of the diagonals of
-      // the current tile.
+      // the current tile, intersecting with a coarse copy of the DEM.
 
       std::vector<Vector2> diagonals;
       int wid = bbox.width() - 1, hgt = bbox.height() - 1, dim = std::max(1, std::max(wid, hgt)/10);
@@ -138,26 +215,17 @@ namespace asp {
           left_fullres_pix = HomographyTransform(m_align_left_matrix).reverse(left_fullres_pix);
         }
 
-        bool has_intersection;
-        Vector3 left_camera_ctr, left_camera_vec;
+        Vector3 left_camera_ctr, left_camera_vec, xyz;
         try {
           left_camera_ctr = m_left_camera_model->camera_center(left_fullres_pix);
           left_camera_vec = m_left_camera_model->pixel_to_vector(left_fullres_pix);
         } catch (...) {
           continue;
         }
-        Vector3 xyz = camera_pixel_to_dem_xyz(left_camera_ctr, left_camera_vec,
-                                              m_dem, m_dem_georef,
-                                              treat_nodata_as_zero,
-                                              has_intersection,
-                                              height_error_tol, max_abs_tol,
-                                              max_rel_tol, num_max_iter,
-                                              prev_xyz
-                                              );
-        if ( !has_intersection || xyz == Vector3() ) continue;
-        prev_xyz = xyz;
-
-        Vector3 llh = m_dem_georef.datum().cartesian_to_geodetic( xyz );
+        if ( !m_coarse_caster->intersect(left_camera_ctr, left_camera_vec, xyz) )
+          continue;
+
+        Vector3 llh = m_coarse_caster->geodetic( xyz );
         Vector2 pix = round(m_dem_georef.lonlat_to_pixel(subvector(llh, 0, 2)));
         dem_box.grow(pix);
       }
@@ -171,83 +239,34 @@ namespace asp {
       // Crop the georef, read the DEM region in memory
       GeoReference georef_crop = crop(m_dem_georef, dem_box);
       ImageView <PixelMask<float> > dem_crop = crop(m_dem, dem_box);
+      DemRayCaster caster(dem_crop, georef_crop);
 
       // Compute the DEM disparity. Use one in every 'm_pixel_sample' pixels.
-
-      for (int row = bbox.min().y(); row < bbox.max().y(); row++){
-        if (row%m_pixel_sample != 0) continue;
-
-        // Must wipe the previous guess since we are now too far from it
-        prev_xyz = Vector3();
-
-        for (int col = bbox.min().x(); col < bbox.max().x(); col++){
-          if (col%m_pixel_sample != 0) continue;
-
-          Vector2 left_lowres_pix = Vector2(col, row);
-
-          Vector2 left_fullres_pix = elem_quot(left_lowres_pix, m_downsample_scale);
-          if (m_do_align){
-            // Need to go to the image pixel in the untransformed image
-            left_fullres_pix = HomographyTransform(m_align_left_matrix).reverse(left_fullres_pix);
-          }
-
-          bool has_intersection;
-          Vector3 left_camera_ctr, left_camera_vec;
-          try {
-            left_camera_ctr = m_left_camera_model->camera_center(left_fullres_pix);
-            left_camera_vec = m_left_camera_model->pixel_to_vector(left_fullres_pix);
-          } catch (...) {
-            continue;
-          }
-          Vector3 xyz = camera_pixel_to_dem_xyz(left_camera_ctr, left_camera_vec,
-                                                dem_crop, georef_crop,
-                                                treat_nodata_as_zero,
-                                                has_intersection,
-                                                height_error_tol, max_abs_tol,
-                                                max_rel_tol, num_max_iter,
-                                                prev_xyz
-                                                );
-          if ( !has_intersection || xyz == Vector3() ) continue;
-          prev_xyz = xyz;
-
-          // Since our DEM is only known approximately, the true
-          // intersection point of the ray coming from the left camera
-          // with the DEM could be anywhere within m_dem_error from
-          // xyz. Use that to get an estimate of the disparity
-          // error.
-
-          ImageView< PixelMask<Vector2> > curr_pixel_disp_range(3, 1);
-          double bias[] = {-1.0, 1.0, 0.0};
-          int success[] = {0, 0, 0};
-
-          for (int k = 0; k < curr_pixel_disp_range.cols(); k++){
-
-            Vector2 right_fullres_pix;
-            try {
-              right_fullres_pix = m_right_camera_model->point_to_pixel(xyz + bias[k]*m_dem_error*left_camera_vec);
-            } catch (...) {
-              curr_pixel_disp_range(k, 0).invalidate();
-              continue;
-            }
-            if (m_do_align){
-              right_fullres_pix = HomographyTransform(m_align_right_matrix).forward(right_fullres_pix);
-            }
-
-            Vector2 right_lowres_pix = elem_prod(right_fullres_pix, m_downsample_scale);
-            curr_pixel_disp_range(k, 0) = right_lowres_pix - left_lowres_pix;
-            success[k] = 1;
-
-            // If the disparities at the endpoints of the range were successful,
-            // don't bother with the middle estimate.
-            if (k == 1 && success[0] && success[1]) break;
-          }
-
-          BBox2f search_range = stereo::get_disparity_range(curr_pixel_disp_range);
-          if (search_range ==  BBox2f(0,0,0,0)) continue;
-
-          lowres_disparity(col, row) = round( (search_range.min() + search_range.max())/2.0 );
-          m_disparity_spread(col, row) = ceil( (search_range.max() - search_range.min())/2.0 );
-
+      // Sample (i, j) of the tile is at pixel first + m_pixel_sample*(i, j).
+      Vector2i first, num_samples;
+      for (int k = 0; k < 2; k++){
+        first[k] = m_pixel_sample*((bbox.min()[k] + m_pixel_sample - 1)/m_pixel_sample);
+        num_samples[k] = std::max(0, (bbox.max()[k] - 1 - first[k])/m_pixel_sample + 1);
+      }
+      if (num_samples.x() <= 0 || num_samples.y() <= 0 || first.x() >= bbox.max().x() ||
+          first.y() >= bbox.max().y())
+        return lowres_disparity;
+
+      // Every sample exactly, or in lattice cells interpolated where
+      // the disparity is smooth. Below half a pixel the rounded
+      // disparity changes by at most one.
+      int step = (m_lattice_spacing <= 0) ? 1 : std::max(1, m_lattice_spacing/m_pixel_sample);
+      const double tol = 0.5;
+      SampleLattice lattice(SampleDisparity(*this, caster, first),
+                            num_samples.x(), num_samples.y(), step, tol);
+
+      for (int j = 0; j < lattice.rows(); j++){
+        for (int i = 0; i < lattice.cols(); i++){
+          if (!lattice.is_valid(i, j)) continue;
+          int col = first.x() + m_pixel_sample*i, row = first.y() + m_pixel_sample*j;
+          Vector2 disp = subvector(lattice(i, j), 0, 2), spread = subvector(lattice(i, j), 2, 2);
+          lowres_disparity(col, row) = round(disp);
+          m_disparity_spread(col, row) = ceil(spread);
         }
       }
 
@@ -271,7 +290,7 @@ namespace asp {
                  bool do_align,
                  Matrix<double> const& align_left_matrix,
                  Matrix<double> const& align_right_matrix,
-                 int pixel_sample,
+                 int pixel_sample, int lattice_spacing,
                  ImageView<PixelMask<Vector2i> > & disparity_spread
                  ) {
     typedef DemDisparity<ImageT, DEMImageT> return_type;
@@ -280,7 +299,7 @@ namespace asp {
                         dem, downsample_scale,
                         left_camera_model, right_camera_model,
                         do_align, align_left_matrix, align_right_matrix,
-                        pixel_sample, disparity_spread
+                        pixel_sample, lattice_spacing, disparity_spread
                         );
   }
 
@@ -312,6 +331,10 @@ namespace asp {
       vw_throw( ArgumentErr() << "dem_disparity: Invalid value for disparity-estimation-dem-error: " << dem_error << ".\n" );
     }
 
+    if (stereo_settings().disparity_estimation_dem_grid < 0){
+      vw_throw( ArgumentErr() << "dem_disparity: Invalid value for disparity-estimation-dem-grid: " << stereo_settings().disparity_estimation_dem_grid << ".\n" );
+    }
+
     GeoReference dem_georef;
     bool has_georef = cartography::read_georeference(dem_georef, dem_file);
     if (!has_georef)
@@ -359,7 +382,8 @@ namespace asp {
                       left_camera_model, right_camera_model,
                       do_align,
                       align_left_matrix, align_right_matrix,
-                      pixel_sample, disparity_spread
+                      pixel_sample, stereo_settings().disparity_estimation_dem_grid,
+                      disparity_spread
                       );
     std::string disparity_file = opt.out_prefix + "-D_sub.tif";
     vw_out() << "Writing low-resolution disparity: " << disparity_file << "\n";
@@ -0,0 +1,69 @@
+// __BEGIN_LICENSE__
+//  Copyright (c) 2009-2013, United States Government as represented by the
+//  Administrator of the National Aeronautics and Space Administration. All
+//  rights reserved.
+//
+//  The NGT platform is licensed under the Apache License, Version 2.0 (the
+//  "License"); you may not use this file except in compliance with the
+//  License. You may obtain a copy of the License at
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+// __END_LICENSE__
+
+
+/// \file DemMosaicTiles.cc
+///
+
+#include <asp/Core/DemMosaicTiles.h>
+
+using namespace vw;
+using namespace vw::cartography;
+
+namespace asp {
+
+  BBox2 dem_input_box(GeoTransform const& geotrans, BBox2i const& dem_box,
+                      BBox2i const& out_box, int border){
+
+    BBox2 in_box = geotrans.reverse_bbox(out_box);
+
+    // Grow to account for blending and erosion length, etc.
+    in_box.expand(border);
+    in_box.crop(dem_box);
+    if (in_box.width() == 1 || in_box.height() == 1){
+      // Grassfire likes to have width of at least 2
+      in_box.expand(1);
+      in_box.crop(dem_box);
+    }
+    return in_box;
+  }
+
+  void find_box_dems(std::vector<GeoReference> const& georefs,
+                     std::vector<BBox2i> const& dem_boxes,
+                     GeoReference const& out_georef,
+                     std::vector<BBox2i> const& out_boxes, int border,
+                     std::vector< std::vector<int> > & box_dems){
+
+    // Each box is checked against each DEM, as the mosaic does for
+    // each of its tiles. A footprint of the DEM in the output can be
+    // far off when the projections differ, so it is not used to
+    // skip boxes.
+    box_dems.clear();
+    box_dems.resize(out_boxes.size());
+    for (size_t dem_iter = 0; dem_iter < georefs.size(); dem_iter++){
+      GeoTransform geotrans(georefs[dem_iter], out_georef);
+      for (size_t box_iter = 0; box_iter < out_boxes.size(); box_iter++){
+        if (out_boxes[box_iter].empty()) continue;
+        BBox2 in_box = dem_input_box(geotrans, dem_boxes[dem_iter],
+                                     out_boxes[box_iter], border);
+        if (in_box.width() <= 1 || in_box.height() <= 1) continue;
+        box_dems[box_iter].push_back(dem_iter);
+      }
+    }
+  }
+
+} // namespace asp
@@ -0,0 +1,54 @@
+// __BEGIN_LICENSE__
+//  Copyright (c) 2009-2013, United States Government as represented by the
+//  Administrator of the National Aeronautics and Space Administration. All
+//  rights reserved.
+//
+//  The NGT platform is licensed under the Apache License, Version 2.0 (the
+//  "License"); you may not use this file except in compliance with the
+//  License. You may obtain a copy of the License at
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+// __END_LICENSE__
+
+
+/// \file DemMosaicTiles.h
+///
+/// Which input DEMs contribute to which boxes of a DEM mosaic. This
+/// is the test the mosaic applies to each of its tiles, so that
+/// tiles can be given only the DEMs they need.
+
+#ifndef __ASP_CORE_DEM_MOSAIC_TILES_H__
+#define __ASP_CORE_DEM_MOSAIC_TILES_H__
+
+#include <vw/Math/BBox.h>
+#include <vw/Cartography/GeoReference.h>
+#include <vw/Cartography/GeoTransform.h>
+#include <vector>
+
+namespace asp {
+
+  /// The region of an input DEM, of pixel box dem_box, needed to
+  /// mosaic the box out_box of the output. geotrans goes from the DEM
+  /// to the output. The region is grown by border pixels, for
+  /// blending and interpolation. It is too small to use if its width
+  /// or height is at most 1.
+  vw::BBox2 dem_input_box(vw::cartography::GeoTransform const& geotrans,
+                          vw::BBox2i const& dem_box, vw::BBox2i const& out_box,
+                          int border);
+
+  /// For each of the output boxes, the indices of the input DEMs, in
+  /// their order, whose region for it is large enough to use.
+  void find_box_dems(std::vector<vw::cartography::GeoReference> const& georefs,
+                     std::vector<vw::BBox2i> const& dem_boxes,
+                     vw::cartography::GeoReference const& out_georef,
+                     std::vector<vw::BBox2i> const& out_boxes, int border,
+                     std::vector< std::vector<int> > & box_dems);
+
+} // namespace asp
+
+#endif//__ASP_CORE_DEM_MOSAIC_TILES_H__
@@ -0,0 +1,363 @@
+// __BEGIN_LICENSE__
+//  Copyright (c) 2009-2013, United States Government as represented by the
+//  Administrator of the National Aeronautics and Space Administration. All
+//  rights reserved.
+//
+//  The NGT platform is licensed under the Apache License, Version 2.0 (the
+//  "License"); you may not use this file except in compliance with the
+//  License. You may obtain a copy of the License at
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+// __END_LICENSE__
+
+
+/// \file DemRayCaster.cc
+///
+
+#include <asp/Core/DemRayCaster.h>
+#include <vw/Core/Exception.h>
+#include <vw/Image/Manipulation.h>
+#include <vw/Image/Algorithms.h>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+using namespace vw;
+using namespace vw::cartography;
+
+namespace {
+
+  const double g_inf = std::numeric_limits<double>::max();
+
+  // The range of ray parameters over which the ray from ctr along dir
+  // is within the ellipsoid with semi-axes (a, a, b).
+  bool ray_ellipsoid( Vector3 const& ctr, Vector3 const& dir, double a, double b,
+                      double & t_near, double & t_far ) {
+    Vector3 c( ctr.x()/a, ctr.y()/a, ctr.z()/b ), d( dir.x()/a, dir.y()/a, dir.z()/b );
+    double A = dot_prod(d, d), B = 2*dot_prod(c, d), C = dot_prod(c, c) - 1;
+    double disc = B*B - 4*A*C;
+    if ( disc < 0 ) return false;
+    double s = sqrt(disc);
+    t_near = (-B - s)/(2*A);
+    t_far  = (-B + s)/(2*A);
+    return true;
+  }
+
+  // The ray parameter at which a linear motion from p with velocity v
+  // leaves the box [lo, hi], or enters it if outside. Infinite if never.
+  double box_exit( Vector2 const& p, Vector2 const& v, Vector2 const& lo, Vector2 const& hi ) {
+    double t = g_inf;
+    for ( int i = 0; i < 2; i++ ) {
+      if ( v[i] > 0 ) t = std::min( t, (hi[i] - p[i])/v[i] );
+      if ( v[i] < 0 ) t = std::min( t, (lo[i] - p[i])/v[i] );
+    }
+    return t;
+  }
+
+  double box_entry( Vector2 const& p, Vector2 const& v, Vector2 const& lo, Vector2 const& hi ) {
+    double t_in = 0, t_out = g_inf;
+    for ( int i = 0; i < 2; i++ ) {
+      if ( v[i] == 0 ) {
+        if ( p[i] < lo[i] || p[i] > hi[i] ) return g_inf;
+        continue;
+      }
+      double t0 = (lo[i] - p[i])/v[i], t1 = (hi[i] - p[i])/v[i];
+      if ( t0 > t1 ) std::swap( t0, t1 );
+      t_in  = std::max( t_in, t0 );
+      t_out = std::min( t_out, t1 );
+    }
+    return t_in <= t_out ? t_in : g_inf;
+  }
+}
+
+namespace asp {
+
+  DemRayCaster::DemRayCaster( ImageView< PixelMask<float> > const& dem,
+                              GeoReference const& georef ):
+    m_dem(dem), m_georef(georef), m_diff_step(1.0), m_center_lon(0) {
+
+    if ( m_dem.cols() > 0 && m_dem.rows() > 0 )
+      m_center_lon = m_georef.pixel_to_lonlat( Vector2( m_dem.cols()/2, m_dem.rows()/2 ) )[0];
+
+    // The finest level, over the interpolation cells
+    int cols = std::max( m_dem.cols() - 1, 0 ), rows = std::max( m_dem.rows() - 1, 0 );
+    if ( cols == 0 || rows == 0 ) return;
+    float big = std::numeric_limits<float>::max();
+    ImageView<Vector2f> level( cols, rows );
+    for ( int row = 0; row < rows; row++ ) {
+      for ( int col = 0; col < cols; col++ ) {
+        Vector2f range( big, -big );
+        bool valid = true;
+        for ( int c = col; c <= col + 1; c++ ) {
+          for ( int r = row; r <= row + 1; r++ ) {
+            valid = valid && is_valid(m_dem(c, r));
+            range[0] = std::min( range[0], m_dem(c, r).child() );
+            range[1] = std::max( range[1], m_dem(c, r).child() );
+          }
+        }
+        level(col, row) = valid ? range : Vector2f( big, -big );
+      }
+    }
+    m_levels.push_back( level );
+
+    // Coarser levels, down to a single cell
+    while ( m_levels.back().cols() > 1 || m_levels.back().rows() > 1 ) {
+      ImageView<Vector2f> const& fine = m_levels.back();
+      ImageView<Vector2f> coarse( (fine.cols() + 1)/2, (fine.rows() + 1)/2 );
+      for ( int row = 0; row < coarse.rows(); row++ ) {
+        for ( int col = 0; col < coarse.cols(); col++ ) {
+          Vector2f range( big, -big );
+          for ( int c = 2*col; c < std::min( 2*col + 2, fine.cols() ); c++ ) {
+            for ( int r = 2*row; r < std::min( 2*row + 2, fine.rows() ); r++ ) {
+              range[0] = std::min( range[0], fine(c, r)[0] );
+              range[1] = std::max( range[1], fine(c, r)[1] );
+            }
+          }
+          coarse(col, row) = range;
+        }
+      }
+      m_levels.push_back( coarse );
+    }
+
+    // Take finite differences along rays over half a DEM pixel
+    Vector2 mid( cols/2, rows/2 );
+    Datum const& datum = m_georef.datum();
+    Vector3 p0 = datum.geodetic_to_cartesian
+      ( Vector3( m_georef.pixel_to_lonlat(mid)[0], m_georef.pixel_to_lonlat(mid)[1], 0 ) );
+    Vector2 ll = m_georef.pixel_to_lonlat( mid + Vector2(1, 1) );
+    Vector3 p1 = datum.geodetic_to_cartesian( Vector3( ll[0], ll[1], 0 ) );
+    m_diff_step = std::max( 0.5*norm_2(p1 - p0)/sqrt(2.0), 1e-3 );
+  }
+
+  bool DemRayCaster::height_range( Vector2 & range ) const {
+    if ( m_levels.empty() ) return false;
+    Vector2f top = m_levels.back()(0, 0);
+    if ( top[0] > top[1] ) return false;
+    range = Vector2( top[0], top[1] );
+    return true;
+  }
+
+  bool DemRayCaster::terrain_height( Vector2 const& pix, double & height ) const {
+    if ( m_levels.empty() ) return false;
+    double x = pix.x(), y = pix.y();
+    if ( !(x >= 0 && y >= 0 && x <= m_dem.cols() - 1 && y <= m_dem.rows() - 1) )
+      return false;
+    int col = std::min( (int)x, m_dem.cols() - 2 ), row = std::min( (int)y, m_dem.rows() - 2 );
+    Vector2f const& range = m_levels[0](col, row);
+    if ( range[0] > range[1] ) return false;
+    double dx = x - col, dy = y - row;
+    height
+      = (1-dx)*(1-dy)*m_dem(col, row    ).child() + dx*(1-dy)*m_dem(col+1, row    ).child()
+      + (1-dx)*dy    *m_dem(col, row + 1).child() + dx*dy    *m_dem(col+1, row + 1).child();
+    return true;
+  }
+
+  Vector3 DemRayCaster::geodetic( Vector3 const& xyz ) const {
+    Vector3 llh = m_georef.datum().cartesian_to_geodetic( xyz );
+    if ( !m_georef.is_projected() )
+      llh[0] += 360.0*round( (m_center_lon - llh[0])/360.0 );
+    return llh;
+  }
+
+  void DemRayCaster::ray_point( Vector3 const& xyz, double & height, Vector2 & pix ) const {
+    Vector3 llh = geodetic( xyz );
+    height = llh[2];
+    pix = m_georef.lonlat_to_pixel( subvector(llh, 0, 2) );
+  }
+
+  // How far the ray may go from the point at t, at given height and
+  // pixel, without passing through the DEM, based on the motion of
+  // the ray over the DEM near that point. Negative if the ray can't
+  // reach the DEM any more.
+  double DemRayCaster::next_step( Vector3 const& camera_ctr, Vector3 const& camera_vec,
+                                  double t, double height, Vector2 const& pix ) const {
+
+    double height2;
+    Vector2 pix2;
+    ray_point( camera_ctr + (t + m_diff_step)*camera_vec, height2, pix2 );
+    Vector2 pix_rate    = (pix2 - pix)/m_diff_step;
+    double  height_rate = (height2 - height)/m_diff_step;
+    double  pix_speed   = std::max( fabs(pix_rate.x()), fabs(pix_rate.y()) );
+
+    // Steps to cross a quarter of a pixel, and to go down a given height
+    double quarter_pix = pix_speed > 0 ? 0.25/pix_speed : g_inf;
+    double nudge       = pix_speed > 0 ? 1e-3/pix_speed : 0;
+
+    Vector2 lo( 0, 0 ), hi( m_dem.cols() - 1, m_dem.rows() - 1 );
+    if ( !( pix.x() >= lo.x() && pix.y() >= lo.y() && pix.x() < hi.x() && pix.y() < hi.y() ) ) {
+      // Outside the DEM, go to where the ray enters it
+      double entry = box_entry( pix, pix_rate, lo, hi );
+      if ( entry == g_inf ) return -1;
+      return std::max( entry + nudge, 0.01*std::min( quarter_pix, m_diff_step ) );
+    }
+
+    // Find the coarsest cell containing the point which the ray is
+    // above, and jump to where it leaves the cell or comes down to its
+    // top, whichever is first.
+    int col = (int)pix.x(), row = (int)pix.y();
+    for ( int k = (int)m_levels.size() - 1; k >= 0; k-- ) {
+      Vector2f const& range = m_levels[k](col >> k, row >> k);
+      if ( !(height > range[1]) ) continue;
+
+      int size = 1 << k;
+      Vector2 cell_lo( (col >> k) << k, (row >> k) << k );
+      double exit = box_exit( pix, pix_rate, cell_lo, cell_lo + Vector2(size, size) );
+      double drop = height_rate < 0 ? (height - range[1])/(-height_rate) : g_inf;
+      if ( exit < g_inf ) exit += nudge;
+      double step = std::min( exit, drop );
+      if ( step == g_inf ) return -1; // neither descends nor moves across
+      return std::max( step, 0.01*std::min( quarter_pix, m_diff_step ) );
+    }
+
+    // The ray is among the heights of the terrain under it. Take small
+    // steps, not going below the lowest point of the cell at once, as
+    // a steep ray crosses few pixels.
+    Vector2f const& range = m_levels[0](col, row);
+    double down = g_inf;
+    if ( height_rate < 0 )
+      down = std::max( 0.25*(range[1] - range[0]), 0.05 )/(-height_rate);
+    double step = std::min( quarter_pix, down );
+    if ( step == g_inf ) return -1;
+    return step;
+  }
+
+  bool DemRayCaster::intersect( Vector3 const& camera_ctr, Vector3 const& camera_vec,
+                                Vector3 & xyz ) const {
+
+    Vector2 range;
+    if ( !height_range(range) ) return false;
+    Vector3 dir = normalize( camera_vec );
+
+    // Only the part of the ray between the ellipsoids through the
+    // lowest and highest DEM points needs to be searched. Padding
+    // covers the difference between height above the datum and
+    // inflating the datum.
+    Datum const& datum = m_georef.datum();
+    double a = datum.semi_major_axis(), b = datum.semi_minor_axis();
+    double pad = 0.01*std::max( fabs(range[0]), fabs(range[1]) ) + 10.0;
+    double t_near, t_far, t_lo_near, t_lo_far;
+    if ( !ray_ellipsoid( camera_ctr, dir, a + range[1] + pad, b + range[1] + pad,
+                         t_near, t_far ) || t_far < 0 )
+      return false;
+    double t_begin = std::max( t_near, 0.0 ), t_end = t_far;
+    if ( ray_ellipsoid( camera_ctr, dir, a + range[0] - pad, b + range[0] - pad,
+                        t_lo_near, t_lo_far ) && t_lo_near >= 0 )
+      t_end = std::min( t_end, t_lo_near );
+
+    const int max_steps = 100000;
+    double t = t_begin, t_above = -1;
+    for ( int step = 0; step < max_steps && t <= t_end; step++ ) {
+
+      double height, terrain;
+      Vector2 pix;
+      ray_point( camera_ctr + t*dir, height, pix );
+
+      if ( terrain_height(pix, terrain) && height <= terrain ) {
+        if ( t_above < 0 ) return false; // starts below the terrain
+
+        // Bisect between the last point known to be above the
+        // terrain (or over no data) and this one
+        double lo = t_above, hi = t;
+        for ( int iter = 0; iter < 60 && hi - lo > 1e-4; iter++ ) {
+          double mid = (lo + hi)/2;
+          ray_point( camera_ctr + mid*dir, height, pix );
+          if ( terrain_height(pix, terrain) && height <= terrain ) hi = mid;
+          else                                                     lo = mid;
+        }
+        xyz = camera_ctr + ((lo + hi)/2)*dir;
+        return true;
+      }
+
+      double len = next_step( camera_ctr, dir, t, height, pix );
+      if ( len < 0 ) return false;
+      t_above = t;
+      t += len;
+    }
+
+    return false;
+  }
+
+  boost::shared_ptr<DemRayCaster>
+  subsampled_dem_ray_caster( ImageViewRef< PixelMask<float> > const& dem,
+                             GeoReference const& georef, int max_size ) {
+    int step = std::max( 1, (std::max( dem.cols(), dem.rows() ) + max_size - 1)/max_size );
+    if ( step == 1 ) {
+      ImageView< PixelMask<float> > dem_copy = dem;
+      return boost::shared_ptr<DemRayCaster>( new DemRayCaster( dem_copy, georef ) );
+    }
+    ImageView< PixelMask<float> > dem_sub = subsample( dem, step );
+    return boost::shared_ptr<DemRayCaster>
+      ( new DemRayCaster( dem_sub, resample( georef, 1.0/step ) ) );
+  }
+
+  CameraFootprint camera_footprint( DemRayCaster const& caster,
+                                    camera::CameraModel const& camera,
+                                    Vector2i const& image_size ) {
+    int cols = image_size.x(), rows = image_size.y();
+    CameraFootprint footprint;
+    footprint.step = std::max( 1, (2*cols + 2*rows)/100 );
+
+    // The image edges, walked around, then the two diagonals
+    std::vector< std::pair<Vector2, Vector2> > lines;
+    lines.push_back( std::make_pair( Vector2(0, 0),               Vector2(cols, 0)       ) );
+    lines.push_back( std::make_pair( Vector2(cols - 1, 0),        Vector2(cols - 1, rows) ) );
+    lines.push_back( std::make_pair( Vector2(cols - 1, rows - 1), Vector2(-1, rows - 1)  ) );
+    lines.push_back( std::make_pair( Vector2(0, rows - 1),        Vector2(0, -1)         ) );
+    lines.push_back( std::make_pair( Vector2(0, 0),               Vector2(cols, rows)    ) );
+    lines.push_back( std::make_pair( Vector2(0, rows - 1),        Vector2(cols, -1)      ) );
+
+    bool last_valid = false;
+    for ( size_t k = 0; k < lines.size(); k++ ) {
+      if ( k == 4 ) last_valid = false; // the edges form a loop, the diagonals don't
+
+      // As in a Bresenham line, step along the longer axis, and stop
+      // before the end point.
+      Vector2 beg = lines[k].first, delta = lines[k].second - beg;
+      int len = (int)std::max( fabs(delta.x()), fabs(delta.y()) );
+      for ( int i = 0; i < len; i += footprint.step ) {
+        Vector2 pix = round( beg + delta*(double(i)/len) );
+        Vector3 xyz;
+        bool has_intersection = false;
+        try {
+          has_intersection = caster.intersect( camera.camera_center(pix),
+                                               camera.pixel_to_vector(pix), xyz );
+        } catch (...) {}
+        if ( !has_intersection ) {
+          last_valid = false;
+          continue;
+        }
+        footprint.llh.push_back( caster.geodetic(xyz) );
+        footprint.follows_previous.push_back( last_valid );
+        last_valid = true;
+      }
+    }
+
+    return footprint;
+  }
+
+  BBox2 footprint_bbox( CameraFootprint const& footprint,
+                        GeoReference const& georef, float & scale ) {
+    BBox2 box;
+    double min_dist = std::numeric_limits<double>::max();
+    Vector2 prev;
+    for ( size_t i = 0; i < footprint.llh.size(); i++ ) {
+      Vector2 point = georef.lonlat_to_point( subvector(footprint.llh[i], 0, 2) );
+      box.grow( point );
+      if ( footprint.follows_previous[i] )
+        min_dist = std::min( min_dist, norm_2(point - prev) );
+      prev = point;
+    }
+    if ( min_dist == std::numeric_limits<double>::max() )
+      scale = std::numeric_limits<float>::quiet_NaN();
+    else
+      scale = min_dist/footprint.step;
+    return box;
+  }
+
+} // namespace asp
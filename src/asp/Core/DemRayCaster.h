@@ -0,0 +1,124 @@
+// __BEGIN_LICENSE__
+//  Copyright (c) 2009-2013, United States Government as represented by the
+//  Administrator of the National Aeronautics and Space Administration. All
+//  rights reserved.
+//
+//  The NGT platform is licensed under the Apache License, Version 2.0 (the
+//  "License"); you may not use this file except in compliance with the
+//  License. You may obtain a copy of the License at
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+// __END_LICENSE__
+
+
+/// \file DemRayCaster.h
+///
+/// Intersect camera rays with a DEM held in memory. The DEM is
+/// interpolated bilinearly, as with vw::cartography::camera_pixel_to_dem_xyz,
+/// but rather than iterating towards the surface from a guess, a ray
+/// is walked down a pyramid of the minimum and maximum heights of the
+/// DEM. Where the ray is above the highest point of a pyramid cell it
+/// jumps to where it leaves the cell, so the empty space above the
+/// terrain is crossed in a few large steps and the first intersection
+/// is never skipped. The surface is then found by bisection.
+///
+/// A built caster does not change, so it may be shared between threads.
+
+#ifndef __ASP_CORE_DEM_RAY_CASTER_H__
+#define __ASP_CORE_DEM_RAY_CASTER_H__
+
+#include <vw/Math/Vector.h>
+#include <vw/Math/BBox.h>
+#include <vw/Image/ImageView.h>
+#include <vw/Image/ImageViewRef.h>
+#include <vw/Image/PixelMask.h>
+#include <vw/Camera/CameraModel.h>
+#include <vw/Cartography/GeoReference.h>
+
+#include <boost/shared_ptr.hpp>
+#include <vector>
+
+namespace asp {
+
+  class DemRayCaster {
+  public:
+    DemRayCaster( vw::ImageView< vw::PixelMask<float> > const& dem,
+                  vw::cartography::GeoReference const& georef );
+
+    /// The first point where the ray from camera_ctr along camera_vec
+    /// meets the DEM. Returns false if the ray misses the DEM, or
+    /// reaches it only where it has no data.
+    bool intersect( vw::Vector3 const& camera_ctr, vw::Vector3 const& camera_vec,
+                    vw::Vector3 & xyz ) const;
+
+    /// The lowest and highest heights of the DEM, if it has valid data
+    bool height_range( vw::Vector2 & range ) const;
+
+    vw::cartography::GeoReference const& georef() const { return m_georef; }
+
+    /// Longitude, latitude, and height of a point, with the longitude
+    /// in the range used by the DEM, which may be [0, 360].
+    vw::Vector3 geodetic( vw::Vector3 const& xyz ) const;
+
+  private:
+    vw::ImageView< vw::PixelMask<float> > m_dem;
+    vw::cartography::GeoReference m_georef;
+
+    // Level k holds (min, max) of the heights over square blocks of
+    // 2^k interpolation cells. The interpolation cell (i, j) spans the
+    // DEM pixels i..i+1 and j..j+1. Cells which can't be interpolated
+    // have min > max.
+    std::vector< vw::ImageView<vw::Vector2f> > m_levels;
+
+    // Meters along a ray for a finite difference step
+    double m_diff_step;
+    double m_center_lon;
+
+    bool terrain_height( vw::Vector2 const& pix, double & height ) const;
+    void ray_point( vw::Vector3 const& xyz, double & height, vw::Vector2 & pix ) const;
+    double next_step( vw::Vector3 const& camera_ctr, vw::Vector3 const& camera_vec,
+                      double t, double height, vw::Vector2 const& pix ) const;
+  };
+
+  /// A caster for a DEM too large to keep in memory at full
+  /// resolution. The DEM is subsampled so that neither of its sides is
+  /// longer than max_size pixels, which is enough to find the extent
+  /// of a camera image on the ground.
+  boost::shared_ptr<DemRayCaster>
+  subsampled_dem_ray_caster( vw::ImageViewRef< vw::PixelMask<float> > const& dem,
+                             vw::cartography::GeoReference const& georef,
+                             int max_size = 2048 );
+
+  /// Where the rays through the edges and the diagonals of a camera
+  /// image meet the DEM, at the pixels vw::cartography::camera_bbox
+  /// samples. Computing it once lets its bounding box be found in
+  /// any number of projections without casting the rays again.
+  struct CameraFootprint {
+    int step; // image pixels between samples along a line
+    std::vector<vw::Vector3> llh;
+    // Whether a point was sampled right after the previous one along
+    // the same line, with no ray in between missing the DEM.
+    std::vector<bool> follows_previous;
+  };
+
+  CameraFootprint camera_footprint( DemRayCaster const& caster,
+                                    vw::camera::CameraModel const& camera,
+                                    vw::Vector2i const& image_size );
+
+  /// The bounding box of a footprint in the projected coordinates of
+  /// georef, and, as scale, the ground distance between image pixels,
+  /// in the same units. As with camera_bbox, this is the smallest
+  /// distance between consecutive points, divided by the sample step.
+  /// The scale is NaN if no two consecutive rays met the DEM.
+  vw::BBox2 footprint_bbox( CameraFootprint const& footprint,
+                            vw::cartography::GeoReference const& georef,
+                            float & scale );
+
+} // namespace asp
+
+#endif//__ASP_CORE_DEM_RAY_CASTER_H__
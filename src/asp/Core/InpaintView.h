@@ -43,10 +43,13 @@ namespace asp {
 
     // Semi-private tasks that I wouldn't like the user to know about
     //
-    // This is used for threaded rendering
+    // This is used for threaded rendering. The view and the patches
+    // cover only part of the image, starting at origin, while the
+    // blob is in image coordinates.
     template <class ViewT, class SViewT>
     class InpaintTask : public vw::Task, boost::noncopyable {
       ViewT const& m_view;
+      vw::Vector2i m_origin, m_image_size;
       blob::BlobCompressed m_c_blob;
       bool m_use_grassfire;
       typename ViewT::pixel_type m_default_inpaint_val;
@@ -54,11 +57,13 @@ namespace asp {
 
     public:
       InpaintTask( vw::ImageViewBase<ViewT> const& view,
+                   vw::Vector2i const& origin, vw::Vector2i const& image_size,
                    blob::BlobCompressed const& c_blob,
                    bool use_grassfire,
                    typename ViewT::pixel_type default_inpaint_val,
                    SparseCompositeView<SViewT> & sparse ) :
-        m_view(view.impl()), m_c_blob(c_blob),
+        m_view(view.impl()), m_origin(origin), m_image_size(image_size),
+        m_c_blob(c_blob),
         m_use_grassfire(use_grassfire), m_default_inpaint_val(default_inpaint_val),
         m_patches(sparse) {}
 
@@ -73,8 +78,8 @@ namespace asp {
 
         // How do we want to handle spots on the edges?
         if ( bbox.min().x() < 0 || bbox.min().y() < 0 ||
-             bbox.max().x() >= m_view.impl().cols() ||
-             bbox.max().y() >= m_view.impl().rows() ) {
+             bbox.max().x() >= m_image_size.x() ||
+             bbox.max().y() >= m_image_size.y() ) {
           return;
         }
 
@@ -86,7 +91,7 @@ namespace asp {
 
         // Building a cropped copy for my patch
         ImageView<pixel_type> cropped_copy =
-          crop( m_view, bbox );
+          crop( m_view, bbox - m_origin );
 
         // Creating binary image to highlight hole
         ImageView<uint8> mask( bbox.width(), bbox.height() );
@@ -143,7 +148,8 @@ namespace asp {
         }
 
         // Insert results into sparse view
-        m_patches.absorb(bbox.min(),copy_mask(cropped_copy,create_mask( mask, 0 )));
+        m_patches.absorb(bbox.min() - m_origin,
+                         copy_mask(cropped_copy,create_mask( mask, 0 )));
       }
 
     };
@@ -183,16 +189,21 @@ namespace asp {
       vw_throw( vw::NoImplErr() << "Per pixel access is not provided for InpaintView" );
     }
 
-    typedef typename vw::CropView<vw::ImageView<typename ViewT::pixel_type> > inner_pre_type;
-    typedef SparseCompositeView<inner_pre_type> prerasterize_type;
-    inline prerasterize_type prerasterize( vw::BBox2i const& bbox ) const {
+    typedef vw::ImageView<typename ViewT::pixel_type> inner_pre_type;
+    typedef SparseCompositeView<inner_pre_type> patched_type;
+
+  private:
+    // The tile with its blobs filled in, over the box bbox_expanded
+    // which also covers every blob touching the tile, in the
+    // coordinates of that box.
+    patched_type patched_tile( vw::BBox2i const& bbox, vw::BBox2i & bbox_expanded ) const {
       using namespace vw;
 
       // Expand the preraster size to include all the area that our patches use
       // - This makes sure all contained blobs are identified and fully contained
       std::vector<size_t> intersections;
       intersections.reserve(20);
-      BBox2i bbox_expanded = bbox;
+      bbox_expanded = bbox;
       for ( size_t i = 0; i < m_bindex.num_blobs(); i++ ) {
         if ( m_bindex.blob_bbox(i).intersects( bbox ) && // Early exit option
              m_bindex.compressed_blob(i).intersects( bbox ) ) {
@@ -204,27 +215,40 @@ namespace asp {
       bbox_expanded.expand(1);
       bbox_expanded.crop( BBox2i(0,0,cols(),rows()) );
 
-      // Generate sparse view that will hold background data and all the patches.
-      inner_pre_type preraster =
-        crop(ImageView<typename ViewT::pixel_type>(crop(m_child,bbox_expanded)),
-             -bbox_expanded.min().x(), -bbox_expanded.min().y(), cols(), rows());
-      SparseCompositeView<inner_pre_type> patched_view( preraster );
+      // Generate sparse view that will hold background data and all
+      // the patches, no bigger than the expanded box.
+      inner_pre_type preraster = crop(m_child,bbox_expanded);
+      patched_type patched_view( preraster );
 
       // Build up the patches that intersect our tile
       // - For each intersecting blob, use InpaintTask to fill in that blob
       typedef inpaint_p::InpaintTask<inner_pre_type, inner_pre_type> task_type;
       for ( std::vector<size_t>::const_iterator it = intersections.begin();
             it != intersections.end(); it++ ) {
-        task_type task( preraster, m_bindex.compressed_blob(*it), m_use_grassfire,
+        task_type task( preraster, bbox_expanded.min(), Vector2i(cols(), rows()),
+                        m_bindex.compressed_blob(*it), m_use_grassfire,
                         m_default_inpaint_val, patched_view );
         task();
       }
 
+      // Flatten the patches so untouched tiles read straight through
+      patched_view.compact();
       return patched_view;
     }
+
+  public:
+    typedef vw::CropView<patched_type> prerasterize_type;
+    inline prerasterize_type prerasterize( vw::BBox2i const& bbox ) const {
+      vw::BBox2i bbox_expanded;
+      return vw::crop( patched_tile( bbox, bbox_expanded ),
+                       -bbox_expanded.min().x(), -bbox_expanded.min().y(), cols(), rows() );
+    }
     template <class DestT>
     inline void rasterize( DestT const& dest, vw::BBox2i const& bbox ) const {
-      vw::rasterize( prerasterize(bbox), dest, bbox );
+      // Copy the background and paste the patches in bulk
+      vw::BBox2i bbox_expanded;
+      patched_type patched_view = patched_tile( bbox, bbox_expanded );
+      patched_view.rasterize( dest, bbox - bbox_expanded.min() );
     }
   };
 
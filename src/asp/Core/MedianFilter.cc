@@ -18,6 +18,10 @@
 
 #include <asp/Core/MedianFilter.h>
 #include <vw/Math/Vector.h>
+#include <vw/Image/Algorithms.h>
+
+#include <algorithm>
+#include <vector>
 
 using namespace vw;
 
@@ -39,3 +43,186 @@ uint8 find_median_in_histogram(Vector<int, CALC_PIXEL_NUM_VALS> histogram,
 
   return i;
 }
+
+namespace {
+  const int MEDIAN_COARSE_BINS = 64;
+  const int MEDIAN_FINE_BINS   = 64; // Per coarse bin
+  const int MEDIAN_LEVELS      = MEDIAN_COARSE_BINS * MEDIAN_FINE_BINS;
+
+  // Add or remove one value from the histograms of a column
+  inline void update_column( std::vector<vw::uint16> & coarse,
+                             std::vector<vw::uint16> & fine,
+                             vw::int32 col, int level, int delta ) {
+    coarse[size_t(col) * MEDIAN_COARSE_BINS + level / MEDIAN_FINE_BINS] += delta;
+    fine  [size_t(col) * MEDIAN_LEVELS + level] += delta;
+  }
+}
+
+void vw::median_filter_tile( ImageView<double> const& src,
+                             ImageView<uint8>  const& src_valid,
+                             int half_kernel, BBox2i const& out_box,
+                             ImageView<double> & dst,
+                             ImageView<uint8>  & dst_valid ) {
+
+  dst.set_size( out_box.width(), out_box.height() );
+  dst_valid.set_size( out_box.width(), out_box.height() );
+  fill( dst, 0.0 );
+  fill( dst_valid, 0 );
+
+  const int32 ncols = src.cols(), nrows = src.rows();
+
+  // Map the values to levels
+  std::vector<double> values;
+  for ( int32 row = 0; row < nrows; row++ )
+    for ( int32 col = 0; col < ncols; col++ )
+      if ( src_valid(col,row) )
+        values.push_back( src(col,row) );
+  if ( values.empty() )
+    return;
+  std::sort( values.begin(), values.end() );
+  values.erase( std::unique( values.begin(), values.end() ), values.end() );
+
+  // With few distinct values each level is one of them, given by
+  // its rank. Otherwise a level may hold several values, and the
+  // median is then found among those of its level in the window.
+  ImageView<uint16> level( ncols, nrows );
+  bool levels_are_values = ( values.size() <= size_t(MEDIAN_LEVELS) );
+  if ( levels_are_values ) {
+    for ( int32 row = 0; row < nrows; row++ )
+      for ( int32 col = 0; col < ncols; col++ )
+        if ( src_valid(col,row) )
+          level(col,row) = std::lower_bound( values.begin(), values.end(),
+                                             src(col,row) ) - values.begin();
+  } else {
+    double lo = values.front(), hi = values.back();
+    double scale = (MEDIAN_LEVELS - 1) / (hi - lo);
+    for ( int32 row = 0; row < nrows; row++ )
+      for ( int32 col = 0; col < ncols; col++ )
+        if ( src_valid(col,row) )
+          level(col,row) = std::min( int( (src(col,row) - lo) * scale ),
+                                     MEDIAN_LEVELS - 1 );
+  }
+  std::vector<double> level_values; // scratch, for one level in a window
+
+  // One coarse and one fine histogram for each column of the tile
+  std::vector<uint16> col_coarse( size_t(ncols) * MEDIAN_COARSE_BINS, 0 );
+  std::vector<uint16> col_fine  ( size_t(ncols) * MEDIAN_LEVELS, 0 );
+
+  // Seed the column histograms for the first output row
+  int32 y0 = out_box.min().y();
+  for ( int32 row = std::max( y0 - half_kernel, 0 );
+        row <= std::min( y0 + half_kernel, nrows - 1 ); row++ )
+    for ( int32 col = 0; col < ncols; col++ )
+      if ( src_valid(col,row) )
+        update_column( col_coarse, col_fine, col, level(col,row), 1 );
+
+  int   kernel_coarse[MEDIAN_COARSE_BINS];
+  int   kernel_fine  [MEDIAN_LEVELS];
+  int32 fine_stamp   [MEDIAN_COARSE_BINS];
+
+  for ( int32 y = y0; y < out_box.max().y(); y++ ) {
+
+    // Slide the column histograms down by one row
+    if ( y > y0 ) {
+      int32 drop = y - half_kernel - 1, add = y + half_kernel;
+      for ( int32 col = 0; col < ncols; col++ ) {
+        if ( drop >= 0 && src_valid(col,drop) )
+          update_column( col_coarse, col_fine, col, level(col,drop), -1 );
+        if ( add < nrows && src_valid(col,add) )
+          update_column( col_coarse, col_fine, col, level(col,add), 1 );
+      }
+    }
+
+    // Seed the kernel coarse histogram at the start of the row. All
+    // fine histograms start out stale.
+    int32 x0 = out_box.min().x();
+    int total = 0;
+    std::fill( kernel_coarse, kernel_coarse + MEDIAN_COARSE_BINS, 0 );
+    std::fill( fine_stamp, fine_stamp + MEDIAN_COARSE_BINS, -1 );
+    for ( int32 col = std::max( x0 - half_kernel, 0 );
+          col <= std::min( x0 + half_kernel, ncols - 1 ); col++ )
+      for ( int b = 0; b < MEDIAN_COARSE_BINS; b++ ) {
+        kernel_coarse[b] += col_coarse[size_t(col) * MEDIAN_COARSE_BINS + b];
+        total            += col_coarse[size_t(col) * MEDIAN_COARSE_BINS + b];
+      }
+
+    for ( int32 x = x0; x < out_box.max().x(); x++ ) {
+
+      // Slide the kernel right by one column
+      if ( x > x0 ) {
+        int32 drop = x - half_kernel - 1, add = x + half_kernel;
+        for ( int b = 0; b < MEDIAN_COARSE_BINS; b++ ) {
+          if ( drop >= 0 ) {
+            kernel_coarse[b] -= col_coarse[size_t(drop) * MEDIAN_COARSE_BINS + b];
+            total            -= col_coarse[size_t(drop) * MEDIAN_COARSE_BINS + b];
+          }
+          if ( add < ncols ) {
+            kernel_coarse[b] += col_coarse[size_t(add) * MEDIAN_COARSE_BINS + b];
+            total            += col_coarse[size_t(add) * MEDIAN_COARSE_BINS + b];
+          }
+        }
+      }
+      if ( total == 0 )
+        continue;
+
+      // Find the coarse bin holding the lower median
+      int rank = (total - 1) / 2, b = 0;
+      while ( rank >= kernel_coarse[b] ) {
+        rank -= kernel_coarse[b];
+        b++;
+      }
+
+      // Bring the fine histogram of that bin up to date
+      int* fine = kernel_fine + b * MEDIAN_FINE_BINS;
+      if ( fine_stamp[b] < 0 || x - fine_stamp[b] > 2 * half_kernel + 1 ) {
+        std::fill( fine, fine + MEDIAN_FINE_BINS, 0 );
+        for ( int32 col = std::max( x - half_kernel, 0 );
+              col <= std::min( x + half_kernel, ncols - 1 ); col++ ) {
+          const uint16* cf = &col_fine[size_t(col) * MEDIAN_LEVELS + b * MEDIAN_FINE_BINS];
+          for ( int f = 0; f < MEDIAN_FINE_BINS; f++ )
+            fine[f] += cf[f];
+        }
+      } else {
+        for ( int32 xp = fine_stamp[b] + 1; xp <= x; xp++ ) {
+          int32 drop = xp - half_kernel - 1, add = xp + half_kernel;
+          if ( drop >= 0 ) {
+            const uint16* cf = &col_fine[size_t(drop) * MEDIAN_LEVELS + b * MEDIAN_FINE_BINS];
+            for ( int f = 0; f < MEDIAN_FINE_BINS; f++ )
+              fine[f] -= cf[f];
+          }
+          if ( add < ncols ) {
+            const uint16* cf = &col_fine[size_t(add) * MEDIAN_LEVELS + b * MEDIAN_FINE_BINS];
+            for ( int f = 0; f < MEDIAN_FINE_BINS; f++ )
+              fine[f] += cf[f];
+          }
+        }
+      }
+      fine_stamp[b] = x;
+
+      int f = 0;
+      while ( rank >= fine[f] ) {
+        rank -= fine[f];
+        f++;
+      }
+
+      int l = b * MEDIAN_FINE_BINS + f;
+      if ( levels_are_values ) {
+        dst(x - x0, y - y0) = values[l];
+      } else {
+        // The median is the value of the given rank among those of
+        // its level in the window.
+        level_values.clear();
+        for ( int32 row = std::max( y - half_kernel, 0 );
+              row <= std::min( y + half_kernel, nrows - 1 ); row++ )
+          for ( int32 col = std::max( x - half_kernel, 0 );
+                col <= std::min( x + half_kernel, ncols - 1 ); col++ )
+            if ( src_valid(col,row) && level(col,row) == l )
+              level_values.push_back( src(col,row) );
+        std::nth_element( level_values.begin(), level_values.begin() + rank,
+                          level_values.end() );
+        dst(x - x0, y - y0) = level_values[rank];
+      }
+      dst_valid(x - x0, y - y0) = 1;
+    }
+  }
+}
@@ -31,6 +31,9 @@
 #include <vw/Image/ImageView.h>
 #include <vw/Image/EdgeExtension.h>
 #include <vw/Image/PerPixelAccessorViews.h>
+#include <vw/Image/PixelMask.h>
+#include <vw/Image/PixelTypeInfo.h>
+#include <vw/Image/Manipulation.h>
 
 namespace vw {
 
@@ -140,6 +143,136 @@ namespace vw {
     return UnaryPerPixelAccessorView<EdgeExtensionView<ViewT, ZeroEdgeExtension>, MedianFilterFunctor<typename ViewT::pixel_type> >(edge_extend(input, ZeroEdgeExtension()), MedianFilterFunctor<typename ViewT::pixel_type> (kernel_width, kernel_height));
   }
 
+
+  /// Median filter one channel of a tile with a constant-time per-pixel
+  /// update (Perreault and Hebert). One histogram is kept per column of
+  /// the tile, and the kernel histogram is updated by adding and
+  /// removing whole column histograms. Histograms are two-level, with
+  /// coarse bins that are always current and fine bins that are brought
+  /// up to date only for the coarse bin holding the median.
+  ///
+  /// Values are mapped to 4096 levels. If the tile has at most that many
+  /// distinct valid values each level is one of them, otherwise they
+  /// are quantized linearly over the tile's own range, and the median
+  /// is then picked among the values of its level in the window. So
+  /// the result is always the exact median, and does not depend on
+  /// how the image is split into tiles.
+  ///
+  /// - src, src_valid: the input tile, including the kernel margin.
+  /// - out_box: the region of src to produce, in src pixel coordinates.
+  /// - Pixels with src_valid == 0 or outside src do not take part, so
+  ///   the kernel shrinks at image edges and around holes. An output
+  ///   pixel whose window has no valid input gets dst_valid = 0.
+  void median_filter_tile( ImageView<double> const& src,
+                           ImageView<uint8>  const& src_valid,
+                           int half_kernel, BBox2i const& out_box,
+                           ImageView<double> & dst,
+                           ImageView<uint8>  & dst_valid );
+
+  namespace median_p {
+    // Access the data part of a pixel, whether masked or not
+    template <class PixelT>
+    inline PixelT const& data( PixelT const& p ) { return p; }
+    template <class PixelT>
+    inline PixelT const& data( PixelMask<PixelT> const& p ) { return p.child(); }
+    template <class PixelT>
+    inline PixelT & data( PixelT & p ) { return p; }
+    template <class PixelT>
+    inline PixelT & data( PixelMask<PixelT> & p ) { return p.child(); }
+
+    template <class PixelT>
+    inline void set_valid( PixelT & /*p*/, bool /*valid*/ ) {}
+    template <class PixelT>
+    inline void set_valid( PixelMask<PixelT> & p, bool valid ) {
+      if ( valid ) p.validate(); else p.invalidate();
+    }
+  }
+
+  /// A lazy, tiled median filter. Each tile is filtered independently
+  /// with median_filter_tile(), so writing this view out with
+  /// block_write_gdal_image() uses all the threads of the pool. Each
+  /// channel is filtered separately. Invalid pixels of masked inputs
+  /// are ignored, and an output pixel is invalid only if its whole
+  /// window is.
+  template <class ImageT>
+  class MedianFilterView : public ImageViewBase<MedianFilterView<ImageT> > {
+    ImageT m_img;
+    int    m_half_kernel;
+
+  public:
+    typedef typename ImageT::pixel_type pixel_type;
+    typedef pixel_type result_type;
+    typedef ProceduralPixelAccessor<MedianFilterView<ImageT> > pixel_accessor;
+
+    MedianFilterView( ImageViewBase<ImageT> const& img, int kernel_size ):
+      m_img(img.impl()), m_half_kernel(kernel_size/2) {
+      VW_ASSERT( kernel_size > 0 && kernel_size % 2 == 1,
+                 ArgumentErr() << "MedianFilterView: kernel size must be positive and odd.\n" );
+    }
+
+    inline int32 cols  () const { return m_img.cols(); }
+    inline int32 rows  () const { return m_img.rows(); }
+    inline int32 planes() const { return 1; }
+
+    inline pixel_accessor origin() const { return pixel_accessor(*this,0,0); }
+
+    inline result_type operator()( int32 /*i*/, int32 /*j*/, int32 /*p*/=0 ) const {
+      vw_throw( NoImplErr() << "Per pixel access is not provided for MedianFilterView" );
+      return result_type();
+    }
+
+    typedef CropView<ImageView<pixel_type> > prerasterize_type;
+    inline prerasterize_type prerasterize( BBox2i const& bbox ) const {
+      typedef typename UnmaskedPixelType<pixel_type>::type data_type;
+      typedef typename CompoundChannelType<data_type>::type channel_type;
+      const int num_channels = CompoundNumChannels<data_type>::value;
+
+      BBox2i src_box = bbox;
+      src_box.expand( m_half_kernel );
+      src_box.crop( bounding_box(m_img) );
+      ImageView<pixel_type> src = crop( m_img, src_box );
+      BBox2i out_box = bbox - src_box.min();
+
+      ImageView<uint8> src_valid( src.cols(), src.rows() );
+      for ( int32 row = 0; row < src.rows(); row++ )
+        for ( int32 col = 0; col < src.cols(); col++ )
+          src_valid(col,row) = is_valid( src(col,row) );
+
+      ImageView<pixel_type> result( bbox.width(), bbox.height() );
+      ImageView<double> plane( src.cols(), src.rows() ), filtered;
+      ImageView<uint8>  filtered_valid;
+      for ( int c = 0; c < num_channels; c++ ) {
+        for ( int32 row = 0; row < src.rows(); row++ )
+          for ( int32 col = 0; col < src.cols(); col++ )
+            plane(col,row) = compound_select_channel<channel_type const&>
+              ( median_p::data(src(col,row)), c );
+
+        median_filter_tile( plane, src_valid, m_half_kernel, out_box,
+                            filtered, filtered_valid );
+
+        for ( int32 row = 0; row < result.rows(); row++ )
+          for ( int32 col = 0; col < result.cols(); col++ )
+            compound_select_channel<channel_type&>( median_p::data(result(col,row)), c )
+              = channel_type( filtered(col,row) );
+      }
+      for ( int32 row = 0; row < result.rows(); row++ )
+        for ( int32 col = 0; col < result.cols(); col++ )
+          median_p::set_valid( result(col,row), filtered_valid(col,row) != 0 );
+
+      return crop( result, -bbox.min().x(), -bbox.min().y(), cols(), rows() );
+    }
+    template <class DestT>
+    inline void rasterize( DestT const& dest, BBox2i const& bbox ) const {
+      vw::rasterize( prerasterize(bbox), dest, bbox );
+    }
+  };
+
+  template <class ImageT>
+  inline MedianFilterView<ImageT>
+  tiled_median_filter( ImageViewBase<ImageT> const& img, int kernel_size ) {
+    return MedianFilterView<ImageT>( img, kernel_size );
+  }
+
 }
 
 #endif // __MEDIAN_FILTER_H__
@@ -37,8 +37,9 @@
 #include <asp/Core/Point2Grid.h>
 #include <boost/foreach.hpp>
 #include <boost/math/special_functions/next.hpp>
+#include <boost/filesystem/operations.hpp>
 #include <asp/Core/OrthoRasterizer.h>
-#include <valarray>
+#include <fstream>
 
 namespace asp{
 
@@ -108,6 +109,7 @@ namespace asp{
     BBox2i m_image_bbox;
     BBox3& m_global_bbox;
     std::vector<BBoxPair>& m_point_image_boundaries;
+    std::vector<vw::int64>& m_valid_counts;
     ImageViewRef<double> const& m_error_image;
     double m_estim_max_error; // used for outlier removal based on percentage
     std::vector<double> & m_errors_hist;
@@ -120,9 +122,13 @@ namespace asp{
     // values which are altitude.
     struct GrowBBoxAccumulator {
       BBox3 bbox;
+      vw::int64 count;
+      GrowBBoxAccumulator(): count(0){}
       void operator()( Vector3 const& v ) {
-        if ( !boost::math::isnan(v.z()) )
+        if ( !boost::math::isnan(v.z()) ){
           bbox.grow(v);
+          count++;
+        }
       }
     };
 
@@ -144,6 +150,7 @@ namespace asp{
                           int sub_block_size,
                           BBox2i const& image_bbox,
                           BBox3& global_bbox, std::vector<BBoxPair>& boundaries,
+                          std::vector<vw::int64>& valid_counts,
                           ImageViewRef<double> const& error_image, double estim_max_error,
                           std::vector<double> & errors_hist,
                           double max_valid_triangulation_error,
@@ -151,7 +158,7 @@ namespace asp{
       m_view(view.impl()), m_sub_block_size(sub_block_size),
       m_image_bbox(image_bbox),
       m_global_bbox(global_bbox), m_point_image_boundaries( boundaries ),
-      m_error_image(error_image), m_estim_max_error(estim_max_error),
+      m_valid_counts(valid_counts), m_error_image(error_image), m_estim_max_error(estim_max_error),
       m_errors_hist(errors_hist), m_max_valid_triangulation_error(max_valid_triangulation_error),
       m_mutex( mutex ), m_progress( progress ), m_inc_amt( inc_amt ) {}
     void operator()() {
@@ -169,15 +176,18 @@ namespace asp{
         image_blocks( m_image_bbox, m_sub_block_size, m_sub_block_size );
       BBox3 local_union;
       std::list<BBoxPair> solutions;
+      std::list<vw::int64> counts;
       std::vector<double> local_hist(m_errors_hist.size(), 0);
       for ( size_t i = 0; i < blocks.size(); i++ ) {
         BBox3 pts_bdbox;
+        vw::int64 count = 0;
         ImageView<Vector3 > local_image2 =
           crop( local_image, blocks[i] - m_image_bbox.min() );
         if (m_max_valid_triangulation_error <= 0){
           GrowBBoxAccumulator accum;
           for_each_pixel( local_image2, accum );
           pts_bdbox = accum.bbox;
+          count = accum.count;
         }else{
           // Skip points with error > m_max_valid_triangulation_error
           ImageView<double> local_error2 =
@@ -187,6 +197,7 @@ namespace asp{
               if (boost::math::isnan(local_image2(col, row).z())) continue;
               if (local_error2(col, row) > m_max_valid_triangulation_error) continue;
               pts_bdbox.grow(local_image2(col, row));
+              count++;
             }
           }
         }
@@ -203,6 +214,7 @@ namespace asp{
           pts_bdbox.max()[0] = boost::math::float_next(pts_bdbox.max()[0]);
           pts_bdbox.max()[1] = boost::math::float_next(pts_bdbox.max()[1]);
           solutions.push_back( std::make_pair( pts_bdbox, blocks[i] ) );
+          counts.push_back( count );
         }
 
         if (remove_outliers_with_pct){
@@ -222,6 +234,7 @@ namespace asp{
               it != solutions.end(); it++ ) {
           m_point_image_boundaries.push_back( *it );
         }
+        m_valid_counts.insert( m_valid_counts.end(), counts.begin(), counts.end() );
 
         m_global_bbox.grow( local_union );
 
@@ -258,6 +271,182 @@ namespace asp{
     
   }
   
+  // The sidecar index of the point cloud sub-blocks. It is a binary
+  // file holding the key of the cloud it was created for, then one
+  // section for each of the last few projections of that cloud. A
+  // section has the key of the projection, the bounding box of the
+  // projected cloud, the error histogram, and for each sub-block its
+  // projected 3D bounding box, its extent in the point cloud image,
+  // and its number of valid points. The projected boxes set the DEM
+  // extent and its default spacing, so they must be exact and cannot
+  // be derived from boxes of the unprojected points. The keys encode
+  // everything the index depends on, so a mismatch means it is stale.
+  const char   PC_INDEX_MAGIC[]  = "ASP_PC_INDEX";
+  const int32  PC_INDEX_VERSION  = 2;
+  const size_t PC_INDEX_MAX_SECTIONS = 4;
+
+  struct PointCloudIndexSection {
+    std::string key;
+    BBox3 bbox;
+    std::vector<BBoxPair> boundaries;
+    std::vector<vw::int64> valid_counts;
+    std::vector<double> errors_hist;
+  };
+
+  template <class T>
+  void write_index_value(std::ofstream & ofs, T const& val){
+    ofs.write((char const*)&val, sizeof(T));
+  }
+
+  template <class T>
+  bool read_index_value(std::ifstream & ifs, T & val){
+    ifs.read((char*)&val, sizeof(T));
+    return ifs.good();
+  }
+
+  void write_index_string(std::ofstream & ofs, std::string const& str){
+    write_index_value(ofs, uint64(str.size()));
+    ofs.write(str.c_str(), str.size());
+  }
+
+  bool read_index_string(std::ifstream & ifs, std::string & str){
+    uint64 len = 0;
+    if (!read_index_value(ifs, len) || len > (uint64(1) << 24)) return false;
+    str.assign(len, '\0');
+    if (len > 0) ifs.read(&str[0], len);
+    return ifs.good();
+  }
+
+  void write_index_bbox(std::ofstream & ofs, BBox3 const& box){
+    for (int k = 0; k < 3; k++) write_index_value(ofs, box.min()[k]);
+    for (int k = 0; k < 3; k++) write_index_value(ofs, box.max()[k]);
+  }
+
+  bool read_index_bbox(std::ifstream & ifs, BBox3 & box){
+    for (int k = 0; k < 3; k++)
+      if (!read_index_value(ifs, box.min()[k])) return false;
+    for (int k = 0; k < 3; k++)
+      if (!read_index_value(ifs, box.max()[k])) return false;
+    return true;
+  }
+
+  // Read all sections of the index, if it was made for this cloud
+  bool read_point_cloud_index(std::string const& index_file,
+                              std::string const& cloud_key,
+                              std::vector<PointCloudIndexSection> & sections){
+
+    sections.clear();
+    std::ifstream ifs(index_file.c_str(), std::ios::binary);
+    if (!ifs.good()) return false;
+
+    std::string magic(sizeof(PC_INDEX_MAGIC), '\0');
+    ifs.read(&magic[0], magic.size());
+    if (!ifs.good() || magic != std::string(PC_INDEX_MAGIC, sizeof(PC_INDEX_MAGIC)))
+      return false;
+
+    int32 version = 0;
+    if (!read_index_value(ifs, version) || version != PC_INDEX_VERSION) return false;
+
+    std::string key;
+    if (!read_index_string(ifs, key) || key != cloud_key) return false;
+
+    uint64 num_sections = 0;
+    if (!read_index_value(ifs, num_sections) || num_sections > PC_INDEX_MAX_SECTIONS)
+      return false;
+    std::vector<PointCloudIndexSection> local_sections(num_sections);
+    for (uint64 n = 0; n < num_sections; n++){
+      PointCloudIndexSection & section = local_sections[n];
+      if (!read_index_string(ifs, section.key)) return false;
+      if (!read_index_bbox(ifs, section.bbox)) return false;
+
+      uint64 hist_len = 0;
+      if (!read_index_value(ifs, hist_len) || hist_len > (uint64(1) << 24)) return false;
+      section.errors_hist.resize(hist_len);
+      for (uint64 s = 0; s < hist_len; s++)
+        if (!read_index_value(ifs, section.errors_hist[s])) return false;
+
+      uint64 num_boxes = 0;
+      if (!read_index_value(ifs, num_boxes) || num_boxes > (uint64(1) << 32)) return false;
+      section.boundaries.resize(num_boxes);
+      section.valid_counts.resize(num_boxes);
+      for (uint64 b = 0; b < num_boxes; b++){
+        int32 c[4];
+        if (!read_index_bbox(ifs, section.boundaries[b].first)) return false;
+        for (int k = 0; k < 4; k++)
+          if (!read_index_value(ifs, c[k])) return false;
+        section.boundaries[b].second = BBox2i(Vector2i(c[0], c[1]), Vector2i(c[2], c[3]));
+        if (!read_index_value(ifs, section.valid_counts[b])) return false;
+      }
+    }
+
+    sections.swap(local_sections);
+    return true;
+  }
+
+  void write_point_cloud_index(std::string const& index_file,
+                               std::string const& cloud_key,
+                               std::vector<PointCloudIndexSection> const& sections){
+
+    // Write to a temporary file of a unique name first, then rename
+    // it, which is atomic. So an interrupted run never leaves behind a
+    // truncated index, and concurrent runs do not write into the same
+    // file. If they both add a section, only one of them is kept.
+    boost::system::error_code ec;
+    std::string tmp_file
+      = boost::filesystem::unique_path(index_file + "-%%%%-%%%%-%%%%.tmp", ec).string();
+    if (ec){
+      vw_out(WarningMessage) << "Could not write point cloud index: "
+                             << index_file << "\n";
+      return;
+    }
+    {
+      std::ofstream ofs(tmp_file.c_str(), std::ios::binary);
+      if (!ofs.good()){
+        vw_out(WarningMessage) << "Could not write point cloud index: "
+                               << index_file << "\n";
+        return;
+      }
+      ofs.write(PC_INDEX_MAGIC, sizeof(PC_INDEX_MAGIC));
+      write_index_value(ofs, PC_INDEX_VERSION);
+      write_index_string(ofs, cloud_key);
+      write_index_value(ofs, uint64(sections.size()));
+      for (size_t n = 0; n < sections.size(); n++){
+        PointCloudIndexSection const& section = sections[n];
+        write_index_string(ofs, section.key);
+        write_index_bbox(ofs, section.bbox);
+        write_index_value(ofs, uint64(section.errors_hist.size()));
+        for (size_t s = 0; s < section.errors_hist.size(); s++)
+          write_index_value(ofs, section.errors_hist[s]);
+        write_index_value(ofs, uint64(section.boundaries.size()));
+        for (size_t b = 0; b < section.boundaries.size(); b++){
+          BBox2i const& box = section.boundaries[b].second;
+          write_index_bbox(ofs, section.boundaries[b].first);
+          write_index_value(ofs, int32(box.min().x()));
+          write_index_value(ofs, int32(box.min().y()));
+          write_index_value(ofs, int32(box.max().x()));
+          write_index_value(ofs, int32(box.max().y()));
+          write_index_value(ofs, section.valid_counts[b]);
+        }
+      }
+      if (!ofs.good()){
+        ofs.close();
+        boost::filesystem::remove(tmp_file, ec);
+        vw_out(WarningMessage) << "Could not write point cloud index: "
+                               << index_file << "\n";
+        return;
+      }
+    }
+
+    boost::filesystem::rename(tmp_file, index_file, ec);
+    if (ec){
+      boost::filesystem::remove(tmp_file, ec);
+      vw_out(WarningMessage) << "Could not write point cloud index: "
+                             << index_file << "\n";
+      return;
+    }
+    vw_out() << "Wrote point cloud index: " << index_file << "\n";
+  }
+
   OrthoRasterizerView::OrthoRasterizerView
   (ImageViewRef<Vector3> point_image, ImageViewRef<double> texture,
    double spacing,
@@ -268,7 +457,9 @@ namespace asp{
    ImageViewRef<double> const& error_image, double estim_max_error,
    double max_valid_triangulation_error,
    bool has_las_or_csv,
-   const ProgressCallback& progress):
+   const ProgressCallback& progress,
+   std::string const& index_file, std::string const& cloud_key,
+   std::string const& projection_key):
     // Ensure all members are initiated, even if to temporary values
     m_point_image(point_image), m_texture(ImageView<float>(1,1)),
     m_bbox(BBox3()), m_spacing(0.0), m_default_spacing(0.0),
@@ -280,7 +471,8 @@ namespace asp{
     m_block_size(pc_tile_size),
     m_hole_fill_mode(hole_fill_mode),
     m_hole_fill_num_smooth_iter(hole_fill_num_smooth_iter), m_hole_fill_len(0),
-    m_error_image(error_image), m_error_cutoff(-1.0) {
+    m_error_image(error_image), m_error_cutoff(-1.0),
+    m_filter(vw::stereo::f_weighted_average), m_percentile(50.0), m_fsaa(1) {
     
     set_texture(texture.impl());
     
@@ -309,32 +501,88 @@ namespace asp{
     sub_block_size = int(round(pow(2.0, floor(log(sub_block_size)/log(2.0)))));
     sub_block_size = std::max(16, sub_block_size);
     sub_block_size = std::min(max_subblock_size(), sub_block_size);
-    std::vector<BBox2i> blocks =
-      image_blocks( m_point_image, m_block_size, m_block_size );
-
-    // Find the bounding box of each subblock, stored in
-    // m_point_image_boundaries, together with other info by
-    // searching through the image.
-    FifoWorkQueue queue( vw_settings().default_num_threads() );
-    typedef SubBlockBoundaryTask task_type;
-    Mutex mutex;
-    float inc_amt = 1.0 / float(blocks.size());
-    for ( size_t i = 0; i < blocks.size(); i++ ) {
-      boost::shared_ptr<task_type>
-        task( new task_type( m_point_image, sub_block_size, blocks[i],
-                             m_bbox, m_point_image_boundaries,
-                             error_image, estim_max_error, errors_hist,
-                             max_valid_triangulation_error,
-                             mutex, progress, inc_amt ) );
-      queue.add_task( task );
+
+    // The index depends on how the cloud is split into blocks, and
+    // on the outlier removal settings, besides what the caller put in
+    // the cloud key.
+    std::string full_cloud_key;
+    std::vector<PointCloudIndexSection> sections;
+    int section_index = -1;
+    if (!index_file.empty()){
+      std::ostringstream os;
+      os.precision(17);
+      os << cloud_key << "\n"
+         << point_image.cols() << ' ' << point_image.rows() << ' '
+         << m_block_size << ' ' << sub_block_size << ' '
+         << remove_outliers_with_pct << ' ' << estim_max_error << ' '
+         << max_valid_triangulation_error << "\n";
+      full_cloud_key = os.str();
+      read_point_cloud_index(index_file, full_cloud_key, sections);
+      for (size_t n = 0; n < sections.size(); n++){
+        if (sections[n].key == projection_key &&
+            sections[n].errors_hist.size() == errors_hist.size())
+          section_index = n;
+      }
+    }
+
+    if (section_index >= 0){
+      PointCloudIndexSection & section = sections[section_index];
+      m_bbox = section.bbox;
+      m_point_image_boundaries.swap(section.boundaries);
+      m_point_image_valid_counts.swap(section.valid_counts);
+      errors_hist.swap(section.errors_hist);
+      vw_out() << "Read point cloud index: " << index_file << "\n";
+      progress.report_finished();
+    }else{
+      std::vector<BBox2i> blocks =
+        image_blocks( m_point_image, m_block_size, m_block_size );
+
+      // Find the bounding box of each subblock, stored in
+      // m_point_image_boundaries, together with other info by
+      // searching through the image.
+      FifoWorkQueue queue( vw_settings().default_num_threads() );
+      typedef SubBlockBoundaryTask task_type;
+      Mutex mutex;
+      float inc_amt = 1.0 / float(blocks.size());
+      for ( size_t i = 0; i < blocks.size(); i++ ) {
+        boost::shared_ptr<task_type>
+          task( new task_type( m_point_image, sub_block_size, blocks[i],
+                               m_bbox, m_point_image_boundaries,
+                               m_point_image_valid_counts,
+                               error_image, estim_max_error, errors_hist,
+                               max_valid_triangulation_error,
+                               mutex, progress, inc_amt ) );
+        queue.add_task( task );
+      }
+      queue.join_all();
+      progress.report_finished();
+
+      // The newest section goes first, and the oldest are dropped
+      if (!index_file.empty() && !m_bbox.empty()){
+        PointCloudIndexSection section;
+        section.key          = projection_key;
+        section.bbox         = m_bbox;
+        section.boundaries   = m_point_image_boundaries;
+        section.valid_counts = m_point_image_valid_counts;
+        section.errors_hist  = errors_hist;
+        for (size_t n = 0; n < sections.size(); n++){
+          if (sections[n].key == projection_key){
+            sections.erase(sections.begin() + n);
+            break;
+          }
+        }
+        sections.insert(sections.begin(), section);
+        if (sections.size() > PC_INDEX_MAX_SECTIONS)
+          sections.resize(PC_INDEX_MAX_SECTIONS);
+        write_point_cloud_index(index_file, full_cloud_key, sections);
+      }
     }
-    queue.join_all();
-    progress.report_finished();
 
     if ( m_bbox.empty() )
       vw_throw( ArgumentErr() <<
                 "OrthoRasterize: Input point cloud is empty!\n" );
     VW_OUT(DebugMessage,"asp") << "Point cloud boundary is " << m_bbox << "\n";
+    VW_OUT(DebugMessage,"asp") << "Number of valid points is " << num_valid_points() << "\n";
 
     // Find the width and height of the median point cloud pixel in
     // projected coordinates. For las or csv files, this approach
@@ -378,16 +626,11 @@ namespace asp{
       m_default_spacing = std::max(m_default_spacing_x, m_default_spacing_y);
     }
       
-    // Set the sampling rate (i.e. spacing between pixels)
+    // Set the sampling rate (i.e. spacing between pixels), which also
+    // snaps the box to the grid.
+    m_unsnapped_bbox = m_bbox;
     this->set_spacing(spacing);
     VW_OUT(DebugMessage,"asp") << "Pixel spacing is " << m_spacing << " pnt/px\n";
-
-    // We will snap the box so that its corners are integer multiples
-    // of the grid size. This ensures that any two DEMs
-    // with the same grid size and overlapping grids have those
-    // grids match perfectly.
-    m_bbox.min() = m_spacing*floor(m_bbox.min()/m_spacing);
-    m_bbox.max() = m_spacing*ceil(m_bbox.max()/m_spacing);
     
     if (remove_outliers_with_pct){
       // Find the outlier cutoff from the histogram of all errors.
@@ -424,6 +667,13 @@ namespace asp{
     return;
   }
 
+  vw::int64 OrthoRasterizerView::num_valid_points() const {
+    vw::int64 num = 0;
+    for (size_t i = 0; i < m_point_image_valid_counts.size(); i++)
+      num += m_point_image_valid_counts[i];
+    return num;
+  }
+
   // Function to convert pixel coordinates to the point domain
   BBox3 OrthoRasterizerView::pixel_to_point_bbox( BBox2 const& px ) const {
     BBox3 output = m_bbox;
@@ -435,6 +685,22 @@ namespace asp{
     return output;
   }
 
+  double OrthoRasterizerView::background_value() const {
+    if (m_use_alpha) {
+      // use this dummy value to denote transparency
+      return std::numeric_limits<float>::min();
+    } else if (m_minz_as_default) {
+      return m_bbox.min().z();
+    }
+    return m_default_value;
+  }
+
+  double OrthoRasterizerView::search_radius_for(double spacing) const {
+    if (m_search_radius_factor <= 0.0)
+      return std::max(spacing, m_default_spacing);
+    return spacing*m_search_radius_factor;
+  }
+
   /// \cond INTERNAL
   OrthoRasterizerView::prerasterize_type OrthoRasterizerView::prerasterize( BBox2i const& bbox ) const {
 
@@ -465,38 +731,22 @@ namespace asp{
     // with different weights (set by Gaussian). We make this radius
     // no smaller than the default DEM spacing. Search radius can be
     // over-ridden by user.
-    double search_radius;
-    if (m_search_radius_factor <= 0.0)
-      search_radius = std::max(m_spacing, m_default_spacing);
-    else
-      search_radius = m_spacing*m_search_radius_factor;
+    double search_radius = search_radius_for(m_spacing);
     vw::stereo::Point2Grid point2grid(bbox_1.width(),
                                       bbox_1.height(),
                                       d_buffer, weights,
                                       local_3d_bbox.min().x(),
                                       local_3d_bbox.min().y(),
                                       m_spacing, m_default_spacing,
-                                      search_radius);
+                                      search_radius,
+                                      vw::stereo::FilterType(m_filter),
+                                      m_percentile);
 
     // Set up the default color value
-    double min_val = 0.0;
-    if (m_use_alpha) {
-      // use this dummy value to denote transparency
-      min_val = std::numeric_limits<float>::min();
-    } else if (m_minz_as_default) {
-      min_val = m_bbox.min().z();
-    } else {
-      min_val = m_default_value;
-    }
-      
-    std::valarray<float> vertices(10), intensities(5);
+    double min_val = background_value();
 
     if (m_use_surface_sampling){
-      static const int NUM_COLOR_COMPONENTS = 1;  // We only need gray scale
-      static const int NUM_VERTEX_COMPONENTS = 2; // DEMs are 2D
       renderer.Clear(min_val);
-      renderer.SetVertexPointer(NUM_VERTEX_COMPONENTS, &vertices[0]);
-      renderer.SetColorPointer(NUM_COLOR_COMPONENTS, &intensities[0]);
     }else{
       point2grid.Clear(min_val);
     }
@@ -535,6 +785,7 @@ namespace asp{
                                          -bbox_1.min().y(),
                                          cols(), rows()) );
       }else{
+        point2grid.normalize(); // fill with the default value
         return prerasterize_type( d_buffer,
                                   BBox2i(-bbox_1.min().x(),
                                          -bbox_1.min().y(),
@@ -546,6 +797,11 @@ namespace asp{
     // pixel we need to see its next up and right neighbors.
     int d = (int)m_use_surface_sampling;
 
+    // With surface sampling, the blocks are kept to be rendered once
+    // for each supersample.
+    std::vector< ImageView<Vector3> > point_blocks;
+    std::vector< ImageView<float> > texture_blocks;
+
     for (std::map<BBox2i, BBox2i, compare_bboxes>::iterator it = blocks_map.begin();
          it != blocks_map.end(); it++){
         
@@ -577,68 +833,68 @@ namespace asp{
       
       ImageView<float> texture_copy = crop(m_texture, block );
 
-      typedef ImageView<Vector3>::pixel_accessor
-        PointAcc;
-      PointAcc row_acc = point_copy.origin();
-      for ( int32 row = 0; row < point_copy.rows()-d; ++row ) {
-        PointAcc point_ul = row_acc;
-          
-        for ( int32 col = 0; col < point_copy.cols()-d; ++col ) {
-            
-          PointAcc point_ur = point_ul; point_ur.next_col();
-          PointAcc point_ll = point_ul; point_ll.next_row();
-          PointAcc point_lr = point_ul; point_lr.advance(1,1);
-
-          if (m_use_surface_sampling){
-
-            // This loop rasterizes a quad indexed by the upper left.
-            if ( !boost::math::isnan((*point_ul).z()) &&
-                 !boost::math::isnan((*point_lr).z()) ) {
-                
-              vertices[0] = (*point_ul).x(); // UL
-              vertices[1] = (*point_ul).y();
-              vertices[2] = (*point_ll).x(); // LL
-              vertices[3] = (*point_ll).y();
-              vertices[4] = (*point_lr).x(); // LR
-              vertices[5] = (*point_lr).y();
-              vertices[6] = (*point_ur).x(); // UR
-              vertices[7] = (*point_ur).y();
-              vertices[8] = (*point_ul).x(); // UL
-              vertices[9] = (*point_ul).y();
-                
-              intensities[0] = texture_copy(col,  row);
-              intensities[1] = texture_copy(col,row+1);
-              intensities[2] = texture_copy(col+1,  row+1);
-              intensities[3] = texture_copy(col+1,row);
-              intensities[4] = texture_copy(col,row);
-                
-              if ( !boost::math::isnan((*point_ll).z()) ) {
-                // triangle 1 is: UL LL LR
-                renderer.DrawPolygon(0, 3);
-              }
-              if ( !boost::math::isnan((*point_ur).z()) ) {
-                // triangle 2 is: LR, UR, UL
-                renderer.DrawPolygon(2, 3);
-              }
-            }
-              
-          }else{
-            // The new engine
-            if ( !boost::math::isnan(point_copy(col, row).z()) ){
-              point2grid.AddPoint(point_copy(col, row).x(),
-                                  point_copy(col, row).y(),
-                                  texture_copy(col,  row));
-            }
-          }
-          point_ul.next_col();
+      if (m_use_surface_sampling){
+        point_blocks.push_back(point_copy);
+        texture_blocks.push_back(texture_copy);
+        continue;
+      }
+
+      for ( int32 row = 0; row < point_copy.rows(); ++row ) {
+        for ( int32 col = 0; col < point_copy.cols(); ++col ) {
+          Vector3 const& point = point_copy(col, row);
+          if ( boost::math::isnan(point.z()) ) continue;
+          point2grid.AddPoint(point.x(), point.y(), texture_copy(col, row));
         }
-        row_acc.next_row();
       }
         
     }
 
-    if (!m_use_surface_sampling)
+    if (m_use_surface_sampling){
+      // Rasterize the two triangles of each quad of points. Points
+      // which are NaN are skipped along with their triangles.
+      if (m_fsaa <= 1){
+        for (size_t b = 0; b < point_blocks.size(); b++)
+          renderer.DrawGrid(point_blocks[b].cols(), point_blocks[b].rows(), 3,
+                            &point_blocks[b](0, 0)[0], &texture_blocks[b](0, 0));
+      }else{
+        // Shift the view by a fraction of a pixel for each supersample,
+        // and average the samples which hit the surface.
+        ImageView<double> sums(render_buffer.cols(), render_buffer.rows());
+        ImageView<int> counts(render_buffer.cols(), render_buffer.rows());
+        fill(sums, 0.0);
+        fill(counts, 0);
+        for (int sy = 0; sy < m_fsaa; sy++){
+          for (int sx = 0; sx < m_fsaa; sx++){
+            double dx = ((sx + 0.5)/m_fsaa - 0.5)*m_spacing;
+            double dy = ((sy + 0.5)/m_fsaa - 0.5)*m_spacing;
+            renderer.Ortho2D(local_3d_bbox.min().x() + dx, local_3d_bbox.max().x() + dx,
+                             local_3d_bbox.min().y() + dy, local_3d_bbox.max().y() + dy);
+            renderer.Clear(std::numeric_limits<float>::quiet_NaN());
+            for (size_t b = 0; b < point_blocks.size(); b++)
+              renderer.DrawGrid(point_blocks[b].cols(), point_blocks[b].rows(), 3,
+                                &point_blocks[b](0, 0)[0], &texture_blocks[b](0, 0));
+            for (int row = 0; row < render_buffer.rows(); row++){
+              for (int col = 0; col < render_buffer.cols(); col++){
+                float val = render_buffer(col, row);
+                if (boost::math::isnan(val)) continue;
+                sums(col, row) += val;
+                counts(col, row)++;
+              }
+            }
+          }
+        }
+        for (int row = 0; row < render_buffer.rows(); row++){
+          for (int col = 0; col < render_buffer.cols(); col++){
+            if (counts(col, row) > 0)
+              render_buffer(col, row) = sums(col, row)/counts(col, row);
+            else
+              render_buffer(col, row) = min_val;
+          }
+        }
+      }
+    }else{
       point2grid.normalize();
+    }
 
     // The software renderer returns an image which will render
     // upside down in most image formats, so we correct that here.
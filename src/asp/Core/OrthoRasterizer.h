@@ -29,6 +29,7 @@
 #include <vw/Image/ImageViewRef.h>
 #include <vw/Math/Vector.h>
 #include <vw/Math/BBox.h>
+#include <string>
 
 namespace asp{
 
@@ -56,10 +57,15 @@ namespace asp{
     int m_hole_fill_len;
     ImageViewRef<double> const& m_error_image;
     double m_error_cutoff;
+    BBox3 m_unsnapped_bbox;   // m_bbox before snapping to the grid
+    int m_filter;             // a vw::stereo::FilterType
+    double m_percentile;
+    int m_fsaa;               // supersamples per pixel along each axis
     
     // We could actually use a quadtree here .. but this should be a
     // good enough improvement.
     std::vector<BBoxPair> m_point_image_boundaries;
+    std::vector<vw::int64> m_point_image_valid_counts; // valid points in each boundary
     // These boundaries describe a point cloud 3D boundaries and then
     // their location in the the point cloud image. These boxes are
     // overlapping in the pc image X/Y domain to insure that
@@ -67,6 +73,12 @@ namespace asp{
 
     // Function to convert pixel coordinates to the point domain
     BBox3 pixel_to_point_bbox( BBox2 const& px ) const;
+
+    // The value of DEM pixels with no points nearby
+    double background_value() const;
+
+    // The radius within which points contribute to a DEM grid point
+    double search_radius_for(double spacing) const;
     
   public:
     typedef PixelGray<float> pixel_type;
@@ -74,6 +86,11 @@ namespace asp{
     typedef ProceduralPixelAccessor<OrthoRasterizerView> pixel_accessor;
     static int max_subblock_size(){ return 128;} // is used in point2dem and below
 
+    /// If index_file is not empty, the sub-block bounds of the point
+    /// cloud are read from it when it was created for the same
+    /// cloud_key and projection_key, and otherwise computed and saved
+    /// to it. The index keeps the bounds for the last few projections
+    /// of a cloud.
     OrthoRasterizerView(ImageViewRef<Vector3> point_image,
                         ImageViewRef<double> texture,
                         double spacing,
@@ -86,7 +103,10 @@ namespace asp{
                         double estim_max_error,
                         double max_valid_triangulation_error,
                         bool has_las_or_csv,
-                        const ProgressCallback& progress);
+                        const ProgressCallback& progress,
+                        std::string const& index_file = "",
+                        std::string const& cloud_key = "",
+                        std::string const& projection_key = "");
     
     /// You can change the texture after the class has been
     /// initialized.  The texture image must have the same dimensions
@@ -122,6 +142,19 @@ namespace asp{
     }
     /// \endcond
 
+    /// How to combine the points near each grid point. See
+    /// vw::stereo::FilterType. The percentile is used only by the
+    /// percentile filter.
+    void set_filter(int filter, double percentile = 50.0) {
+      m_filter = filter;
+      m_percentile = percentile;
+    }
+
+    /// With surface sampling, make each pixel the average of fsaa x
+    /// fsaa samples spread over it. The samples are accumulated tile
+    /// by tile, so this costs time but no more memory.
+    void set_fsaa(int fsaa) { m_fsaa = std::max(fsaa, 1); }
+
     void set_use_alpha(bool val) { m_use_alpha = val; }
     void set_use_minz_as_default(bool val) { m_minz_as_default = val; }
     void set_default_value(double val) { m_default_value = val; }
@@ -134,14 +167,22 @@ namespace asp{
     /// approximately the same pixel dimensions as the input image.
     /// Note, however, that this could lead to a loss in DEM
     /// resolution if the DEM is rotated from the orientation of the
-    /// original image.
+    /// original image. A copy of this view with another spacing
+    /// gives the DEM at that spacing without scanning the cloud
+    /// again for its bounds.
     void set_spacing(double val) {
       if (val == 0.0) {
         m_spacing = m_default_spacing;
       } else {
         m_spacing = val;
       }
-      
+
+      // We will snap the box so that its corners are integer multiples
+      // of the grid size. This ensures that any two DEMs
+      // with the same grid size and overlapping grids have those
+      // grids match perfectly.
+      m_bbox.min() = m_spacing*floor(m_unsnapped_bbox.min()/m_spacing);
+      m_bbox.max() = m_spacing*ceil(m_unsnapped_bbox.max()/m_spacing);
     }
 
     double spacing() { return m_spacing; }
@@ -166,6 +207,10 @@ namespace asp{
     
     BBox3 bounding_box() { return m_bbox; }
 
+    /// Number of valid points in the cloud, after removing points
+    /// above the triangulation error threshold, if set.
+    vw::int64 num_valid_points() const;
+
     // Return the affine georeferencing transform.
     vw::Matrix<double,3,3> geo_transform();
     
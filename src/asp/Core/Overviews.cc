@@ -0,0 +1,137 @@
+// __BEGIN_LICENSE__
+//  Copyright (c) 2009-2013, United States Government as represented by the
+//  Administrator of the National Aeronautics and Space Administration. All
+//  rights reserved.
+//
+//  The NGT platform is licensed under the Apache License, Version 2.0 (the
+//  "License"); you may not use this file except in compliance with the
+//  License. You may obtain a copy of the License at
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+// __END_LICENSE__
+
+
+/// \file Overviews.cc
+///
+
+#include <asp/Core/Overviews.h>
+#include <vw/Core/Exception.h>
+#include <vw/Core/Thread.h>
+#include <gdal_priv.h>
+#include <algorithm>
+#include <cmath>
+
+using namespace vw;
+
+namespace asp {
+
+  void nodata_aware_pyramid(ImageView<double> const& block, double nodata,
+                            int num_levels,
+                            std::vector< ImageView<double> > & levels){
+
+    // Carry sums and counts down the levels, so that each coarse
+    // pixel is the mean of the full-resolution pixels, rather than a
+    // mean of means with unequal support.
+    ImageView<double> sums(block.cols(), block.rows()), counts(block.cols(), block.rows());
+    for (int col = 0; col < block.cols(); col++){
+      for (int row = 0; row < block.rows(); row++){
+        double val = block(col, row);
+        bool valid = (val == val) && (val != nodata);
+        sums  (col, row) = valid ? val : 0.0;
+        counts(col, row) = valid ? 1.0 : 0.0;
+      }
+    }
+
+    levels.clear();
+    for (int level = 0; level < num_levels; level++){
+      int cols = (sums.cols() + 1)/2, rows = (sums.rows() + 1)/2;
+      ImageView<double> coarse_sums(cols, rows), coarse_counts(cols, rows);
+      ImageView<double> means(cols, rows);
+      for (int col = 0; col < cols; col++){
+        for (int row = 0; row < rows; row++){
+          double sum = 0.0, count = 0.0;
+          for (int c = 2*col; c < std::min(2*col + 2, sums.cols()); c++){
+            for (int r = 2*row; r < std::min(2*row + 2, sums.rows()); r++){
+              sum   += sums(c, r);
+              count += counts(c, r);
+            }
+          }
+          coarse_sums  (col, row) = sum;
+          coarse_counts(col, row) = count;
+          means        (col, row) = (count > 0) ? sum/count : nodata;
+        }
+      }
+      levels.push_back(means);
+      sums   = coarse_sums;
+      counts = coarse_counts;
+    }
+  }
+
+  int num_overview_levels(Vector2i const& image_size, Vector2i const& block_size){
+    const int min_size = 256;
+    int num_levels = 0;
+    int max_size = std::max(image_size.x(), image_size.y());
+    for (int factor = 2; ; factor *= 2){
+      if (block_size.x() % factor != 0 || block_size.y() % factor != 0)
+        break;
+      // The previous level already fits in one tile
+      if ((max_size + factor/2 - 1)/(factor/2) <= min_size)
+        break;
+      num_levels++;
+    }
+    return num_levels;
+  }
+
+  OverviewWriter::OverviewWriter(DiskImageResourceGDAL & rsrc, double nodata,
+                                 int num_levels):
+    m_dataset(rsrc.get_dataset_ptr()), m_nodata(nodata), m_num_levels(num_levels){
+
+    if (m_dataset->GetRasterCount() != 1)
+      vw_throw(ArgumentErr() << "Overviews can be built only for single-band images.\n");
+
+    // Allocate the levels only. Their contents come from add_block().
+    std::vector<int> factors;
+    for (int level = 0; level < m_num_levels; level++)
+      factors.push_back(1 << (level + 1));
+
+    Mutex::Lock lock(DiskImageResourceGDAL::global_lock());
+    int band = 1;
+    if (m_dataset->BuildOverviews("NONE", m_num_levels, &factors[0], 1, &band,
+                                  NULL, NULL) != CE_None ||
+        m_dataset->GetRasterBand(1)->GetOverviewCount() != m_num_levels)
+      vw_throw(ArgumentErr() << "Failed to allocate the overviews of: "
+               << m_dataset->GetDescription() << "\n");
+  }
+
+  void OverviewWriter::add_block(ImageView<double> const& block, BBox2i const& bbox) const{
+
+    std::vector< ImageView<double> > levels;
+    nodata_aware_pyramid(block, m_nodata, m_num_levels, levels);
+
+    Mutex::Lock lock(DiskImageResourceGDAL::global_lock());
+    for (int level = 0; level < m_num_levels; level++){
+      int factor = 1 << (level + 1);
+      GDALRasterBand * overview = m_dataset->GetRasterBand(1)->GetOverview(level);
+      ImageView<double> & vals = levels[level];
+
+      // The last level pixel may stick out if the image size is not a
+      // multiple of the factor while the overview size rounds down.
+      int col0 = bbox.min().x()/factor, row0 = bbox.min().y()/factor;
+      int cols = std::min(vals.cols(), overview->GetXSize() - col0);
+      int rows = std::min(vals.rows(), overview->GetYSize() - row0);
+      if (cols <= 0 || rows <= 0) continue;
+
+      if (overview->RasterIO(GF_Write, col0, row0, cols, rows, &vals(0, 0),
+                             cols, rows, GDT_Float64, sizeof(double),
+                             sizeof(double)*vals.cols()) != CE_None)
+        vw_throw(IOErr() << "Failed to write overview level " << level + 1
+                 << " of: " << m_dataset->GetDescription() << "\n");
+    }
+  }
+
+} // end namespace asp
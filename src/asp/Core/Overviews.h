@@ -0,0 +1,149 @@
+// __BEGIN_LICENSE__
+//  Copyright (c) 2009-2013, United States Government as represented by the
+//  Administrator of the National Aeronautics and Space Administration. All
+//  rights reserved.
+//
+//  The NGT platform is licensed under the Apache License, Version 2.0 (the
+//  "License"); you may not use this file except in compliance with the
+//  License. You may obtain a copy of the License at
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+// __END_LICENSE__
+
+
+/// \file Overviews.h
+///
+/// Write internal GeoTIFF overviews of a single-channel image in the
+/// same pass as the image itself. Each block is decimated into the
+/// coarser levels while it is still in memory, so the written file
+/// never has to be read back.
+
+#ifndef __ASP_CORE_OVERVIEWS_H__
+#define __ASP_CORE_OVERVIEWS_H__
+
+#include <vw/Image/ImageView.h>
+#include <vw/Image/ImageViewBase.h>
+#include <vw/Image/PixelTypeInfo.h>
+#include <vw/Image/Manipulation.h>
+#include <vw/Image/Algorithms.h>
+#include <vw/Math/BBox.h>
+#include <vw/FileIO/DiskImageResourceGDAL.h>
+#include <vw/Cartography/GeoReference.h>
+#include <asp/Core/Common.h>
+#include <boost/shared_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <vector>
+
+class GDALDataset;
+
+namespace asp {
+
+  // Successive 2x averages of a block, skipping nodata (and NaN)
+  // pixels. Level i is reduced by a factor of 2^(i+1), and each of its
+  // pixels is the mean of all valid full-resolution pixels it covers,
+  // or nodata if there are none. Partial cells at the right and
+  // bottom edges average what is there.
+  void nodata_aware_pyramid(vw::ImageView<double> const& block, double nodata,
+                            int num_levels,
+                            std::vector< vw::ImageView<double> > & levels);
+
+  // The number of 2x overview levels to build for an image of given
+  // size written in blocks of given size. The reduction factors must
+  // divide the block size, so that each block decimates on its own,
+  // and we stop once a level fits within a single 256 pixel tile.
+  int num_overview_levels(vw::Vector2i const& image_size,
+                          vw::Vector2i const& block_size);
+
+  // Allocates the overviews of a GDAL resource opened for writing and
+  // fills them in block by block. The blocks must be aligned to the
+  // block size the levels were computed for. Thread-safe.
+  class OverviewWriter {
+    boost::shared_ptr<GDALDataset> m_dataset;
+    double m_nodata;
+    int m_num_levels;
+  public:
+    OverviewWriter(vw::DiskImageResourceGDAL & rsrc, double nodata, int num_levels);
+    void add_block(vw::ImageView<double> const& block, vw::BBox2i const& bbox) const;
+  };
+
+  // Passes the pixels of an image through unchanged, sending each
+  // rasterized block to an OverviewWriter on the way.
+  template <class ImageT>
+  class OverviewView : public vw::ImageViewBase< OverviewView<ImageT> > {
+    ImageT m_child;
+    boost::shared_ptr<OverviewWriter> m_writer;
+  public:
+    typedef typename ImageT::pixel_type pixel_type;
+    typedef pixel_type result_type;
+    typedef vw::ProceduralPixelAccessor<OverviewView> pixel_accessor;
+
+    OverviewView(ImageT const& child, boost::shared_ptr<OverviewWriter> writer):
+      m_child(child), m_writer(writer){}
+
+    inline vw::int32 cols  () const { return m_child.cols(); }
+    inline vw::int32 rows  () const { return m_child.rows(); }
+    inline vw::int32 planes() const { return 1; }
+
+    inline pixel_accessor origin() const { return pixel_accessor(*this, 0, 0); }
+
+    inline pixel_type operator()( double/*i*/, double/*j*/, vw::int32/*p*/ = 0 ) const {
+      vw::vw_throw(vw::NoImplErr() << "OverviewView::operator()(...) is not implemented");
+      return pixel_type();
+    }
+
+    typedef vw::CropView< vw::ImageView<pixel_type> > prerasterize_type;
+    inline prerasterize_type prerasterize(vw::BBox2i const& bbox) const {
+      vw::ImageView<pixel_type> tile = crop(m_child, bbox);
+      vw::ImageView<double> vals
+        = vw::channel_cast<double>(vw::select_channel(tile, 0));
+      m_writer->add_block(vals, bbox);
+      return prerasterize_type(tile, -bbox.min().x(), -bbox.min().y(),
+                               cols(), rows());
+    }
+
+    template <class DestT>
+    inline void rasterize(DestT const& dest, vw::BBox2i bbox) const {
+      vw::rasterize(prerasterize(bbox), dest, bbox);
+    }
+  };
+
+  // Block write a single-channel image with nodata and georef, and
+  // build its internal overviews along the way.
+  template <class ImageT, class NoDataT>
+  void block_write_gdal_image_with_overviews
+  (const std::string &filename, vw::ImageViewBase<ImageT> const& image,
+   vw::cartography::GeoReference const& georef, NoDataT nodata,
+   BaseOptions const& opt,
+   vw::ProgressCallback const& progress_callback =
+   vw::ProgressCallback::dummy_instance()){
+
+    if (vw::PixelNumChannels<typename ImageT::pixel_type>::value != 1)
+      vw::vw_throw(vw::ArgumentErr()
+                   << "Overviews can be built only for single-channel images.\n");
+
+    boost::scoped_ptr<vw::DiskImageResourceGDAL> rsrc(build_gdal_rsrc(filename, image, opt));
+    rsrc->set_nodata_write(nodata);
+    vw::cartography::write_georeference(*rsrc, georef);
+
+    int num_levels
+      = num_overview_levels(vw::Vector2i(image.impl().cols(), image.impl().rows()),
+                            rsrc->block_write_size());
+    if (num_levels <= 0){
+      vw::block_write_image(*rsrc, image.impl(), progress_callback);
+      return;
+    }
+
+    boost::shared_ptr<OverviewWriter>
+      writer(new OverviewWriter(*rsrc, nodata, num_levels));
+    vw::block_write_image(*rsrc, OverviewView<ImageT>(image.impl(), writer),
+                          progress_callback);
+  }
+
+} // end namespace asp
+
+#endif//__ASP_CORE_OVERVIEWS_H__
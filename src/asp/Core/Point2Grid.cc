@@ -24,6 +24,8 @@
 #include <asp/Core/Point2Grid.h>
 
 #include <iostream>
+#include <algorithm>
+#include <cstdlib>
 
 using namespace std;
 using namespace vw;
@@ -36,14 +38,19 @@ using namespace stereo;
 Point2Grid::Point2Grid(int width, int height,
                        ImageView<double> & buffer, ImageView<double> & weights,
                        double x0, double y0, double grid_size, double min_spacing,
-                       double radius): m_width(width), m_height(height),
-                                       m_buffer(buffer), m_weights(weights),
-                                       m_x0(x0), m_y0(y0), m_grid_size(grid_size),
-                                       m_radius(radius){
+                       double radius, FilterType filter, double percentile):
+  m_width(width), m_height(height),
+  m_buffer(buffer), m_weights(weights),
+  m_x0(x0), m_y0(y0), m_grid_size(grid_size),
+  m_radius(radius), m_clear_value(0),
+  m_filter(filter), m_percentile(percentile/100.0){
   if (m_grid_size <= 0)
     vw_throw( ArgumentErr() << "Point2Grid: Grid size must be > 0.\n" );
   if (m_radius <= 0)
     vw_throw( ArgumentErr() << "Point2Grid: Search radius must be > 0.\n" );
+  if (m_percentile < 0 || m_percentile > 1)
+    vw_throw( ArgumentErr() << "Point2Grid: Percentile must be between 0 and 100.\n" );
+  if (m_filter == f_median) m_percentile = 0.5;
 
   // By the time we reached the distance 'spacing' from the origin, we
   // want the Gaussian exp(-sigma*x^2) to decay to given value.  Note
@@ -62,18 +69,36 @@ Point2Grid::Point2Grid(int width, int height,
     double dist = k*m_dx;
     m_sampled_gauss[k] = exp(-sigma*dist*dist);
   }
-  
+
+  // A point reaches at most this many grid points along a row
+  int row_len = 2*(int)ceil(m_radius/m_grid_size) + 2;
+  m_row_dist.resize(row_len);
+  m_row_index.resize(row_len);
 }
 
 void Point2Grid::Clear(const float value) {
+  m_clear_value = value;
   m_buffer.set_size (m_width, m_height);
   m_weights.set_size (m_width, m_height);
-  for (int c = 0; c < m_buffer.cols(); c++){
-    for (int r = 0; r < m_buffer.rows(); r++){
-      m_buffer (c, r) = value;
-      m_weights(c, r) = 0.0;
+  for (int r = 0; r < m_buffer.rows(); r++){
+    double * buf = &m_buffer(0, r);
+    double * wts = &m_weights(0, r);
+    for (int c = 0; c < m_buffer.cols(); c++){
+      buf[c] = 0.0;
+      wts[c] = 0.0;
     }
   }
+
+  // The per-point state of the order statistics. This is bounded by
+  // the grid size, not by the number of points.
+  if (m_filter == f_stddev){
+    m_m2.set_size(m_width, m_height);
+    for (int r = 0; r < m_m2.rows(); r++)
+      for (int c = 0; c < m_m2.cols(); c++)
+        m_m2(c, r) = 0.0;
+  }
+  if (m_filter == f_median || m_filter == f_percentile)
+    m_quantiles.assign(size_t(m_width)*m_height, P2Quantile());
 }
 
 void Point2Grid::AddPoint(double x, double y, double z){
@@ -84,30 +109,202 @@ void Point2Grid::AddPoint(double x, double y, double z){
   int maxx = std::min( (int)floor( (x + m_radius - m_x0)/m_grid_size ), m_buffer.cols() - 1 );
   int maxy = std::min( (int)floor( (y + m_radius - m_y0)/m_grid_size ), m_buffer.rows() - 1 );
 
-  // Add the contribution of current point to all grid points within radius
-  for (int ix = minx; ix <= maxx; ix++){
-    for (int iy = miny; iy <= maxy; iy++){
-      
+  int len = maxx - minx + 1;
+  if (len <= 0 || maxy < miny) return;
+
+  if (m_filter != f_weighted_average){
+    AddPointFiltered(x, y, z, minx, miny, maxx, maxy);
+    return;
+  }
+  if (len > (int)m_row_dist.size()){
+    m_row_dist.resize(len);
+    m_row_index.resize(len);
+  }
+
+  // Add the contribution of current point to all grid points within
+  // radius. Go row by row, so that the buffers are updated
+  // contiguously. First find the distances and the samples of the
+  // Gaussian for the whole row, in a loop with no branches which the
+  // compiler can vectorize, then accumulate.
+  int    num_samples = m_sampled_gauss.size();
+  double * dist = &m_row_dist[0];
+  int    * index = &m_row_index[0];
+  double const* gauss = &m_sampled_gauss[0];
+  for (int iy = miny; iy <= maxy; iy++){
+
+    double gy = m_y0 + iy*m_grid_size;
+    double dy2 = (y-gy)*(y-gy);
+    for (int k = 0; k < len; k++){
+      double gx = m_x0 + (minx + k)*m_grid_size;
+      double d = sqrt( (x-gx)*(x-gx) + dy2 );
+      dist[k]  = d;
+      index[k] = std::min((int)(d/m_dx + 0.5), num_samples - 1);
+    }
+
+    double * buf = &m_buffer(minx, iy);
+    double * wts = &m_weights(minx, iy);
+    for (int k = 0; k < len; k++){
+      double wt = (dist[k] > m_radius) ? 0.0 : gauss[index[k]];
+      buf[k] += z*wt;
+      wts[k] += wt;
+    }
+  }
+}
+
+// Add a point to all grid points within radius, with equal weight
+void Point2Grid::AddPointFiltered(double x, double y, double z, int minx, int miny,
+                                  int maxx, int maxy){
+
+  double r2 = m_radius*m_radius;
+  for (int iy = miny; iy <= maxy; iy++){
+    double gy = m_y0 + iy*m_grid_size;
+    double dy2 = (y-gy)*(y-gy);
+    double * buf = &m_buffer(0, iy);
+    double * wts = &m_weights(0, iy);
+    for (int ix = minx; ix <= maxx; ix++){
       double gx = m_x0 + ix*m_grid_size;
-      double gy = m_y0 + iy*m_grid_size;
-      double dist = sqrt( (x-gx)*(x-gx) + (y-gy)*(y-gy) );
-      if ( dist > m_radius ) continue;
-
-      if (m_weights(ix, iy) == 0) m_buffer(ix, iy) = 0.0;
-      double wt = m_sampled_gauss[(int)round(dist/m_dx)];
-      if (wt <= 0) continue;
-      m_buffer(ix, iy)  += z*wt;
-      m_weights(ix, iy) += wt;
+      if ( (x-gx)*(x-gx) + dy2 > r2 ) continue;
+
+      double count = wts[ix];
+      switch (m_filter){
+      case f_min:
+        buf[ix] = (count == 0) ? z : std::min(buf[ix], z);
+        break;
+      case f_max:
+        buf[ix] = (count == 0) ? z : std::max(buf[ix], z);
+        break;
+      case f_mean:
+        buf[ix] += z;
+        break;
+      case f_stddev: {
+        // Welford's update of the mean and the squared deviations
+        double delta = z - buf[ix];
+        buf[ix] += delta/(count + 1);
+        m_m2(ix, iy) += delta*(z - buf[ix]);
+        break;
+      }
+      case f_median:
+      case f_percentile:
+        m_quantiles[size_t(iy)*m_width + ix].add(z, m_percentile);
+        break;
+      default: // count
+        break;
+      }
+      wts[ix] = count + 1;
     }
-    
   }
 }
 
 void Point2Grid::normalize(){
-  for (int c = 0; c < m_buffer.cols(); c++){
-    for (int r = 0; r < m_buffer.rows(); r++){
-      if (m_weights(c, r) > 0)
-        m_buffer (c, r) /= m_weights(c, r);
+  for (int r = 0; r < m_buffer.rows(); r++){
+    double * buf = &m_buffer(0, r);
+    double const* wts = &m_weights(0, r);
+    for (int c = 0; c < m_buffer.cols(); c++){
+      if (wts[c] <= 0){
+        buf[c] = m_clear_value;
+        continue;
+      }
+      switch (m_filter){
+      case f_weighted_average:
+      case f_mean:
+        buf[c] /= wts[c];
+        break;
+      case f_stddev:
+        buf[c] = sqrt(m_m2(c, r)/wts[c]);
+        break;
+      case f_median:
+      case f_percentile:
+        buf[c] = m_quantiles[size_t(r)*m_width + c].value(m_percentile);
+        break;
+      case f_count:
+        buf[c] = wts[c];
+        break;
+      default: // min and max are already in place
+        break;
+      }
     }
   }
 }
+
+void P2Quantile::add(double x, double p){
+
+  // Collect the first five values
+  if (count < 5){
+    q[count++] = x;
+    if (count == 5){
+      std::sort(q, q + 5);
+      for (int i = 0; i < 5; i++) n[i] = i;
+    }
+    return;
+  }
+
+  // Find the cell the value falls in, and move the markers above it
+  int k;
+  if (x < q[0]){
+    q[0] = x;
+    k = 0;
+  }else if (x >= q[4]){
+    q[4] = x;
+    k = 3;
+  }else{
+    k = 0;
+    while (k < 3 && x >= q[k+1]) k++;
+  }
+  for (int i = k + 1; i < 5; i++) n[i]++;
+  count++;
+
+  // Adjust the middle markers towards their desired positions with
+  // a piecewise-parabolic fit, or a linear one if that is not monotone.
+  double dn[5] = {0.0, p/2.0, p, (1.0 + p)/2.0, 1.0};
+  for (int i = 1; i < 4; i++){
+    double d = (count - 1)*dn[i] - n[i];
+    if ( (d >= 1.0 && n[i+1] - n[i] > 1) || (d <= -1.0 && n[i-1] - n[i] < -1) ){
+      int s = (d > 0) ? 1 : -1;
+      double qp = q[i] + double(s)/(n[i+1] - n[i-1])
+        * ( (n[i] - n[i-1] + s)*(q[i+1] - q[i])/(n[i+1] - n[i])
+            + (n[i+1] - n[i] - s)*(q[i] - q[i-1])/(n[i] - n[i-1]) );
+      if (q[i-1] < qp && qp < q[i+1])
+        q[i] = qp;
+      else
+        q[i] = q[i] + s*(q[i+s] - q[i])/(n[i+s] - n[i]);
+      n[i] += s;
+    }
+  }
+}
+
+double P2Quantile::value(double p) const {
+  if (count == 0) return 0.0;
+  if (count > 5) return q[2];
+
+  // Few values, pick the exact one. With five the markers are still
+  // the sorted values themselves.
+  double v[5];
+  std::copy(q, q + count, v);
+  std::sort(v, v + count);
+  return v[(int)round(p*(count - 1))];
+}
+
+FilterType vw::stereo::parse_filter(std::string const& name, double & percentile){
+  percentile = 50.0;
+  if (name == "weighted_average") return f_weighted_average;
+  if (name == "min")              return f_min;
+  if (name == "max")              return f_max;
+  if (name == "mean")             return f_mean;
+  if (name == "median")           return f_median;
+  if (name == "stddev")           return f_stddev;
+  if (name == "count")            return f_count;
+
+  // A percentile, such as 75pct
+  std::string suffix = "pct";
+  if (name.size() > suffix.size() &&
+      name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0){
+    std::string val = name.substr(0, name.size() - suffix.size());
+    char * end = NULL;
+    percentile = strtod(val.c_str(), &end);
+    if (end != val.c_str() && *end == '\0' && percentile >= 0 && percentile <= 100)
+      return f_percentile;
+  }
+
+  vw_throw( ArgumentErr() << "Unknown filter: " << name << ".\n" );
+  return f_weighted_average;
+}
@@ -23,16 +23,41 @@
 #define __VW_POINT2GRID_H__
 
 #include <vw/Image/ImageView.h>
+#include <string>
+#include <vector>
 
 namespace vw { namespace stereo {
+
+  // How to combine the values of the points within the search radius
+  // of a grid point. Only the weighted average uses the Gaussian
+  // weights, the others treat all points within the radius equally.
+  enum FilterType { f_weighted_average, f_min, f_max, f_mean, f_median,
+                    f_percentile, f_stddev, f_count };
+
+  // Streaming estimate of a percentile with five markers, using the
+  // P-square algorithm of Jain and Chlamtac (1985). Exact for up to
+  // five values.
+  struct P2Quantile {
+    double q[5]; // marker heights
+    int n[5];    // marker positions
+    int count;
+    P2Quantile(): count(0){}
+    void add(double x, double p);
+    double value(double p) const;
+  };
   
   struct Point2Grid {
     
     Point2Grid(int width, int height,
                ImageView<double> & buffer, ImageView<double> & weights,
                double x0, double y0,
-               double grid_size, double min_spacing, double radius);
+               double grid_size, double min_spacing, double radius,
+               FilterType filter = f_weighted_average, double percentile = 50.0);
     ~Point2Grid(){}
+    // Until normalize() is called, for the weighted average the buffer
+    // holds the weighted sums of heights, with zero where there are
+    // no points nearby. For the other filters the weights hold the
+    // number of points.
     void Clear(const float val);
     void AddPoint(double x, double y, double z);
     void normalize();
@@ -45,9 +70,24 @@ namespace vw { namespace stereo {
     double m_grid_size;  // spacing between output DEM pixels
     double m_radius;   // how far to search for cloud points
     double m_dx;       // spacing between samples
+    double m_clear_value; // value of grid points with no points nearby
     std::vector<double> m_sampled_gauss;
-    
+    std::vector<double> m_row_dist; // scratch, distances along a grid row
+    std::vector<int>    m_row_index; // scratch, indices into m_sampled_gauss
+
+    FilterType m_filter;
+    double m_percentile;                // in [0, 1]
+    ImageView<double> m_m2;             // for stddev, squared deviations from the mean
+    std::vector<P2Quantile> m_quantiles; // for median and percentile
+
+    void AddPointFiltered(double x, double y, double z, int minx, int miny,
+                          int maxx, int maxy);
   };
+
+  // Parse a filter name: weighted_average, min, max, mean, median,
+  // stddev, count, or a percentile such as 75pct. Throw if invalid.
+  FilterType parse_filter(std::string const& name, double & percentile);
+
   
 }}
 
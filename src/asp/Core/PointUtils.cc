@@ -24,7 +24,12 @@
 #include <asp/Core/Common.h>
 #include <asp/Core/PointUtils.h>
 #include <vw/Cartography/Chipper.h>
+#include <vw/Cartography/GeoReference.h>
+#include <vw/Core/Thread.h>
 #include <boost/math/special_functions/fpclassify.hpp>
+#include <map>
+#include <sstream>
+#include <cstdlib>
 
 using namespace vw;
 using namespace vw::cartography;
@@ -765,3 +770,429 @@ vw::BBox3 asp::pointcloud_bbox(vw::ImageViewRef<vw::Vector3> const& point_image,
   
   return result;
 }
+
+// The batch point projector
+
+struct asp::BatchPointProjector::State {
+  vw::Mutex mutex;
+  bool warned;
+  State(): warned(false){}
+};
+
+namespace {
+
+  // Parse a PROJ.4 string into key/value pairs. Flags such as +south
+  // get an empty value.
+  std::map<std::string, std::string> parse_proj4(std::string const& proj4){
+    std::map<std::string, std::string> params;
+    std::istringstream is(proj4);
+    std::string token;
+    while (is >> token){
+      if (token.empty() || token[0] != '+') continue;
+      token = token.substr(1);
+      size_t pos = token.find('=');
+      if (pos == std::string::npos)
+        params[token] = "";
+      else
+        params[token.substr(0, pos)] = token.substr(pos + 1);
+    }
+    return params;
+  }
+
+  // Parse a number, returning false if it is not one
+  bool proj4_number(std::map<std::string, std::string> const& params,
+                    std::string const& key, double & val){
+    std::map<std::string, std::string>::const_iterator it = params.find(key);
+    if (it == params.end()) return false;
+    char * end = NULL;
+    val = strtod(it->second.c_str(), &end);
+    return end != it->second.c_str() && *end == '\0';
+  }
+
+  // Wrap an angle in radians to [-pi, pi], as PROJ.4 does before projecting
+  inline double adjust_lon(double lon){
+    if (fabs(lon) <= M_PI) return lon;
+    return lon - 2*M_PI*floor((lon + M_PI)/(2*M_PI));
+  }
+
+}
+
+asp::BatchPointProjector::BatchPointProjector(vw::cartography::GeoReference const& georef,
+                                              double center_lon, vw::Vector3 const& offset):
+  m_georef(new GeoReference(georef)), m_state(new State),
+  m_center_lon(center_lon), m_offset(offset), m_kernel(GENERIC),
+  m_a(0), m_e2(0), m_e(0), m_lon0(0), m_x0(0), m_y0(0), m_k0(1), m_south(false),
+  m_akm1(0), m_lat0(0), m_cos_lat_ts(1), m_tm_A(0) {
+
+  for (int k = 0; k < 6; k++) m_tm_alpha[k] = 0;
+
+  double a = georef.datum().semi_major_axis();
+  double b = georef.datum().semi_minor_axis();
+  if (a <= 0 || b <= 0 || b > a) return; // leave it to the georeference
+  m_a  = a;
+  m_e2 = (a*a - b*b)/(a*a);
+  m_e  = sqrt(m_e2);
+
+  if (!georef.is_projected())
+    m_kernel = GEOGRAPHIC;
+  else
+    parse_projection(georef.proj4_str());
+}
+
+void asp::BatchPointProjector::parse_projection(std::string const& proj4){
+
+  std::map<std::string, std::string> params = parse_proj4(proj4);
+  std::string proj = params["proj"];
+
+  // Only meters are supported
+  if (params.count("units") && params["units"] != "m") return;
+  if (params.count("to_meter")) return;
+  if (params.count("over") || params.count("pm") || params.count("geoc")) return;
+
+  double deg = M_PI/180.0;
+  double val;
+  if (proj4_number(params, "lon_0", val)) m_lon0 = val*deg;
+  if (proj4_number(params, "x_0", val))   m_x0   = val;
+  if (proj4_number(params, "y_0", val))   m_y0   = val;
+  if (proj4_number(params, "k_0", val) || proj4_number(params, "k", val)) m_k0 = val;
+
+  if (proj == "utm" || proj == "tmerc"){
+
+    if (proj == "utm"){
+      double zone;
+      if (!proj4_number(params, "zone", zone) || zone < 1 || zone > 60) return;
+      m_lon0 = ((int)zone*6.0 - 183.0)*deg;
+      m_x0   = 500000.0;
+      m_y0   = params.count("south") ? 10000000.0 : 0.0;
+      m_k0   = 0.9996;
+    }else{
+      // The series below is measured from the equator
+      if (proj4_number(params, "lat_0", val) && val != 0) return;
+    }
+
+    // The Krueger series to sixth order in the third flattening
+    double f = 1.0 - sqrt(1.0 - m_e2);
+    double n = f/(2.0 - f);
+    double n2 = n*n, n3 = n2*n, n4 = n3*n, n5 = n4*n, n6 = n5*n;
+    m_tm_A = m_a/(1.0 + n)*(1.0 + n2/4.0 + n4/64.0 + n6/256.0);
+    m_tm_alpha[0] = n/2.0 - 2.0*n2/3.0 + 5.0*n3/16.0 + 41.0*n4/180.0
+      - 127.0*n5/288.0 + 7891.0*n6/37800.0;
+    m_tm_alpha[1] = 13.0*n2/48.0 - 3.0*n3/5.0 + 557.0*n4/1440.0
+      + 281.0*n5/630.0 - 1983433.0*n6/1935360.0;
+    m_tm_alpha[2] = 61.0*n3/240.0 - 103.0*n4/140.0 + 15061.0*n5/26880.0
+      + 167603.0*n6/181440.0;
+    m_tm_alpha[3] = 49561.0*n4/161280.0 - 179.0*n5/168.0 + 6601661.0*n6/7257600.0;
+    m_tm_alpha[4] = 34729.0*n5/80640.0 - 3418889.0*n6/1995840.0;
+    m_tm_alpha[5] = 212378941.0*n6/319334400.0;
+    m_kernel = TRANSVERSE_MERCATOR;
+
+  }else if (proj == "stere" || proj == "ups"){
+
+    double lat0 = 0, lat_ts = 90.0;
+    if (proj == "ups"){
+      m_south = (params.count("south") > 0);
+      m_k0 = 0.994;
+      m_x0 = 2000000.0;
+      m_y0 = 2000000.0;
+      m_lon0 = 0.0;
+    }else{
+      // Only the polar aspect is done here
+      if (!proj4_number(params, "lat_0", lat0) || fabs(fabs(lat0) - 90.0) > 1e-10)
+        return;
+      m_south = (lat0 < 0);
+      if (proj4_number(params, "lat_ts", val)) lat_ts = fabs(val);
+    }
+
+    if (fabs(lat_ts - 90.0) < 1e-10){
+      m_akm1 = 2.0*m_k0/sqrt(pow(1.0 + m_e, 1.0 + m_e)*pow(1.0 - m_e, 1.0 - m_e));
+    }else{
+      double phits = lat_ts*deg, s = sin(phits);
+      double ts = tan(0.5*(M_PI/2.0 - phits))/pow((1.0 - m_e*s)/(1.0 + m_e*s), 0.5*m_e);
+      m_akm1 = cos(phits)/ts/sqrt(1.0 - m_e2*s*s);
+    }
+    m_kernel = POLAR_STEREOGRAPHIC;
+
+  }else if (proj == "eqc"){
+
+    double lat_ts = 0;
+    if (proj4_number(params, "lat_ts", val)) lat_ts = val;
+    if (proj4_number(params, "lat_0", val))  m_lat0 = val*deg;
+    m_cos_lat_ts = cos(lat_ts*deg);
+    m_kernel = EQUIRECTANGULAR;
+  }
+}
+
+std::string asp::BatchPointProjector::kernel_name() const {
+  switch (m_kernel){
+  case GEOGRAPHIC:          return "geographic";
+  case TRANSVERSE_MERCATOR: return "transverse Mercator";
+  case POLAR_STEREOGRAPHIC: return "polar stereographic";
+  case EQUIRECTANGULAR:     return "equirectangular";
+  default:                  return "generic";
+  }
+}
+
+vw::Vector3 asp::BatchPointProjector::project_generic(vw::Vector3 const& point) const {
+
+  // Same steps as cartesian_to_geodetic, recenter_longitude,
+  // point_image_offset, and geodetic_to_point.
+  if (point == Vector3())
+    return Vector3(0, 0, std::numeric_limits<double>::quiet_NaN());
+
+  Vector3 llh = m_georef->datum().cartesian_to_geodetic(point);
+  llh = CenterLongitudeFunc(m_center_lon)(llh);
+  llh = PointOffsetFunc(m_offset)(llh);
+  if (boost::math::isnan(llh[2])) return llh;
+
+  Vector2 proj = m_georef->lonlat_to_point(subvector(llh, 0, 2));
+  return Vector3(proj[0], proj[1], llh[2]);
+}
+
+// Cartesian to geodetic, in closed form (Vermeille, 2002), followed
+// by recentering the longitude and applying the offset. Return false
+// for points too close to the planet center, which must go through
+// the georeference.
+inline bool asp::BatchPointProjector::to_geodetic(double & x, double & y, double & z) const {
+
+  const double deg = 180.0/M_PI;
+  const double a2 = m_a*m_a, e2 = m_e2, e4 = e2*e2;
+
+  double X = x, Y = y, Z = z;
+  if (X == 0 && Y == 0 && Z == 0){
+    x = 0; y = 0; z = std::numeric_limits<double>::quiet_NaN();
+    return true;
+  }
+  double w2 = X*X + Y*Y;
+  double p  = w2/a2;
+  double q  = (1.0 - e2)*Z*Z/a2;
+  double r  = (p + q - e4)/6.0;
+  if (!(r > 0) || !boost::math::isfinite(r))
+    return false;
+  double s  = e4*p*q/(4.0*r*r*r);
+  double t  = cbrt(1.0 + s + sqrt(s*(2.0 + s)));
+  double u  = r*(1.0 + t + 1.0/t);
+  double v  = sqrt(u*u + e4*q);
+  double ww = e2*(u + v - q)/(2.0*v);
+  double k  = sqrt(u + v + ww*ww) - ww;
+  double D  = k*sqrt(w2)/(k + e2);
+  double DZ = sqrt(D*D + Z*Z);
+  double lon = atan2(Y, X)*deg;
+  double lat = 2.0*atan2(Z, D + DZ)*deg;
+  double h   = (k + e2 - 1.0)/k*DZ;
+
+  while (lon < m_center_lon - 180) lon += 360;
+  while (lon > m_center_lon + 180) lon -= 360;
+  if (lon != 0 || lat != 0 || h != 0){
+    lon += m_offset[0]; lat += m_offset[1]; h += m_offset[2];
+  }
+  x = lon; y = lat; z = h;
+  return true;
+}
+
+// Longitude and latitude in degrees to projected coordinates
+inline void asp::BatchPointProjector::tm_forward(double & x, double & y) const {
+  const double rad = M_PI/180.0, e = m_e;
+  double lam = adjust_lon(x*rad - m_lon0);
+  double phi = y*rad;
+  double sphi = sin(phi);
+  double tau  = sinh(atanh(sphi) - e*atanh(e*sphi));
+  double xip  = atan2(tau, cos(lam));
+  double etap = asinh(sin(lam)/sqrt(tau*tau + cos(lam)*cos(lam)));
+  double xi = xip, eta = etap;
+  for (int j = 0; j < 6; j++){
+    double jj = 2.0*(j + 1);
+    xi  += m_tm_alpha[j]*sin(jj*xip)*cosh(jj*etap);
+    eta += m_tm_alpha[j]*cos(jj*xip)*sinh(jj*etap);
+  }
+  x = m_x0 + m_k0*m_tm_A*eta;
+  y = m_y0 + m_k0*m_tm_A*xi;
+}
+
+inline void asp::BatchPointProjector::ps_forward(double & x, double & y) const {
+  const double rad = M_PI/180.0, e = m_e;
+  double lam = adjust_lon(x*rad - m_lon0);
+  double phi = y*rad;
+  if (m_south) phi = -phi;
+  double sphi = sin(phi);
+  double ts  = tan(0.5*(M_PI/2.0 - phi))/pow((1.0 - e*sphi)/(1.0 + e*sphi), 0.5*e);
+  double rho = m_a*m_akm1*ts;
+  x = m_x0 + rho*sin(lam);
+  y = m_south ? m_y0 + rho*cos(lam) : m_y0 - rho*cos(lam);
+}
+
+inline void asp::BatchPointProjector::eqc_forward(double & x, double & y) const {
+  const double rad = M_PI/180.0;
+  double lam = adjust_lon(x*rad - m_lon0);
+  x = m_x0 + m_a*m_cos_lat_ts*lam;
+  y = m_y0 + m_a*(y*rad - m_lat0);
+}
+
+void asp::BatchPointProjector::project_kernel(size_t n, double * x, double * y, double * z,
+                                              std::vector<char> & generic) const {
+
+  // Each step is a separate pass over the arrays
+  for (size_t i = 0; i < n; i++){
+    if (!to_geodetic(x[i], y[i], z[i]))
+      generic[i] = 1;
+  }
+
+  switch (m_kernel){
+
+  case GEOGRAPHIC:
+    break;
+
+  case TRANSVERSE_MERCATOR:
+    for (size_t i = 0; i < n; i++){
+      if (generic[i] || boost::math::isnan(z[i])) continue;
+      tm_forward(x[i], y[i]);
+    }
+    break;
+
+  case POLAR_STEREOGRAPHIC:
+    for (size_t i = 0; i < n; i++){
+      if (generic[i] || boost::math::isnan(z[i])) continue;
+      ps_forward(x[i], y[i]);
+    }
+    break;
+
+  case EQUIRECTANGULAR:
+    for (size_t i = 0; i < n; i++){
+      if (generic[i] || boost::math::isnan(z[i])) continue;
+      eqc_forward(x[i], y[i]);
+    }
+    break;
+
+  default:
+    std::fill(generic.begin(), generic.end(), 1);
+  }
+}
+
+// A point the kernel found no height for agrees only if the
+// georeference finds none either.
+bool asp::BatchPointProjector::agrees(Vector3 const& input, double x, double y,
+                                      double z) const {
+  Vector3 expected = project_generic(input);
+  if (boost::math::isnan(z) || boost::math::isnan(expected[2]))
+    return boost::math::isnan(z) && boost::math::isnan(expected[2]);
+  double tol = (m_kernel == GEOGRAPHIC) ? 1e-9 : 1e-3;
+  return fabs(expected[0] - x) <= tol && fabs(expected[1] - y) <= tol &&
+    fabs(expected[2] - z) <= 1e-4;
+}
+
+void asp::BatchPointProjector::project(size_t n, double * x, double * y, double * z) const {
+  project_grid(n, n, x, y, z);
+}
+
+// Project a batch of points which are the rows, each of the given
+// number of columns, of a tile.
+void asp::BatchPointProjector::project_grid(size_t n, size_t cols,
+                                            double * x, double * y, double * z) const {
+
+  if (n == 0) return;
+
+  // Keep the inputs, for points which must go through the
+  // georeference, and for validation.
+  std::vector<double> x0(x, x + n), y0(y, y + n), z0(z, z + n);
+  std::vector<char> generic(n, (char)(m_kernel == GENERIC));
+
+  if (m_kernel != GENERIC)
+    project_kernel(n, x, y, z, generic);
+
+  // Validate points against the georeference, on a grid of 5 x 5
+  // points spanning the tile, corners included, so that a kernel
+  // which is wrong (such as a projection string parsed incorrectly)
+  // or which fails only in part of the tile, such as near the edge of
+  // the projection's domain, is caught. A point with no height must
+  // have none through the georeference either. Debug builds check all
+  // points.
+  bool valid = true;
+  if (m_kernel != GENERIC){
+    std::vector<size_t> samples;
+#ifdef NDEBUG
+    const size_t num_steps = 4;
+    cols = std::max(std::min(cols, n), size_t(1));
+    size_t rows = (n + cols - 1)/cols;
+    for (size_t r = 0; r <= num_steps; r++){
+      for (size_t c = 0; c <= num_steps; c++){
+        size_t i = (r*(rows - 1)/num_steps)*cols + c*(cols - 1)/num_steps;
+        samples.push_back(std::min(i, n - 1));
+      }
+    }
+#else
+    samples.resize(n);
+    for (size_t i = 0; i < n; i++) samples[i] = i;
+#endif
+    for (size_t s = 0; s < samples.size() && valid; s++){
+      size_t i = samples[s];
+      if (generic[i]) continue;
+      valid = agrees(Vector3(x0[i], y0[i], z0[i]), x[i], y[i], z[i]);
+    }
+  }
+
+  if (!valid){
+    {
+      vw::Mutex::Lock lock(m_state->mutex);
+      if (!m_state->warned)
+        vw_out(WarningMessage) << "The " << kernel_name() << " point projection "
+                               << "disagrees with the georeference. Using "
+                               << "the georeference instead.\n";
+      m_state->warned = true;
+    }
+    std::fill(generic.begin(), generic.end(), 1);
+  }
+
+  for (size_t i = 0; i < n; i++){
+    if (!generic[i]) continue;
+    Vector3 p = project_generic(Vector3(x0[i], y0[i], z0[i]));
+    x[i] = p[0]; y[i] = p[1]; z[i] = p[2];
+  }
+}
+
+void asp::BatchPointProjector::project(vw::ImageView<vw::Vector3> & points) const {
+
+  // Repack as separate coordinate arrays so the kernels run over
+  // contiguous memory.
+  size_t n = size_t(points.cols())*points.rows();
+  std::vector<double> x(n), y(n), z(n);
+  size_t count = 0;
+  for (int row = 0; row < points.rows(); row++){
+    for (int col = 0; col < points.cols(); col++){
+      Vector3 const& p = points(col, row);
+      x[count] = p[0]; y[count] = p[1]; z[count] = p[2];
+      count++;
+    }
+  }
+
+  project_grid(n, points.cols(), &x[0], &y[0], &z[0]);
+
+  count = 0;
+  for (int row = 0; row < points.rows(); row++){
+    for (int col = 0; col < points.cols(); col++){
+      points(col, row) = Vector3(x[count], y[count], z[count]);
+      count++;
+    }
+  }
+}
+
+vw::Vector3 asp::BatchPointProjector::project(vw::Vector3 const& point) const {
+
+  // No copies or validation here, as this is called for each pixel.
+  // Debug builds compare each point against the georeference.
+  double x = point[0], y = point[1], z = point[2];
+  if (m_kernel == GENERIC || !to_geodetic(x, y, z))
+    return project_generic(point);
+
+  if (!boost::math::isnan(z)){
+    switch (m_kernel){
+    case TRANSVERSE_MERCATOR: tm_forward(x, y);  break;
+    case POLAR_STEREOGRAPHIC: ps_forward(x, y);  break;
+    case EQUIRECTANGULAR:     eqc_forward(x, y); break;
+    default:                  break;
+    }
+#ifndef NDEBUG
+    if (!agrees(point, x, y, z))
+      return project_generic(point);
+#endif
+  }
+  return Vector3(x, y, z);
+}
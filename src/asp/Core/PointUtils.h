@@ -27,6 +27,9 @@
 #include <vw/Math/Vector.h>
 #include <vw/Math/Matrix.h>
 #include <vw/Image/ImageViewRef.h>
+#include <vw/Image/ImageView.h>
+#include <vw/Image/Manipulation.h>
+#include <boost/shared_ptr.hpp>
 
 namespace vw{
   namespace cartography{
@@ -173,6 +176,117 @@ namespace asp {
   
   vw::BBox3 pointcloud_bbox(vw::ImageViewRef<vw::Vector3> const& point_image,
                             bool is_geodetic);
+
+  /// Convert cartesian points to the projected space of a
+  /// georeference, with heights above datum. This does the work of
+  /// geodetic_to_point(point_image_offset(recenter_longitude
+  /// (cartesian_to_geodetic(image, georef), center_lon), offset), georef),
+  /// but on arrays of points at once. Common projections (geographic,
+  /// UTM, polar stereographic, equirectangular) are done in closed
+  /// form, others go through the georeference point by point. A grid
+  /// of points in each batch, including its corners, is checked
+  /// against the georeference, and the batch is redone point by point
+  /// if any of them disagree.
+  class BatchPointProjector {
+  public:
+    enum KernelType { GENERIC, GEOGRAPHIC, TRANSVERSE_MERCATOR,
+                      POLAR_STEREOGRAPHIC, EQUIRECTANGULAR };
+
+    BatchPointProjector(vw::cartography::GeoReference const& georef,
+                        double center_lon, vw::Vector3 const& offset);
+
+    /// Project n points given by their coordinate arrays, in place.
+    void project(size_t n, double * x, double * y, double * z) const;
+
+    /// Project the points in an image, in place.
+    void project(vw::ImageView<vw::Vector3> & points) const;
+
+    /// Project a single point with the same kernel as the batch, but
+    /// without checking it against the georeference.
+    vw::Vector3 project(vw::Vector3 const& point) const;
+
+    /// Project a single point through the georeference.
+    vw::Vector3 project_generic(vw::Vector3 const& point) const;
+
+    KernelType kernel() const { return m_kernel; }
+    std::string kernel_name() const;
+
+  private:
+    struct State;
+    boost::shared_ptr<vw::cartography::GeoReference> m_georef;
+    boost::shared_ptr<State> m_state;
+    double m_center_lon;
+    vw::Vector3 m_offset;
+    KernelType m_kernel;
+
+    // Ellipsoid
+    double m_a, m_e2, m_e;
+
+    // Projection parameters, in meters and radians
+    double m_lon0, m_x0, m_y0, m_k0;
+    bool m_south;                // for polar stereographic
+    double m_akm1;               // polar stereographic scale
+    double m_lat0, m_cos_lat_ts; // equirectangular
+    double m_tm_A, m_tm_alpha[6]; // transverse Mercator series
+
+    void parse_projection(std::string const& proj4);
+    bool to_geodetic(double & x, double & y, double & z) const;
+    void tm_forward (double & x, double & y) const;
+    void ps_forward (double & x, double & y) const;
+    void eqc_forward(double & x, double & y) const;
+    void project_kernel(size_t n, double * x, double * y, double * z,
+                        std::vector<char> & generic) const;
+    void project_grid(size_t n, size_t cols, double * x, double * y, double * z) const;
+    bool agrees(vw::Vector3 const& input, double x, double y, double z) const;
+  };
+
+  /// A view applying a BatchPointProjector to each tile of a point
+  /// image. Pixel access projects single points.
+  template <class ImageT>
+  class ProjectPointsView: public vw::ImageViewBase< ProjectPointsView<ImageT> > {
+    ImageT m_image;
+    BatchPointProjector m_projector;
+  public:
+    typedef vw::Vector3 pixel_type;
+    typedef vw::Vector3 result_type;
+    typedef vw::ProceduralPixelAccessor<ProjectPointsView> pixel_accessor;
+
+    ProjectPointsView(ImageT const& image, BatchPointProjector const& projector):
+      m_image(image), m_projector(projector){}
+
+    inline vw::int32 cols() const { return m_image.cols(); }
+    inline vw::int32 rows() const { return m_image.rows(); }
+    inline vw::int32 planes() const { return 1; }
+
+    inline pixel_accessor origin() const { return pixel_accessor(*this); }
+
+    inline result_type operator()( vw::int32 i, vw::int32 j, vw::int32 p=0 ) const {
+      return m_projector.project(m_image(i, j, p));
+    }
+
+    /// \cond INTERNAL
+    typedef vw::CropView< vw::ImageView<pixel_type> > prerasterize_type;
+    inline prerasterize_type prerasterize( vw::BBox2i const& bbox ) const {
+      vw::ImageView<pixel_type> points = crop(m_image, bbox);
+      m_projector.project(points);
+      return prerasterize_type(points, vw::BBox2i(-bbox.min().x(), -bbox.min().y(),
+                                                  cols(), rows()));
+    }
+    template <class DestT>
+    inline void rasterize( DestT const& dest, vw::BBox2i const& bbox ) const {
+      vw::rasterize(prerasterize(bbox), dest, bbox);
+    }
+    /// \endcond
+  };
+
+  template <class ImageT>
+  ProjectPointsView<ImageT>
+  inline project_points( vw::ImageViewBase<ImageT> const& image,
+                         vw::cartography::GeoReference const& georef,
+                         double center_lon, vw::Vector3 const& offset ) {
+    return ProjectPointsView<ImageT>(image.impl(),
+                                     BatchPointProjector(georef, center_lon, offset));
+  }
   
 } 
 
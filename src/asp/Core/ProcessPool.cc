@@ -0,0 +1,237 @@
+// __BEGIN_LICENSE__
+//  Copyright (c) 2009-2013, United States Government as represented by the
+//  Administrator of the National Aeronautics and Space Administration. All
+//  rights reserved.
+//
+//  The NGT platform is licensed under the Apache License, Version 2.0 (the
+//  "License"); you may not use this file except in compliance with the
+//  License. You may obtain a copy of the License at
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+// __END_LICENSE__
+
+
+
+#include <vw/Core/Exception.h>
+#include <vw/Core/Log.h>
+#include <vw/Core/Settings.h>
+#include <asp/Core/ProcessPool.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <exception>
+#include <string>
+#include <vector>
+
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace vw;
+
+namespace {
+
+  const size_t ERROR_MSG_SIZE = 1024;
+
+  // The layout of the shared memory is one SharedHeader followed by
+  // one SlotHeader plus slot_size bytes for each worker.
+  struct SharedHeader {
+    volatile int next_job;
+  };
+  struct SlotHeader {
+    int  job;
+    int  failed;
+    char error_msg[ERROR_MSG_SIZE];
+  };
+
+  size_t slot_stride( size_t slot_size ) {
+    // Keep slots aligned for any pixel type
+    size_t stride = sizeof(SlotHeader) + slot_size;
+    return (stride + 63) / 64 * 64;
+  }
+
+  // Retry reads and writes interrupted by signals
+  bool read_all( int fd, void* data, size_t len ) {
+    char* p = static_cast<char*>(data);
+    while ( len > 0 ) {
+      ssize_t n = ::read( fd, p, len );
+      if ( n < 0 && errno == EINTR ) continue;
+      if ( n <= 0 ) return false;
+      p += n; len -= n;
+    }
+    return true;
+  }
+  bool write_all( int fd, const void* data, size_t len ) {
+    const char* p = static_cast<const char*>(data);
+    while ( len > 0 ) {
+      ssize_t n = ::write( fd, p, len );
+      if ( n < 0 && errno == EINTR ) continue;
+      if ( n <= 0 ) return false;
+      p += n; len -= n;
+    }
+    return true;
+  }
+
+  // The body of a worker process. Never returns.
+  void worker_loop( int worker, int num_jobs, char* shared, size_t slot_size,
+                    int ready_fd, int ack_fd,
+                    asp::TileProcessPool::WorkFunc const& work ) {
+    SharedHeader* header = reinterpret_cast<SharedHeader*>(shared);
+    char* slot = shared + sizeof(SharedHeader) + worker * slot_stride(slot_size);
+    SlotHeader* slot_header = reinterpret_cast<SlotHeader*>(slot);
+    char* buffer = slot + sizeof(SlotHeader);
+
+    int status = 0;
+    while ( true ) {
+      int job = __sync_fetch_and_add( &header->next_job, 1 );
+      if ( job >= num_jobs )
+        break;
+
+      slot_header->job    = job;
+      slot_header->failed = 0;
+      try {
+        work( job, buffer );
+      } catch ( std::exception const& e ) {
+        slot_header->failed = 1;
+        strncpy( slot_header->error_msg, e.what(), ERROR_MSG_SIZE - 1 );
+        slot_header->error_msg[ERROR_MSG_SIZE - 1] = '\0';
+      }
+
+      // Tell the parent the slot is full, and wait until it is emptied
+      char ack;
+      if ( !write_all( ready_fd, &worker, sizeof(worker) ) ||
+           !read_all( ack_fd, &ack, 1 ) || slot_header->failed ) {
+        status = 1;
+        break;
+      }
+    }
+
+    // Skip destructors and atexit handlers, they belong to the parent
+    _exit( status );
+  }
+
+} // end anonymous namespace
+
+asp::TileProcessPool::TileProcessPool( int num_processes, size_t slot_size ):
+  m_num_processes(num_processes), m_slot_size(slot_size) {
+  if ( m_num_processes <= 0 )
+    m_num_processes = vw_settings().default_num_threads();
+  m_num_processes = std::max( m_num_processes, 1 );
+}
+
+void asp::TileProcessPool::run( int num_jobs, WorkFunc const& work,
+                                CollectFunc const& collect,
+                                ProgressCallback const& progress_callback ) const {
+  if ( num_jobs <= 0 )
+    return;
+  int num_workers = std::min( m_num_processes, num_jobs );
+
+  size_t shared_size = sizeof(SharedHeader) + num_workers * slot_stride(m_slot_size);
+  void* mem = mmap( NULL, shared_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+  if ( mem == MAP_FAILED )
+    vw_throw( ArgumentErr() << "TileProcessPool: could not allocate "
+              << shared_size << " bytes of shared memory: " << strerror(errno) << "\n" );
+  char* shared = static_cast<char*>(mem);
+  reinterpret_cast<SharedHeader*>(shared)->next_job = 0;
+
+  // One pipe for workers to announce full slots, and one per worker
+  // for the parent to announce that its slot was emptied.
+  int ready_pipe[2];
+  if ( pipe( ready_pipe ) != 0 ) {
+    munmap( mem, shared_size );
+    vw_throw( ArgumentErr() << "TileProcessPool: pipe() failed: " << strerror(errno) << "\n" );
+  }
+  std::vector<int> ack_read( num_workers, -1 ), ack_write( num_workers, -1 );
+  std::vector<pid_t> pids;
+  std::string error;
+  for ( int w = 0; w < num_workers; w++ ) {
+    int ack_pipe[2];
+    if ( pipe( ack_pipe ) != 0 ) {
+      error = std::string("pipe() failed: ") + strerror(errno);
+      break;
+    }
+    ack_read[w] = ack_pipe[0]; ack_write[w] = ack_pipe[1];
+
+    pid_t pid = fork();
+    if ( pid < 0 ) {
+      error = std::string("fork() failed: ") + strerror(errno);
+      close( ack_read[w] ); close( ack_write[w] );
+      ack_read[w] = ack_write[w] = -1;
+      break;
+    }
+    if ( pid == 0 ) {
+      // Child. Drop the pipe ends that belong to the parent and others.
+      close( ready_pipe[0] );
+      for ( int o = 0; o <= w; o++ ) {
+        close( ack_write[o] );
+        if ( o != w ) close( ack_read[o] );
+      }
+      worker_loop( w, num_jobs, shared, m_slot_size, ready_pipe[1], ack_read[w], work );
+    }
+    pids.push_back( pid );
+    close( ack_read[w] );
+    ack_read[w] = -1;
+  }
+
+  // Without this the read below would never see end of file
+  close( ready_pipe[1] );
+
+  int num_done = 0;
+  if ( error.empty() ) {
+    progress_callback.report_progress(0);
+    while ( num_done < num_jobs ) {
+      int worker;
+      if ( !read_all( ready_pipe[0], &worker, sizeof(worker) ) ) {
+        error = "a worker process exited before finishing its work";
+        break;
+      }
+      char* slot = shared + sizeof(SharedHeader) + worker * slot_stride(m_slot_size);
+      SlotHeader* slot_header = reinterpret_cast<SlotHeader*>(slot);
+      if ( slot_header->failed ) {
+        error = slot_header->error_msg;
+        break;
+      }
+      try {
+        collect( slot_header->job, slot + sizeof(SlotHeader) );
+      } catch ( std::exception const& e ) {
+        error = e.what();
+        break;
+      }
+      num_done++;
+      progress_callback.report_progress( double(num_done) / num_jobs );
+
+      char ack = 1;
+      write_all( ack_write[worker], &ack, 1 );
+    }
+  }
+
+  // On failure, stop the workers still running
+  if ( !error.empty() )
+    for ( size_t w = 0; w < pids.size(); w++ )
+      kill( pids[w], SIGTERM );
+
+  for ( int w = 0; w < num_workers; w++ )
+    if ( ack_write[w] >= 0 ) close( ack_write[w] );
+  close( ready_pipe[0] );
+
+  for ( size_t w = 0; w < pids.size(); w++ ) {
+    int status = 0;
+    while ( waitpid( pids[w], &status, 0 ) < 0 && errno == EINTR ) {}
+    if ( error.empty() && !( WIFEXITED(status) && WEXITSTATUS(status) == 0 ) )
+      error = "a worker process failed";
+  }
+  munmap( mem, shared_size );
+
+  if ( !error.empty() )
+    vw_throw( ArgumentErr() << "TileProcessPool: " << error << "\n" );
+  progress_callback.report_finished();
+}
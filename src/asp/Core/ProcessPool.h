@@ -0,0 +1,340 @@
+// __BEGIN_LICENSE__
+//  Copyright (c) 2009-2013, United States Government as represented by the
+//  Administrator of the National Aeronautics and Space Administration. All
+//  rights reserved.
+//
+//  The NGT platform is licensed under the Apache License, Version 2.0 (the
+//  "License"); you may not use this file except in compliance with the
+//  License. You may obtain a copy of the License at
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+// __END_LICENSE__
+
+
+/// \file ProcessPool.h
+///
+/// Rasterize an image with several processes rather than threads.
+/// This is for views built on camera models that are not thread safe,
+/// such as ISIS. Each worker is a fork() of the calling process.
+/// Workers take tiles from a shared counter, render them into a slot
+/// of shared memory, and the parent copies finished tiles into the
+/// output file, which only it writes to.
+///
+/// A forked worker inherits the open files of the parent, and reads
+/// from several processes through the same handle would race on its
+/// file offset. So the view is not passed in built, but as a factory
+/// which each worker calls after the fork, opening its own inputs and
+/// making its own cameras.
+///
+/// A view may keep counters while it is rendered, such as of points
+/// it rejected. Each worker sends the change in these with each tile,
+/// and the parent sums them.
+///
+/// Fork only copies the calling thread, so these functions must be
+/// called while no other thread is busy, e.g. not from inside a task
+/// of the VW thread pool.
+
+#ifndef __ASP_CORE_PROCESS_POOL_H__
+#define __ASP_CORE_PROCESS_POOL_H__
+
+#include <vw/Core/ProgressCallback.h>
+#include <vw/Image/ImageView.h>
+#include <vw/Image/Manipulation.h>
+#include <vw/Image/PixelTypeInfo.h>
+#include <vw/FileIO/DiskImageResourceGDAL.h>
+#include <vw/Cartography/GeoReference.h>
+#include <asp/Core/Common.h>
+
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace asp {
+
+  /// Runs a list of jobs in forked worker processes. Each job writes
+  /// at most slot_size bytes of output, which are handed back to the
+  /// parent through shared memory.
+  class TileProcessPool : boost::noncopyable {
+  public:
+    /// Runs in a worker. Must fill the buffer with the output of job.
+    typedef boost::function<void (int job, char* buffer)> WorkFunc;
+    /// Runs in the parent, once per job, in the order jobs complete.
+    typedef boost::function<void (int job, const char* buffer)> CollectFunc;
+
+    TileProcessPool( int num_processes, size_t slot_size );
+
+    /// Run jobs 0 to num_jobs-1. An exception thrown by a job, or a
+    /// worker dying, is rethrown in the parent as a vw::ArgumentErr
+    /// after the other workers are stopped.
+    void run( int num_jobs, WorkFunc const& work, CollectFunc const& collect,
+              vw::ProgressCallback const& progress_callback
+              = vw::ProgressCallback::dummy_instance() ) const;
+
+    int num_processes() const { return m_num_processes; }
+
+  private:
+    int    m_num_processes;
+    size_t m_slot_size;
+  };
+
+  /// Counters kept by a view while it is rendered
+  typedef vw::Vector<vw::int64, 4> ViewCounters;
+
+  /// A view, with the objects it refers to by pointer, such as the
+  /// camera models, which must live as long as it does. If set,
+  /// counters returns the running totals of the view's counters.
+  template <class PixelT>
+  struct OwnedView {
+    typedef PixelT pixel_type;
+    vw::ImageViewRef<PixelT> view;
+    boost::shared_ptr<void> owner;
+    boost::function<ViewCounters ()> counters;
+  };
+
+  // The functions below take a view factory: a copyable function
+  // object with no arguments which returns an OwnedView, and has its
+  // type as result_type. It is called once in the parent, for the
+  // size and pixel format of the output only, and once in each worker.
+
+  namespace process_pool_p {
+
+    // Render one tile of the image into the raw buffer, after the
+    // change in the view's counters since the previous tile. The view
+    // is made on the first job of each worker.
+    template <class FactoryT>
+    class RenderTile {
+      typedef typename FactoryT::result_type OwnedT;
+      typedef typename OwnedT::pixel_type PixelT;
+      FactoryT m_make_view;
+      std::vector<vw::BBox2i> const& m_tiles;
+      mutable boost::shared_ptr<OwnedT> m_owned;
+      mutable ViewCounters m_counters;
+    public:
+      RenderTile( FactoryT const& make_view, std::vector<vw::BBox2i> const& tiles ):
+        m_make_view(make_view), m_tiles(tiles) {}
+      void operator()( int job, char* buffer ) const {
+        if ( !m_owned )
+          m_owned.reset( new OwnedT( m_make_view() ) );
+        vw::ImageView<PixelT> tile = crop( m_owned->view, m_tiles[job] );
+        ViewCounters change;
+        if ( m_owned->counters ) {
+          ViewCounters counters = m_owned->counters();
+          change = counters - m_counters;
+          m_counters = counters;
+        }
+        std::memcpy( buffer, &change[0], sizeof(ViewCounters) );
+        std::memcpy( buffer + sizeof(ViewCounters), &tile(0,0),
+                     sizeof(PixelT) * tile.cols() * tile.rows() );
+      }
+    };
+
+    // Write a rendered tile to the output resource, and add up the
+    // counters sent with it.
+    template <class PixelT>
+    struct WriteTile {
+      vw::ImageResource & m_rsrc;
+      std::vector<vw::BBox2i> const& m_tiles;
+      ViewCounters * m_counters;
+      WriteTile( vw::ImageResource & rsrc, std::vector<vw::BBox2i> const& tiles,
+                 ViewCounters * counters ):
+        m_rsrc(rsrc), m_tiles(tiles), m_counters(counters) {}
+      void operator()( int job, const char* buffer ) const {
+        if ( m_counters ) {
+          ViewCounters change;
+          std::memcpy( &change[0], buffer, sizeof(ViewCounters) );
+          *m_counters += change;
+        }
+        vw::BBox2i const& bbox = m_tiles[job];
+        vw::ImageBuffer buf;
+        buf.data    = const_cast<char*>(buffer + sizeof(ViewCounters));
+        buf.format  = vw::ImageView<PixelT>( bbox.width(), bbox.height() ).format();
+        buf.cstride = sizeof(PixelT);
+        buf.rstride = sizeof(PixelT) * bbox.width();
+        buf.pstride = sizeof(PixelT) * bbox.width() * bbox.height();
+        m_rsrc.write( buf, bbox );
+      }
+    };
+
+    // The steps of block_write_approx_gdal_image(), on a made view
+    template <class FactoryT>
+    struct ApproxFactory {
+      typedef typename FactoryT::result_type::pixel_type InPixelT;
+      typedef typename vw::CompoundChannelCast<InPixelT, float>::type PixelT;
+      typedef OwnedView<PixelT> result_type;
+      FactoryT m_make_view;
+      vw::Vector3 m_shift;
+      double m_scale;
+      ApproxFactory( FactoryT const& make_view, vw::Vector3 const& shift, double scale ):
+        m_make_view(make_view), m_shift(shift), m_scale(scale) {}
+      result_type operator()() const {
+        typename FactoryT::result_type in = m_make_view();
+        result_type out;
+        out.view  = vw::channel_cast<float>( round_image_pixels( subtract_shift( in.view, m_shift ),
+                                                                 m_scale ) );
+        out.owner    = in.owner;
+        out.counters = in.counters;
+        return out;
+      }
+    };
+
+    // The steps of block_write_quantized_gdal_image(), on a made view.
+    // Points which do not fit are handled by quantize_pixels() the
+    // same way, but not counted, as the workers keep no statistics.
+    template <class FactoryT>
+    struct QuantizeFactory {
+      typedef typename FactoryT::result_type::pixel_type InPixelT;
+      typedef vw::Vector<vw::int32, vw::math::VectorSize<InPixelT>::value> PixelT;
+      typedef OwnedView<PixelT> result_type;
+      FactoryT m_make_view;
+      vw::Vector3 m_shift;
+      double m_scale;
+      QuantizeFactory( FactoryT const& make_view, vw::Vector3 const& shift, double scale ):
+        m_make_view(make_view), m_shift(shift), m_scale(scale) {}
+      result_type operator()() const {
+        typename FactoryT::result_type in = m_make_view();
+        result_type out;
+        out.view  = quantize_pixels( subtract_shift( in.view, m_shift ), m_scale );
+        out.owner    = in.owner;
+        out.counters = in.counters;
+        return out;
+      }
+    };
+  }
+
+  /// Write an image to a resource, rasterizing its tiles in
+  /// num_processes worker processes, each with its own view from
+  /// make_view. The tiles are the resource's write blocks. If
+  /// counters is given, the counters of the workers' views are added
+  /// to it.
+  template <class FactoryT>
+  void process_write_image( vw::ImageResource & rsrc,
+                            FactoryT const& make_view,
+                            int num_processes,
+                            vw::ProgressCallback const& progress_callback
+                            = vw::ProgressCallback::dummy_instance(),
+                            ViewCounters * counters = NULL ) {
+    typedef typename FactoryT::result_type::pixel_type PixelT;
+    vw::Vector2i block_size = rsrc.block_write_size();
+    std::vector<vw::BBox2i> tiles =
+      image_blocks( vw::BBox2i(0, 0, rsrc.cols(), rsrc.rows()),
+                    block_size.x(), block_size.y() );
+
+    TileProcessPool pool( num_processes, sizeof(ViewCounters) +
+                          sizeof(PixelT) * block_size.x() * block_size.y() );
+    pool.run( tiles.size(),
+              process_pool_p::RenderTile<FactoryT>( make_view, tiles ),
+              process_pool_p::WriteTile<PixelT>( rsrc, tiles, counters ),
+              progress_callback );
+  }
+
+  // The same variants as the block_write_gdal_image() functions in
+  // Common.h, for views that are not thread safe. The parent's view is
+  // only used to make the resource, and is released before the fork.
+
+  template <class FactoryT>
+  void process_write_gdal_image( const std::string &filename,
+                                 FactoryT const& make_view,
+                                 vw::cartography::GeoReference const& georef,
+                                 BaseOptions const& opt,
+                                 vw::ProgressCallback const& progress_callback =
+                                 vw::ProgressCallback::dummy_instance(),
+                                 std::map<std::string, std::string> keywords =
+                                 std::map<std::string, std::string>()
+                                 ) {
+    boost::scoped_ptr<vw::DiskImageResourceGDAL> rsrc;
+    rsrc.reset( build_gdal_rsrc( filename, make_view().view, opt ) );
+    for (std::map<std::string, std::string>::iterator i = keywords.begin();
+         i != keywords.end(); i++){
+      vw::cartography::write_header_string(*rsrc, i->first, i->second);
+    }
+    vw::cartography::write_georeference(*rsrc, georef);
+    process_write_image( *rsrc, make_view, opt.num_threads, progress_callback );
+  }
+
+  template <class FactoryT, class NoDataT>
+  void process_write_gdal_image( const std::string &filename,
+                                 FactoryT const& make_view,
+                                 vw::cartography::GeoReference const& georef,
+                                 NoDataT nodata,
+                                 BaseOptions const& opt,
+                                 vw::ProgressCallback const& progress_callback =
+                                 vw::ProgressCallback::dummy_instance(),
+                                 std::map<std::string, std::string> keywords =
+                                 std::map<std::string, std::string>()
+                                 ) {
+    boost::scoped_ptr<vw::DiskImageResourceGDAL> rsrc;
+    rsrc.reset( build_gdal_rsrc( filename, make_view().view, opt ) );
+    rsrc->set_nodata_write(nodata);
+    for (std::map<std::string, std::string>::iterator i = keywords.begin();
+         i != keywords.end(); i++){
+      vw::cartography::write_header_string(*rsrc, i->first, i->second);
+    }
+    vw::cartography::write_georeference(*rsrc, georef);
+    process_write_image( *rsrc, make_view, opt.num_threads, progress_callback );
+  }
+
+  // Like block_write_approx_gdal_image(), with worker processes.
+  template <class FactoryT>
+  void process_write_approx_gdal_image( const std::string &filename,
+                                        vw::Vector3 const& shift,
+                                        double rounding_error,
+                                        FactoryT const& make_view,
+                                        BaseOptions const& opt,
+                                        vw::ProgressCallback const& progress_callback
+                                        = vw::ProgressCallback::dummy_instance(),
+                                        ViewCounters * counters = NULL ) {
+
+    // Don't round pixels for bodies of small radius
+    if (norm_2(shift) > 0){
+      process_pool_p::ApproxFactory<FactoryT>
+        approx( make_view, shift, get_rounding_error(shift, rounding_error) );
+      boost::scoped_ptr<vw::DiskImageResourceGDAL> rsrc;
+      rsrc.reset( build_gdal_rsrc( filename, approx().view, opt ) );
+      vw::cartography::write_header_string(*rsrc, POINT_OFFSET, vec_to_str(shift));
+      process_write_image( *rsrc, approx, opt.num_threads, progress_callback, counters );
+    }else{
+      boost::scoped_ptr<vw::DiskImageResourceGDAL> rsrc;
+      rsrc.reset( build_gdal_rsrc( filename, make_view().view, opt ) );
+      process_write_image( *rsrc, make_view, opt.num_threads, progress_callback, counters );
+    }
+  }
+
+  // Like block_write_quantized_gdal_image(), with worker processes.
+  template <class FactoryT>
+  void process_write_quantized_gdal_image( const std::string &filename,
+                                           vw::Vector3 const& shift,
+                                           double rounding_error,
+                                           FactoryT const& make_view,
+                                           BaseOptions const& opt,
+                                           vw::ProgressCallback const& progress_callback
+                                           = vw::ProgressCallback::dummy_instance(),
+                                           ViewCounters * counters = NULL ) {
+
+    if (norm_2(shift) == 0){
+      process_write_approx_gdal_image(filename, shift, rounding_error, make_view,
+                                      opt, progress_callback, counters);
+      return;
+    }
+
+    double scale = get_rounding_error(shift, rounding_error);
+    process_pool_p::QuantizeFactory<FactoryT> quantized( make_view, shift, scale );
+    boost::scoped_ptr<vw::DiskImageResourceGDAL> rsrc;
+    rsrc.reset( build_quantized_gdal_rsrc( filename, quantized().view,
+                                           shift, scale, opt ) );
+    process_write_image( *rsrc, quantized, opt.num_threads, progress_callback, counters );
+  }
+
+} // namespace asp
+
+#endif//__ASP_CORE_PROCESS_POOL_H__
@@ -0,0 +1,121 @@
+// __BEGIN_LICENSE__
+//  Copyright (c) 2009-2013, United States Government as represented by the
+//  Administrator of the National Aeronautics and Space Administration. All
+//  rights reserved.
+//
+//  The NGT platform is licensed under the Apache License, Version 2.0 (the
+//  "License"); you may not use this file except in compliance with the
+//  License. You may obtain a copy of the License at
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+// __END_LICENSE__
+
+
+#include <vw/Image/Algorithms.h>
+#include <asp/Core/SampleLattice.h>
+
+#include <algorithm>
+#include <vector>
+
+using namespace vw;
+
+asp::SampleLattice::SampleLattice( FuncT const& func, int cols, int rows,
+                                   int step, double tolerance ) :
+  m_values(cols, rows), m_status(cols, rows), m_span(cols, rows),
+  m_tolerance(tolerance), m_num_evals(0) {
+  fill( m_status, uint8(UNKNOWN) );
+  if ( cols <= 0 || rows <= 0 )
+    return;
+
+  if ( step <= 1 ) {
+    for ( int j = 0; j < rows; j++ )
+      for ( int i = 0; i < cols; i++ )
+        sample( func, i, j );
+    return;
+  }
+
+  // Cells of step samples, with the last ones reaching the edge
+  for ( int j0 = 0; j0 == 0 || j0 < rows - 1; j0 += step ) {
+    int j1 = std::min( j0 + step, rows - 1 );
+    for ( int i0 = 0; i0 == 0 || i0 < cols - 1; i0 += step ) {
+      int i1 = std::min( i0 + step, cols - 1 );
+      refine( func, i0, j0, i1, j1 );
+    }
+  }
+}
+
+// Evaluate a sample, unless that was done already. A sample filled
+// in by a neighboring cell is evaluated now, as it is a corner.
+bool asp::SampleLattice::sample( FuncT const& func, int i, int j ) {
+  uint8 & status = m_status(i, j);
+  if ( status != VALID && status != INVALID ) {
+    m_num_evals++;
+    status = func( i, j, m_values(i, j) ) ? VALID : INVALID;
+  }
+  return status == VALID;
+}
+
+asp::SampleLattice::ValueT
+asp::SampleLattice::interpolate( int i0, int j0, int i1, int j1, int i, int j ) const {
+  double u = (i1 > i0) ? double(i - i0)/(i1 - i0) : 0.0;
+  double v = (j1 > j0) ? double(j - j0)/(j1 - j0) : 0.0;
+  return (1-u)*(1-v)*m_values(i0, j0) + u*(1-v)*m_values(i1, j0)
+    + (1-u)*v*m_values(i0, j1) + u*v*m_values(i1, j1);
+}
+
+// Fill in the samples of the cell with corners (i0, j0) and (i1, j1)
+void asp::SampleLattice::refine( FuncT const& func, int i0, int j0, int i1, int j1 ) {
+
+  int num_valid = 0;
+  num_valid += sample( func, i0, j0 );
+  num_valid += sample( func, i1, j0 );
+  num_valid += sample( func, i0, j1 );
+  num_valid += sample( func, i1, j1 );
+  if ( i1 - i0 <= 1 && j1 - j0 <= 1 ) return; // no samples but the corners
+
+  int im = (i0 + i1)/2, jm = (j0 + j1)/2;
+  bool agree = false;
+  if ( num_valid == 4 && sample( func, im, jm ) ) {
+    ValueT err = m_values(im, jm) - interpolate( i0, j0, i1, j1, im, jm );
+    agree = ( norm_inf(err) <= m_tolerance );
+  } else if ( num_valid == 0 && !sample( func, im, jm ) &&
+              i1 - i0 <= 4 && j1 - j0 <= 4 ) {
+    // A small cell with no valid value, such as off the DEM
+    for ( int j = j0; j <= j1; j++ )
+      for ( int i = i0; i <= i1; i++ )
+        if ( m_status(i, j) == UNKNOWN ) m_status(i, j) = ASSUMED_INVALID;
+    return;
+  }
+
+  if ( agree ) {
+    // A sample on an edge shared with a cell filled in before keeps
+    // the value from the smaller cell, as its edge corners are closer.
+    int span = std::max( i1 - i0, j1 - j0 );
+    for ( int j = j0; j <= j1; j++ )
+      for ( int i = i0; i <= i1; i++ ) {
+        uint8 status = m_status(i, j);
+        if ( status == VALID || status == INVALID ||
+             ( status == INTERPOLATED && m_span(i, j) <= span ) )
+          continue;
+        m_values(i, j) = interpolate( i0, j0, i1, j1, i, j );
+        m_status(i, j) = INTERPOLATED;
+        m_span  (i, j) = span;
+      }
+    return;
+  }
+
+  // Split along the sides longer than one sample
+  std::vector<Vector2i> cols, rows;
+  if ( i1 - i0 <= 1 ) cols.push_back( Vector2i(i0, i1) );
+  else { cols.push_back( Vector2i(i0, im) ); cols.push_back( Vector2i(im, i1) ); }
+  if ( j1 - j0 <= 1 ) rows.push_back( Vector2i(j0, j1) );
+  else { rows.push_back( Vector2i(j0, jm) ); rows.push_back( Vector2i(jm, j1) ); }
+  for ( size_t r = 0; r < rows.size(); r++ )
+    for ( size_t c = 0; c < cols.size(); c++ )
+      refine( func, cols[c][0], rows[r][0], cols[c][1], rows[r][1] );
+}
@@ -0,0 +1,87 @@
+// __BEGIN_LICENSE__
+//  Copyright (c) 2009-2013, United States Government as represented by the
+//  Administrator of the National Aeronautics and Space Administration. All
+//  rights reserved.
+//
+//  The NGT platform is licensed under the Apache License, Version 2.0 (the
+//  "License"); you may not use this file except in compliance with the
+//  License. You may obtain a copy of the License at
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+// __END_LICENSE__
+
+
+/// \file SampleLattice.h
+///
+/// Values of an expensive function on a grid of samples, such as the
+/// disparity and its spread found by casting rays onto a DEM. The
+/// grid is split in cells of a given number of samples. The function
+/// is evaluated at the corners of each cell, and if the bilinear
+/// interpolation of those agrees with it at the middle of the cell,
+/// the other samples of the cell are interpolated, else the cell is
+/// split in four. The corners of all cells, at any level, are always
+/// evaluated exactly, never taken from an interpolation.
+
+#ifndef __ASP_CORE_SAMPLE_LATTICE_H__
+#define __ASP_CORE_SAMPLE_LATTICE_H__
+
+#include <vw/Math/Vector.h>
+#include <vw/Image/ImageView.h>
+
+#include <boost/function.hpp>
+
+namespace asp {
+
+  class SampleLattice {
+  public:
+    /// Up to four quantities per sample
+    typedef vw::Vector4 ValueT;
+
+    /// Find the value at sample (i, j). Returns false if there is
+    /// none there.
+    typedef boost::function<bool (int, int, ValueT &)> FuncT;
+
+    /// Fill a grid of cols x rows samples. With a step of one or less
+    /// every sample is evaluated. The tolerance bounds the difference
+    /// in each quantity between the exact and interpolated values at
+    /// the middle of a cell.
+    SampleLattice( FuncT const& func, int cols, int rows, int step,
+                   double tolerance );
+
+    int cols() const { return m_values.cols(); }
+    int rows() const { return m_values.rows(); }
+
+    /// Whether there is a value at a sample, exact or interpolated
+    bool is_valid( int i, int j ) const {
+      return m_status(i, j) == VALID || m_status(i, j) == INTERPOLATED;
+    }
+    bool is_exact( int i, int j ) const { return m_status(i, j) == VALID; }
+    ValueT const& operator()( int i, int j ) const { return m_values(i, j); }
+
+    /// How many times the function was called
+    int num_evaluations() const { return m_num_evals; }
+
+  private:
+    // Samples that were not evaluated are INTERPOLATED, or
+    // ASSUMED_INVALID inside small cells with no valid corners.
+    enum { UNKNOWN = 0, VALID, INVALID, INTERPOLATED, ASSUMED_INVALID };
+
+    vw::ImageView<ValueT>     m_values;
+    vw::ImageView<vw::uint8>  m_status;
+    vw::ImageView<int>        m_span; // of the cell an interpolation came from
+    double m_tolerance;
+    int    m_num_evals;
+
+    bool sample( FuncT const& func, int i, int j );
+    void refine( FuncT const& func, int i0, int j0, int i1, int j1 );
+    ValueT interpolate( int i0, int j0, int i1, int j1, int i, int j ) const;
+  };
+
+} // namespace asp
+
+#endif//__ASP_CORE_SAMPLE_LATTICE_H__
@@ -45,8 +45,12 @@
 #include <vw/Core/Exception.h>
 #include <vw/Core/FundamentalTypes.h>
 #include <asp/Core/SoftwareRenderer.h>
+#include <boost/math/special_functions/fpclassify.hpp>
 
 #include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cmath>
 
 using namespace std;
 using namespace vw;
@@ -632,6 +636,153 @@ FillTriangle(GraphicsState *gc, Vertex *a, Vertex *b, Vertex *c)
   }
 }
 
+// ===========================================================================
+// Grid rasterization
+// ===========================================================================
+
+// DrawGrid uses the half-space approach instead of the spans above.
+// A pixel is inside a triangle if it is on the inner side of its
+// three edges, and its value is interpolated from the same edge
+// functions. The pixels in the bounding box of a triangle are visited
+// in tiles. Tiles outside the triangle are skipped, and tiles inside
+// it are filled without per-pixel tests. Each row of a tile is a
+// straight loop without branches, which the compiler vectorizes.
+
+static const int kTileSize = 8;
+
+// As with FillTriangle, the value of pixel (x, y) is the one at
+// window coordinates (x + 1, y + 1).
+static const double kSampleOffset = 1.0;
+
+// Faster than std::floor and std::ceil, which are function calls
+// unless SSE4.1 is enabled. The window coordinates fit in an int.
+static inline int
+FloorToInt(double x)
+{
+  int i = int(x);
+  return i - (x < double(i));
+}
+
+static inline int
+CeilToInt(double x)
+{
+  int i = int(x);
+  return i + (x > double(i));
+}
+
+// Twice the signed area of the triangle formed by an edge and a
+// point. An edge shared by two triangles is always set up from its
+// vertex with the smaller index, so the two triangles see exactly
+// opposite values on it and no pixel falls in the crack between them.
+struct EdgeFunction
+{
+  EdgeFunction() {}
+  EdgeFunction(const double *wx, const double *wy, int i, int j)
+  {
+    sign = 1.0;
+    if (j < i) { std::swap(i, j); sign = -1.0; }
+    x0 = wx[i]; y0 = wy[i];
+    dx = wx[j] - wx[i]; dy = wy[j] - wy[i];
+  }
+  // The value at (x, y) is (c - s*x) once the row y is fixed.
+  double RowConstant(double y) const { return sign*(dx*(y - y0) + dy*x0); }
+  double RowSlope() const { return sign*dy; }
+  double operator()(double x, double y) const { return RowConstant(y) - RowSlope()*x; }
+  double x0, y0, dx, dy, sign;
+};
+
+// A triangle set up for DrawGrid. Edge k is the one opposite vertex
+// k, so its edge function is the barycentric weight of that vertex
+// times the area.
+struct GridTriangle
+{
+  // Returns false if the triangle is degenerate
+  bool Setup(const double *wx, const double *wy, const float *gray,
+             int a, int b, int c)
+  {
+    edges[0] = EdgeFunction(wx, wy, b, c);
+    edges[1] = EdgeFunction(wx, wy, c, a);
+    edges[2] = EdgeFunction(wx, wy, a, b);
+    double area = edges[2](wx[c], wy[c]);
+    if (area == 0.0)
+      return false;
+    if (area < 0.0) {
+      for (int k = 0; k < 3; k++)
+        edges[k].sign = -edges[k].sign;
+      area = -area;
+    }
+    values[0] = gray[a] / area;
+    values[1] = gray[b] / area;
+    values[2] = gray[c] / area;
+    return true;
+  }
+  EdgeFunction edges[3];
+  double values[3];                     // Divided by the area
+};
+
+// Fill the pixels [xBeg, xEnd) of a row within a triangle. When
+// testInside is false the caller knows all of them are inside.
+static inline void
+FillGridSpan(float *row, int xBeg, int xEnd, double y,
+             const GridTriangle &triangle, bool testInside)
+{
+  const EdgeFunction *edges = triangle.edges;
+  double c0 = edges[0].RowConstant(y), s0 = edges[0].RowSlope();
+  double c1 = edges[1].RowConstant(y), s1 = edges[1].RowSlope();
+  double c2 = edges[2].RowConstant(y), s2 = edges[2].RowSlope();
+  double v0 = triangle.values[0], v1 = triangle.values[1], v2 = triangle.values[2];
+
+  if (testInside) {
+    for (int x = xBeg; x < xEnd; x++) {
+      double px = x + kSampleOffset;
+      double e0 = c0 - s0*px, e1 = c1 - s1*px, e2 = c2 - s2*px;
+      bool inside = (e0 >= 0.0) & (e1 >= 0.0) & (e2 >= 0.0);
+      float value = float(e0*v0 + e1*v1 + e2*v2);
+      row[x] = inside ? value : row[x];
+    }
+  } else {
+    for (int x = xBeg; x < xEnd; x++) {
+      double px = x + kSampleOffset;
+      row[x] = float((c0 - s0*px)*v0 + (c1 - s1*px)*v1 + (c2 - s2*px)*v2);
+    }
+  }
+}
+
+// Fill the pixels of [xBeg, xEnd) x [yBeg, yEnd) within a large
+// triangle, a tile at a time.
+static void
+FillGridTriangle(float *buffer, int width, const GridTriangle &triangle,
+                 int xBeg, int xEnd, int yBeg, int yEnd)
+{
+  for (int ty = yBeg; ty < yEnd; ty += kTileSize) {
+    int tyEnd = std::min(ty + kTileSize, yEnd);
+    for (int tx = xBeg; tx < xEnd; tx += kTileSize) {
+      int txEnd = std::min(tx + kTileSize, xEnd);
+
+      // An edge function is linear, so over a tile it is extreme at
+      // the corners.
+      bool outside = false, inside = true;
+      for (int k = 0; k < 3 && !outside; k++) {
+        const EdgeFunction &edge = triangle.edges[k];
+        double e00 = edge(tx        + kSampleOffset, ty        + kSampleOffset);
+        double e10 = edge(txEnd - 1 + kSampleOffset, ty        + kSampleOffset);
+        double e01 = edge(tx        + kSampleOffset, tyEnd - 1 + kSampleOffset);
+        double e11 = edge(txEnd - 1 + kSampleOffset, tyEnd - 1 + kSampleOffset);
+        if (std::max(std::max(e00, e10), std::max(e01, e11)) < 0.0)
+          outside = true;
+        if (std::min(std::min(e00, e10), std::min(e01, e11)) < 0.0)
+          inside = false;
+      }
+      if (outside)
+        continue;
+
+      for (int y = ty; y < tyEnd; y++)
+        FillGridSpan(&buffer[y * width], tx, txEnd, y + kSampleOffset,
+                     triangle, !inside);
+    }
+  }
+}
+
 inline void
 MapToWindow(Coords &coords,
             const double ndcMap[3][2],
@@ -813,3 +964,74 @@ SoftwareRenderer::DrawPolygon(const int startIndex, const int numVertices)
     colorIndex2 += m_triangleColorStep;
   }
 }
+
+void
+SoftwareRenderer::DrawGrid(const int cols, const int rows, const int numComponents,
+                           const double * const vertices, const float * const colors)
+{
+  if (cols < 2 || rows < 2 || numComponents < 2)
+    return;
+
+  // Map each vertex to the window once, rather than once for each
+  // of the up to six triangles it is part of.
+  const int numVertices = cols * rows;
+  const double scaleX = 0.5 * m_transformNDC[0][0] * m_bufferWidth;
+  const double shiftX = 0.5 * (m_transformNDC[2][0] + 1.0) * m_bufferWidth;
+  const double scaleY = 0.5 * m_transformNDC[1][1] * m_bufferHeight;
+  const double shiftY = 0.5 * (m_transformNDC[2][1] + 1.0) * m_bufferHeight;
+  std::vector<double> wx(numVertices), wy(numVertices);
+  std::vector<char> valid(numVertices);
+  for (int i = 0; i < numVertices; i++) {
+    const double *v = &vertices[i * numComponents];
+    wx[i] = scaleX * v[0] + shiftX;
+    wy[i] = scaleY * v[1] + shiftY;
+    bool isValid = true;
+    for (int k = 0; k < numComponents; k++)
+      isValid = isValid && !boost::math::isnan(v[k]);
+    valid[i] = isValid;
+  }
+
+  GridTriangle triangles[2];
+  for (int row = 0; row < rows - 1; row++) {
+    for (int col = 0; col < cols - 1; col++) {
+      const int ul = row * cols + col, ur = ul + 1;
+      const int ll = ul + cols,        lr = ll + 1;
+      if (!valid[ul] || !valid[lr])
+        continue;
+
+      // The pixels whose sample points are in the bounding box of the
+      // quad. Quads finer than the output grid often have none.
+      double minX = std::min(std::min(wx[ul], wx[ur]), std::min(wx[ll], wx[lr]));
+      double maxX = std::max(std::max(wx[ul], wx[ur]), std::max(wx[ll], wx[lr]));
+      int xBeg = std::max(0,             CeilToInt(minX - kSampleOffset));
+      int xEnd = std::min(m_bufferWidth, FloorToInt(maxX - kSampleOffset) + 1);
+      if (xBeg >= xEnd)
+        continue;
+      double minY = std::min(std::min(wy[ul], wy[ur]), std::min(wy[ll], wy[lr]));
+      double maxY = std::max(std::max(wy[ul], wy[ur]), std::max(wy[ll], wy[lr]));
+      int yBeg = std::max(0,              CeilToInt(minY - kSampleOffset));
+      int yEnd = std::min(m_bufferHeight, FloorToInt(maxY - kSampleOffset) + 1);
+      if (yBeg >= yEnd)
+        continue;
+
+      // Triangle UL, LL, LR, then triangle LR, UR, UL
+      int numTriangles = 0;
+      if (valid[ll] && triangles[numTriangles].Setup(&wx[0], &wy[0], colors, ul, ll, lr))
+        numTriangles++;
+      if (valid[ur] && triangles[numTriangles].Setup(&wx[0], &wy[0], colors, lr, ur, ul))
+        numTriangles++;
+
+      if (xEnd - xBeg <= kTileSize && yEnd - yBeg <= kTileSize) {
+        // The usual case of a quad covering a few pixels
+        for (int y = yBeg; y < yEnd; y++) {
+          float *bufferRow = &m_buffer[y * m_bufferWidth];
+          for (int k = 0; k < numTriangles; k++)
+            FillGridSpan(bufferRow, xBeg, xEnd, y + kSampleOffset, triangles[k], true);
+        }
+      } else {
+        for (int k = 0; k < numTriangles; k++)
+          FillGridTriangle(m_buffer, m_bufferWidth, triangles[k], xBeg, xEnd, yBeg, yEnd);
+      }
+    }
+  }
+}
@@ -36,6 +36,16 @@ namespace stereo {
       void SetColorPointer(const int numComponents, float * const colors);
       void DrawPolygon(const int startIndex, const int numVertices);
 
+      /// Draw the two triangles of each quad of a grid of vertices,
+      /// such as a block of a point cloud. The cols x rows vertices
+      /// are stored row by row with numComponents coordinates each,
+      /// of which only x and y are used, and the colors are one gray
+      /// value per vertex. For the quad with upper-left vertex UL,
+      /// triangle UL, LL, LR and triangle LR, UR, UL are drawn if
+      /// none of their vertices has a NaN coordinate.
+      void DrawGrid(const int cols, const int rows, const int numComponents,
+                    const double * const vertices, const float * const colors);
+
     private:
       int m_numVertexComponents;
       float *m_vertexPointer;
@@ -24,6 +24,9 @@
 
 // Standard
 #include <vector>
+#include <map>
+#include <list>
+#include <algorithm>
 
 // VW
 #include <vw/Core/Log.h>
@@ -49,6 +52,15 @@ namespace asp {
   // For the time being we do not support overwriting previous data. It
   // seems non trivial at this hour.
 
+  // Once all patches are absorbed, call compact(). This flattens the
+  // per-row maps into sorted run arrays, one set of runs for each
+  // (row, tile column) pair, plus one flag per tile saying whether any
+  // patch touches it. Reads that land in an untouched tile then go
+  // straight to the underlying image, and rasterize() only visits the
+  // runs of the tiles it overlaps instead of doing a map lookup per
+  // pixel. Calling absorb() again drops back to the map representation
+  // until compact() is called again.
+
   template <class ImageT>
   class SparseCompositeView : public vw::ImageViewBase< SparseCompositeView<ImageT> > {
     // The key in our map is the index marking the end of the
@@ -59,6 +71,41 @@ namespace asp {
     bool   m_allow_overlap;
     ImageT m_under_image;
 
+    // Flat representation, valid only when m_compact is true. Run k
+    // covers columns [m_run_start[k], m_run_end[k]) of its row and its
+    // pixels start at m_pixels[m_run_offset[k]]. The runs of row j
+    // that fall in tile column t are m_cell_begin[j*m_tile_cols+t]
+    // through m_cell_begin[j*m_tile_cols+t+1], sorted by column.
+    static const vw::int32 m_tile_size = 64;
+    bool m_compact;
+    vw::int32 m_tile_cols, m_tile_rows;
+    std::vector<vw::uint8>  m_tile_has_patch;
+    std::vector<vw::uint32> m_cell_begin;
+    std::vector<vw::int32>  m_run_start, m_run_end;
+    std::vector<vw::uint32> m_run_offset;
+    std::vector<typename ImageT::pixel_type> m_pixels;
+
+    inline bool tile_has_patch( vw::int32 i, vw::int32 j ) const {
+      return m_tile_has_patch[(j/m_tile_size)*m_tile_cols + i/m_tile_size] != 0;
+    }
+
+    // Slow path, used before compact() is called
+    inline typename ImageT::pixel_type map_lookup( vw::int32 i, vw::int32 j, vw::int32 p ) const {
+      // Get next container entry after column 'i'.  Since each container is labeled
+      //   with the last column in that section, this finds the section which might contain 'i'.
+      typename map_type::const_iterator it;
+      it = m_data[j].upper_bound(i);
+
+      if ( it != m_data[j].end() ) { // If a segment possibly containing 'i' was found
+        vw::int32 s_idx = it->first - it->second.size(); // Get the starting index of this section
+        if ( i < s_idx )
+          return m_under_image( i, j, p ); // The segment does not contain the requested pixel, use the underlying image
+        else
+          return it->second[i-s_idx];     // The segment contains the data, return it
+      }
+      return m_under_image( i, j, p ); // No segment contains the requested pixel, use the underlying image
+    }
+
   public:
     typedef typename ImageT::pixel_type pixel_type;
     typedef pixel_type result_type;
@@ -68,7 +115,8 @@ namespace asp {
     SparseCompositeView( vw::ImageViewBase<ImageT> const& under_image,
                          bool allow_overlap = false ) :
       m_data(under_image.impl().rows()), m_allow_overlap(allow_overlap),
-      m_under_image(under_image.impl()) {}
+      m_under_image(under_image.impl()), m_compact(false),
+      m_tile_cols(0), m_tile_rows(0) {}
 
     inline vw::int32 cols  () const { return m_under_image.cols(); }
     inline vw::int32 rows  () const { return m_under_image.rows(); }
@@ -77,35 +125,105 @@ namespace asp {
     inline pixel_accessor origin() const { return pixel_accessor(*this,0,0); }
 
     inline result_type operator()( vw::int32 i, vw::int32 j, vw::int32 p=0 ) const {
+      if ( !m_compact )
+        return map_lookup( i, j, p );
 
-      // Get next container entry after column 'i'.  Since each container is labeled
-      //   with the last column in that section, this finds the section which might contain 'i'.
-      typename map_type::const_iterator it;
-      it = m_data[j].upper_bound(i);
+      if ( j >= vw::int32(m_data.size()) || !tile_has_patch( i, j ) )
+        return m_under_image( i, j, p );
 
-      if ( it != m_data[j].end() ) { // If a segment possibly containing 'i' was found
-        vw::int32 s_idx = it->first - it->second.size(); // Get the starting index of this section
-        if ( i < s_idx )
-          return m_under_image( i, j, p ); // The segment does not contain the requested pixel, use the underlying image
-        else
-          return it->second[i-s_idx];     // The segment contains the data, return it
+      // Only the handful of runs of this row inside this tile need searching
+      size_t cell = size_t(j)*m_tile_cols + i/m_tile_size;
+      std::vector<vw::int32>::const_iterator first = m_run_end.begin() + m_cell_begin[cell];
+      std::vector<vw::int32>::const_iterator last  = m_run_end.begin() + m_cell_begin[cell+1];
+      std::vector<vw::int32>::const_iterator it    = std::upper_bound( first, last, i );
+      if ( it != last ) {
+        size_t k = it - m_run_end.begin();
+        if ( i >= m_run_start[k] )
+          return m_pixels[m_run_offset[k] + (i - m_run_start[k])];
       }
-      return m_under_image( i, j, p ); // No segment contains the requested pixel, use the underlying image
+      return m_under_image( i, j, p );
     }
 
     typedef SparseCompositeView<ImageT> prerasterize_type;
     inline prerasterize_type prerasterize( vw::BBox2i const& bbox ) const { return *this; }
     template <class DestT>
     inline void rasterize( DestT const& dest, vw::BBox2i const& bbox ) const {
-      vw::rasterize( prerasterize(bbox), dest, bbox );
+      if ( !m_compact ) {
+        vw::rasterize( prerasterize(bbox), dest, bbox );
+        return;
+      }
+
+      // Copy the underlying image in bulk, then paste the runs of the
+      // tiles that have any on top of it.
+      vw::rasterize( m_under_image, dest, bbox );
+      vw::int32 t_col_begin = std::max( bbox.min().x(), 0 ) / m_tile_size;
+      vw::int32 t_col_end   = std::min( (bbox.max().x() - 1) / m_tile_size + 1, m_tile_cols );
+      vw::int32 row_end     = std::min( bbox.max().y(), vw::int32(m_data.size()) );
+      for ( vw::int32 j = std::max( bbox.min().y(), 0 ); j < row_end; ++j ) {
+        for ( vw::int32 t = t_col_begin; t < t_col_end; ++t ) {
+          if ( !m_tile_has_patch[(j/m_tile_size)*m_tile_cols + t] )
+            continue;
+          size_t cell = size_t(j)*m_tile_cols + t;
+          for ( vw::uint32 k = m_cell_begin[cell]; k < m_cell_begin[cell+1]; ++k ) {
+            vw::int32 start = std::max( m_run_start[k], bbox.min().x() );
+            vw::int32 end   = std::min( m_run_end[k],   bbox.max().x() );
+            for ( vw::int32 i = start; i < end; ++i )
+              dest( i - bbox.min().x(), j - bbox.min().y() ) =
+                m_pixels[m_run_offset[k] + (i - m_run_start[k])];
+          }
+        }
+      }
     }
 
+    /// Flatten the absorbed patches into the tiled run arrays. Must be
+    /// called after the last absorb() for reads to take the fast path.
+    void compact() {
+      using namespace vw;
+      m_tile_cols = (cols() + m_tile_size - 1) / m_tile_size;
+      m_tile_rows = (int32(m_data.size()) + m_tile_size - 1) / m_tile_size;
+      m_tile_has_patch.assign( size_t(m_tile_cols)*m_tile_rows, 0 );
+      m_cell_begin.assign( m_data.size()*m_tile_cols + 1, 0 );
+      m_run_start.clear(); m_run_end.clear(); m_run_offset.clear(); m_pixels.clear();
+
+      for ( int32 j = 0; j < int32(m_data.size()); ++j ) {
+        // Runs are split at tile column boundaries so each lands in one cell
+        std::vector<uint32> per_cell( m_tile_cols, 0 );
+        for ( typename map_type::const_iterator it = m_data[j].begin();
+              it != m_data[j].end(); ++it ) {
+          int32 start = it->first - it->second.size();
+          int32 end   = it->first;
+          while ( start < end ) {
+            int32 t         = start / m_tile_size;
+            int32 piece_end = std::min( end, (t+1)*m_tile_size );
+            m_run_start.push_back( start );
+            m_run_end.push_back( piece_end );
+            m_run_offset.push_back( m_pixels.size() );
+            int32 s_idx = it->first - it->second.size();
+            m_pixels.insert( m_pixels.end(), it->second.begin() + (start - s_idx),
+                             it->second.begin() + (piece_end - s_idx) );
+            m_tile_has_patch[(j/m_tile_size)*m_tile_cols + t] = 1;
+            per_cell[t]++;
+            start = piece_end;
+          }
+        }
+        // The map is ordered by column, so the runs already come out
+        // sorted and grouped by tile column.
+        size_t cell = size_t(j)*m_tile_cols;
+        for ( int32 t = 0; t < m_tile_cols; ++t )
+          m_cell_begin[cell+t+1] = m_cell_begin[cell+t] + per_cell[t];
+      }
+      m_compact = true;
+    }
+
+    bool is_compact() const { return m_compact; }
+
     // Difficult insertation
     template <class InputT>
     void absorb( vw::Vector2i starting_index,
                  vw::ImageViewBase<InputT> const& image_base ) {
       using namespace vw;
       InputT image = image_base.impl();
+      m_compact = false;
       VW_DEBUG_ASSERT( starting_index[0] >= 0 && starting_index[1] >= 0,
                        NoImplErr() << "SparseCompositeView doesn't support insertation behind image origin.\n" );
 
@@ -199,10 +317,10 @@ namespace asp {
     void print_structure() const {
       using namespace vw;
       vw_out() << "SparseCompositeView Structure:\n";
-      for ( uint32 i = 0; i < m_data->size(); ++i ) {
+      for ( uint32 i = 0; i < m_data.size(); ++i ) {
         vw_out() << i << " | ";
-        for ( typename map_type::const_iterator it = (*m_data)[i].begin();
-              it != (*m_data)[i].end(); ++it ) {
+        for ( typename map_type::const_iterator it = m_data[i].begin();
+              it != m_data[i].end(); ++it ) {
           int32 start = it->first - it->second.size();
           vw_out() << "(" << start << "->" << it->first << ")";
         }
@@ -109,6 +109,8 @@ namespace asp {
                                  "DEM to use in estimating the low-resolution disparity (when corr-seed-mode is 2).")
       ("disparity-estimation-dem-error", po::value(&global.disparity_estimation_dem_error)->default_value(0.0),
                                  "Error (in meters) of the disparity estimation DEM.")
+      ("disparity-estimation-dem-grid", po::value(&global.disparity_estimation_dem_grid)->default_value(0),
+                                 "If positive, compute the low-resolution disparity from the DEM exactly only on a lattice with this spacing in pixels, refined where the lattice disagrees with the exact values, and interpolate in between.")
       ("use-local-homography",   po::bool_switch(&global.use_local_homography)->default_value(false)->implicit_value(true),
                                  "Apply a local homography in each tile.")
       ("corr-timeout",           po::value(&global.corr_timeout)->default_value(1800),
@@ -212,10 +214,14 @@ namespace asp {
                                             "How much to round the output point cloud values, in meters (more rounding means less precision but potentially smaller size on disk). The inverse of a power of 2 is suggested. Default: 1/2^10 for Earth and proportionally less for smaller bodies.")
       ("save-double-precision-point-cloud", po::bool_switch(&global.save_double_precision_point_cloud)->default_value(false)->implicit_value(true),
                                             "Save the final point cloud in double precision rather than bringing the points closer to origin and saving as float (marginally more precision at twice the storage).")
+      ("quantize-point-cloud",              po::bool_switch(&global.quantize_point_cloud)->default_value(false)->implicit_value(true),
+                                            "Save the point cloud as integer multiples of the rounding error, with horizontal differencing before compression. Same precision, much smaller files.")
       ("compute-point-cloud-center-only",   po::bool_switch(&global.compute_point_cloud_center_only)->default_value(false)->implicit_value(true),
                                             "Only compute the center of triangulated point cloud and exit.")
       ("compute-error-vector",              po::bool_switch(&global.compute_error_vector)->default_value(false)->implicit_value(true),
                                             "Compute the triangulation error vector, not just its length.")
+      ("camera-surrogate-tol",              po::value(&global.camera_surrogate_tol)->default_value(0.0),
+                                            "If positive, sample the cameras on a grid and triangulate with interpolated rays, with this maximum error in pixels. Faster for expensive cameras, and lets ISIS cameras run multi-threaded.")
       ;
   }
 
@@ -110,6 +110,7 @@ namespace asp {
     bool compute_low_res_disparity_only;      // Skip the full-resolution disparity computation
     std::string disparity_estimation_dem;     // DEM to use in estimating the low-resolution disparity
     double disparity_estimation_dem_error; // Error (in meters) of the disparity estimation DEM
+    int    disparity_estimation_dem_grid;  // Lattice spacing for the DEM disparity, 0 for every pixel
     bool   use_local_homography;      // Apply a local homography in each tile
     int    corr_timeout;              // Correlation timeout for a tile, in seconds
 
@@ -153,9 +154,11 @@ namespace asp {
     std::string bundle_adjust_prefix; // Use the camera adjustments obtained by previously running bundle_adjust with the output prefix specified here.
     bool   use_least_squares;         // Use a more rigorous triangulation
     bool   save_double_precision_point_cloud; // Save final point cloud in double precision rather than bringing the points closer to origin and saving as float (marginally more precision at 2x the storage).
+    bool   quantize_point_cloud;      // Save the point cloud as integer multiples of the rounding error
     double point_cloud_rounding_error;// How much to round the output point cloud values
     bool   compute_point_cloud_center_only; // Only compute the center of triangulated point cloud and exit.
     bool   compute_error_vector;      // Compute the triangulation error vector, not just its length
+    double camera_surrogate_tol;      // If positive, triangulate with interpolated cameras with this max error in pixels
 
     // DG Options
     bool disable_correct_velocity_aberration;
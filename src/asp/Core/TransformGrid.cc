@@ -0,0 +1,151 @@
+// __BEGIN_LICENSE__
+//  Copyright (c) 2009-2013, United States Government as represented by the
+//  Administrator of the National Aeronautics and Space Administration. All
+//  rights reserved.
+//
+//  The NGT platform is licensed under the Apache License, Version 2.0 (the
+//  "License"); you may not use this file except in compliance with the
+//  License. You may obtain a copy of the License at
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+// __END_LICENSE__
+
+
+/// \file TransformGrid.cc
+///
+
+#include <asp/Core/TransformGrid.h>
+#include <vw/Image/Algorithms.h>
+#include <algorithm>
+
+using namespace vw;
+
+namespace {
+
+  // A cell at most this wide where all the samples have the same
+  // invalid value is taken to be invalid throughout. Smaller islands
+  // of valid values can be missed.
+  const int MAX_INVALID_CELL_SIZE = 8;
+
+  Vector2 bilinear( Vector2 const& v00, Vector2 const& v10,
+                    Vector2 const& v01, Vector2 const& v11,
+                    double a, double b ) {
+    return (1-a)*(1-b)*v00 + a*(1-b)*v10 + (1-a)*b*v01 + a*b*v11;
+  }
+
+}
+
+asp::TransformGrid::TransformGrid( FuncT const& func, BBox2i const& box,
+                                   BBox2 const& valid_box, double tolerance,
+                                   int cell_size ):
+  m_func(func), m_box(box), m_valid_box(valid_box), m_tolerance(tolerance),
+  m_max_error(0), m_num_evals(0) {
+
+  int cols = box.width(), rows = box.height();
+  cell_size = std::max( cell_size, 2 );
+  m_pix.set_size( cols, rows );
+  m_nodes.set_size( cols + 1, rows + 1 );
+  m_known.set_size( cols + 1, rows + 1 );
+  fill( m_known, 0 );
+
+  for ( int row = 0; row < rows; row += cell_size )
+    for ( int col = 0; col < cols; col += cell_size )
+      refine( col, row, std::min( col + cell_size, cols ),
+              std::min( row + cell_size, rows ) );
+
+  for ( int row = 0; row < rows; row++ )
+    for ( int col = 0; col < cols; col++ )
+      if ( is_good( m_pix(col, row) ) )
+        m_values_box.grow( m_pix(col, row) );
+
+  // Keep only what is needed for lookups
+  m_nodes.set_size( 0, 0 );
+  m_known.set_size( 0, 0 );
+  m_func = FuncT();
+}
+
+Vector2 asp::TransformGrid::exact( int col, int row ) {
+  if ( !m_known(col, row) ) {
+    m_nodes(col, row) = m_func( Vector2( col + m_box.min().x(), row + m_box.min().y() ) );
+    m_known(col, row) = 1;
+    m_num_evals++;
+  }
+  return m_nodes(col, row);
+}
+
+bool asp::TransformGrid::is_good( Vector2 const& val ) const {
+  return val == val && m_valid_box.contains(val);
+}
+
+// Fill the pixels in [col0, col1) x [row0, row1), using the nodes at
+// the corners, which include col1 and row1.
+void asp::TransformGrid::refine( int col0, int row0, int col1, int row1 ) {
+
+  int cols = col1 - col0, rows = row1 - row0;
+  if ( cols <= 2 && rows <= 2 ) {
+    for ( int row = row0; row < row1; row++ )
+      for ( int col = col0; col < col1; col++ )
+        m_pix(col, row) = exact( col, row );
+    return;
+  }
+
+  Vector2 v00 = exact( col0, row0 ), v10 = exact( col1, row0 );
+  Vector2 v01 = exact( col0, row1 ), v11 = exact( col1, row1 );
+  int mid_col = (col0 + col1)/2, mid_row = (row0 + row1)/2;
+
+  int check_cols[] = { mid_col, mid_col, mid_col, col0,    col1    };
+  int check_rows[] = { mid_row, row0,    row1,    mid_row, mid_row };
+  bool good = is_good(v00) && is_good(v10) && is_good(v01) && is_good(v11);
+  double error = 0;
+  if ( good ) {
+    for ( int k = 0; k < 5; k++ ) {
+      Vector2 val = exact( check_cols[k], check_rows[k] );
+      if ( !is_good(val) ) {
+        good = false;
+        break;
+      }
+      double a = double(check_cols[k] - col0)/cols, b = double(check_rows[k] - row0)/rows;
+      error = std::max( error, norm_2( val - bilinear( v00, v10, v01, v11, a, b ) ) );
+    }
+  } else if ( cols <= MAX_INVALID_CELL_SIZE && rows <= MAX_INVALID_CELL_SIZE &&
+              !is_good(v00) && v10 == v00 && v01 == v00 && v11 == v00 ) {
+    // Such as the value returned for points off the DEM or the image
+    bool uniform = true;
+    for ( int k = 0; k < 5 && uniform; k++ )
+      uniform = ( exact( check_cols[k], check_rows[k] ) == v00 );
+    if ( uniform ) {
+      for ( int row = row0; row < row1; row++ )
+        for ( int col = col0; col < col1; col++ )
+          m_pix(col, row) = v00;
+      return;
+    }
+  }
+
+  if ( good && error <= m_tolerance ) {
+    m_max_error = std::max( m_max_error, error );
+    for ( int row = row0; row < row1; row++ )
+      for ( int col = col0; col < col1; col++ )
+        m_pix(col, row) = bilinear( v00, v10, v01, v11,
+                                    double(col - col0)/cols, double(row - row0)/rows );
+    return;
+  }
+
+  // Split along the dimensions that can still be split
+  if ( cols > 2 && rows > 2 ) {
+    refine( col0,    row0,    mid_col, mid_row );
+    refine( mid_col, row0,    col1,    mid_row );
+    refine( col0,    mid_row, mid_col, row1    );
+    refine( mid_col, mid_row, col1,    row1    );
+  } else if ( cols > 2 ) {
+    refine( col0,    row0, mid_col, row1 );
+    refine( mid_col, row0, col1,    row1 );
+  } else {
+    refine( col0, row0,    col1, mid_row );
+    refine( col0, mid_row, col1, row1    );
+  }
+}
@@ -0,0 +1,229 @@
+// __BEGIN_LICENSE__
+//  Copyright (c) 2009-2013, United States Government as represented by the
+//  Administrator of the National Aeronautics and Space Administration. All
+//  rights reserved.
+//
+//  The NGT platform is licensed under the Apache License, Version 2.0 (the
+//  "License"); you may not use this file except in compliance with the
+//  License. You may obtain a copy of the License at
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+// __END_LICENSE__
+
+
+/// \file TransformGrid.h
+///
+/// Approximate an expensive but smooth transform, such as the
+/// Map2CamTrans of mapproject, over one tile of output pixels at a
+/// time. The exact transform is evaluated at the corners of coarse
+/// cells and interpolated bilinearly in between. A cell whose
+/// interpolation error at its center and edge midpoints exceeds the
+/// tolerance is split in four, down to a few pixels, which are then
+/// computed exactly. So are cells touching points that map outside
+/// the valid region, such as the edge of the camera image.
+
+#ifndef __ASP_CORE_TRANSFORM_GRID_H__
+#define __ASP_CORE_TRANSFORM_GRID_H__
+
+#include <vw/Core/Thread.h>
+#include <vw/Math/Vector.h>
+#include <vw/Math/BBox.h>
+#include <vw/Image/ImageView.h>
+#include <vw/Image/Transform.h>
+
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/tss.hpp>
+
+#include <cmath>
+#include <map>
+
+namespace asp {
+
+  /// The approximation of a transform over one box of integer pixels
+  class TransformGrid {
+  public:
+    typedef boost::function<vw::Vector2 (vw::Vector2 const&)> FuncT;
+
+    /// Transformed points are interpolated only if all points used
+    /// for a cell are finite and within valid_box.
+    TransformGrid( FuncT const& func, vw::BBox2i const& box,
+                   vw::BBox2 const& valid_box, double tolerance,
+                   int cell_size );
+
+    vw::BBox2i const& box() const { return m_box; }
+
+    /// The value at a pixel within box()
+    vw::Vector2 operator()( vw::Vector2i const& pix ) const {
+      return m_pix( pix.x() - m_box.min().x(), pix.y() - m_box.min().y() );
+    }
+
+    /// The largest error found at the check points of the
+    /// interpolated cells
+    double max_error() const { return m_max_error; }
+
+    /// How many times the exact transform was evaluated
+    int num_evals() const { return m_num_evals; }
+
+    /// The bounding box of the values within the valid region, empty
+    /// if there are none
+    vw::BBox2 const& valid_values_bbox() const { return m_values_box; }
+
+  private:
+    FuncT      m_func; // only during construction
+    vw::BBox2i m_box;
+    vw::BBox2  m_valid_box, m_values_box;
+    double     m_tolerance, m_max_error;
+    int        m_num_evals;
+    vw::ImageView<vw::Vector2> m_pix;
+    // Exact values at the grid nodes, filled in on demand
+    vw::ImageView<vw::Vector2> m_nodes;
+    vw::ImageView<vw::uint8>   m_known;
+
+    vw::Vector2 exact( int col, int row );
+    bool is_good( vw::Vector2 const& val ) const;
+    void refine( int col0, int row0, int col1, int row1 );
+  };
+
+  /// Counts of the work done by an ApproxTransform, over all tiles
+  struct TransformGridStats {
+    double max_error;
+    double num_evals, num_pixels;
+    TransformGridStats(): max_error(0), num_evals(0), num_pixels(0) {}
+  };
+
+  namespace transform_grid_p {
+
+    // What a thread keeps for its current tile: its own copy of the
+    // transform, which may cache data for the tile, and the grid.
+    template <class TxT>
+    struct TileState {
+      TxT tx;
+      boost::shared_ptr<TransformGrid> grid;
+      TileState( TxT const& tx_in ): tx(tx_in) {}
+    };
+
+    // The tile states are owned here, one per thread, so they are
+    // freed with the transform rather than at thread exit. Each thread
+    // finds its own without locking through a non-owning
+    // thread-specific pointer.
+    template <class TxT>
+    struct SharedState {
+      vw::Mutex mutex;
+      TransformGridStats stats;
+      std::map< boost::thread::id, boost::shared_ptr< TileState<TxT> > > tiles;
+      boost::thread_specific_ptr< TileState<TxT> > current;
+      static void no_cleanup( TileState<TxT>* ) {}
+      SharedState(): current(&no_cleanup) {}
+    };
+  }
+
+  /// Wraps a transform whose reverse_bbox() is called for each output
+  /// tile before reverse() is called for the pixels of that tile, as
+  /// done by TransformView. The reverse_bbox() call copies the
+  /// transform, lets cache_tile() prepare the copy for the tile, and
+  /// builds a TransformGrid for the tile from it, all private to the
+  /// calling thread. Then reverse() answers from the grid, and any
+  /// other point goes to the thread's copy of the transform. The
+  /// transform is never used by two threads at once, so it may cache
+  /// data for its tile, as Map2CamTrans does.
+  template <class TxT>
+  class ApproxTransform : public vw::TransformBase< ApproxTransform<TxT> > {
+  public:
+    typedef boost::function<void (TxT const&, vw::BBox2i const&)> CacheFuncT;
+
+  private:
+    // Don't keep grids for boxes that are not tiles
+    static const int MAX_GRID_AREA = 1024*1024;
+
+    typedef transform_grid_p::TileState<TxT>   TileStateT;
+    typedef transform_grid_p::SharedState<TxT> SharedStateT;
+
+    struct Reverse {
+      TxT const& m_tx;
+      Reverse( TxT const& tx ): m_tx(tx) {}
+      vw::Vector2 operator()( vw::Vector2 const& p ) const { return m_tx.reverse(p); }
+    };
+
+    TxT        m_tx; // Only copied, and used by threads with no tile yet
+    CacheFuncT m_cache_tile;
+    vw::BBox2  m_valid_box;
+    double     m_tolerance;
+    int        m_cell_size;
+    boost::shared_ptr<SharedStateT> m_state;
+
+  public:
+    /// If set, cache_tile(tx, bbox) is called on each copy of the
+    /// transform before it is used for the output box bbox.
+    ApproxTransform( TxT const& tx, vw::BBox2 const& valid_box, double tolerance,
+                     int cell_size = 32, CacheFuncT const& cache_tile = CacheFuncT() ):
+      m_tx(tx), m_cache_tile(cache_tile), m_valid_box(valid_box), m_tolerance(tolerance),
+      m_cell_size(cell_size), m_state(new SharedStateT()) {}
+
+    inline vw::Vector2 forward( vw::Vector2 const& p ) const { return m_tx.forward(p); }
+
+    inline vw::Vector2 reverse( vw::Vector2 const& p ) const {
+      TileStateT const* tile = m_state->current.get();
+      if ( !tile )
+        return m_tx.reverse(p);
+      TransformGrid const* grid = tile->grid.get();
+      if ( grid && p.x() == std::floor(p.x()) && p.y() == std::floor(p.y()) ) {
+        vw::Vector2i pix( (int)p.x(), (int)p.y() );
+        if ( grid->box().contains(pix) )
+          return (*grid)(pix);
+      }
+      return tile->tx.reverse(p);
+    }
+
+    /// The input box is that of the grid values in the valid region,
+    /// expanded by the tolerance and a pixel, so the exact transform
+    /// is evaluated only at the grid nodes.
+    inline vw::BBox2i reverse_bbox( vw::BBox2i const& bbox ) const {
+      boost::shared_ptr<TileStateT> tile( new TileStateT(m_tx) );
+      if ( m_cache_tile )
+        m_cache_tile( tile->tx, bbox );
+
+      vw::BBox2i in_box;
+      int num_evals = 0;
+      if ( !bbox.empty() && double(bbox.width())*bbox.height() <= MAX_GRID_AREA ) {
+        tile->grid.reset( new TransformGrid( Reverse(tile->tx), bbox, m_valid_box,
+                                             m_tolerance, m_cell_size ) );
+        num_evals = tile->grid->num_evals();
+        vw::BBox2 values_box = tile->grid->valid_values_bbox();
+        if ( !values_box.empty() ) {
+          values_box.expand( std::ceil(m_tolerance) + 1 );
+          in_box = vw::grow_bbox_to_int( values_box );
+        }
+      }
+      // Not a tile, or nothing of it maps to the valid region
+      if ( in_box.empty() )
+        in_box = tile->tx.reverse_bbox(bbox);
+
+      vw::Mutex::Lock lock( m_state->mutex );
+      m_state->tiles[boost::this_thread::get_id()] = tile;
+      m_state->current.reset( tile.get() );
+      if ( tile->grid ) {
+        TransformGridStats & stats = m_state->stats;
+        stats.max_error   = std::max( stats.max_error, tile->grid->max_error() );
+        stats.num_evals  += num_evals;
+        stats.num_pixels += double(bbox.width())*bbox.height();
+      }
+      return in_box;
+    }
+
+    /// The statistics so far, from all copies of this transform
+    TransformGridStats stats() const {
+      vw::Mutex::Lock lock( m_state->mutex );
+      return m_state->stats;
+    }
+  };
+
+} // namespace asp
+
+#endif//__ASP_CORE_TRANSFORM_GRID_H__
@@ -0,0 +1,161 @@
+// __BEGIN_LICENSE__
+//  Copyright (c) 2009-2013, United States Government as represented by the
+//  Administrator of the National Aeronautics and Space Administration. All
+//  rights reserved.
+//
+//  The NGT platform is licensed under the Apache License, Version 2.0 (the
+//  "License"); you may not use this file except in compliance with the
+//  License. You may obtain a copy of the License at
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+// __END_LICENSE__
+
+
+
+#include <test/Helpers.h>
+#include <vw/Camera/PinholeModel.h>
+#include <vw/Cartography/Datum.h>
+#include <asp/Core/CameraSurrogate.h>
+
+using namespace vw;
+
+namespace {
+  // Looking straight down from 100 km above (lon, lat)
+  camera::PinholeModel make_pinhole( cartography::Datum const& datum,
+                                     double lon, double lat ) {
+    Vector3 ground = datum.geodetic_to_cartesian( Vector3(lon, lat, 0) );
+    Vector3 center = datum.geodetic_to_cartesian( Vector3(lon, lat, 1e5) );
+    Matrix3x3 ned = datum.lonlat_to_ned_matrix( Vector2(lon, lat) );
+    Matrix3x3 rotation;
+    select_col( rotation, 0 ) = select_row( ned, 1 );  // x: east
+    select_col( rotation, 1 ) = -select_row( ned, 0 ); // y: south
+    select_col( rotation, 2 ) = normalize( ground - center );
+    return camera::PinholeModel( center, rotation, 5000, 5000, 500, 400 );
+  }
+}
+
+class CameraSurrogateTest : public ::testing::Test {
+protected:
+  CameraSurrogateTest() :
+    datum( "D_TEST", "Test sphere", "Reference Meridian", 1e6, 1e6, 0 ),
+    image_size( 1000, 800 ) {}
+
+  virtual void SetUp() {
+    pinhole = make_pinhole( datum, 10, 20 );
+  }
+
+  cartography::Datum   datum;
+  Vector2i             image_size;
+  camera::PinholeModel pinhole;
+};
+
+TEST_F( CameraSurrogateTest, matches_camera ) {
+  double tol = 0.01;
+  asp::CameraSurrogate surrogate( pinhole, image_size, tol, datum, Vector2(-500, 2000) );
+  EXPECT_LE( surrogate.ray_error(),    tol );
+  EXPECT_LE( surrogate.ground_error(), tol );
+
+  for ( int k = 0; k < 50; k++ ) {
+    Vector2 pix( 997.0 * k / 49, 13 + 11 * k );
+    EXPECT_VECTOR_NEAR( pinhole.camera_center(pix),
+                        surrogate.camera_center(pix), 1e-3 );
+    EXPECT_VECTOR_NEAR( pinhole.pixel_to_vector(pix),
+                        surrogate.pixel_to_vector(pix), 1e-5 );
+
+    Vector3 xyz = pinhole.camera_center(pix) + 1.0005e5 * pinhole.pixel_to_vector(pix);
+    EXPECT_VECTOR_NEAR( pinhole.point_to_pixel(xyz),
+                        surrogate.point_to_pixel(xyz), 2 * tol );
+  }
+
+  // Far away from the footprint
+  EXPECT_THROW( surrogate.point_to_pixel( datum.geodetic_to_cartesian(Vector3(50, 20, 0)) ),
+                camera::PointToPixelErr );
+}
+
+// A camera whose rays are pushed sideways by up to a pixel in a small
+// spot, so that only a few cells need refining.
+class BumpyCamera : public camera::PinholeModel {
+  Vector2 m_spot;
+public:
+  BumpyCamera( camera::PinholeModel const& pinhole, Vector2 const& spot ) :
+    camera::PinholeModel(pinhole), m_spot(spot) {}
+  virtual Vector3 pixel_to_vector( Vector2 const& pix ) const {
+    double shift = exp( -norm_2_sqr( pix - m_spot ) / 18.0 );
+    return camera::PinholeModel::pixel_to_vector( pix + Vector2(shift, 0) );
+  }
+};
+
+TEST_F( CameraSurrogateTest, refines_where_needed ) {
+  // The spot is on the edge between two coarse cells, halfway
+  // between their corners, and too small to show at their centers.
+  Vector2 spot( 4.5 * 999 / 8, 2 * 799 / 8.0 );
+  BumpyCamera bumpy( pinhole, spot );
+  double tol = 0.05;
+  asp::CameraSurrogate surrogate( bumpy, image_size, tol );
+  EXPECT_LE( surrogate.ray_error(), tol );
+
+  double focal = 5000, max_error = 0;
+  for ( int j = -10; j <= 10; j++ )
+    for ( int i = -10; i <= 10; i++ ) {
+      Vector2 pix = spot + Vector2( i, j );
+      Vector3 a = bumpy.pixel_to_vector(pix), b = surrogate.pixel_to_vector(pix);
+      max_error = std::max( max_error, focal * acos( std::min( dot_prod(a, b), 1.0 ) ) );
+    }
+  EXPECT_LE( max_error, 2 * tol );
+}
+
+// A camera whose rays jump by 5 pixels past a column, which no
+// grid can interpolate.
+class SteppedCamera : public camera::PinholeModel {
+public:
+  SteppedCamera( camera::PinholeModel const& pinhole ) :
+    camera::PinholeModel(pinhole) {}
+  virtual Vector3 pixel_to_vector( Vector2 const& pix ) const {
+    double shift = pix.x() > 300.3 ? 5 : 0;
+    return camera::PinholeModel::pixel_to_vector( pix + Vector2(shift, 0) );
+  }
+};
+
+TEST_F( CameraSurrogateTest, fails_at_pixel_spacing ) {
+  SteppedCamera stepped( pinhole );
+  EXPECT_THROW( asp::CameraSurrogate( stepped, image_size, 0.05 ), ArgumentErr );
+}
+
+TEST_F( CameraSurrogateTest, across_antimeridian ) {
+  camera::PinholeModel cam = make_pinhole( datum, 180, 20 );
+  double tol = 0.05;
+  asp::CameraSurrogate surrogate( cam, image_size, tol, datum, Vector2(0, 1000) );
+  EXPECT_LE( surrogate.ground_error(), tol );
+
+  // On both sides of the antimeridian, whichever way the longitude
+  // is written
+  double lons[] = { 179.99, -179.99, 180.01, 539.99 };
+  for ( int k = 0; k < 4; k++ ) {
+    Vector3 xyz = datum.geodetic_to_cartesian( Vector3(lons[k], 20.005, 500) );
+    EXPECT_VECTOR_NEAR( cam.point_to_pixel(xyz), surrogate.point_to_pixel(xyz), 2 * tol );
+  }
+}
+
+TEST_F( CameraSurrogateTest, read_write ) {
+  asp::CameraSurrogate surrogate( pinhole, image_size, 0.05, datum, Vector2(0, 1000) );
+  UnlinkName file("surrogate.txt");
+  surrogate.write( file );
+  asp::CameraSurrogate loaded( file );
+
+  EXPECT_TRUE( loaded.has_ground_grid() );
+  EXPECT_NEAR( surrogate.ground_error(), loaded.ground_error(), 1e-12 );
+  Vector2 pix( 123.4, 567.8 );
+  EXPECT_VECTOR_NEAR( surrogate.pixel_to_vector(pix), loaded.pixel_to_vector(pix), 1e-12 );
+  Vector3 xyz = datum.geodetic_to_cartesian( Vector3(10.01, 19.99, 300) );
+  EXPECT_VECTOR_NEAR( surrogate.point_to_pixel(xyz), loaded.point_to_pixel(xyz), 1e-9 );
+
+  // Without a ground grid there is no point_to_pixel
+  asp::CameraSurrogate rays_only( pinhole, image_size, 0.05 );
+  EXPECT_FALSE( rays_only.has_ground_grid() );
+  EXPECT_THROW( rays_only.point_to_pixel(xyz), camera::PointToPixelErr );
+}
@@ -0,0 +1,83 @@
+// __BEGIN_LICENSE__
+//  Copyright (c) 2009-2013, United States Government as represented by the
+//  Administrator of the National Aeronautics and Space Administration. All
+//  rights reserved.
+//
+//  The NGT platform is licensed under the Apache License, Version 2.0 (the
+//  "License"); you may not use this file except in compliance with the
+//  License. You may obtain a copy of the License at
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+// __END_LICENSE__
+
+
+
+#include <test/Helpers.h>
+#include <vw/Image/ImageView.h>
+#include <asp/Core/Common.h>
+
+using namespace vw;
+
+namespace {
+
+  // Points a few meters from the shift, with an error of 0.25
+  ImageView<Vector4> make_cloud( Vector3 const& shift ) {
+    ImageView<Vector4> cloud(4, 3);
+    for ( int32 row = 0; row < cloud.rows(); row++ )
+      for ( int32 col = 0; col < cloud.cols(); col++ )
+        cloud(col, row) = Vector4( shift[0] + col, shift[1] + row, shift[2] + 0.5, 0.25 );
+    return cloud;
+  }
+
+}
+
+TEST( Common, quantize_far_outlier ) {
+  Vector3 shift( 1e6, 2e6, 3e6 );
+  double scale = 1.0/1024;
+  ImageView<Vector4> cloud = make_cloud(shift);
+  cloud(1,1) = Vector4( 1e12, 2e6, 3e6, 0.25 ); // too far from the shift
+  cloud(2,1)[3] = 1e10;                         // too large an error
+  cloud(3,2) = Vector4();                       // invalid
+
+  boost::shared_ptr<asp::QuantizeStats> stats( new asp::QuantizeStats );
+  ImageView< Vector<int32, 4> > quantized
+    = asp::quantize_pixels( asp::subtract_shift(cloud, shift), scale, stats );
+  EXPECT_EQ( 1u, stats->num_invalidated );
+  EXPECT_EQ( 1u, stats->num_clamped );
+
+  EXPECT_EQ( Vector<int32, 4>(), quantized(1,1) );
+  EXPECT_EQ( Vector<int32, 4>(), quantized(3,2) );
+  EXPECT_EQ( std::numeric_limits<int32>::max(), quantized(2,1)[3] );
+  EXPECT_EQ( Vector<int32, 4>( 2048, 1024, 512, std::numeric_limits<int32>::max() ),
+             quantized(2,1) );
+  EXPECT_EQ( Vector<int32, 4>( 0, 0, 512, 256 ), quantized(0,0) );
+}
+
+TEST( Common, quantized_cloud_round_trip ) {
+  Vector3 shift( 1e6, 2e6, 3e6 );
+  double scale = 1.0/1024;
+  ImageView<Vector4> cloud = make_cloud(shift);
+  cloud(1,1) = Vector4( -1e12, 2e6, 3e6, 0.25 );
+
+  UnlinkName file("QuantizedCloud.tif");
+  asp::BaseOptions opt;
+  opt.raster_tile_size = Vector2i(256, 256);
+  EXPECT_NO_THROW( asp::block_write_quantized_gdal_image( file, shift, scale, cloud, opt ) );
+
+  // The outlier comes back invalid, and the rest as it was
+  ImageView<Vector4> result = asp::read_cloud<4>( file );
+  ASSERT_EQ( cloud.cols(), result.cols() );
+  ASSERT_EQ( cloud.rows(), result.rows() );
+  for ( int32 row = 0; row < cloud.rows(); row++ )
+    for ( int32 col = 0; col < cloud.cols(); col++ ){
+      if ( col == 1 && row == 1 )
+        EXPECT_VECTOR_NEAR( Vector4(), result(col, row), 1e-12 );
+      else
+        EXPECT_VECTOR_NEAR( cloud(col, row), result(col, row), scale );
+    }
+}
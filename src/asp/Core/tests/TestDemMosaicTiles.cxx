@@ -0,0 +1,108 @@
+// __BEGIN_LICENSE__
+//  Copyright (c) 2009-2013, United States Government as represented by the
+//  Administrator of the National Aeronautics and Space Administration. All
+//  rights reserved.
+//
+//  The NGT platform is licensed under the Apache License, Version 2.0 (the
+//  "License"); you may not use this file except in compliance with the
+//  License. You may obtain a copy of the License at
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+// __END_LICENSE__
+
+
+#include <test/Helpers.h>
+#include <vw/Math/Matrix.h>
+#include <vw/Cartography/GeoReference.h>
+#include <vw/Cartography/GeoTransform.h>
+#include <asp/Core/DemMosaicTiles.h>
+#include <algorithm>
+
+using namespace vw;
+using namespace vw::cartography;
+
+namespace {
+  GeoReference make_georef(bool utm, double pixel_size, Vector2 const& origin){
+    GeoReference georef;
+    georef.set_well_known_geogcs("WGS84");
+    if (utm) georef.set_UTM(10);
+    Matrix3x3 transform;
+    transform.set_identity();
+    transform(0, 0) = pixel_size;
+    transform(1, 1) = -pixel_size;
+    transform(0, 2) = origin.x();
+    transform(1, 2) = origin.y();
+    georef.set_transform(transform);
+    return georef;
+  }
+
+  bool has_dem(std::vector<int> const& dems, int dem){
+    return std::find(dems.begin(), dems.end(), dem) != dems.end();
+  }
+}
+
+TEST(DemMosaicTiles, dems_in_another_projection) {
+
+  // A 400 x 400 pixel UTM mosaic in 100 pixel tiles, with a UTM DEM
+  // and a geographic one, each covering part of it.
+  GeoReference out_georef = make_georef(true, 10.0, Vector2(500000, 4200000));
+  std::vector<GeoReference> georefs;
+  std::vector<BBox2i> dem_boxes;
+  georefs.push_back(make_georef(true, 5.0, Vector2(502500, 4199000)));
+  dem_boxes.push_back(BBox2i(0, 0, 200, 200));
+  georefs.push_back(make_georef(false, 1e-4, Vector2(-122.99, 37.935)));
+  dem_boxes.push_back(BBox2i(0, 0, 200, 200));
+
+  int tile_size = 100, num_tiles = 4, border = 2;
+  std::vector<BBox2i> tile_boxes;
+  for (int ty = 0; ty < num_tiles; ty++){
+    for (int tx = 0; tx < num_tiles; tx++)
+      tile_boxes.push_back(BBox2i(tx*tile_size, ty*tile_size, tile_size, tile_size));
+  }
+
+  std::vector< std::vector<int> > tile_dems;
+  asp::find_box_dems(georefs, dem_boxes, out_georef, tile_boxes, border, tile_dems);
+  ASSERT_EQ(tile_boxes.size(), tile_dems.size());
+
+  for (int dem = 0; dem < (int)georefs.size(); dem++){
+
+    // Every tile a DEM pixel lands in must have that DEM, and the
+    // region of the DEM for it must be within the DEM.
+    GeoTransform geotrans(georefs[dem], out_georef);
+    std::vector<bool> covered(tile_boxes.size(), false);
+    for (int col = 0; col < dem_boxes[dem].width(); col++){
+      for (int row = 0; row < dem_boxes[dem].height(); row++){
+        Vector2 pix = geotrans.forward(Vector2(col, row));
+        int tx = (int)floor(pix.x()/tile_size), ty = (int)floor(pix.y()/tile_size);
+        if (tx < 0 || ty < 0 || tx >= num_tiles || ty >= num_tiles) continue;
+        covered[ty*num_tiles + tx] = true;
+      }
+    }
+    for (size_t tile = 0; tile < tile_boxes.size(); tile++){
+      if (!covered[tile]) continue;
+      EXPECT_TRUE(has_dem(tile_dems[tile], dem));
+      BBox2 in_box = asp::dem_input_box(geotrans, dem_boxes[dem], tile_boxes[tile],
+                                        border);
+      EXPECT_TRUE(BBox2(dem_boxes[dem]).contains(in_box));
+    }
+  }
+
+  // The UTM DEM spans output columns 250-350 and rows 100-200, and
+  // the geographic one roughly columns 88-264 and rows 140-362.
+  EXPECT_TRUE (has_dem(tile_dems[1*num_tiles + 2], 0));
+  EXPECT_FALSE(has_dem(tile_dems[0*num_tiles + 0], 0));
+  EXPECT_FALSE(has_dem(tile_dems[3*num_tiles + 0], 0));
+  EXPECT_TRUE (has_dem(tile_dems[1*num_tiles + 1], 1));
+  EXPECT_TRUE (has_dem(tile_dems[3*num_tiles + 0], 1));
+  EXPECT_FALSE(has_dem(tile_dems[0*num_tiles + 0], 1));
+  EXPECT_FALSE(has_dem(tile_dems[3*num_tiles + 3], 1));
+
+  // DEMs are listed in their input order
+  EXPECT_EQ(2u, tile_dems[1*num_tiles + 2].size());
+  EXPECT_EQ(0,  tile_dems[1*num_tiles + 2][0]);
+}
@@ -0,0 +1,162 @@
+// __BEGIN_LICENSE__
+//  Copyright (c) 2009-2013, United States Government as represented by the
+//  Administrator of the National Aeronautics and Space Administration. All
+//  rights reserved.
+//
+//  The NGT platform is licensed under the Apache License, Version 2.0 (the
+//  "License"); you may not use this file except in compliance with the
+//  License. You may obtain a copy of the License at
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+// __END_LICENSE__
+
+
+#include <test/Helpers.h>
+#include <vw/Math/Matrix.h>
+#include <asp/Core/DemRayCaster.h>
+
+using namespace vw;
+using namespace vw::cartography;
+
+namespace {
+  // Hills, with a square hole of no data
+  ImageView< PixelMask<float> > make_dem() {
+    int n = 200;
+    ImageView< PixelMask<float> > dem(n, n);
+    for ( int row = 0; row < n; row++ )
+      for ( int col = 0; col < n; col++ ) {
+        dem(col, row) = PixelMask<float>( 300 + 200*sin(col/25.0)*cos(row/35.0) );
+        if ( col >= 140 && col < 160 && row >= 40 && row < 60 )
+          dem(col, row).invalidate();
+      }
+    return dem;
+  }
+
+  // Flat ground with a ridge 500 meters high over columns 100 to 104
+  ImageView< PixelMask<float> > make_ridge_dem() {
+    int n = 200;
+    ImageView< PixelMask<float> > dem(n, n);
+    for ( int row = 0; row < n; row++ )
+      for ( int col = 0; col < n; col++ )
+        dem(col, row) = PixelMask<float>( col >= 100 && col <= 104 ? 500 : 0 );
+    return dem;
+  }
+
+  GeoReference make_georef() {
+    GeoReference georef;
+    georef.set_well_known_geogcs("WGS84");
+    Matrix3x3 T = math::identity_matrix<3>();
+    T(0,0) =  0.001; T(0,2) = 10.0;
+    T(1,1) = -0.001; T(1,2) = 20.2;
+    georef.set_transform(T);
+    return georef;
+  }
+}
+
+TEST( DemRayCaster, hits_dem_points ) {
+  ImageView< PixelMask<float> > dem = make_dem();
+  GeoReference georef = make_georef();
+  asp::DemRayCaster caster(dem, georef);
+
+  Vector2 range;
+  ASSERT_TRUE( caster.height_range(range) );
+  EXPECT_NEAR( range[0], 100, 1.0 );
+  EXPECT_NEAR( range[1], 500, 1.0 );
+
+  // Look at DEM pixels from high above, so none is hidden by another
+  Datum const& datum = georef.datum();
+  Vector3 ctr = datum.geodetic_to_cartesian( Vector3(10.15, 20.05, 300000) );
+  for ( int row = 5; row < dem.rows(); row += 15 ) {
+    for ( int col = 5; col < dem.cols(); col += 15 ) {
+      if ( col >= 138 && col < 162 && row >= 38 && row < 62 ) continue;
+      Vector2 lonlat = georef.pixel_to_lonlat( Vector2(col, row) );
+      Vector3 ground = datum.geodetic_to_cartesian
+        ( Vector3(lonlat[0], lonlat[1], dem(col, row).child()) );
+      Vector3 xyz;
+      ASSERT_TRUE( caster.intersect(ctr, ground - ctr, xyz) );
+      EXPECT_LT( norm_2(xyz - ground), 1e-3 );
+    }
+  }
+}
+
+TEST( DemRayCaster, misses ) {
+  ImageView< PixelMask<float> > dem = make_dem();
+  GeoReference georef = make_georef();
+  asp::DemRayCaster caster(dem, georef);
+
+  Datum const& datum = georef.datum();
+  Vector3 ctr = datum.geodetic_to_cartesian( Vector3(10.15, 20.05, 300000) );
+  Vector3 xyz;
+
+  // Into the hole, and away from the planet
+  Vector2 lonlat = georef.pixel_to_lonlat( Vector2(150, 50) );
+  Vector3 ground = datum.geodetic_to_cartesian( Vector3(lonlat[0], lonlat[1], 300) );
+  EXPECT_FALSE( caster.intersect(ctr, ground - ctr, xyz) );
+  EXPECT_FALSE( caster.intersect(ctr, ctr, xyz) );
+}
+
+TEST( DemRayCaster, ridge_occlusion ) {
+  ImageView< PixelMask<float> > dem = make_ridge_dem();
+  GeoReference georef = make_georef();
+  asp::DemRayCaster caster(dem, georef);
+  Datum const& datum = georef.datum();
+
+  // Low oblique rays toward the flat ground behind the ridge, through
+  // a point over its far edge, from a camera on the other side.
+  Vector2 lonlat = georef.pixel_to_lonlat( Vector2(150, 100) );
+  Vector3 target = datum.geodetic_to_cartesian( Vector3(lonlat[0], lonlat[1], 0) );
+  lonlat = georef.pixel_to_lonlat( Vector2(104, 100) );
+
+  // Passing 5 meters over the ridge, the ray reaches the target
+  Vector3 edge = datum.geodetic_to_cartesian( Vector3(lonlat[0], lonlat[1], 505) );
+  Vector3 ctr  = edge + 2*(edge - target);
+  Vector3 xyz;
+  ASSERT_TRUE( caster.intersect(ctr, target - ctr, xyz) );
+  EXPECT_LT( norm_2(xyz - target), 1e-3 );
+
+  // Passing 50 meters below the top, it stops on the near slope of
+  // the ridge, between columns 99 and 100.
+  edge = datum.geodetic_to_cartesian( Vector3(lonlat[0], lonlat[1], 450) );
+  ctr  = edge + 2*(edge - target);
+  ASSERT_TRUE( caster.intersect(ctr, target - ctr, xyz) );
+  EXPECT_LT( norm_2(xyz - ctr), norm_2(edge - ctr) );
+  Vector3 llh = datum.cartesian_to_geodetic( xyz );
+  Vector2 pix = georef.lonlat_to_pixel( subvector(llh, 0, 2) );
+  EXPECT_GT( pix.x(), 99 );
+  EXPECT_LT( pix.x(), 100 );
+  EXPECT_NEAR( llh[2], 500*(pix.x() - 99), 0.05 );
+}
+
+TEST( DemRayCaster, dem_edges ) {
+  ImageView< PixelMask<float> > dem = make_ridge_dem();
+  GeoReference georef = make_georef();
+  asp::DemRayCaster caster(dem, georef);
+  Datum const& datum = georef.datum();
+  Vector3 xyz;
+
+  // Within a pixel of the last column, from a camera off the DEM, so
+  // the ray enters the DEM over its edge before coming down.
+  Vector2 lonlat = georef.pixel_to_lonlat( Vector2(198.5, 100.5) );
+  Vector3 ground = datum.geodetic_to_cartesian( Vector3(lonlat[0], lonlat[1], 0) );
+  lonlat = georef.pixel_to_lonlat( Vector2(240, 100) );
+  Vector3 ctr = datum.geodetic_to_cartesian( Vector3(lonlat[0], lonlat[1], 5000) );
+  ASSERT_TRUE( caster.intersect(ctr, ground - ctr, xyz) );
+  EXPECT_LT( norm_2(xyz - ground), 1e-3 );
+
+  // Near a corner, from high above
+  ctr = datum.geodetic_to_cartesian( Vector3(10.1, 20.1, 300000) );
+  lonlat = georef.pixel_to_lonlat( Vector2(0.4, 198.6) );
+  ground = datum.geodetic_to_cartesian( Vector3(lonlat[0], lonlat[1], 0) );
+  ASSERT_TRUE( caster.intersect(ctr, ground - ctr, xyz) );
+  EXPECT_LT( norm_2(xyz - ground), 1e-3 );
+
+  // Just beyond the last column there is no terrain
+  lonlat = georef.pixel_to_lonlat( Vector2(199.5, 100) );
+  ground = datum.geodetic_to_cartesian( Vector3(lonlat[0], lonlat[1], 0) );
+  EXPECT_FALSE( caster.intersect(ctr, ground - ctr, xyz) );
+}
@@ -0,0 +1,94 @@
+// __BEGIN_LICENSE__
+//  Copyright (c) 2009-2013, United States Government as represented by the
+//  Administrator of the National Aeronautics and Space Administration. All
+//  rights reserved.
+//
+//  The NGT platform is licensed under the Apache License, Version 2.0 (the
+//  "License"); you may not use this file except in compliance with the
+//  License. You may obtain a copy of the License at
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+// __END_LICENSE__
+
+
+#include <test/Helpers.h>
+#include <vw/Image/ImageView.h>
+#include <vw/Image/BlockRasterize.h>
+#include <asp/Core/MedianFilter.h>
+
+#include <algorithm>
+#include <cstdlib>
+
+using namespace vw;
+
+// Brute force median of the valid pixels in a window
+float brute_median( ImageView<PixelMask<float> > const& img,
+                    int32 i, int32 j, int half ) {
+  std::vector<float> w;
+  for ( int32 y = j - half; y <= j + half; y++ )
+    for ( int32 x = i - half; x <= i + half; x++ )
+      if ( x >= 0 && y >= 0 && x < img.cols() && y < img.rows() &&
+           is_valid(img(x,y)) )
+        w.push_back( img(x,y).child() );
+  std::sort( w.begin(), w.end() );
+  return w[(w.size()-1)/2];
+}
+
+TEST(MedianFilter, matches_brute_force) {
+  srand(5);
+  ImageView<PixelMask<float> > img(57,43);
+  for ( int32 j = 0; j < img.rows(); j++ )
+    for ( int32 i = 0; i < img.cols(); i++ ) {
+      img(i,j) = PixelMask<float>( 100.0 * rand() / RAND_MAX - 50 );
+      if ( rand() % 6 == 0 )
+        img(i,j).invalidate();
+    }
+
+  // Rasterize in small blocks so that tile edges are exercised
+  ImageView<PixelMask<float> > filtered =
+    block_rasterize( tiled_median_filter( img, 5 ), Vector2i(16,16), 1 );
+  for ( int32 j = 0; j < img.rows(); j++ )
+    for ( int32 i = 0; i < img.cols(); i++ ) {
+      ASSERT_TRUE( is_valid(filtered(i,j)) );
+      EXPECT_EQ( brute_median(img,i,j,2), filtered(i,j).child() );
+    }
+}
+
+TEST(MedianFilter, many_distinct_values) {
+  // More distinct values than levels, crowded near zero so that many
+  // share a level, and with a different range in each tile.
+  srand(7);
+  ImageView<PixelMask<float> > img(110,90);
+  for ( int32 j = 0; j < img.rows(); j++ )
+    for ( int32 i = 0; i < img.cols(); i++ ) {
+      double u = 2.0 * rand() / RAND_MAX - 1;
+      img(i,j) = PixelMask<float>( 1000 * u * u * u + (i < 50 ? 0 : 300) );
+      if ( rand() % 9 == 0 )
+        img(i,j).invalidate();
+    }
+
+  ImageView<PixelMask<float> > filtered =
+    block_rasterize( tiled_median_filter( img, 7 ), Vector2i(80,64), 1 );
+  for ( int32 j = 0; j < img.rows(); j++ )
+    for ( int32 i = 0; i < img.cols(); i++ ) {
+      ASSERT_TRUE( is_valid(filtered(i,j)) );
+      EXPECT_EQ( brute_median(img,i,j,3), filtered(i,j).child() );
+    }
+}
+
+TEST(MedianFilter, multi_channel) {
+  ImageView<Vector2f> img(9,9);
+  for ( int32 j = 0; j < img.rows(); j++ )
+    for ( int32 i = 0; i < img.cols(); i++ )
+      img(i,j) = Vector2f( i, -j );
+  img(4,4) = Vector2f( 1000, 1000 ); // Outlier gets removed
+
+  ImageView<Vector2f> filtered = tiled_median_filter( img, 3 );
+  EXPECT_VECTOR_NEAR( Vector2f(4,-4), filtered(4,4), 1e-6 );
+  EXPECT_VECTOR_NEAR( Vector2f(2,-6), filtered(2,6), 1e-6 );
+}
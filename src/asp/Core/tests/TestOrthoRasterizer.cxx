@@ -0,0 +1,203 @@
+// __BEGIN_LICENSE__
+//  Copyright (c) 2009-2013, United States Government as represented by the
+//  Administrator of the National Aeronautics and Space Administration. All
+//  rights reserved.
+//
+//  The NGT platform is licensed under the Apache License, Version 2.0 (the
+//  "License"); you may not use this file except in compliance with the
+//  License. You may obtain a copy of the License at
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+// __END_LICENSE__
+
+
+
+#include <test/Helpers.h>
+#include <vw/Image/ImageView.h>
+#include <vw/Image/Manipulation.h>
+#include <vw/Core/ProgressCallback.h>
+#include <vw/Image/BlockRasterize.h>
+#include <asp/Core/OrthoRasterizer.h>
+#include <boost/filesystem/operations.hpp>
+
+using namespace vw;
+using namespace asp;
+
+namespace {
+  // A tilted plane with a hole in it
+  ImageView<Vector3> make_cloud(){
+    ImageView<Vector3> cloud(300, 200);
+    double nan = std::numeric_limits<double>::quiet_NaN();
+    for ( int32 row = 0; row < cloud.rows(); row++ ){
+      for ( int32 col = 0; col < cloud.cols(); col++ ){
+        if (col > 100 && col < 150 && row > 50 && row < 80)
+          cloud(col, row) = Vector3(0, 0, nan);
+        else
+          cloud(col, row) = Vector3(col, row, 0.1*col + 0.2*row);
+      }
+    }
+    return cloud;
+  }
+}
+
+TEST(OrthoRasterizer, index_round_trip) {
+  ImageView<Vector3> cloud = make_cloud();
+  ImageViewRef<Vector3> point_image = cloud;
+  ImageViewRef<double> texture = select_channel(cloud, 2);
+  ImageViewRef<double> error_image;
+  std::string index_file = "TestOrthoRasterizer-index.bin";
+  boost::filesystem::remove(index_file);
+
+  // The first pass computes and writes the index, the second reads it
+  OrthoRasterizerView computed(point_image, texture, 1.0, 0.0, false, 64, 1, 4,
+                               false, Vector2(75.0, 3.0), error_image, 0.0, 0.0,
+                               false, ProgressCallback::dummy_instance(),
+                               index_file, "cloud", "projection");
+  ASSERT_TRUE(boost::filesystem::exists(index_file));
+  OrthoRasterizerView loaded(point_image, texture, 1.0, 0.0, false, 64, 1, 4,
+                             false, Vector2(75.0, 3.0), error_image, 0.0, 0.0,
+                             false, ProgressCallback::dummy_instance(),
+                             index_file, "cloud", "projection");
+
+  EXPECT_EQ(300*200 - 49*29, computed.num_valid_points());
+  EXPECT_EQ(computed.num_valid_points(), loaded.num_valid_points());
+  EXPECT_VECTOR_EQ(computed.bounding_box().min(), loaded.bounding_box().min());
+  EXPECT_VECTOR_EQ(computed.bounding_box().max(), loaded.bounding_box().max());
+  EXPECT_EQ(computed.cols(), loaded.cols());
+  EXPECT_EQ(computed.rows(), loaded.rows());
+
+  // The rasterized DEMs must agree
+  ImageView<PixelGray<float> > dem1 = computed, dem2 = loaded;
+  ASSERT_EQ(dem1.cols(), dem2.cols());
+  ASSERT_EQ(dem1.rows(), dem2.rows());
+  for ( int32 row = 0; row < dem1.rows(); row++ )
+    for ( int32 col = 0; col < dem1.cols(); col++ )
+      EXPECT_EQ(dem1(col, row), dem2(col, row));
+
+  // Another projection of the same cloud, stood in for by shifted
+  // points, gets its own bounds, and those of the first are kept.
+  ImageView<Vector3> shifted = cloud;
+  for ( int32 row = 0; row < shifted.rows(); row++ )
+    for ( int32 col = 0; col < shifted.cols(); col++ )
+      shifted(col, row).z() += 10;
+  ImageViewRef<Vector3> shifted_image = shifted;
+  ImageViewRef<double> shifted_texture = select_channel(shifted, 2);
+  OrthoRasterizerView reprojected(shifted_image, shifted_texture, 1.0, 0.0, false, 64,
+                                  1, 4, false, Vector2(75.0, 3.0), error_image, 0.0,
+                                  0.0, false, ProgressCallback::dummy_instance(),
+                                  index_file, "cloud", "other projection");
+  EXPECT_NEAR(computed.bounding_box().min().z() + 10,
+              reprojected.bounding_box().min().z(), 1e-10);
+  OrthoRasterizerView reloaded(shifted_image, shifted_texture, 1.0, 0.0, false, 64,
+                               1, 4, false, Vector2(75.0, 3.0), error_image, 0.0,
+                               0.0, false, ProgressCallback::dummy_instance(),
+                               index_file, "cloud", "projection");
+  EXPECT_VECTOR_EQ(computed.bounding_box().min(), reloaded.bounding_box().min());
+  EXPECT_VECTOR_EQ(computed.bounding_box().max(), reloaded.bounding_box().max());
+
+  // A different cloud must not pick up the stale index
+  OrthoRasterizerView recomputed(shifted_image, shifted_texture, 1.0, 0.0, false, 64,
+                                 1, 4, false, Vector2(75.0, 3.0), error_image, 0.0,
+                                 0.0, false, ProgressCallback::dummy_instance(),
+                                 index_file, "other cloud", "projection");
+  EXPECT_NEAR(computed.bounding_box().min().z() + 10,
+              recomputed.bounding_box().min().z(), 1e-10);
+
+  // No temporary files are left behind
+  boost::filesystem::directory_iterator end;
+  for (boost::filesystem::directory_iterator it("."); it != end; ++it)
+    EXPECT_NE(0, it->path().filename().string().find(index_file + "-"));
+
+  boost::filesystem::remove(index_file);
+}
+
+TEST(OrthoRasterizer, other_spacings) {
+  ImageView<Vector3> cloud = make_cloud();
+  ImageViewRef<Vector3> point_image = cloud;
+  ImageViewRef<double> texture = select_channel(cloud, 2);
+  ImageViewRef<double> error_image;
+
+  OrthoRasterizerView fine(point_image, texture, 1.0, 0.0, false, 64, 1, 4,
+                           false, Vector2(75.0, 3.0), error_image, 0.0, 0.0,
+                           false, ProgressCallback::dummy_instance());
+  fine.set_use_minz_as_default(false);
+  fine.set_default_value(-1.0);
+
+  // A copy at another spacing gives the same DEM as a view made for
+  // that spacing from the start.
+  std::vector<double> spacings;
+  spacings.push_back(2.0);
+  spacings.push_back(5.0);
+  for (size_t k = 0; k < spacings.size(); k++){
+    OrthoRasterizerView coarse(point_image, texture, spacings[k], 0.0, false,
+                               64, 1, 4, false, Vector2(75.0, 3.0), error_image,
+                               0.0, 0.0, false, ProgressCallback::dummy_instance());
+    coarse.set_use_minz_as_default(false);
+    coarse.set_default_value(-1.0);
+    OrthoRasterizerView copy = fine;
+    copy.set_spacing(spacings[k]);
+
+    ImageView<PixelGray<float> > expected = coarse;
+    ImageView<PixelGray<float> > actual = copy;
+    ASSERT_EQ(expected.cols(), actual.cols());
+    ASSERT_EQ(expected.rows(), actual.rows());
+    Matrix3x3 t1 = coarse.geo_transform(), t2 = copy.geo_transform();
+    EXPECT_MATRIX_NEAR(t1, t2, 1e-12);
+    for ( int32 row = 0; row < expected.rows(); row++ )
+      for ( int32 col = 0; col < expected.cols(); col++ )
+        EXPECT_NEAR(expected(col, row)[0], actual(col, row)[0], 1e-4);
+  }
+
+  // Going back to the original spacing restores the original DEM
+  OrthoRasterizerView copy = fine;
+  copy.set_spacing(5.0);
+  copy.set_spacing(1.0);
+  EXPECT_EQ(fine.cols(), copy.cols());
+  EXPECT_EQ(fine.rows(), copy.rows());
+  Matrix3x3 t1 = fine.geo_transform(), t2 = copy.geo_transform();
+  EXPECT_MATRIX_NEAR(t1, t2, 1e-12);
+}
+
+TEST(OrthoRasterizer, fsaa) {
+  // Averaging supersamples of a plane, placed symmetrically around
+  // each pixel, gives back the value at the pixel.
+  ImageView<Vector3> cloud(120, 100);
+  for ( int32 row = 0; row < cloud.rows(); row++ )
+    for ( int32 col = 0; col < cloud.cols(); col++ )
+      cloud(col, row) = Vector3(col, row, 0.3*col - 0.2*row);
+  ImageViewRef<Vector3> point_image = cloud;
+  ImageViewRef<double> texture = select_channel(cloud, 2);
+  ImageViewRef<double> error_image;
+
+  OrthoRasterizerView single(point_image, texture, 2.0, 0.0, true, 64, 1, 4,
+                             false, Vector2(75.0, 3.0), error_image, 0.0, 0.0,
+                             false, ProgressCallback::dummy_instance());
+  OrthoRasterizerView multi(point_image, texture, 2.0, 0.0, true, 64, 1, 4,
+                            false, Vector2(75.0, 3.0), error_image, 0.0, 0.0,
+                            false, ProgressCallback::dummy_instance());
+  single.set_use_minz_as_default(false);
+  single.set_default_value(-100.0);
+  multi.set_use_minz_as_default(false);
+  multi.set_default_value(-100.0);
+  multi.set_fsaa(3);
+
+  ImageView<PixelGray<float> > dem1 = block_rasterize(single, Vector2i(32, 32), 1);
+  ImageView<PixelGray<float> > dem3 = block_rasterize(multi,  Vector2i(32, 32), 1);
+  ASSERT_EQ(dem1.cols(), dem3.cols());
+  ASSERT_EQ(dem1.rows(), dem3.rows());
+
+  int num_valid = 0;
+  for ( int32 row = 1; row < dem1.rows() - 1; row++ ){
+    for ( int32 col = 1; col < dem1.cols() - 1; col++ ){
+      if (dem1(col, row)[0] == -100.0) continue;
+      EXPECT_NEAR(dem1(col, row)[0], dem3(col, row)[0], 1e-4);
+      num_valid++;
+    }
+  }
+  EXPECT_GT(num_valid, 2000);
+}
@@ -0,0 +1,69 @@
+// __BEGIN_LICENSE__
+//  Copyright (c) 2009-2013, United States Government as represented by the
+//  Administrator of the National Aeronautics and Space Administration. All
+//  rights reserved.
+//
+//  The NGT platform is licensed under the Apache License, Version 2.0 (the
+//  "License"); you may not use this file except in compliance with the
+//  License. You may obtain a copy of the License at
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+// __END_LICENSE__
+
+
+#include <test/Helpers.h>
+#include <vw/Image/ImageView.h>
+#include <asp/Core/Overviews.h>
+
+using namespace vw;
+
+TEST(Overviews, pyramid_skips_nodata) {
+  double nodata = -32768;
+  ImageView<double> block(5, 3);
+  for (int c = 0; c < block.cols(); c++)
+    for (int r = 0; r < block.rows(); r++)
+      block(c, r) = c + 10*r;
+  block(1, 0) = nodata;
+  block(0, 1) = std::numeric_limits<double>::quiet_NaN();
+
+  std::vector< ImageView<double> > levels;
+  asp::nodata_aware_pyramid(block, nodata, 2, levels);
+  ASSERT_EQ(2u, levels.size());
+
+  ASSERT_EQ(3, levels[0].cols());
+  ASSERT_EQ(2, levels[0].rows());
+  EXPECT_NEAR((0 + 11)/2.0,             levels[0](0, 0), 1e-12);
+  EXPECT_NEAR((2 + 3 + 12 + 13)/4.0,    levels[0](1, 0), 1e-12);
+  EXPECT_NEAR((4 + 14)/2.0,             levels[0](2, 0), 1e-12);
+  EXPECT_NEAR((20 + 21)/2.0,            levels[0](0, 1), 1e-12);
+  EXPECT_NEAR(24.0,                     levels[0](2, 1), 1e-12);
+
+  // The coarser level averages the full-resolution pixels directly
+  ASSERT_EQ(2, levels[1].cols());
+  ASSERT_EQ(1, levels[1].rows());
+  EXPECT_NEAR((0 + 2 + 3 + 11 + 12 + 13 + 20 + 21 + 22 + 23)/10.0,
+              levels[1](0, 0), 1e-12);
+  EXPECT_NEAR((4 + 14 + 24)/3.0, levels[1](1, 0), 1e-12);
+
+  // All nodata stays nodata
+  ImageView<double> empty(4, 4);
+  fill(empty, nodata);
+  asp::nodata_aware_pyramid(empty, nodata, 2, levels);
+  EXPECT_EQ(nodata, levels[0](1, 1));
+  EXPECT_EQ(nodata, levels[1](0, 0));
+}
+
+TEST(Overviews, num_levels) {
+  // Stop when the previous level fits in a tile
+  EXPECT_EQ(0, asp::num_overview_levels(Vector2i(256, 100),   Vector2i(256, 256)));
+  EXPECT_EQ(1, asp::num_overview_levels(Vector2i(257, 100),   Vector2i(256, 256)));
+  EXPECT_EQ(3, asp::num_overview_levels(Vector2i(2048, 2048), Vector2i(256, 256)));
+  // Limited by what one block can decimate on its own
+  EXPECT_EQ(8, asp::num_overview_levels(Vector2i(100000, 10), Vector2i(256, 256)));
+  EXPECT_EQ(2, asp::num_overview_levels(Vector2i(100000, 10), Vector2i(256, 20)));
+}
@@ -0,0 +1,145 @@
+// __BEGIN_LICENSE__
+//  Copyright (c) 2009-2013, United States Government as represented by the
+//  Administrator of the National Aeronautics and Space Administration. All
+//  rights reserved.
+//
+//  The NGT platform is licensed under the Apache License, Version 2.0 (the
+//  "License"); you may not use this file except in compliance with the
+//  License. You may obtain a copy of the License at
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+// __END_LICENSE__
+
+
+
+#include <test/Helpers.h>
+#include <vw/Image/ImageView.h>
+#include <asp/Core/Point2Grid.h>
+
+using namespace vw;
+
+namespace {
+  // The straightforward algorithm, visiting the grid points column by
+  // column and checking each distance.
+  void reference_splat(ImageView<double> & buf, ImageView<double> & wts,
+                       double x0, double y0, double grid_size, double min_spacing,
+                       double radius, double x, double y, double z){
+    double spacing = std::max(grid_size, min_spacing);
+    double sigma = -log(0.25)/spacing/spacing;
+    double dx = radius/999.0;
+    for (int ix = 0; ix < buf.cols(); ix++){
+      for (int iy = 0; iy < buf.rows(); iy++){
+        double gx = x0 + ix*grid_size, gy = y0 + iy*grid_size;
+        double dist = sqrt( (x-gx)*(x-gx) + (y-gy)*(y-gy) );
+        if (dist > radius) continue;
+        double sampled = round(dist/dx)*dx;
+        double wt = exp(-sigma*sampled*sampled);
+        buf(ix, iy) += z*wt;
+        wts(ix, iy) += wt;
+      }
+    }
+  }
+}
+
+TEST(Point2Grid, matches_reference) {
+  int width = 37, height = 23;
+  double x0 = 10.0, y0 = -5.0, grid_size = 0.5, min_spacing = 0.7, radius = 1.3;
+  double nodata = -32768;
+
+  ImageView<double> buf, wts;
+  stereo::Point2Grid grid(width, height, buf, wts, x0, y0, grid_size, min_spacing,
+                          radius);
+  grid.Clear(nodata);
+
+  ImageView<double> ref_buf(width, height), ref_wts(width, height);
+  for (int r = 0; r < height; r++){
+    for (int c = 0; c < width; c++){
+      ref_buf(c, r) = 0.0;
+      ref_wts(c, r) = 0.0;
+    }
+  }
+
+  // Points inside and near the edges of the grid, leaving the upper
+  // right corner empty.
+  for (int k = 0; k < 200; k++){
+    double x = x0 - 1.0 + 0.07*(k % 50);
+    double y = y0 - 1.0 + 0.11*(k % 37);
+    double z = 3.0 + 0.01*k;
+    grid.AddPoint(x, y, z);
+    reference_splat(ref_buf, ref_wts, x0, y0, grid_size, min_spacing, radius, x, y, z);
+  }
+  grid.normalize();
+
+  for (int r = 0; r < height; r++){
+    for (int c = 0; c < width; c++){
+      EXPECT_NEAR(ref_wts(c, r), wts(c, r), 1e-12);
+      if (ref_wts(c, r) > 0)
+        EXPECT_NEAR(ref_buf(c, r)/ref_wts(c, r), buf(c, r), 1e-12);
+      else
+        EXPECT_EQ(nodata, buf(c, r));
+    }
+  }
+  EXPECT_EQ(nodata, buf(width - 1, height - 1));
+}
+
+TEST(Point2Grid, filters) {
+  // All points land within the radius of the single grid point. With
+  // five values the median is exact.
+  double vals[] = {4.0, -1.0, 7.0, 2.0, 10.0};
+  int num = sizeof(vals)/sizeof(double);
+  double mean = 0.0;
+  for (int k = 0; k < num; k++) mean += vals[k]/num;
+  double var = 0.0;
+  for (int k = 0; k < num; k++) var += (vals[k] - mean)*(vals[k] - mean)/num;
+
+  stereo::FilterType filters[] = {stereo::f_min, stereo::f_max, stereo::f_mean,
+                                  stereo::f_stddev, stereo::f_count, stereo::f_median};
+  double expected[] = {-1.0, 10.0, mean, sqrt(var), num, 4.0};
+  for (int f = 0; f < 6; f++){
+    ImageView<double> buf, wts;
+    stereo::Point2Grid grid(1, 1, buf, wts, 0.0, 0.0, 1.0, 1.0, 0.5, filters[f]);
+    grid.Clear(-9999);
+    for (int k = 0; k < num; k++)
+      grid.AddPoint(0.1*(k % 3), -0.1*(k % 2), vals[k]);
+    grid.normalize();
+    EXPECT_NEAR(expected[f], buf(0, 0), 1e-12);
+  }
+}
+
+TEST(Point2Grid, percentile_sketch) {
+  // Exact for few values
+  stereo::P2Quantile few;
+  few.add(5.0, 0.5); few.add(1.0, 0.5); few.add(3.0, 0.5);
+  EXPECT_EQ(3.0, few.value(0.5));
+
+  // Also with exactly five, when the markers are first set
+  stereo::P2Quantile five;
+  double vals[] = {9.0, 2.0, 7.0, 4.0, 1.0};
+  for (int k = 0; k < 5; k++) five.add(vals[k], 0.75);
+  EXPECT_EQ(7.0, five.value(0.75));
+  EXPECT_EQ(1.0, five.value(0.1));
+
+  // Approximate for many
+  double pcts[] = {0.25, 0.5, 0.9};
+  for (int p = 0; p < 3; p++){
+    stereo::P2Quantile sketch;
+    unsigned int seed = 1;
+    for (int k = 0; k < 10000; k++){
+      seed = seed*1103515245 + 12345;
+      sketch.add(double((seed >> 8) % 10000), pcts[p]);
+    }
+    EXPECT_NEAR(10000*pcts[p], sketch.value(pcts[p]), 200);
+  }
+
+  double pct;
+  EXPECT_EQ(stereo::f_percentile, stereo::parse_filter("75pct", pct));
+  EXPECT_EQ(75.0, pct);
+  EXPECT_EQ(stereo::f_median, stereo::parse_filter("median", pct));
+  EXPECT_THROW(stereo::parse_filter("120pct", pct), ArgumentErr);
+  EXPECT_THROW(stereo::parse_filter("mode", pct), ArgumentErr);
+}
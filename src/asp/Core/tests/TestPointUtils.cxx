@@ -0,0 +1,123 @@
+// __BEGIN_LICENSE__
+//  Copyright (c) 2009-2013, United States Government as represented by the
+//  Administrator of the National Aeronautics and Space Administration. All
+//  rights reserved.
+//
+//  The NGT platform is licensed under the Apache License, Version 2.0 (the
+//  "License"); you may not use this file except in compliance with the
+//  License. You may obtain a copy of the License at
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+// __END_LICENSE__
+
+
+
+#include <test/Helpers.h>
+#include <vw/Image/ImageView.h>
+#include <vw/Cartography/GeoReference.h>
+#include <vw/Cartography/PointImageManipulation.h>
+#include <asp/Core/PointUtils.h>
+
+using namespace vw;
+using namespace vw::cartography;
+using namespace asp;
+
+namespace {
+
+  // Points on and above the datum around given lon-lat, with a few
+  // invalid ones.
+  ImageView<Vector3> make_points(GeoReference const& georef, Vector2 const& lonlat){
+    ImageView<Vector3> points(20, 15);
+    for ( int32 row = 0; row < points.rows(); row++ ){
+      for ( int32 col = 0; col < points.cols(); col++ ){
+        Vector3 llh(lonlat[0] + 0.1*col, lonlat[1] + 0.1*row, 100.0*(col - row));
+        points(col, row) = georef.datum().geodetic_to_cartesian(llh);
+      }
+    }
+    points(3, 4) = Vector3();
+    points(10, 7) = Vector3();
+    return points;
+  }
+
+  void check_projection(GeoReference const& georef, Vector2 const& lonlat,
+                        double center_lon, Vector3 const& offset, double tol){
+    ImageView<Vector3> points = make_points(georef, lonlat);
+
+    // The lazy views the batch projection replaces
+    ImageView<Vector3> expected;
+    if (offset != Vector3())
+      expected = geodetic_to_point
+        (point_image_offset(recenter_longitude(cartesian_to_geodetic(points, georef),
+                                               center_lon), offset), georef);
+    else
+      expected = geodetic_to_point
+        (recenter_longitude(cartesian_to_geodetic(points, georef), center_lon), georef);
+
+    ImageView<Vector3> actual = project_points(points, georef, center_lon, offset);
+
+    // Single points, as with pixel access
+    BatchPointProjector projector(georef, center_lon, offset);
+
+    for ( int32 row = 0; row < points.rows(); row++ ){
+      for ( int32 col = 0; col < points.cols(); col++ ){
+        Vector3 single = projector.project(points(col, row));
+        if (boost::math::isnan(expected(col, row).z())){
+          EXPECT_TRUE(boost::math::isnan(actual(col, row).z()));
+          EXPECT_TRUE(boost::math::isnan(single.z()));
+          continue;
+        }
+        EXPECT_VECTOR_NEAR(expected(col, row), actual(col, row), tol);
+        EXPECT_VECTOR_NEAR(expected(col, row), single, tol);
+      }
+    }
+  }
+}
+
+TEST(PointUtils, batch_projection_geographic) {
+  GeoReference georef;
+  georef.set_well_known_geogcs("WGS84");
+  EXPECT_EQ(BatchPointProjector::GEOGRAPHIC,
+            BatchPointProjector(georef, 0, Vector3()).kernel());
+  check_projection(georef, Vector2(-122.5, 37.2), 0, Vector3(), 1e-9);
+  check_projection(georef, Vector2(-179.5, -10.0), 180, Vector3(), 1e-9);
+  check_projection(georef, Vector2(10.0, 45.0), 0, Vector3(0.5, -0.25, 20), 1e-9);
+}
+
+TEST(PointUtils, batch_projection_utm) {
+  GeoReference georef;
+  georef.set_well_known_geogcs("WGS84");
+  georef.set_UTM(10);
+  EXPECT_EQ(BatchPointProjector::TRANSVERSE_MERCATOR,
+            BatchPointProjector(georef, 0, Vector3()).kernel());
+  check_projection(georef, Vector2(-124.0, 37.2), 0, Vector3(), 1e-3);
+
+  georef.set_UTM(33, false);
+  check_projection(georef, Vector2(14.0, -33.0), 0, Vector3(), 1e-3);
+}
+
+TEST(PointUtils, batch_projection_polar_stereographic) {
+  GeoReference georef;
+  georef.set_well_known_geogcs("WGS84");
+  georef.set_stereographic(90, -45, 1);
+  EXPECT_EQ(BatchPointProjector::POLAR_STEREOGRAPHIC,
+            BatchPointProjector(georef, 0, Vector3()).kernel());
+  check_projection(georef, Vector2(-50.0, 70.0), 0, Vector3(), 1e-3);
+
+  georef.set_stereographic(-90, 0, 0.97);
+  check_projection(georef, Vector2(160.0, -78.0), 0, Vector3(), 1e-3);
+}
+
+TEST(PointUtils, batch_projection_fallback) {
+  // Oblique stereographic has no closed-form kernel
+  GeoReference georef;
+  georef.set_well_known_geogcs("WGS84");
+  georef.set_stereographic(40, 10, 1);
+  EXPECT_EQ(BatchPointProjector::GENERIC,
+            BatchPointProjector(georef, 0, Vector3()).kernel());
+  check_projection(georef, Vector2(10.0, 40.0), 0, Vector3(), 1e-6);
+}
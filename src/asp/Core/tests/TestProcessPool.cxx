@@ -0,0 +1,141 @@
+// __BEGIN_LICENSE__
+//  Copyright (c) 2009-2013, United States Government as represented by the
+//  Administrator of the National Aeronautics and Space Administration. All
+//  rights reserved.
+//
+//  The NGT platform is licensed under the Apache License, Version 2.0 (the
+//  "License"); you may not use this file except in compliance with the
+//  License. You may obtain a copy of the License at
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+// __END_LICENSE__
+
+
+
+#include <test/Helpers.h>
+#include <vw/Image/ImageView.h>
+#include <vw/Image/PerPixelViews.h>
+#include <vw/Camera/CameraModel.h>
+#include <vw/FileIO/DiskImageView.h>
+#include <vw/FileIO/DiskImageResourceGDAL.h>
+#include <asp/Core/ProcessPool.h>
+
+#include <boost/bind.hpp>
+
+#include <unistd.h>
+
+using namespace vw;
+
+// A camera which only the process that made it may use. After a fork
+// a copy made by another process is state shared with it, as are
+// inherited ISIS cameras and open files.
+class ProcessLocalCamera : public camera::CameraModel {
+  pid_t m_pid;
+  mutable int64 m_num_projections;
+public:
+  ProcessLocalCamera() : m_pid(getpid()), m_num_projections(0) {}
+  virtual std::string type() const { return "ProcessLocal"; }
+  virtual Vector2 point_to_pixel( Vector3 const& point ) const {
+    if ( getpid() != m_pid )
+      vw_throw( LogicErr() << "ProcessLocalCamera was used by another process.\n" );
+    m_num_projections++;
+    return Vector2( point[0] + 2*point[1], point[1] - point[2] );
+  }
+  virtual Vector3 pixel_to_vector( Vector2 const& /*pix*/ ) const { return Vector3(0,0,1); }
+  virtual Vector3 camera_center( Vector2 const& /*pix*/ ) const { return Vector3(); }
+  asp::ViewCounters counters() const {
+    return asp::ViewCounters( m_num_projections, 1, 0, 0 );
+  }
+};
+
+// Project a point built from the pixel location through the camera
+struct ProjectFunc : public ReturnFixedType<Vector2f> {
+  camera::CameraModel const* m_cam;
+  ProjectFunc( camera::CameraModel const* cam ) : m_cam(cam) {}
+  Vector2f operator()( Vector2i const& pix ) const {
+    return m_cam->point_to_pixel( Vector3( pix[0], pix[1], 3 ) );
+  }
+};
+
+// Projects the pixels through a camera. If no camera is given, a new
+// one is made each time, as a worker of the process pool should.
+struct ProjectedFactory {
+  typedef asp::OwnedView<Vector2f> result_type;
+  ImageView<Vector2i> m_pixels;
+  boost::shared_ptr<ProcessLocalCamera> m_shared_cam;
+  result_type operator()() const {
+    boost::shared_ptr<ProcessLocalCamera> cam = m_shared_cam;
+    if ( !cam )
+      cam.reset( new ProcessLocalCamera );
+    result_type result;
+    result.view  = per_pixel_filter( m_pixels, ProjectFunc(cam.get()) );
+    result.owner = cam;
+    result.counters = boost::bind( &ProcessLocalCamera::counters, cam.get() );
+    return result;
+  }
+};
+
+ImageView<Vector2i> pixel_locations( int cols, int rows ) {
+  ImageView<Vector2i> pixels(cols, rows);
+  for ( int32 j = 0; j < pixels.rows(); j++ )
+    for ( int32 i = 0; i < pixels.cols(); i++ )
+      pixels(i,j) = Vector2i(i,j);
+  return pixels;
+}
+
+TEST(ProcessPool, workers_make_own_cameras) {
+  ProjectedFactory factory;
+  factory.m_pixels = pixel_locations(300, 200);
+
+  UnlinkName file("ProcessPool.tif");
+  asp::ViewCounters counters;
+  {
+    DiskImageResourceGDAL rsrc( file, factory().view.format(), Vector2i(64,64) );
+    EXPECT_NO_THROW( asp::process_write_image( rsrc, factory, 4,
+                                               ProgressCallback::dummy_instance(),
+                                               &counters ) );
+  }
+
+  // Each pixel is projected once, and the camera of each worker that
+  // took a tile sends its fixed counter only with its first one.
+  EXPECT_EQ( 300*200, counters[0] );
+  EXPECT_GE( counters[1], 1 );
+  EXPECT_LE( counters[1], 4 );
+  EXPECT_EQ( 0, counters[2] );
+
+  DiskImageView<Vector2f> result( file );
+  ASSERT_EQ( 300, result.cols() );
+  ASSERT_EQ( 200, result.rows() );
+  for ( int32 j = 0; j < result.rows(); j++ )
+    for ( int32 i = 0; i < result.cols(); i++ )
+      EXPECT_VECTOR_NEAR( Vector2f( i + 2*j, j - 3 ), result(i,j), 1e-6 );
+}
+
+TEST(ProcessPool, shared_camera_is_detected) {
+  // A camera made before the fork is what the pool must avoid, and
+  // must make the workers fail.
+  ProjectedFactory factory;
+  factory.m_pixels = pixel_locations(300, 200);
+  factory.m_shared_cam.reset( new ProcessLocalCamera );
+
+  UnlinkName file("ProcessPoolShared.tif");
+  DiskImageResourceGDAL rsrc( file, factory().view.format(), Vector2i(64,64) );
+  EXPECT_THROW( asp::process_write_image( rsrc, factory, 4 ), ArgumentErr );
+}
+
+TEST(ProcessPool, worker_error) {
+  asp::TileProcessPool pool( 3, 16 );
+  struct Fail {
+    static void work( int job, char* /*buffer*/ ) {
+      if ( job == 7 )
+        vw_throw( ArgumentErr() << "Job 7 failed.\n" );
+    }
+    static void collect( int /*job*/, const char* /*buffer*/ ) {}
+  };
+  EXPECT_THROW( pool.run( 20, &Fail::work, &Fail::collect ), ArgumentErr );
+}
@@ -0,0 +1,103 @@
+// __BEGIN_LICENSE__
+//  Copyright (c) 2009-2013, United States Government as represented by the
+//  Administrator of the National Aeronautics and Space Administration. All
+//  rights reserved.
+//
+//  The NGT platform is licensed under the Apache License, Version 2.0 (the
+//  "License"); you may not use this file except in compliance with the
+//  License. You may obtain a copy of the License at
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+// __END_LICENSE__
+
+
+#include <test/Helpers.h>
+#include <asp/Core/SampleLattice.h>
+
+using namespace vw;
+
+namespace {
+  // A jump of 10 across a slanted line, and no values in a corner
+  bool step_field( int i, int j, Vector4 & value ) {
+    if ( i >= 61 && j >= 20 ) return false;
+    double v = ( i + 0.4*j > 37.3 ) ? 10.0 : 0.0;
+    value = Vector4( v, -v, 1, 2 );
+    return true;
+  }
+
+  // Curved just enough along i that the cells are split once
+  bool smooth_field( int i, int j, Vector4 & value ) {
+    value = Vector4( 0.008*i*i, 0.001*j*j, 0.003*i*j, 5 );
+    return true;
+  }
+
+  // A narrow bump at the middle of the edge between the two cells of
+  // a 33 x 17 lattice with a step of 16, too far from the center of
+  // the left cell to be seen there, and a jump in the right cell.
+  bool edge_bump_field( int i, int j, Vector4 & value ) {
+    double v = 3*exp( -0.5*((i - 16)*(i - 16) + (j - 8)*(j - 8)) );
+    if ( i > 27 ) v += 10;
+    value = Vector4( v, 0, 0, 0 );
+    return true;
+  }
+
+  // Check the lattice against the field at samples from column
+  // min_col on.
+  void check_lattice( asp::SampleLattice::FuncT const& func,
+                      asp::SampleLattice const& lattice, double tol,
+                      int min_col = 0 ) {
+    for ( int j = 0; j < lattice.rows(); j++ )
+      for ( int i = min_col; i < lattice.cols(); i++ ) {
+        Vector4 exact;
+        bool valid = func( i, j, exact );
+        ASSERT_EQ( valid, lattice.is_valid(i, j) ) << i << " " << j;
+        if ( valid )
+          EXPECT_LE( norm_inf( exact - lattice(i, j) ), tol ) << i << " " << j;
+      }
+  }
+}
+
+TEST( SampleLattice, step_field ) {
+  // Cells spanning the jump get split down to single samples, so all
+  // values are exact, including on the edges shared with the cells
+  // that were interpolated.
+  asp::SampleLattice::FuncT func = &step_field;
+  asp::SampleLattice lattice( func, 91, 43, 8, 0.5 );
+  check_lattice( func, lattice, 1e-12 );
+  EXPECT_LT( lattice.num_evaluations(), 91*43 );
+}
+
+TEST( SampleLattice, smooth_field ) {
+  asp::SampleLattice::FuncT func = &smooth_field;
+  double tol = 0.5;
+  asp::SampleLattice lattice( func, 100, 70, 16, tol );
+  check_lattice( func, lattice, tol );
+  EXPECT_LT( lattice.num_evaluations(), 100*70/4 );
+  for ( int j = 0; j < lattice.rows(); j += 16 )
+    for ( int i = 0; i < lattice.cols(); i += 16 )
+      EXPECT_TRUE( lattice.is_exact(i, j) );
+}
+
+TEST( SampleLattice, shared_edges ) {
+  // The left cell agrees at its center and is interpolated, bump
+  // and all. The right cell is split, and the middle of the shared
+  // edge becomes a corner, so it must be found exactly rather than
+  // taken from the left cell, and then the bump is refined.
+  asp::SampleLattice::FuncT func = &edge_bump_field;
+  asp::SampleLattice lattice( func, 33, 17, 16, 0.5 );
+  EXPECT_TRUE( lattice.is_exact(16, 8) );
+  EXPECT_NEAR( 3.0, lattice(16, 8)[0], 1e-12 );
+  check_lattice( func, lattice, 0.5, 16 );
+}
+
+TEST( SampleLattice, every_sample ) {
+  asp::SampleLattice::FuncT func = &step_field;
+  asp::SampleLattice lattice( func, 20, 30, 1, 0.5 );
+  EXPECT_EQ( 20*30, lattice.num_evaluations() );
+  check_lattice( func, lattice, 0.0 );
+}
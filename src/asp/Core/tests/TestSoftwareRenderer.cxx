@@ -22,6 +22,7 @@
 #include <asp/Core/SoftwareRenderer.h>
 
 #include <vector>
+#include <limits>
 
 #include <boost/assign/list_of.hpp>
 #include <boost/assign/std/vector.hpp>
@@ -185,3 +186,60 @@ TEST_F( SoftwareRenderTest, ExtremelyLargeTriangle ) {
     }
   }
 }
+
+TEST_F( SoftwareRenderTest, DrawGrid ) {
+  // A perturbed 6 x 5 grid of points, with one of them missing
+  const int cols = 6, rows = 5;
+  std::vector<double> points(3*cols*rows);
+  std::vector<float> values(cols*rows);
+  for ( int row = 0; row < rows; row++ ) {
+    for ( int col = 0; col < cols; col++ ) {
+      int i = row*cols + col;
+      points[3*i  ] = 0.1 + 0.15*col + 0.013*((3*col + 5*row) % 7);
+      points[3*i+1] = 0.9 - 0.18*row + 0.011*((4*col + 3*row) % 5);
+      points[3*i+2] = 1.0;
+      values[i]     = 2.0 + col - 0.5*row;
+    }
+  }
+  points[3*(2*cols + 3) + 2] = std::numeric_limits<double>::quiet_NaN();
+
+  // Draw the same triangles one at a time
+  vertices.resize(10);
+  color.resize(5);
+  renderer.SetVertexPointer( 2, &vertices[0] );
+  renderer.SetColorPointer( 1, &color[0] );
+  renderer.Clear(-1.0);
+  for ( int row = 0; row < rows-1; row++ ) {
+    for ( int col = 0; col < cols-1; col++ ) {
+      int ul = row*cols + col, ur = ul + 1, ll = ul + cols, lr = ll + 1;
+      int quad[5] = { ul, ll, lr, ur, ul };
+      for ( int k = 0; k < 5; k++ ) {
+        vertices[2*k  ] = points[3*quad[k]  ];
+        vertices[2*k+1] = points[3*quad[k]+1];
+        color[k]        = values[quad[k]];
+      }
+      bool missing[4] = { points[3*ul+2] != points[3*ul+2], points[3*ll+2] != points[3*ll+2],
+                          points[3*lr+2] != points[3*lr+2], points[3*ur+2] != points[3*ur+2] };
+      if ( missing[0] || missing[2] ) continue;
+      if ( !missing[1] ) renderer.DrawPolygon(0,3);
+      if ( !missing[3] ) renderer.DrawPolygon(2,3);
+    }
+  }
+  ImageView<float> ground_truth = copy(render_buffer);
+
+  renderer.Clear(-1.0);
+  renderer.DrawGrid( cols, rows, 3, &points[0], &values[0] );
+
+  int num_drawn = 0;
+  for ( int row = 0; row < render_buffer.rows(); row++ ) {
+    for ( int col = 0; col < render_buffer.cols(); col++ ) {
+      EXPECT_NEAR( ground_truth(col,row), render_buffer(col,row), 1e-4 ) << col << "," << row;
+      num_drawn += ( render_buffer(col,row) != -1.0 );
+    }
+  }
+  EXPECT_GT( num_drawn, 5000 );
+
+  // The pixel at the missing point is not drawn
+  EXPECT_EQ( -1.0, render_buffer( int(128*points[3*(2*cols+3)]),
+                                  int(128*points[3*(2*cols+3)+1]) ) );
+}
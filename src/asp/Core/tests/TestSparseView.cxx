@@ -0,0 +1,119 @@
+// __BEGIN_LICENSE__
+//  Copyright (c) 2009-2013, United States Government as represented by the
+//  Administrator of the National Aeronautics and Space Administration. All
+//  rights reserved.
+//
+//  The NGT platform is licensed under the Apache License, Version 2.0 (the
+//  "License"); you may not use this file except in compliance with the
+//  License. You may obtain a copy of the License at
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+// __END_LICENSE__
+
+
+#include <test/Helpers.h>
+#include <vw/Image/ImageView.h>
+#include <vw/Image/Manipulation.h>
+#include <vw/Image/MaskViews.h>
+#include <asp/Core/SparseView.h>
+#include <asp/Core/InpaintView.h>
+
+using namespace vw;
+using namespace asp;
+
+typedef PixelMask<float> PixelT;
+
+TEST(SparseView, compact_matches_map) {
+  // Wide enough to span several tiles so runs get split
+  ImageView<PixelT> under(200,100);
+  for ( int32 j = 0; j < under.rows(); j++ )
+    for ( int32 i = 0; i < under.cols(); i++ )
+      under(i,j) = PixelT(i + 1000*j);
+
+  // A patch straddling the tile boundary at column 64, with a hole in it
+  ImageView<PixelT> patch(20,3);
+  for ( int32 j = 0; j < patch.rows(); j++ )
+    for ( int32 i = 0; i < patch.cols(); i++ )
+      patch(i,j) = PixelT(-1 - i - 100*j);
+  patch(5,1).invalidate();
+
+  SparseCompositeView<ImageView<PixelT> > sparse( under );
+  sparse.absorb( Vector2i(55,10), patch );
+  ImageView<PixelT> before = sparse;
+  EXPECT_FALSE( sparse.is_compact() );
+
+  sparse.compact();
+  EXPECT_TRUE( sparse.is_compact() );
+  for ( int32 j = 0; j < under.rows(); j++ )
+    for ( int32 i = 0; i < under.cols(); i++ )
+      EXPECT_EQ( before(i,j).child(), sparse(i,j).child() );
+
+  EXPECT_EQ( -1,    sparse(55,10).child() );
+  EXPECT_EQ( -111,  sparse(65,11).child() );
+  EXPECT_EQ( 11060, sparse(60,11).child() ); // The hole reads through
+  EXPECT_EQ( 75,    sparse(75,0).child()  ); // Untouched tile
+
+  // Bulk rasterization of a region crossing the patch
+  ImageView<PixelT> region = crop( sparse, BBox2i(50,8,30,6) );
+  for ( int32 j = 0; j < region.rows(); j++ )
+    for ( int32 i = 0; i < region.cols(); i++ )
+      EXPECT_EQ( before(50+i,8+j).child(), region(i,j).child() );
+}
+
+TEST(SparseView, inpaint_tiles) {
+  ImageView<PixelT> image(300,200);
+  for ( int32 j = 0; j < image.rows(); j++ )
+    for ( int32 i = 0; i < image.cols(); i++ )
+      image(i,j) = PixelT(i + 1000*j);
+
+  // Holes inside the image, one crossing the boundary of the tiles
+  // below, and one on the edge, which is left alone.
+  BBox2i holes[] = { BBox2i(10,10,4,3), BBox2i(60,60,10,5), BBox2i(200,150,3,3),
+                     BBox2i(0,100,3,3) };
+  for ( int h = 0; h < 4; h++ )
+    for ( int32 j = holes[h].min().y(); j < holes[h].max().y(); j++ )
+      for ( int32 i = holes[h].min().x(); i < holes[h].max().x(); i++ )
+        image(i,j).invalidate();
+
+  BlobIndexThreaded bindex( invert_mask( image ), 1000, 64, 1 );
+  EXPECT_EQ( 4u, bindex.num_blobs() );
+  PixelT fill_val(-5);
+  InpaintView<ImageView<PixelT> > inpainted( image, bindex, false, fill_val );
+
+  // Rasterize tile by tile, both in bulk and pixel by pixel through
+  // the prerasterized view.
+  ImageView<PixelT> bulk(image.cols(), image.rows());
+  for ( int32 y = 0; y < image.rows(); y += 64 ) {
+    for ( int32 x = 0; x < image.cols(); x += 64 ) {
+      BBox2i tile(x, y, 64, 64);
+      tile.crop( bounding_box(image) );
+      inpainted.rasterize( crop(bulk, tile), tile );
+
+      InpaintView<ImageView<PixelT> >::prerasterize_type pre = inpainted.prerasterize( tile );
+      for ( int32 j = tile.min().y(); j < tile.max().y(); j++ )
+        for ( int32 i = tile.min().x(); i < tile.max().x(); i++ ) {
+          EXPECT_EQ( is_valid(bulk(i,j)), is_valid(pre(i,j)) );
+          EXPECT_EQ( bulk(i,j).child(), pre(i,j).child() );
+        }
+    }
+  }
+
+  for ( int32 j = 0; j < image.rows(); j++ )
+    for ( int32 i = 0; i < image.cols(); i++ ) {
+      bool in_edge_hole = holes[3].contains( Vector2i(i,j) );
+      if ( is_valid(image(i,j)) ) {
+        EXPECT_TRUE( is_valid(bulk(i,j)) );
+        EXPECT_EQ( image(i,j).child(), bulk(i,j).child() );
+      } else if ( in_edge_hole ) {
+        EXPECT_FALSE( is_valid(bulk(i,j)) );
+      } else {
+        EXPECT_TRUE( is_valid(bulk(i,j)) );
+        EXPECT_EQ( fill_val.child(), bulk(i,j).child() );
+      }
+    }
+}
@@ -0,0 +1,149 @@
+// __BEGIN_LICENSE__
+//  Copyright (c) 2009-2013, United States Government as represented by the
+//  Administrator of the National Aeronautics and Space Administration. All
+//  rights reserved.
+//
+//  The NGT platform is licensed under the Apache License, Version 2.0 (the
+//  "License"); you may not use this file except in compliance with the
+//  License. You may obtain a copy of the License at
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+// __END_LICENSE__
+
+
+#include <test/Helpers.h>
+#include <asp/Core/TransformGrid.h>
+
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
+
+using namespace vw;
+
+namespace {
+  // Smooth, with some curvature
+  Vector2 smooth_func( Vector2 const& p ) {
+    return Vector2( 1000 + 1.3*p.x() + 0.0005*p.x()*p.y() + 2*sin(p.y()/80.0),
+                    500  + 0.9*p.y() + 0.0003*p.x()*p.x() );
+  }
+
+  // Like the above, but with a region mapping to an invalid value
+  Vector2 clipped_func( Vector2 const& p ) {
+    if ( p.x() > 600 ) return Vector2(-1, -1);
+    return smooth_func(p);
+  }
+
+  // Gives the right values only near the box last passed to cache(),
+  // like Map2CamTrans, so a copy shared by the threads would give
+  // wrong values.
+  struct CachingTransform : public TransformBase<CachingTransform> {
+    mutable BBox2i m_cache_box;
+    void cache( BBox2i const& bbox ) const {
+      m_cache_box = bbox;
+      m_cache_box.expand(2);
+    }
+    Vector2 reverse( Vector2 const& p ) const {
+      if ( !m_cache_box.contains( Vector2i( (int)floor(p.x()), (int)floor(p.y()) ) ) )
+        return Vector2(-1, -1);
+      return smooth_func(p);
+    }
+    BBox2i reverse_bbox( BBox2i const& bbox ) const {
+      cache(bbox);
+      return TransformBase<CachingTransform>::reverse_bbox(bbox);
+    }
+  };
+
+  void cache_tile( CachingTransform const& tx, BBox2i const& bbox ) {
+    tx.cache(bbox);
+  }
+
+  // Go over every num_threads-th tile, as TransformView would, and
+  // record the largest error, and whether all values were within the
+  // input boxes.
+  void project_tiles( asp::ApproxTransform<CachingTransform> const& approx,
+                      std::vector<BBox2i> const& tiles, int thread, int num_threads,
+                      double & max_err, bool & in_boxes ) {
+    for ( size_t i = thread; i < tiles.size(); i += num_threads ) {
+      BBox2i in_box = approx.reverse_bbox( tiles[i] );
+      for ( int row = tiles[i].min().y(); row < tiles[i].max().y(); row++ )
+        for ( int col = tiles[i].min().x(); col < tiles[i].max().x(); col++ ) {
+          Vector2 val = approx.reverse( Vector2(col, row) );
+          max_err = std::max( max_err, norm_2( val - smooth_func( Vector2(col, row) ) ) );
+          in_boxes = in_boxes && in_box.contains(val);
+        }
+    }
+  }
+}
+
+TEST( TransformGrid, smooth ) {
+  BBox2i box( 512, 256, 256, 256 );
+  double tol = 0.05;
+  asp::TransformGrid grid( &smooth_func, box, BBox2(0, 0, 5000, 5000), tol, 32 );
+
+  double max_err = 0;
+  for ( int row = box.min().y(); row < box.max().y(); row++ )
+    for ( int col = box.min().x(); col < box.max().x(); col++ )
+      max_err = std::max( max_err, norm_2( grid( Vector2i(col, row) )
+                                           - smooth_func( Vector2(col, row) ) ) );
+  EXPECT_LT( max_err, tol );
+  EXPECT_LE( grid.max_error(), tol );
+  EXPECT_LT( grid.num_evals(), box.width()*box.height()/20 );
+}
+
+TEST( TransformGrid, invalid_region ) {
+  BBox2i box( 512, 256, 256, 256 );
+  double tol = 0.05;
+  asp::TransformGrid grid( &clipped_func, box, BBox2(0, 0, 5000, 5000), tol, 32 );
+
+  // Invalid values are kept as they are, and never mixed with valid ones
+  double max_err = 0;
+  for ( int row = box.min().y(); row < box.max().y(); row++ )
+    for ( int col = box.min().x(); col < box.max().x(); col++ ) {
+      Vector2 val = grid( Vector2i(col, row) );
+      if ( col > 600 )
+        EXPECT_VECTOR_NEAR( Vector2(-1, -1), val, 0.0 );
+      else
+        max_err = std::max( max_err, norm_2( val - smooth_func( Vector2(col, row) ) ) );
+    }
+  EXPECT_LT( max_err, tol );
+  EXPECT_LT( grid.num_evals(), box.width()*box.height()/5 );
+}
+
+TEST( TransformGrid, threaded_tiles ) {
+  CachingTransform tx;
+  double tol = 0.05;
+  asp::ApproxTransform<CachingTransform> approx( tx, BBox2(0, 0, 5000, 5000), tol,
+                                                 32, &cache_tile );
+
+  std::vector<BBox2i> tiles;
+  int size = 512, tile_size = 64;
+  for ( int row = 0; row < size; row += tile_size )
+    for ( int col = 0; col < size; col += tile_size )
+      tiles.push_back( BBox2i( col, row, tile_size, tile_size ) );
+
+  const int num_threads = 8;
+  std::vector<double> max_err( num_threads, 0 );
+  boost::thread_group threads;
+  bool in_box_flags[num_threads];
+  for ( int t = 0; t < num_threads; t++ ) {
+    in_box_flags[t] = true;
+    threads.create_thread( boost::bind( &project_tiles, boost::cref(approx), boost::cref(tiles),
+                                        t, num_threads, boost::ref(max_err[t]),
+                                        boost::ref(in_box_flags[t]) ) );
+  }
+  threads.join_all();
+
+  for ( int t = 0; t < num_threads; t++ ) {
+    EXPECT_LT( max_err[t], tol );
+    EXPECT_TRUE( in_box_flags[t] );
+  }
+
+  asp::TransformGridStats stats = approx.stats();
+  EXPECT_EQ( double(size*size), stats.num_pixels );
+  EXPECT_LE( stats.max_error, tol );
+  EXPECT_LT( stats.num_evals, stats.num_pixels/5 );
+}
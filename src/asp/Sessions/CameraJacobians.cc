@@ -0,0 +1,115 @@
+// __BEGIN_LICENSE__
+//  Copyright (c) 2009-2013, United States Government as represented by the
+//  Administrator of the National Aeronautics and Space Administration. All
+//  rights reserved.
+//
+//  The NGT platform is licensed under the Apache License, Version 2.0 (the
+//  "License"); you may not use this file except in compliance with the
+//  License. You may obtain a copy of the License at
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+// __END_LICENSE__
+
+
+#include <vw/Math/LinearAlgebra.h>
+#include <vw/Camera/CameraModel.h>
+#include <vw/Cartography/Datum.h>
+#include <asp/Sessions/CameraJacobians.h>
+#include <asp/Sessions/RPC/RPCModel.h>
+
+using namespace vw;
+
+namespace asp {
+
+  Matrix<double, 2, 3> rpc_point_to_pixel_jacobian(RPCModel const& rpc,
+                                                   Vector3 const& xyz){
+    cartography::Datum const& datum = rpc.datum();
+    Vector3 llh = datum.cartesian_to_geodetic(xyz);
+
+    // Steps in degrees and meters
+    Vector3 step(1e-6, 1e-6, 1.0);
+    Matrix3x3 dxyz_dllh;
+    for (int k = 0; k < 3; k++){
+      Vector3 delta;
+      delta[k] = step[k];
+      select_col(dxyz_dllh, k) = (datum.geodetic_to_cartesian(llh + delta) -
+                                  datum.geodetic_to_cartesian(llh - delta))/(2*step[k]);
+    }
+    return rpc.geodetic_to_pixel_Jacobian(llh)*inverse(dxyz_dllh);
+  }
+
+  // Finding the pixel of a point takes an iterative solve, but the
+  // ray through a given pixel, from pixel_to_vector() and
+  // camera_center(), is a direct evaluation of the position and pose
+  // interpolants. The pixel pix of the point xyz makes the residual
+  //   F(pix, xyz) = pixel_to_vector(pix) - normalize(xyz - camera_center(pix))
+  // vanish, as in LinescanDGModel::LinescanCorrLMA, so its derivatives
+  // are -(A^T A)^{-1} A^T B, where A and B are those of F with respect
+  // to pix and xyz. A is found with central differences in the pixel.
+  Matrix<double, 2, 3>
+  linescan_point_to_pixel_jacobian(camera::CameraModel const& camera,
+                                   Vector3 const& xyz, Vector2 const& pix){
+    Vector3 ctr  = camera.camera_center(pix);
+    double  dist = norm_2(xyz - ctr);
+    Vector3 dir  = (xyz - ctr)/dist;
+
+    // The derivative of -normalize(xyz - ctr) with respect to ctr,
+    // which is minus that with respect to xyz.
+    Matrix3x3 P = (math::identity_matrix<3>() - outer_prod(dir, dir))/dist;
+
+    Matrix<double, 3, 2> A;
+    double step = 0.5; // pixels
+    for (int k = 0; k < 2; k++){
+      Vector2 delta;
+      delta[k] = step;
+      select_col(A, k) =
+        (camera.pixel_to_vector(pix + delta) - camera.pixel_to_vector(pix - delta) +
+         P*(camera.camera_center(pix + delta) - camera.camera_center(pix - delta)))/(2*step);
+    }
+
+    Matrix2x2 AtA = transpose(A)*A;
+    double det = AtA(0, 0)*AtA(1, 1) - AtA(0, 1)*AtA(1, 0);
+    if (det == 0)
+      vw_throw( camera::PixelToRayErr() << "Degenerate linescan camera derivatives.\n" );
+    Matrix2x2 AtA_inv;
+    AtA_inv(0, 0) =  AtA(1, 1)/det; AtA_inv(0, 1) = -AtA(0, 1)/det;
+    AtA_inv(1, 0) = -AtA(1, 0)/det; AtA_inv(1, 1) =  AtA(0, 0)/det;
+
+    return AtA_inv*transpose(A)*P;
+  }
+
+  Matrix<double, 2, 3>
+  numeric_point_to_pixel_jacobian(camera::CameraModel const& camera,
+                                  Vector3 const& xyz){
+    // As ceres does, relative to the size of the coordinates
+    double step = std::max(1e-6*norm_2(xyz), 1e-6);
+    Matrix<double, 2, 3> J;
+    for (int k = 0; k < 3; k++){
+      Vector3 delta;
+      delta[k] = step;
+      select_col(J, k) = (camera.point_to_pixel(xyz + delta) -
+                          camera.point_to_pixel(xyz - delta))/(2*step);
+    }
+    return J;
+  }
+
+  Matrix<double, 2, 3>
+  point_to_pixel_jacobian(camera::CameraModel const& camera,
+                          Vector3 const& xyz, Vector2 const& pix){
+
+    RPCModel const* rpc = dynamic_cast<RPCModel const*>(&camera);
+    if (rpc != NULL)
+      return rpc_point_to_pixel_jacobian(*rpc, xyz);
+
+    if (camera.type() == "LinescanDG")
+      return linescan_point_to_pixel_jacobian(camera, xyz, pix);
+
+    return numeric_point_to_pixel_jacobian(camera, xyz);
+  }
+
+} // namespace asp
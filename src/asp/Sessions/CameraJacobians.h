@@ -0,0 +1,119 @@
+// __BEGIN_LICENSE__
+//  Copyright (c) 2009-2013, United States Government as represented by the
+//  Administrator of the National Aeronautics and Space Administration. All
+//  rights reserved.
+//
+//  The NGT platform is licensed under the Apache License, Version 2.0 (the
+//  "License"); you may not use this file except in compliance with the
+//  License. You may obtain a copy of the License at
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+// __END_LICENSE__
+
+
+/// \file CameraJacobians.h
+///
+/// Derivatives of the projection of ground points into cameras, used
+/// by bundle adjustment.
+///
+#ifndef __STEREO_SESSION_CAMERA_JACOBIANS_H__
+#define __STEREO_SESSION_CAMERA_JACOBIANS_H__
+
+#include <vw/Math/Vector.h>
+#include <vw/Math/Matrix.h>
+#include <vw/Camera/CameraModel.h>
+
+#include <cmath>
+#include <limits>
+
+namespace asp {
+
+  class RPCModel;
+
+  /// The derivatives of point_to_pixel() of an RPC camera. The RPC
+  /// polynomials are differentiated exactly, and the conversion from
+  /// cartesian to geodetic coordinates by inverting the derivatives of
+  /// the closed-form reverse conversion.
+  vw::Matrix<double, 2, 3> rpc_point_to_pixel_jacobian(RPCModel const& rpc,
+                                                       vw::Vector3 const& xyz);
+
+  /// The derivatives of point_to_pixel() of a LinescanDG camera, at
+  /// the point xyz, whose pixel pix is already known.
+  vw::Matrix<double, 2, 3>
+  linescan_point_to_pixel_jacobian(vw::camera::CameraModel const& camera,
+                                   vw::Vector3 const& xyz, vw::Vector2 const& pix);
+
+  /// The derivatives of point_to_pixel() of any camera, by central
+  /// differences in the point.
+  vw::Matrix<double, 2, 3>
+  numeric_point_to_pixel_jacobian(vw::camera::CameraModel const& camera,
+                                  vw::Vector3 const& xyz);
+
+  /// The derivatives of camera.point_to_pixel() at xyz, whose pixel
+  /// pix is already known. Use the structure of the camera where we
+  /// know it, and central differences otherwise.
+  vw::Matrix<double, 2, 3>
+  point_to_pixel_jacobian(vw::camera::CameraModel const& camera,
+                          vw::Vector3 const& xyz, vw::Vector2 const& pix);
+
+  /// Rotate a point by an angle-axis vector, as
+  /// ceres::AngleAxisRotatePoint() does, for any type with the usual
+  /// arithmetic, such as ceres jets.
+  template <typename T>
+  void angle_axis_rotate_point(const T angle_axis[3], const T pt[3], T result[3]){
+    using std::sqrt; using std::cos; using std::sin;
+    const T theta2 = angle_axis[0]*angle_axis[0] + angle_axis[1]*angle_axis[1]
+      + angle_axis[2]*angle_axis[2];
+    if (theta2 > T(std::numeric_limits<double>::epsilon())){
+      // Rodrigues' formula
+      const T theta = sqrt(theta2);
+      const T c = cos(theta), s = sin(theta);
+      const T w[3] = { angle_axis[0]/theta, angle_axis[1]/theta, angle_axis[2]/theta };
+      const T w_cross_pt[3] = { w[1]*pt[2] - w[2]*pt[1],
+                                w[2]*pt[0] - w[0]*pt[2],
+                                w[0]*pt[1] - w[1]*pt[0] };
+      const T tmp = (w[0]*pt[0] + w[1]*pt[1] + w[2]*pt[2])*(T(1.0) - c);
+      for (int k = 0; k < 3; k++)
+        result[k] = pt[k]*c + w_cross_pt[k]*s + w[k]*tmp;
+    }else{
+      // Near zero the rotation is the identity plus the cross product,
+      // which keeps the derivatives exact at zero.
+      const T w_cross_pt[3] = { angle_axis[1]*pt[2] - angle_axis[2]*pt[1],
+                                angle_axis[2]*pt[0] - angle_axis[0]*pt[2],
+                                angle_axis[0]*pt[1] - angle_axis[1]*pt[0] };
+      for (int k = 0; k < 3; k++)
+        result[k] = pt[k] + w_cross_pt[k];
+    }
+  }
+
+  /// Project a point into a pinhole camera without lens distortion.
+  /// The camera is given by its center and its camera-to-world
+  /// rotation as an angle-axis vector multiplied by pose_scale, and
+  /// the intrinsics by the focal length, the same for both axes, and
+  /// the pixel offsets. This is the projection of the
+  /// vw::camera::PinholeModel with these parameters, written so that
+  /// it can be differentiated automatically.
+  template <typename T>
+  void pinhole_point_to_pixel(const T camera[6], const T point[3],
+                              const T intrinsic[3], double pose_scale, T pixel[2]){
+
+    // Rotate the point from world to camera coordinates
+    T inv_rotation[3], offset[3], cam_pt[3];
+    for (int k = 0; k < 3; k++){
+      inv_rotation[k] = -camera[3 + k]/pose_scale;
+      offset[k] = point[k] - camera[k];
+    }
+    angle_axis_rotate_point(inv_rotation, offset, cam_pt);
+
+    pixel[0] = intrinsic[0]*cam_pt[0]/cam_pt[2] + intrinsic[1];
+    pixel[1] = intrinsic[0]*cam_pt[1]/cam_pt[2] + intrinsic[2];
+  }
+
+} // namespace asp
+
+#endif//__STEREO_SESSION_CAMERA_JACOBIANS_H__
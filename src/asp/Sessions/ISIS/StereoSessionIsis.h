@@ -150,6 +150,9 @@ namespace asp {
 
     virtual std::string name() const { return "isis"; }
 
+    // ISIS is not thread safe
+    virtual bool supports_multi_threading() const { return false; }
+
     typedef vw::HomographyTransform tx_type;
     typedef vw::stereo::StereoModel stereo_model_type;
     tx_type tx_left() const;
@@ -159,6 +159,11 @@ namespace asp {
     // Method to help determine what session we actually have
     virtual std::string name() const = 0;
 
+    // Whether the camera models of this session may be used from
+    // several threads at once. If not, tools rasterize with worker
+    // processes instead, see asp/Core/ProcessPool.h.
+    virtual bool supports_multi_threading() const { return true; }
+
     // Specialization for how interest points are found
     virtual bool ip_matching(std::string const& input_file1,
                              std::string const& input_file2,
@@ -0,0 +1,161 @@
+// __BEGIN_LICENSE__
+//  Copyright (c) 2009-2013, United States Government as represented by the
+//  Administrator of the National Aeronautics and Space Administration. All
+//  rights reserved.
+//
+//  The NGT platform is licensed under the Apache License, Version 2.0 (the
+//  "License"); you may not use this file except in compliance with the
+//  License. You may obtain a copy of the License at
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+// __END_LICENSE__
+
+
+#include <asp/asp_config.h>
+#include <asp/Sessions/CameraJacobians.h>
+#include <asp/Sessions/DG/StereoSessionDG.h>
+#include <asp/Sessions/DG/XML.h>
+#include <asp/Sessions/RPC/RPCModel.h>
+#include <test/Helpers.h>
+
+#include <vw/Math/Quaternion.h>
+#include <vw/Camera/PinholeModel.h>
+#include <vw/Cartography/Datum.h>
+
+#if defined(ASP_HAVE_PKG_CERES) && ASP_HAVE_PKG_CERES == 1
+#include <ceres/jet.h>
+#endif
+
+using namespace vw;
+using namespace asp;
+using namespace xercesc;
+using namespace vw::test;
+
+namespace {
+
+  // Points within the footprint of dg_example1.xml
+  std::vector<Vector3> footprint_points(){
+    cartography::Datum datum("WGS84");
+    std::vector<Vector3> points;
+    points.push_back(datum.geodetic_to_cartesian(Vector3(-105.42399, 39.833107, 2595.9)));
+    points.push_back(datum.geodetic_to_cartesian(Vector3(-105.35823, 39.842179, 2441.3)));
+    points.push_back(datum.geodetic_to_cartesian(Vector3(-105.39100, 39.818000, 2600.0)));
+    return points;
+  }
+
+  // Central differences of point_to_pixel(), with a step in meters
+  Matrix<double, 2, 3> central_differences(camera::CameraModel const& camera,
+                                           Vector3 const& xyz, double step){
+    Matrix<double, 2, 3> J;
+    for (int k = 0; k < 3; k++){
+      Vector3 delta;
+      delta[k] = step;
+      select_col(J, k) = (camera.point_to_pixel(xyz + delta) -
+                          camera.point_to_pixel(xyz - delta))/(2*step);
+    }
+    return J;
+  }
+
+  void expect_matrix_near(Matrix<double, 2, 3> const& A,
+                          Matrix<double, 2, 3> const& B, double tol){
+    for (int r = 0; r < 2; r++){
+      for (int c = 0; c < 3; c++)
+        EXPECT_NEAR(A(r, c), B(r, c), tol);
+    }
+  }
+}
+
+TEST(CameraJacobians, RPC) {
+  XMLPlatformUtils::Initialize();
+  RPCXML xml;
+  xml.read_from_file( "dg_example1.xml" );
+  RPCModel rpc( *xml.rpc_ptr() );
+
+  std::vector<Vector3> points = footprint_points();
+  for (size_t i = 0; i < points.size(); i++){
+    Matrix<double, 2, 3> J = rpc_point_to_pixel_jacobian(rpc, points[i]);
+    expect_matrix_near(J, central_differences(rpc, points[i], 1.0), 1e-4);
+    expect_matrix_near(J, point_to_pixel_jacobian(rpc, points[i],
+                                                  rpc.point_to_pixel(points[i])), 1e-12);
+  }
+}
+
+TEST(CameraJacobians, LinescanDG) {
+  XMLPlatformUtils::Initialize();
+  StereoSessionDG session;
+  boost::shared_ptr<camera::CameraModel> cam( session.camera_model("", "dg_example1.xml") );
+  ASSERT_EQ( "LinescanDG", cam->type() );
+
+  // Each projection is an iterative solve to about 0.01 pixels, so
+  // the differences take steps of several pixels.
+  std::vector<Vector3> points = footprint_points();
+  for (size_t i = 0; i < points.size(); i++){
+    Vector2 pix = cam->point_to_pixel(points[i]);
+    Matrix<double, 2, 3> J = linescan_point_to_pixel_jacobian(*cam, points[i], pix);
+    expect_matrix_near(J, central_differences(*cam, points[i], 5.0), 5e-3);
+    expect_matrix_near(J, point_to_pixel_jacobian(*cam, points[i], pix), 1e-12);
+  }
+}
+
+TEST(CameraJacobians, Numeric) {
+  camera::PinholeModel cam(Vector3(100, -50, 7000), math::identity_matrix<3>(),
+                           1000, 1000, 500, 400);
+  Vector3 xyz(120, -30, 8000);
+  expect_matrix_near(numeric_point_to_pixel_jacobian(cam, xyz),
+                     central_differences(cam, xyz, 1e-3), 1e-6);
+}
+
+TEST(CameraJacobians, Pinhole) {
+  // The parameters as stored in bundle adjustment, with the rotation
+  // scaled.
+  const double pose_scale = 1.0e+6;
+  double camera[6] = { 100, -50, 7000, 0.1*pose_scale, -0.05*pose_scale, 3.0*pose_scale };
+  double intrinsic[3] = { 1000, 500, 400 };
+  Vector3 rotation(0.1, -0.05, 3.0);
+
+  camera::PinholeModel cam(Vector3(camera[0], camera[1], camera[2]),
+                           axis_angle_to_quaternion(rotation).rotation_matrix(),
+                           intrinsic[0], intrinsic[0], intrinsic[1], intrinsic[2]);
+
+  // A point seen away from the image center
+  Vector3 xyz = cam.camera_center(Vector2()) + 7000*cam.pixel_to_vector(Vector2(300, 200));
+  double point[3] = { xyz[0], xyz[1], xyz[2] };
+
+  double pixel[2];
+  pinhole_point_to_pixel(camera, point, intrinsic, pose_scale, pixel);
+  EXPECT_VECTOR_NEAR( cam.point_to_pixel(xyz), Vector2(pixel[0], pixel[1]), 1e-8 );
+
+  // A rotation small enough to take the other branch
+  double camera0[6] = { 100, -50, 7000, 0, 0, 1e-3 };
+  camera::PinholeModel cam0(Vector3(camera0[0], camera0[1], camera0[2]),
+                            axis_angle_to_quaternion(Vector3(0, 0, 1e-9)).rotation_matrix(),
+                            intrinsic[0], intrinsic[0], intrinsic[1], intrinsic[2]);
+  xyz = Vector3(120, -30, 8000);
+  double point0[3] = { xyz[0], xyz[1], xyz[2] };
+  pinhole_point_to_pixel(camera0, point0, intrinsic, pose_scale, pixel);
+  EXPECT_VECTOR_NEAR( cam0.point_to_pixel(xyz), Vector2(pixel[0], pixel[1]), 1e-8 );
+
+#if defined(ASP_HAVE_PKG_CERES) && ASP_HAVE_PKG_CERES == 1
+  // The derivatives in the point, with jets as in the bundle
+  // adjustment, against central differences of the pinhole model.
+  typedef ceres::Jet<double, 3> JetT;
+  xyz = Vector3(point[0], point[1], point[2]);
+  JetT jcamera[6], jpoint[3], jintrinsic[3], jpixel[2];
+  for (int k = 0; k < 6; k++) jcamera[k] = JetT(camera[k]);
+  for (int k = 0; k < 3; k++) jpoint[k] = JetT(point[k], k);
+  for (int k = 0; k < 3; k++) jintrinsic[k] = JetT(intrinsic[k]);
+  pinhole_point_to_pixel(jcamera, jpoint, jintrinsic, pose_scale, jpixel);
+
+  Matrix<double, 2, 3> J;
+  for (int r = 0; r < 2; r++){
+    for (int c = 0; c < 3; c++)
+      J(r, c) = jpixel[r].v[c];
+  }
+  expect_matrix_near(J, central_differences(cam, xyz, 1e-2), 1e-6);
+#endif
+}
@@ -22,8 +22,11 @@
 #include <asp/Core/Macros.h>
 #include <asp/Tools/bundle_adjust.h>
 #include <asp/Sessions/StereoSession.h>
+#include <asp/Sessions/CameraJacobians.h>
+#include <asp/Core/CameraSurrogate.h>
 #include <ceres/ceres.h>
 #include <ceres/loss_function.h>
+#include <ceres/rotation.h>
 
 namespace po = boost::program_options;
 namespace fs = boost::filesystem;
@@ -69,10 +72,11 @@ struct Options : public asp::BaseOptions {
   std::vector<std::string> image_files, camera_files, gcp_files;
   std::string cnet_file, out_prefix, stereo_session_string, cost_function, ba_type;
   
-  double lambda, camera_weight, robust_threshold;
+  double lambda, camera_weight, robust_threshold, camera_surrogate_tol;
+  vw::Vector2 surrogate_height_range;
   int report_level, min_matches, max_iterations, overlap_limit;
 
-  bool save_iteration, have_input_cams;
+  bool save_iteration, have_input_cams, numeric_diff;
   std::string datum_str;
   double semi_major, semi_minor;
   
@@ -82,8 +86,10 @@ struct Options : public asp::BaseOptions {
   
   // Make sure all values are initialized, even though they will be
   // over-written later.
-  Options():lambda(-1.0), camera_weight(0), robust_threshold(0), report_level(0), min_matches(0),
+  Options():lambda(-1.0), camera_weight(0), robust_threshold(0), camera_surrogate_tol(0),
+            report_level(0), min_matches(0),
             max_iterations(0), overlap_limit(0), save_iteration(false), have_input_cams(true),
+            numeric_diff(false),
             semi_major(0), semi_minor(0), 
             datum(cartography::Datum(UNSPECIFIED_DATUM, "User Specified Spheroid",
                                      "Reference Meridian", 1, 1, 0)){}
@@ -175,7 +181,8 @@ update_cnet_and_init_cams(ModelT & ba_model, Options & opt,
 // in the observation, the model, and the current camera and point
 // indices. The result is the residual, the difference in the
 // observation and the projection of the point into the camera,
-// normalized by pixel_sigma.
+// normalized by pixel_sigma. This is differentiated numerically, so
+// it is used only with --numeric-diff, see BaAdjustedCameraError.
 template<class ModelT>
 struct BaReprojectionError {
   BaReprojectionError(Vector2 const& observation, Vector2 const& pixel_sigma,
@@ -247,18 +254,107 @@ struct BaReprojectionError {
   size_t m_icam, m_ipt;
 };
 
+// A ceres cost function with the same residual as
+// BaReprojectionError<BundleAdjustmentModel>, with derivatives found
+// by the chain rule. The adjustment of the camera, which moves the
+// point into the frame of the original camera, is differentiated
+// exactly with ceres jets. The original camera contributes the
+// derivatives of its point_to_pixel(), see
+// asp::point_to_pixel_jacobian(). So the point is projected once for
+// RPC and linescan cameras, and seven times for others, rather than
+// twice for each of the nine parameters.
+class BaAdjustedCameraError:
+  public ceres::SizedCostFunction<2, BundleAdjustmentModel::camera_params_n,
+                                  BundleAdjustmentModel::point_params_n> {
+public:
+  BaAdjustedCameraError(Vector2 const& observation, Vector2 const& pixel_sigma,
+                        BundleAdjustmentModel const& ba_model, size_t icam):
+    m_observation(observation),
+    m_pixel_sigma(pixel_sigma),
+    m_camera(ba_model.camera(icam)),
+    m_rotation_center(ba_model.rotation_center(icam)){}
+
+  virtual bool Evaluate(double const* const* parameters, double* residuals,
+                        double** jacobians) const {
+
+    const int num_params = BundleAdjustmentModel::camera_params_n
+      + BundleAdjustmentModel::point_params_n;
+    typedef ceres::Jet<double, num_params> JetT;
+    double const* camera = parameters[0];
+    double const* point  = parameters[1];
+
+    // As in vw::camera::AdjustedCameraModel::point_to_pixel(), undo the
+    // translation, then the rotation about the rotation center. The
+    // derivatives are with respect to the camera parameters, then the
+    // point.
+    JetT inv_rotation[3], offset[3], rotated[3];
+    for (int k = 0; k < 3; k++){
+      inv_rotation[k] = -JetT(camera[3 + k], 3 + k);
+      offset[k] = JetT(point[k], BundleAdjustmentModel::camera_params_n + k)
+        - JetT(camera[k], k) - m_rotation_center[k];
+    }
+    ceres::AngleAxisRotatePoint(inv_rotation, offset, rotated);
+
+    Vector3 xyz;
+    Matrix<double, 3, num_params> dxyz;
+    for (int k = 0; k < 3; k++){
+      xyz[k] = rotated[k].a + m_rotation_center[k];
+      for (int p = 0; p < num_params; p++)
+        dxyz(k, p) = rotated[k].v[p];
+    }
+
+    try{
+
+      Vector2 prediction = m_camera->point_to_pixel(xyz);
+      residuals[0] = (prediction[0] - m_observation[0])/m_pixel_sigma[0];
+      residuals[1] = (prediction[1] - m_observation[1])/m_pixel_sigma[1];
+
+      if (jacobians == NULL || (jacobians[0] == NULL && jacobians[1] == NULL))
+        return true;
+
+      Matrix<double, 2, num_params> J
+        = asp::point_to_pixel_jacobian(*m_camera, xyz, prediction)*dxyz;
+
+      // Ceres wants the derivatives of each block in row-major order
+      int offsets[2] = {0, BundleAdjustmentModel::camera_params_n};
+      int sizes  [2] = {BundleAdjustmentModel::camera_params_n,
+                        BundleAdjustmentModel::point_params_n};
+      for (int b = 0; b < 2; b++){
+        if (jacobians[b] == NULL) continue;
+        for (int r = 0; r < 2; r++){
+          for (int c = 0; c < sizes[b]; c++)
+            jacobians[b][r*sizes[b] + c] = J(r, offsets[b] + c)/m_pixel_sigma[r];
+        }
+      }
+
+    } catch (const camera::PixelToRayErr& e) {
+      // Failed to project into the camera
+      residuals[0] = 1e+20;
+      residuals[1] = 1e+20;
+      return false;
+    }
+
+    return true;
+  }
+
+private:
+  Vector2 m_observation;
+  Vector2 m_pixel_sigma;
+  BundleAdjustmentModel::cam_ptr_t m_camera;
+  Vector3 m_rotation_center;
+};
+
 // A ceres cost function. Here we float a pinhole camera's intrinsic
 // and extrinsic parameters. The result is the residual, the
 // difference in the observation and the projection of the point into
-// the camera, normalized by pixel_sigma.
+// the camera, normalized by pixel_sigma. The projection is that of
+// the camera made by BAPinholeModel::get_pinhole_model(), see
+// asp::pinhole_point_to_pixel().
 template<class ModelT>
 struct BaPinholeError {
-  BaPinholeError(Vector2 const& observation, Vector2 const& pixel_sigma,
-                      ModelT * const ba_model, size_t icam, size_t ipt):
+  BaPinholeError(Vector2 const& observation, Vector2 const& pixel_sigma):
     m_observation(observation),
-    m_pixel_sigma(pixel_sigma),
-    m_ba_model(ba_model),
-    m_icam(icam), m_ipt(ipt){}
+    m_pixel_sigma(pixel_sigma){}
   
   template <typename T>
   bool operator()(const T* const camera,
@@ -266,36 +362,13 @@ struct BaPinholeError {
                   const T* const intrinsic,
                   T* residuals) const {
 
-    try{
-
-      size_t num_cameras = m_ba_model->num_cameras();
-      size_t num_points  = m_ba_model->num_points();
-      VW_ASSERT(m_icam < num_cameras,
-                ArgumentErr() << "Out of bounds in the number of cameras");
-      VW_ASSERT(m_ipt < num_points,
-                ArgumentErr() << "Out of bounds in the number of points");
-
-      // Copy the input data to structures expected by the BA model
-      typename ModelT::camera_intr_vector_t cam_intr_vec;
-      asp::concat_extrinsics_intrinsics<ModelT>(camera, intrinsic, cam_intr_vec);
-      typename ModelT::point_vector_t  point_vec;
-      for (size_t p = 0; p < point_vec.size(); p++)
-        point_vec[p]  = (double)point[p];
+    T pixel[2];
+    asp::pinhole_point_to_pixel(camera, point, intrinsic, ModelT::pose_scale, pixel);
 
-      // Project the current point into the current camera
-      Vector2 prediction = (*m_ba_model)(m_ipt, m_icam, cam_intr_vec, point_vec);
-      
-      // The error is the difference between the predicted and observed position,
-      // normalized by sigma.
-      residuals[0] = (prediction[0] - m_observation[0])/m_pixel_sigma[0];
-      residuals[1] = (prediction[1] - m_observation[1])/m_pixel_sigma[1];
-
-    } catch (const camera::PixelToRayErr& e) {
-      // Failed to project into the camera
-      residuals[0] = T(1e+20);
-      residuals[1] = T(1e+20);
-      return false;
-    }
+    // The error is the difference between the predicted and observed position,
+    // normalized by sigma.
+    residuals[0] = (pixel[0] - m_observation[0])/m_pixel_sigma[0];
+    residuals[1] = (pixel[1] - m_observation[1])/m_pixel_sigma[1];
     
     return true;
   }
@@ -304,22 +377,22 @@ struct BaPinholeError {
   // the client code.
   static ceres::CostFunction* Create(Vector2 const& observation,
                                      Vector2 const& pixel_sigma,
-                                     ModelT * const ba_model,
-                                     size_t icam, // camera index
-                                     size_t ipt // point index
-                                     ){
-    return (new ceres::NumericDiffCostFunction<BaPinholeError,
-            ceres::CENTRAL, 2, ModelT::camera_params_n, ModelT::point_params_n,
+                                     bool numeric_diff){
+    if (numeric_diff)
+      return (new ceres::NumericDiffCostFunction<BaPinholeError,
+              ceres::CENTRAL, 2, ModelT::camera_params_n, ModelT::point_params_n,
+              ModelT::intrinsic_params_n>
+              (new BaPinholeError(observation, pixel_sigma)));
+
+    return (new ceres::AutoDiffCostFunction<BaPinholeError,
+            2, ModelT::camera_params_n, ModelT::point_params_n,
             ModelT::intrinsic_params_n>
-            (new BaPinholeError(observation, pixel_sigma,
-                                     ba_model, icam, ipt)));
+            (new BaPinholeError(observation, pixel_sigma)));
     
   }
   
   Vector2 m_observation;
   Vector2 m_pixel_sigma;
-  ModelT * const m_ba_model;
-  size_t m_icam, m_ipt;
 };
 
 // A ceres cost function. The residual is the difference between the
@@ -332,7 +405,7 @@ struct XYZError {
   template <typename T>
   bool operator()(const T* const point, T* residuals) const {
     for (size_t p = 0; p < m_observation.size(); p++)
-      residuals[p] = ((double)point[p] - m_observation[p])/m_xyz_sigma[p];
+      residuals[p] = (point[p] - m_observation[p])/m_xyz_sigma[p];
     
     return true;
   }
@@ -341,7 +414,7 @@ struct XYZError {
   // the client code.
   static ceres::CostFunction* Create(Vector3 const& observation,
                                      Vector3 const& xyz_sigma){
-    return (new ceres::NumericDiffCostFunction<XYZError, ceres::CENTRAL, 3, 3>
+    return (new ceres::AutoDiffCostFunction<XYZError, 3, 3>
             (new XYZError(observation, xyz_sigma)));
     
   }
@@ -376,7 +449,7 @@ struct CamError {
   // Factory to hide the construction of the CostFunction object from
   // the client code.
   static ceres::CostFunction* Create(CamVecT const& orig_cam, double weight){
-    return (new ceres::NumericDiffCostFunction<CamError, ceres::CENTRAL,
+    return (new ceres::AutoDiffCostFunction<CamError,
             ModelT::camera_params_n, ModelT::camera_params_n>
             (new CamError(orig_cam, weight)));
     
@@ -411,12 +484,17 @@ add_residual_block(ModelT & ba_model,
                    Vector2 const& observation, Vector2 const& pixel_sigma,
                    size_t icam, size_t ipt, 
                    double * camera, double * point, double * intrinsics,
+                   bool numeric_diff,
                    ceres::LossFunction* loss_function,
                    ceres::Problem & problem){
   
-  ceres::CostFunction* cost_function = 
-    BaReprojectionError<ModelT>::Create(observation, pixel_sigma,
-                                        &ba_model, icam, ipt);
+  ceres::CostFunction* cost_function;
+  if (numeric_diff)
+    cost_function = BaReprojectionError<ModelT>::Create(observation, pixel_sigma,
+                                                        &ba_model, icam, ipt);
+  else
+    cost_function = new BaAdjustedCameraError(observation, pixel_sigma,
+                                               ba_model, icam);
   problem.AddResidualBlock(cost_function, loss_function, camera, point);
   
 }
@@ -428,12 +506,12 @@ add_residual_block(ModelT & ba_model,
                    Vector2 const& observation, Vector2 const& pixel_sigma,
                    size_t icam, size_t ipt, 
                    double * camera, double * point, double * intrinsics,
+                   bool numeric_diff,
                    ceres::LossFunction* loss_function,
                    ceres::Problem & problem){
   
   ceres::CostFunction* cost_function = 
-    BaPinholeError<ModelT>::Create(observation, pixel_sigma,
-                                   &ba_model, icam, ipt);
+    BaPinholeError<ModelT>::Create(observation, pixel_sigma, numeric_diff);
   problem.AddResidualBlock(cost_function, loss_function, camera,
                            point, intrinsics);
   
@@ -511,7 +589,8 @@ void do_ba_ceres(ModelT & ba_model, Options& opt ){
       ceres::LossFunction* loss_function = get_loss_function(opt);
 
       add_residual_block(ba_model, observation, pixel_sigma, icam, ipt,
-                         camera, point, intrinsics, loss_function, problem);
+                         camera, point, intrinsics, opt.numeric_diff,
+                         loss_function, problem);
       
     }
   }
@@ -792,7 +871,13 @@ void handle_arguments( int argc, char *argv[], Options& opt ) {
     ("lambda,l", po::value(&opt.lambda)->default_value(-1),
      "Set the initial value of the LM parameter lambda (ignored for the Ceres solver).")
     ("report-level,r",po::value(&opt.report_level)->default_value(10),
-     "Use a value >= 20 to get increasingly more verbose output.");
+     "Use a value >= 20 to get increasingly more verbose output.")
+    ("camera-surrogate-tol", po::value(&opt.camera_surrogate_tol)->default_value(0.0),
+     "If positive, sample the input cameras on a grid and project with interpolation, with this maximum error in pixels. Needs the datum.")
+    ("surrogate-height-range", po::value(&opt.surrogate_height_range)->default_value(Vector2(-1000, 10000), "-1000 10000"),
+     "The range of heights above the datum covered by the camera surrogates, in meters.")
+    ("numeric-diff", po::bool_switch(&opt.numeric_diff)->default_value(false),
+     "Differentiate the reprojection errors numerically with the Ceres solver, as a check. This projects each point many more times.");
 //     ("save-iteration-data,s", "Saves all camera information between iterations to output-prefix-iterCameraParam.txt, it also saves point locations for all iterations in output-prefix-iterPointsParam.txt.");
   general_options.add( asp::BaseOptionsDescription(opt) );
 
@@ -830,8 +915,9 @@ void handle_arguments( int argc, char *argv[], Options& opt ) {
   opt.have_input_cams
     = (!opt.camera_files.empty()) || asp::images_are_cubes(opt.image_files);
   
-  if (!opt.gcp_files.empty() || !opt.have_input_cams){
-    // Need to read the datum if we have gcps.
+  if (!opt.gcp_files.empty() || !opt.have_input_cams ||
+      opt.camera_surrogate_tol > 0){
+    // Need to read the datum if we have gcps or camera surrogates.
     if (opt.datum_str != ""){
       // If the user set the datum, use it.
       opt.datum.set_well_known_datum(opt.datum_str);
@@ -850,6 +936,10 @@ void handle_arguments( int argc, char *argv[], Options& opt ) {
         vw_throw( ArgumentErr() << "When there is no input camera information, "
                   << "the datum must be specified.\n"
                   << usage << general_options );
+      else
+        vw_throw( ArgumentErr() << "When camera surrogates are used, "
+                  << "the datum must be specified.\n"
+                  << usage << general_options );
     }
     vw_out() << "Will use datum: " << opt.datum << std::endl;
     
@@ -929,6 +1019,16 @@ int main(int argc, char* argv[]) {
       if (opt.have_input_cams){
         opt.camera_models.push_back(session->camera_model(opt.image_files[i],
                                                           opt.camera_files[i]));
+        if (opt.camera_surrogate_tol > 0){
+          boost::shared_ptr<asp::CameraSurrogate> surrogate
+            (new asp::CameraSurrogate(*opt.camera_models.back(),
+                                      asp::file_image_size(opt.image_files[i]),
+                                      opt.camera_surrogate_tol, opt.datum,
+                                      opt.surrogate_height_range));
+          vw_out() << "Camera surrogate for " << opt.image_files[i]
+                   << " has max error " << surrogate->ground_error() << " pixels.\n";
+          opt.camera_models.back() = surrogate;
+        }
       }
       else{
         // Create new cameras from scratch. These are just
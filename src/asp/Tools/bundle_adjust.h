@@ -73,6 +73,7 @@ public:
                      +intrinsic_params_n> camera_intr_vector_t;
 private:
   std::vector<cam_ptr_t> m_cameras;
+  std::vector<vw::Vector3> m_rotation_centers;
   boost::shared_ptr<vw::ba::ControlNetwork> m_network;
 
   std::vector<camera_intr_vector_t> a;
@@ -84,8 +85,14 @@ private:
 public:
   BundleAdjustmentModel(std::vector<cam_ptr_t> const& cameras,
                         boost::shared_ptr<vw::ba::ControlNetwork> network) :
-    m_cameras(cameras), m_network(network), a(cameras.size()),
-    b(network->size()), a_target(cameras.size()), b_target(network->size()) {
+    m_cameras(cameras), m_rotation_centers(cameras.size()), m_network(network),
+    a(cameras.size()), b(network->size()), a_target(cameras.size()),
+    b_target(network->size()) {
+
+    // An adjusted camera rotates about the center of the original
+    // camera at pixel (0, 0), see vw::camera::AdjustedCameraModel.
+    for (unsigned j = 0; j < cameras.size(); ++j)
+      m_rotation_centers[j] = cameras[j]->camera_center(vw::Vector2());
 
     // Compute the number of observations from the bundle.
     m_num_pixel_observations = 0;
@@ -118,6 +125,10 @@ public:
   unsigned num_points() const { return b.size(); }
   unsigned num_pixel_observations() const { return m_num_pixel_observations; }
 
+  // The unadjusted camera j, and the point its adjustment rotates about
+  cam_ptr_t camera(int j) const { return m_cameras[j]; }
+  vw::Vector3 rotation_center(int j) const { return m_rotation_centers[j]; }
+
   // Return the covariance of the camera parameters for camera j.
   inline vw::Matrix<double,camera_params_n,camera_params_n>
   A_inverse_covariance ( unsigned /*j*/ ) const {
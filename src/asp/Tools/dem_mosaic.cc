@@ -34,6 +34,7 @@
 #include <iomanip>
 #include <string>
 #include <vector>
+#include <algorithm>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -47,6 +48,9 @@ using namespace std;
 #include <vw/Math.h>
 #include <asp/Core/Macros.h>
 #include <asp/Core/Common.h>
+#include <asp/Core/DemMosaicTiles.h>
+#include <asp/Core/Overviews.h>
+#include <asp/Core/ProcessPool.h>
 
 using namespace vw;
 using namespace vw::cartography;
@@ -146,15 +150,27 @@ struct Options : asp::BaseOptions {
   RealT out_nodata_value;
   int tile_size, tile_index, erode_len, blending_len;
   bool first, last, min, max, mean, median, count;
+  double percentile;
+  bool build_overviews;
+  string write_manifest_file, manifest_file;
+  int num_processes;
   BBox2 target_projwin;
   Options(): tr(0), geo_tile_size(0), has_out_nodata(false), tile_index(-1),
              first(false), last(false), min(false), max(false), 
-             mean(false), median(false), count(false){}
+             mean(false), median(false), count(false), percentile(-1),
+             build_overviews(false), num_processes(1){}
 };
 
 int no_blend(Options const& opt){
   return int(opt.first) + int(opt.last) + int(opt.min) + int(opt.max) 
-    + int(opt.mean) + int(opt.median) + int(opt.count);
+    + int(opt.mean) + int(opt.median) + int(opt.count)
+    + int(opt.percentile >= 0);
+}
+
+// If all DEM values at a pixel must be known, rather than combined
+// one at a time.
+bool use_order_stats(Options const& opt){
+  return opt.median || opt.percentile >= 0;
 }
 
 std::string tile_suffix(Options const& opt){
@@ -165,9 +181,88 @@ std::string tile_suffix(Options const& opt){
   if (opt.mean) return "mean-";
   if (opt.median) return "median-";
   if (opt.count) return "count-";
+  if (opt.percentile >= 0){
+    ostringstream os;
+    os << "percentile-" << opt.percentile << "-";
+    return os.str();
+  }
   return "";
 }
 
+// The value at the given percentile (between 0 and 100) of a range
+// of values, interpolating linearly between the closest ones. This
+// is the median for the 50th percentile. The range gets reordered.
+double destructive_percentile(float * beg, float * end, double pct){
+  int len = end - beg;
+  double pos = (pct/100.0)*(len - 1);
+  int lo = std::min(std::max((int)floor(pos), 0), len - 1);
+  std::nth_element(beg, beg + lo, end);
+  double val = beg[lo];
+  if (lo + 1 < len && pos > lo){
+    double next = *std::min_element(beg + lo + 1, end);
+    val += (pos - lo)*(next - val);
+  }
+  return val;
+}
+
+// The DEM values found at the pixels of a tile. They are appended as
+// the DEMs are processed, and grouped by pixel at the end, so each
+// pixel holds only as many values as there are DEMs overlapping it.
+// The values are kept as floats, the precision of the output, so a
+// sample with its pixel index takes 8 bytes.
+class TileSamples{
+  int m_cols, m_rows;
+  struct Sample{
+    int32 pixel; // row*cols + col
+    float val;
+  };
+  vector<Sample> m_samples;
+public:
+  TileSamples(int cols, int rows): m_cols(cols), m_rows(rows){}
+
+  void add(int col, int row, double val){
+    Sample s;
+    s.pixel = row*m_cols + col;
+    s.val   = val;
+    m_samples.push_back(s);
+  }
+
+  // Set each pixel having values to the given percentile of them
+  void percentile(double pct, ImageView<double> & tile){
+
+    // Group the values by pixel with a counting sort, then release
+    // the samples.
+    int num_pixels = m_cols*m_rows;
+    vector<int> offsets(num_pixels + 1, 0);
+    for (size_t i = 0; i < m_samples.size(); i++)
+      offsets[m_samples[i].pixel + 1]++;
+    for (int k = 0; k < num_pixels; k++)
+      offsets[k + 1] += offsets[k];
+    vector<float> vals(m_samples.size());
+    {
+      vector<int> pos(offsets.begin(), offsets.end() - 1);
+      for (size_t i = 0; i < m_samples.size(); i++)
+        vals[pos[m_samples[i].pixel]++] = m_samples[i].val;
+      vector<Sample>().swap(m_samples);
+    }
+
+    for (int row = 0; row < m_rows; row++){
+      for (int col = 0; col < m_cols; col++){
+        int k = row*m_cols + col;
+        if (offsets[k] == offsets[k + 1]) continue;
+        tile(col, row) = destructive_percentile(&vals[0] + offsets[k],
+                                                &vals[0] + offsets[k + 1], pct);
+      }
+    }
+  }
+};
+
+// The border of the region of an input DEM needed for a box of the
+// output, see asp::dem_input_box().
+int dem_border(Options const& opt){
+  return opt.erode_len + opt.blending_len + BilinearInterpolation::pixel_buffer + 1;
+}
+
 class DemMosaicView: public ImageViewBase<DemMosaicView>{
   int m_cols, m_rows;
   Options const& m_opt;
@@ -223,7 +318,9 @@ public:
 
     int noblend = no_blend(m_opt);
 
-    std::vector< ImageView<double> > tiles; // used for median calculation
+    // All values, for the median and percentiles
+    bool order_stats = use_order_stats(m_opt);
+    TileSamples samples(bbox.width(), bbox.height());
     
     for (int dem_iter = 0; dem_iter < (int)m_images.size(); dem_iter++){
 
@@ -235,25 +332,10 @@ public:
       // from pixels to points and lon-lat.
       GeoTransform geotrans(georef, m_out_georef);
 
-      BBox2 in_box = geotrans.reverse_bbox(bbox);
-      
-      // Grow to account for blending and erosion length, etc.
-      in_box.expand(m_opt.erode_len + m_opt.blending_len
-                    + BilinearInterpolation::pixel_buffer + 1);
-      in_box.crop(bounding_box(disk_dem));
-      if (in_box.width() == 1 || in_box.height() == 1){
-        // Grassfire likes to have width of at least 2
-        in_box.expand(1);
-        in_box.crop(bounding_box(disk_dem));
-      }
+      BBox2 in_box = asp::dem_input_box(geotrans, bounding_box(disk_dem), bbox,
+                                        dem_border(m_opt));
       if (in_box.width() <= 1 || in_box.height() <= 1) continue;
 
-      if (m_opt.median){
-        // Must use a blank tile each time
-        fill( tile, m_opt.out_nodata_value );
-        fill( weights, 0.0 );
-      }
-      
       // Crop the disk dem to a 2-channel in-memory image. First channel
       // is the image pixels, second will be the grassfire weights.
       ImageView<RealGrayA> dem = crop(disk_dem, in_box);
@@ -329,10 +411,15 @@ public:
           
           if (wt <= 0) continue;
 
+          if (order_stats){
+            samples.add(c, r, val);
+            continue;
+          }
+
           bool is_nodata = (tile(c, r) == m_opt.out_nodata_value);
 
           // Initialize the tile if not done already
-          if (!m_opt.median && !m_opt.min && !m_opt.max){
+          if (!m_opt.min && !m_opt.max){
             if ( is_nodata ){
               tile(c, r) = 0;
               weights(c, r) = 0.0;
@@ -342,8 +429,7 @@ public:
           if ( ( m_opt.first && is_nodata)                        || 
                m_opt.last                                         ||
                ( m_opt.min && ( val < tile(c, r) || is_nodata ) ) ||
-               ( m_opt.max && ( val > tile(c, r) || is_nodata ) ) ||
-               m_opt.median ){
+               ( m_opt.max && ( val > tile(c, r) || is_nodata ) ) ){
             tile(c, r) = val;
             weights(c, r) = wt;
           }else if (m_opt.mean){
@@ -360,10 +446,6 @@ public:
         }
       }
 
-      // This will be memory intensive
-      if (m_opt.median)
-        tiles.push_back(copy(tile));
-      
     } // end iterating over DEMs
     
     // Divide by the weights
@@ -377,23 +459,8 @@ public:
       }
     }
 
-    if (m_opt.median){
-      fill( tile, m_opt.out_nodata_value );
-      vector<double> vals(tiles.size());
-      for (int c = 0; c < bbox.width(); c++){
-        for (int r = 0; r < bbox.height(); r++){
-          vals.clear();
-          for (int i = 0; i < (int)tiles.size(); i++){
-            ImageView<double> & tile_ref = tiles[i];
-            if ( tile_ref(c, r) == m_opt.out_nodata_value ) continue;
-            vals.push_back(tile_ref(c, r));
-          }
-          if (!vals.empty()){
-            tile(c, r) = math::destructive_median(vals);
-          }
-        }
-      }
-    }
+    if (order_stats)
+      samples.percentile(m_opt.median ? 50.0 : m_opt.percentile, tile);
 
     return prerasterize_type(pixel_cast<RealT>(tile),
                              -bbox.min().x(), -bbox.min().y(),
@@ -438,13 +505,23 @@ void handle_arguments( int argc, char *argv[], Options& opt ) {
     ("mean", po::bool_switch(&opt.mean)->default_value(false),
      "Find the mean DEM value.")
     ("median", po::bool_switch(&opt.median)->default_value(false),
-     "Find the median DEM value (this can be memory-intensive, fewer threads are suggested).")
+     "Find the median DEM value.")
+    ("percentile", po::value<double>(&opt.percentile),
+     "Find this percentile of the DEM values (between 0 and 100).")
     ("count", po::bool_switch(&opt.count)->default_value(false),
      "Each pixel is set to the number of valid DEM heights at that pixel.")
     ("georef-tile-size", po::value<double>(&opt.geo_tile_size),
      "Set the tile size in georeferenced (projected) units (e.g., degrees or meters).")
     ("output-nodata-value", po::value<RealT>(&opt.out_nodata_value),
      "No-data value to use on output. Default: use the one from the first DEM to be mosaicked.")
+    ("build-overviews", po::bool_switch(&opt.build_overviews)->default_value(false),
+     "Store reduced-resolution overviews inside each output tile, computed while the tile is written.")
+    ("write-manifest", po::value(&opt.write_manifest_file),
+     "Instead of mosaicking, save the output grid, the no-data values, and the DEMs overlapping each tile to this file.")
+    ("manifest", po::value(&opt.manifest_file),
+     "Mosaic the tiles of a manifest made with --write-manifest, rather than a list of DEMs. Only the DEMs overlapping a tile are opened.")
+    ("num-processes", po::value<int>(&opt.num_processes)->default_value(1),
+     "With --manifest, write this many tiles at the same time, each in its own process.")
     ("threads", po::value<int>(&opt.num_threads)->default_value(4),
      "Number of threads to use.")
     ("help,h", "Display this help message.");
@@ -465,9 +542,12 @@ void handle_arguments( int argc, char *argv[], Options& opt ) {
                              allow_unregistered, unregistered );
 
   // Error checking  
-  if (opt.out_prefix == "")
+  if (opt.out_prefix == "" && opt.write_manifest_file == "")
     vw_throw(ArgumentErr() << "No output prefix was specified.\n"
               << usage << general_options );
+  if (opt.write_manifest_file != "" && opt.manifest_file != "")
+    vw_throw(ArgumentErr() << "Cannot both write and use a manifest.\n"
+              << usage << general_options );
   if (opt.num_threads == 0)
     vw_throw(ArgumentErr() << "The number of threads must be set and "
              << "positive.\n" << usage << general_options );
@@ -486,7 +566,11 @@ void handle_arguments( int argc, char *argv[], Options& opt ) {
   
   if (noblend > 1)
     vw_throw(ArgumentErr() << "At most one of the options --first, --last, "
-             << "--min, --max, -mean, --median, --count can be specified.\n"
+             << "--min, --max, -mean, --median, --percentile, --count can be "
+             << "specified.\n" << usage << general_options );
+
+  if (vm.count("percentile") && (opt.percentile < 0 || opt.percentile > 100))
+    vw_throw(ArgumentErr() << "The percentile must be between 0 and 100.\n"
              << usage << general_options );
 
   if (opt.geo_tile_size < 0)
@@ -495,7 +579,15 @@ void handle_arguments( int argc, char *argv[], Options& opt ) {
               << usage << general_options );
 
   // Read the DEMs
-  if (opt.dem_list_file != ""){
+  if (opt.manifest_file != ""){
+
+    // They are in the manifest
+    if (opt.dem_list_file != "" || !unregistered.empty())
+      vw_throw(ArgumentErr() << "The DEMs are read from the manifest. There were however "
+               << "extraneous files or options passed in.\n"
+               << usage << general_options );
+    
+  }else if (opt.dem_list_file != ""){
 
     // Get them from a list
     
@@ -521,10 +613,12 @@ void handle_arguments( int argc, char *argv[], Options& opt ) {
   }
   
   // Create the output directory 
-  asp::create_out_dir(opt.out_prefix);
+  if (opt.out_prefix != ""){
+    asp::create_out_dir(opt.out_prefix);
   
-  // Turn on logging to file
-  asp::log_to_file(argc, argv, "", opt.out_prefix);
+    // Turn on logging to file
+    asp::log_to_file(argc, argv, "", opt.out_prefix);
+  }
 
   if (!vm.count("output-nodata-value")){
     // Set a default out_nodata_value, but remember that this is
@@ -536,6 +630,330 @@ void handle_arguments( int argc, char *argv[], Options& opt ) {
 
 }
 
+// The output georeference before it is cropped to the extent of the
+// mosaic. That of the given DEM, with the projection and resolution
+// requested by the user.
+GeoReference base_out_georef(Options const& opt, std::string const& dem_file){
+
+  GeoReference out_georef = read_georef(dem_file);
+  if (opt.target_srs_string != ""                                      &&
+      opt.target_srs_string != processed_proj4(out_georef.proj4_str()) &&
+      opt.tr <= 0 ){
+    vw_throw(ArgumentErr()
+             << "Changing the projection was requested. The output DEM "
+             << "resolution must be specified via the --tr option.\n");
+  }
+
+  if (opt.target_srs_string != ""){
+    // Set the srs string into georef.
+    bool have_user_datum = false;
+    Datum user_datum;
+    asp::set_srs_string(opt.target_srs_string,
+                        have_user_datum, user_datum, out_georef);
+  }
+
+  // Use desired spacing if user-specified
+  if (opt.tr > 0.0){
+    Matrix<double,3,3> transform = out_georef.transform();
+    transform.set_identity();
+    transform(0, 0) = opt.tr;
+    transform(1, 1) = -opt.tr;
+    out_georef.set_transform(transform);
+  }
+
+  return out_georef;
+}
+
+// Everything the tiles of a mosaic need to know about the inputs: the
+// output grid, the nodata value of each input DEM, and which DEMs
+// contribute to each tile. It can be saved to a manifest, so that
+// tiles can be produced later, each opening only the DEMs it needs.
+struct MosaicPlan {
+  std::string georef_dem; // the DEM the output georef is based on
+  Vector2 crop_offset;    // where the mosaic starts in that georef, in pixels
+  int cols, rows, num_tiles_x, num_tiles_y;
+  vector<string> dem_files;
+  vector<RealT> nodata_values;
+  vector< vector<int> > tile_dems; // for each tile, in the input order
+  int num_tiles() const { return num_tiles_x*num_tiles_y; }
+};
+
+BBox2i tile_box(Options const& opt, MosaicPlan const& plan, int tile_id){
+  int tile_index_y = tile_id / plan.num_tiles_x;
+  int tile_index_x = tile_id - tile_index_y*plan.num_tiles_x;
+  BBox2i box(tile_index_x*opt.tile_size, tile_index_y*opt.tile_size,
+             opt.tile_size, opt.tile_size);
+  box.crop(BBox2i(0, 0, plan.cols, plan.rows));
+  return box;
+}
+
+// Find the DEMs which are used by the tiles in [start_tile, end_tile),
+// with the same test as the mosaic itself. The other tiles get none.
+void find_tile_dems(Options const& opt, GeoReference const& out_georef,
+                    vector<GeoReference> const& georefs,
+                    vector<BBox2i> const& dem_boxes,
+                    int start_tile, int end_tile, MosaicPlan & plan){
+
+  vector<BBox2i> tile_boxes(plan.num_tiles());
+  for (int tile_id = start_tile; tile_id < end_tile; tile_id++)
+    tile_boxes[tile_id] = tile_box(opt, plan, tile_id);
+  asp::find_box_dems(georefs, dem_boxes, out_georef, tile_boxes,
+                     dem_border(opt), plan.tile_dems);
+}
+
+// The manifest is a text file. File names are last on their lines,
+// so they may contain spaces.
+const std::string MANIFEST_HEADER = "dem_mosaic_manifest 1";
+
+void write_manifest(std::string const& file, Options const& opt,
+                    MosaicPlan const& plan){
+
+  vw_out() << "Writing: " << file << std::endl;
+  std::ofstream os(file.c_str());
+  os.precision(17);
+  os << MANIFEST_HEADER << "\n";
+  os << "t_srs " << opt.target_srs_string << "\n";
+  os << "tr " << opt.tr << "\n";
+  os << "crop_offset " << plan.crop_offset[0] << " " << plan.crop_offset[1] << "\n";
+  os << "size " << plan.cols << " " << plan.rows << "\n";
+  os << "tile_size " << opt.tile_size << "\n";
+  os << "lengths " << opt.erode_len << " " << opt.blending_len << "\n";
+  os << "output_nodata_value " << opt.out_nodata_value << "\n";
+  os << "georef_dem " << plan.georef_dem << "\n";
+  os << "num_dems " << plan.dem_files.size() << "\n";
+  for (size_t dem_iter = 0; dem_iter < plan.dem_files.size(); dem_iter++)
+    os << plan.nodata_values[dem_iter] << " " << plan.dem_files[dem_iter] << "\n";
+  os << "num_tiles " << plan.num_tiles_x << " " << plan.num_tiles_y << "\n";
+  for (int tile_id = 0; tile_id < plan.num_tiles(); tile_id++){
+    os << tile_id << " " << plan.tile_dems[tile_id].size();
+    for (size_t k = 0; k < plan.tile_dems[tile_id].size(); k++)
+      os << " " << plan.tile_dems[tile_id][k];
+    os << "\n";
+  }
+  if (!os)
+    vw_throw(IOErr() << "Failed writing: " << file << ".\n");
+}
+
+// Read a keyword and check that it is the expected one
+void read_manifest_key(std::istream & is, std::string const& key,
+                       std::string const& file){
+  std::string val;
+  if (!(is >> val) || val != key)
+    vw_throw(IOErr() << "Invalid manifest: " << file << ". Expecting: "
+             << key << ".\n");
+}
+
+// The rest of the current line, without the separating space
+std::string read_manifest_line(std::istream & is){
+  std::string line;
+  std::getline(is, line);
+  if (!line.empty() && line[0] == ' ') line = line.substr(1);
+  return line;
+}
+
+void read_manifest(std::string const& file, Options & opt, MosaicPlan & plan){
+
+  std::ifstream is(file.c_str());
+  if (!is)
+    vw_throw(ArgumentErr() << "Cannot read: " << file << ".\n");
+
+  std::string header;
+  std::getline(is, header);
+  if (header != MANIFEST_HEADER)
+    vw_throw(IOErr() << "Invalid manifest: " << file << ".\n");
+
+  read_manifest_key(is, "t_srs", file);
+  opt.target_srs_string = read_manifest_line(is);
+  read_manifest_key(is, "tr", file);          is >> opt.tr;
+  read_manifest_key(is, "crop_offset", file); is >> plan.crop_offset[0] >> plan.crop_offset[1];
+  read_manifest_key(is, "size", file);        is >> plan.cols >> plan.rows;
+  read_manifest_key(is, "tile_size", file);   is >> opt.tile_size;
+  read_manifest_key(is, "lengths", file);     is >> opt.erode_len >> opt.blending_len;
+  read_manifest_key(is, "output_nodata_value", file); is >> opt.out_nodata_value;
+  opt.has_out_nodata = true;
+  read_manifest_key(is, "georef_dem", file);
+  plan.georef_dem = read_manifest_line(is);
+
+  int num_dems = 0;
+  read_manifest_key(is, "num_dems", file); is >> num_dems;
+  plan.dem_files.resize(num_dems);
+  plan.nodata_values.resize(num_dems);
+  for (int dem_iter = 0; dem_iter < num_dems; dem_iter++){
+    is >> plan.nodata_values[dem_iter];
+    plan.dem_files[dem_iter] = read_manifest_line(is);
+  }
+
+  read_manifest_key(is, "num_tiles", file); is >> plan.num_tiles_x >> plan.num_tiles_y;
+  plan.tile_dems.resize(plan.num_tiles());
+  for (int tile_id = 0; tile_id < plan.num_tiles(); tile_id++){
+    int id = -1, num = 0;
+    is >> id >> num;
+    if (!is || id != tile_id || num < 0 || num > num_dems)
+      vw_throw(IOErr() << "Invalid manifest: " << file << ".\n");
+    plan.tile_dems[tile_id].resize(num);
+    for (int k = 0; k < num; k++)
+      is >> plan.tile_dems[tile_id][k];
+  }
+  if (!is)
+    vw_throw(IOErr() << "Invalid manifest: " << file << ".\n");
+}
+
+// Mosaic one tile. The images and georefs are those of the DEMs the
+// plan lists for this tile.
+void write_tile(Options & opt, MosaicPlan const& plan,
+                GeoReference const& out_georef, int tile_id,
+                vector< ImageViewRef<RealT> > const& images,
+                vector<GeoReference> const& georefs,
+                ProgressCallback const& progress_callback){
+
+  vector<RealT> nodata_values;
+  for (size_t k = 0; k < plan.tile_dems[tile_id].size(); k++)
+    nodata_values.push_back(plan.nodata_values[plan.tile_dems[tile_id][k]]);
+
+  // The next power of 2 >= 4*(blending_len + erode_len). We want to
+  // make the blocks big, to reduce overhead from blending_len and
+  // erode_len, but not so big that it may not fit in memory.
+  int block_size = nextpow2(4.0*(opt.erode_len + opt.blending_len));
+  block_size = std::max(block_size, 256); // don't make them too small though
+
+  BBox2i box = tile_box(opt, plan, tile_id);
+  ostringstream os;
+  os << opt.out_prefix << "-tile-" << tile_suffix(opt) << tile_id << ".tif";
+  std::string dem_tile = os.str();
+
+  // We use block_cache to rasterize tiles of size block_size.
+  ImageViewRef<RealT> out_dem
+    = crop(DemMosaicView(plan.cols, plan.rows, opt, images, georefs,
+                         out_georef, nodata_values),
+           box);
+
+  vw_out() << "Writing: " << dem_tile << std::endl;
+  opt.raster_tile_size = Vector2(block_size, block_size); // disk block size
+  GeoReference crop_georef = crop(out_georef, box.min().x(), box.min().y());
+
+  // Overviews go with the final write, made in 256 pixel blocks.
+  bool rewrite = (opt.raster_tile_size[0] != 256);
+  if (opt.build_overviews && !rewrite)
+    block_write_gdal_image_with_overviews(dem_tile, out_dem, crop_georef,
+                                          opt.out_nodata_value, opt,
+                                          progress_callback);
+  else
+    block_write_gdal_image(dem_tile, out_dem, crop_georef, opt.out_nodata_value,
+                           opt, progress_callback);
+
+  // We wrote big blocks, as then there's less overhead.
+  // But those are hard to manipulate with gdal_translate.
+  if (rewrite){
+    std::string tmp_tile = fs::path(dem_tile).replace_extension(".tmp.tif").string();
+    fs::rename(dem_tile, tmp_tile);
+    DiskImageView<RealT> tmp_dem(tmp_tile);
+    opt.raster_tile_size = Vector2(256, 256); // disk block size
+    vw_out() << "Re-writing with blocks of size: " << opt.raster_tile_size[0] << std::endl;
+    if (opt.build_overviews)
+      block_write_gdal_image_with_overviews(dem_tile, tmp_dem, crop_georef,
+                                            opt.out_nodata_value, opt,
+                                            progress_callback);
+    else
+      block_write_gdal_image(dem_tile, tmp_dem, crop_georef, opt.out_nodata_value,
+                             opt, progress_callback);
+    fs::remove(tmp_tile);
+  }
+}
+
+// Mosaic tiles of a manifest, opening only the DEMs each tile
+// needs. Tiles are numbered from first_tile. Can run in a worker
+// process of a TileProcessPool, then its progress is not shown.
+class ManifestTileWriter {
+  Options m_opt;
+  MosaicPlan const& m_plan;
+  GeoReference m_out_georef;
+  int m_first_tile;
+  bool m_show_progress;
+public:
+  ManifestTileWriter(Options const& opt, MosaicPlan const& plan,
+                     GeoReference const& out_georef, int first_tile,
+                     bool show_progress):
+    m_opt(opt), m_plan(plan), m_out_georef(out_georef),
+    m_first_tile(first_tile), m_show_progress(show_progress){}
+
+  void operator()(int job, char* /*buffer*/){
+    int tile_id = m_first_tile + job;
+    vector< ImageViewRef<RealT> > images;
+    vector<GeoReference> georefs;
+    for (size_t k = 0; k < m_plan.tile_dems[tile_id].size(); k++){
+      std::string const& file = m_plan.dem_files[m_plan.tile_dems[tile_id][k]];
+      images.push_back(DiskImageView<RealT>(file));
+      georefs.push_back(read_georef(file));
+    }
+    if (m_show_progress)
+      write_tile(m_opt, m_plan, m_out_georef, tile_id, images, georefs,
+                 TerminalProgressCallback("asp", "\t--> "));
+    else
+      write_tile(m_opt, m_plan, m_out_georef, tile_id, images, georefs,
+                 ProgressCallback::dummy_instance());
+  }
+};
+
+// The tiles are written directly to disk, there's nothing to collect
+void skip_collect(int /*job*/, const char* /*buffer*/){}
+
+// The tiles to write, as [start_tile, end_tile). False if the
+// requested tile does not exist.
+bool tile_range(Options const& opt, MosaicPlan const& plan,
+                int & start_tile, int & end_tile){
+
+  vw_out() << "Number of tiles: " << plan.num_tiles_x << " x "
+           << plan.num_tiles_y << " = " << plan.num_tiles() << std::endl;
+
+  if (opt.tile_index >= plan.num_tiles()){
+    vw_out() << "Tile with index: " << opt.tile_index << " is out of bounds."
+             << std::endl;
+    return false;
+  }
+
+  // See if to save all tiles, or an individual tile.
+  start_tile = opt.tile_index;
+  end_tile   = opt.tile_index + 1;
+  if (opt.tile_index < 0){
+    start_tile = 0;
+    end_tile = plan.num_tiles();
+  }
+  return true;
+}
+
+// Mosaic from a manifest, rather than from the DEMs
+void run_manifest(Options & opt){
+
+  MosaicPlan plan;
+  read_manifest(opt.manifest_file, opt, plan);
+  vw_out() << "Using output no-data value: " << opt.out_nodata_value << endl;
+
+  GeoReference out_georef = crop(base_out_georef(opt, plan.georef_dem),
+                                 plan.crop_offset[0], plan.crop_offset[1]);
+  vw_out() << "The size of the mosaic is " << plan.cols << " x " << plan.rows
+           << " pixels.\n";
+
+  int start_tile = 0, end_tile = 0;
+  if (!tile_range(opt, plan, start_tile, end_tile)) return;
+
+  // Each worker process opens its own DEMs, so no file handles are
+  // shared across a fork.
+  int num_tiles = end_tile - start_tile;
+  if (opt.num_processes > 1 && num_tiles > 1){
+    asp::TileProcessPool pool(opt.num_processes, 0);
+    vw_out() << "Writing " << num_tiles << " tiles with "
+             << pool.num_processes() << " processes.\n";
+    pool.run(num_tiles,
+             ManifestTileWriter(opt, plan, out_georef, start_tile, false),
+             skip_collect, TerminalProgressCallback("asp", "\t--> "));
+    return;
+  }
+
+  ManifestTileWriter writer(opt, plan, out_georef, start_tile, true);
+  for (int job = 0; job < num_tiles; job++)
+    writer(job, NULL);
+}
+
 int main( int argc, char *argv[] ) {
 
   Options opt;
@@ -543,6 +961,11 @@ int main( int argc, char *argv[] ) {
     
     handle_arguments( argc, argv, opt );
 
+    if (opt.manifest_file != ""){
+      run_manifest(opt);
+      return 0;
+    }
+
     // Read nodata from first DEM, unless the user chooses to specify it.
     if (!opt.has_out_nodata){
       DiskImageResourceGDAL in_rsrc(opt.dem_files[0]);
@@ -556,33 +979,11 @@ int main( int argc, char *argv[] ) {
     if (opt.target_srs_string != "")
       opt.target_srs_string = processed_proj4(opt.target_srs_string);
       
-    GeoReference out_georef = read_georef(opt.dem_files[0]);
-    double spacing = opt.tr;
-    if (opt.target_srs_string != ""                                      &&
-        opt.target_srs_string != processed_proj4(out_georef.proj4_str()) &&
-        spacing <= 0 ){
-      vw_throw(ArgumentErr()
-               << "Changing the projection was requested. The output DEM "
-               << "resolution must be specified via the --tr option.\n");
-    }
-
-    if (opt.target_srs_string != ""){
-      // Set the srs string into georef.
-      bool have_user_datum = false;
-      Datum user_datum;
-      asp::set_srs_string(opt.target_srs_string,
-                          have_user_datum, user_datum, out_georef);
-    }
-    
-    // Use desired spacing if user-specified
-    if (spacing > 0.0){
-      Matrix<double,3,3> transform = out_georef.transform();
-      transform.set_identity();
-      transform(0, 0) = spacing;
-      transform(1, 1) = -spacing;
-      out_georef.set_transform(transform);
-    }else
-      spacing = out_georef.transform()(0, 0);
+    MosaicPlan plan;
+    plan.georef_dem = opt.dem_files[0];
+    plan.dem_files  = opt.dem_files;
+    GeoReference out_georef = base_out_georef(opt, plan.georef_dem);
+    double spacing = out_georef.transform()(0, 0);
 
     // if the user specified the tile size in georeferenced units.
     if (opt.geo_tile_size > 0){
@@ -598,9 +999,9 @@ int main( int argc, char *argv[] ) {
     TerminalProgressCallback tpc("", "\t--> ");
     tpc.report_progress(0);
     double inc_amount = 1.0 / double(opt.dem_files.size() );
-    vector<RealT> nodata_values;
     vector< ImageViewRef<RealT> > images;
     vector< GeoReference > georefs;
+    vector<BBox2i> dem_boxes;
     BBox2 mosaic_bbox;
     for (int dem_iter = 0; dem_iter < (int)opt.dem_files.size(); dem_iter++){
       
@@ -629,9 +1030,10 @@ int main( int argc, char *argv[] ) {
         mosaic_bbox.grow(proj_box);
       }
       
-      nodata_values.push_back(curr_nodata_value);
+      plan.nodata_values.push_back(curr_nodata_value);
       images.push_back(img);
       georefs.push_back(georef);
+      dem_boxes.push_back(bounding_box(img));
       
       tpc.report_incremental_progress( inc_amount );
     }
@@ -652,85 +1054,45 @@ int main( int argc, char *argv[] ) {
     Vector2 beg_pix = pixel_box.min();
     if (norm_2(beg_pix - round(beg_pix)) < g_tol ) beg_pix = round(beg_pix);
     out_georef = crop(out_georef, beg_pix[0], beg_pix[1]);
+    plan.crop_offset = beg_pix;
 
     // Image size
     pixel_box = point_to_pixel_bbox_nogrow(out_georef, mosaic_bbox);
     Vector2 end_pix = pixel_box.max();
     
-    int cols = (int)round(end_pix[0]); // end_pix is the last pix in the image
-    int rows = (int)round(end_pix[1]);
+    plan.cols = (int)round(end_pix[0]); // end_pix is the last pix in the image
+    plan.rows = (int)round(end_pix[1]);
     
     // Form the mosaic and write it to disk
-    vw_out()<< "The size of the mosaic is " << cols << " x " << rows
+    vw_out()<< "The size of the mosaic is " << plan.cols << " x " << plan.rows
             << " pixels.\n";
 
-    // The next power of 2 >= 4*(blending_len + erode_len). We want to
-    // make the blocks big, to reduce overhead from blending_len and
-    // erode_len, but not so big that it may not fit in memory.
-    int block_size = nextpow2(4.0*(opt.erode_len + opt.blending_len));
-    block_size = std::max(block_size, 256); // don't make them too small though
-
-    int num_tiles_x = (int)ceil((double)cols/double(opt.tile_size));
-    if (num_tiles_x <= 0) num_tiles_x = 1;
-    int num_tiles_y = (int)ceil((double)rows/double(opt.tile_size));
-    if (num_tiles_y <= 0) num_tiles_y = 1;
-    int num_tiles = num_tiles_x*num_tiles_y;
-    vw_out() << "Number of tiles: " << num_tiles_x << " x "
-             << num_tiles_y << " = " << num_tiles << std::endl;
-
-    if (opt.tile_index >= num_tiles){
-      vw_out() << "Tile with index: " << opt.tile_index << " is out of bounds."
-               << std::endl;
+    plan.num_tiles_x = (int)ceil((double)plan.cols/double(opt.tile_size));
+    if (plan.num_tiles_x <= 0) plan.num_tiles_x = 1;
+    plan.num_tiles_y = (int)ceil((double)plan.rows/double(opt.tile_size));
+    if (plan.num_tiles_y <= 0) plan.num_tiles_y = 1;
+    if (opt.write_manifest_file != ""){
+      find_tile_dems(opt, out_georef, georefs, dem_boxes, 0, plan.num_tiles(), plan);
+      write_manifest(opt.write_manifest_file, opt, plan);
       return 0;
     }
 
-    // See if to save all tiles, or an individual tile.
-    int start_tile = opt.tile_index, end_tile = opt.tile_index + 1;
-    if (opt.tile_index < 0){
-      start_tile = 0;
-      end_tile = num_tiles;
-    }
+    int start_tile = 0, end_tile = 0;
+    if (!tile_range(opt, plan, start_tile, end_tile)) return 0;
+    find_tile_dems(opt, out_georef, georefs, dem_boxes, start_tile, end_tile, plan);
     
     for (int tile_id = start_tile; tile_id < end_tile; tile_id++){
-      
-      int tile_index_y = tile_id / num_tiles_x;
-      int tile_index_x = tile_id - tile_index_y*num_tiles_x;
-      BBox2i tile_box(tile_index_x*opt.tile_size, tile_index_y*opt.tile_size,
-                      opt.tile_size, opt.tile_size);
-      tile_box.crop(BBox2i(0, 0, cols, rows));
-      ostringstream os;
-      os << opt.out_prefix << "-tile-" << tile_suffix(opt) << tile_id << ".tif";
-      std::string dem_tile = os.str();
-      
-      // We use block_cache to rasterize tiles of size block_size.
-      ImageViewRef<RealT> out_dem
-        = crop(DemMosaicView(cols, rows, opt, images, georefs,
-                             out_georef, nodata_values),
-               tile_box);
-      
-      vw_out() << "Writing: " << dem_tile << std::endl;
-      opt.raster_tile_size = Vector2(block_size, block_size); // disk block size
-      GeoReference crop_georef
-        = crop(out_georef, tile_box.min().x(), tile_box.min().y());
-      block_write_gdal_image(dem_tile, out_dem, crop_georef, opt.out_nodata_value,
-                             opt, TerminalProgressCallback("asp", "\t--> "));
-
-      // We wrote big blocks, as then there's less overhead.
-      // But those are hard to manipulate with gdal_translate.
-      if (opt.raster_tile_size[0] != 256){
-        std::string tmp_tile = fs::path(dem_tile).replace_extension(".tmp.tif").string();
-        fs::rename(dem_tile, tmp_tile);
-        DiskImageView<RealT> tmp_dem(tmp_tile);
-        opt.raster_tile_size = Vector2(256, 256); // disk block size
-        vw_out() << "Re-writing with blocks of size: " << opt.raster_tile_size[0] << std::endl;
-        block_write_gdal_image(dem_tile, tmp_dem, crop_georef, opt.out_nodata_value,
-                               opt, TerminalProgressCallback("asp", "\t--> "));
-        fs::remove(tmp_tile);
+      vector< ImageViewRef<RealT> > tile_images;
+      vector<GeoReference> tile_georefs;
+      for (size_t k = 0; k < plan.tile_dems[tile_id].size(); k++){
+        tile_images.push_back(images[plan.tile_dems[tile_id][k]]);
+        tile_georefs.push_back(georefs[plan.tile_dems[tile_id][k]]);
       }
+      write_tile(opt, plan, out_georef, tile_id, tile_images, tile_georefs,
+                 TerminalProgressCallback("asp", "\t--> "));
     }
     
   } ASP_STANDARD_CATCHES;
   
   return 0;
 }
-
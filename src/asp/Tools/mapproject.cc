@@ -29,6 +29,10 @@ using namespace vw::cartography;
 
 #include <asp/Core/Macros.h>
 #include <asp/Core/Common.h>
+#include <asp/Core/ProcessPool.h>
+#include <asp/Core/CameraSurrogate.h>
+#include <asp/Core/TransformGrid.h>
+#include <asp/Core/DemRayCaster.h>
 #include <asp/Sessions/DG/StereoSessionDG.h>
 #include <asp/Sessions/DG/XML.h>
 #include <asp/asp_config.h>
@@ -42,11 +46,14 @@ struct Options : asp::BaseOptions {
   // Input
   std::string dem_file, image_file, camera_model_file, output_file, stereo_session,
     bundle_adjust_prefix;
+  // All images to project, with image_file etc. above set to the first
+  std::vector<std::string> image_files, camera_model_files, output_files;
   bool isQuery;
 
   // Settings
   std::string target_srs_string;
-  double nodata_value, target_resolution, mpp, ppd;
+  double nodata_value, target_resolution, mpp, ppd, camera_surrogate_tol,
+    projection_grid_tol;
   BBox2 target_projwin, target_pixelwin;
 };
 
@@ -73,24 +80,26 @@ void handle_arguments( int argc, char *argv[], Options& opt ) {
     ("t_pixelwin",       po::value(&opt.target_pixelwin),
      "Limit the map-projected image to this region, with the corners given in pixels (xmin ymin xmax ymax). Max is exclusive.")
     ("bundle-adjust-prefix", po::value(&opt.bundle_adjust_prefix),
-     "Use the camera adjustment obtained by previously running bundle_adjust with this output prefix.");
+     "Use the camera adjustment obtained by previously running bundle_adjust with this output prefix.")
+    ("camera-surrogate-tol", po::value(&opt.camera_surrogate_tol)->default_value(0.0),
+     "If positive, sample the camera on a grid over the DEM and project with interpolation, with this maximum error in pixels. Faster for expensive cameras, and lets ISIS cameras run multi-threaded.")
+    ("projection-grid-tol", po::value(&opt.projection_grid_tol)->default_value(0.0),
+     "If positive, find the camera pixel of each output pixel by interpolating between exactly projected pixels, on a grid refined in each output tile until the error at check points is at most this many pixels.");
     
   general_options.add( asp::BaseOptionsDescription(opt) );
 
+  std::vector<std::string> input_files;
   po::options_description positional("");
   positional.add_options()
     ("dem",          po::value(&opt.dem_file))
-    ("camera-image", po::value(&opt.image_file))
-    ("camera-model", po::value(&opt.camera_model_file))
-    ("output-file" , po::value(&opt.output_file));
+    ("input-files",  po::value(&input_files));
 
   po::positional_options_description positional_desc;
   positional_desc.add("dem",         1);
-  positional_desc.add("camera-image",1);
-  positional_desc.add("camera-model",1);
-  positional_desc.add("output-file", 1);
+  positional_desc.add("input-files", -1);
 
-  std::string usage("[options] <dem> <camera-image> <camera-model> <output>");
+  std::string usage("[options] <dem> <camera-image> <camera-model> <output> "
+                    "[<camera-image> <camera-model> <output> ...]");
   bool allow_unregistered = false;
   std::vector<std::string> unregistered;
   po::variables_map vm =
@@ -98,9 +107,30 @@ void handle_arguments( int argc, char *argv[], Options& opt ) {
                              positional, positional_desc, usage,
                              allow_unregistered, unregistered );
 
-  if ( !vm.count("dem") || !vm.count("camera-image") || !vm.count("camera-model") )
+  if ( !vm.count("dem") || input_files.size() < 2 )
     vw_throw( ArgumentErr() << usage << general_options );
 
+  // A single image may omit the output, as for ISIS the camera is in
+  // the image. Several images must come in complete triples.
+  if ( input_files.size() <= 3 ){
+    opt.image_files.push_back(input_files[0]);
+    opt.camera_model_files.push_back(input_files[1]);
+    opt.output_files.push_back(input_files.size() == 3 ? input_files[2] : "");
+  }else{
+    if ( input_files.size() % 3 != 0 )
+      vw_throw( ArgumentErr() << "Expecting the inputs to be triples of "
+                << "image, camera model, and output file.\n"
+                << usage << general_options );
+    for (size_t i = 0; i < input_files.size(); i += 3){
+      opt.image_files.push_back(input_files[i]);
+      opt.camera_model_files.push_back(input_files[i+1]);
+      opt.output_files.push_back(input_files[i+2]);
+    }
+  }
+  opt.image_file        = opt.image_files[0];
+  opt.camera_model_file = opt.camera_model_files[0];
+  opt.output_file       = opt.output_files[0];
+
   // We support map-projecting using the DG camera model, however, these images
   // cannot be used later to do stereo, as that process expects the images
   // to be map-projected using the RPC model. 
@@ -115,69 +145,61 @@ void handle_arguments( int argc, char *argv[], Options& opt ) {
   
 }
 
-template <class ImageT>
-void write_parallel_cond( std::string              const& filename,
-                          ImageViewBase<ImageT>    const& image,
-                          GeoReference             const& georef,
-                          bool has_nodata, double nodata_val,
-                          Options                  const& opt,
-                          TerminalProgressCallback const& tpc ) {
-
-  // Save the session type. Later in stereo we will check that we use
-  // only images written by mapproject with the -t rpc session.
-  std::map<std::string, std::string> keywords;
-  keywords["CAMERA_MODEL_TYPE" ] = opt.stereo_session;
-
-  // ISIS is not thread safe so we must switch out base on what the session is.
-
-  vw_out() << "Writing: " << filename << "\n";
-  if (has_nodata){
-    if ( opt.stereo_session == "isis" ) {
-      asp::write_gdal_georeferenced_image(filename, image.impl(), georef,
-                                          nodata_val, opt, tpc, keywords);
-    } else {
-      asp::block_write_gdal_image(filename, image.impl(), georef,
-                                  nodata_val, opt, tpc, keywords);
-    }
-  }else{ // Does not have nodata
-    if ( opt.stereo_session == "isis" ) {
-      asp::write_gdal_georeferenced_image(filename, image.impl(), georef,
-                                          opt, tpc, keywords);
-    } else {
-      asp::block_write_gdal_image(filename, image.impl(), georef,
-                                  opt, tpc, keywords);
-    }
-  }
+/// The map-projected image, given the output-to-camera pixel transform
+template <class TxT>
+ImageViewRef<float> projected_view( boost::shared_ptr<DiskImageResource> img_rsrc,
+                                    TxT const& tx, BBox2i const& target_image_size,
+                                    BBox2i const& croppedImageBB, double nodata_value ) {
+  PMaskT nodata_mask = PMaskT(); // invalid value for a PixelMask
+  return
+    crop( // Apply crop (only happens if --t_pixelwin was specified)
+         apply_mask
+         ( // Handle nodata
+          transform_nodata( // Apply the output from Map2CamTrans
+                           create_mask(DiskImageView<float>(img_rsrc),
+                                       nodata_value), // Handle nodata
+                           tx,
+                           target_image_size.width(),
+                           target_image_size.height(),
+                           ValueEdgeExtension<PMaskT>(nodata_mask),
+                           BicubicInterpolation(), nodata_mask
+                           ),
+          nodata_value
+          ),
+         croppedImageBB
+         );
+}
 
+/// The range of heights in a DEM, padded a bit
+Vector2 dem_height_range( asp::DemRayCaster const& caster ) {
+  Vector2 range;
+  if ( !caster.height_range(range) )
+    vw_throw( ArgumentErr() << "The DEM has no valid heights.\n" );
+  double pad = 0.1 * (range[1] - range[0]) + 10.0;
+  return Vector2( range[0] - pad, range[1] + pad );
 }
 
 /// Compute output georeference to use
 void calc_target_geom(// Inputs
-                      bool first_pass,
                       bool calc_target_res,
-                      Vector2i const& image_size,
-                      boost::shared_ptr<camera::CameraModel> const& camera_model,
-                      ImageViewRef<PMaskT> const& dem,
-                      GeoReference dem_georef, // make copy on purpose
+                      asp::CameraFootprint const& footprint,
                       // Outputs
                       Options & opt, BBox2 & cam_box, GeoReference & target_georef
                       ){
 
   // Find the camera bbox and the target resolution unless user-supplied.
-  // - This call returns the bounding box of the camera view on the ground.
-  // - The bounding box is in units defined by dem_georef and might not be meters.
+  // - The bounding box of the camera view on the ground is found
+  //   from where the camera rays meet the DEM.
+  // - The bounding box is in units defined by target_georef and might not be meters.
   // - auto_res is an estimate of the ground resolution visible by the camera.
-  //   This is in a unit defined by dem_georef and also might not be meters.
+  //   This is in a unit defined by target_georef and also might not be meters.
   float auto_res;
-  cam_box = camera_bbox(dem, dem_georef, camera_model,
-                        image_size.x(), image_size.y(), auto_res);
-
-  if (first_pass){
-    // Convert bounding box from dem_georef coordinate system to
-    //  target_georef coordinate system
-    cam_box = target_georef.lonlat_to_point_bbox
-      (dem_georef.point_to_lonlat_bbox(cam_box));
-  }
+  cam_box = asp::footprint_bbox(footprint, target_georef, auto_res);
+  if (footprint.llh.empty() && opt.target_projwin == BBox2())
+    vw_throw( ArgumentErr() << "The camera image does not overlap with the DEM.\n" );
+  if (calc_target_res && std::isnan(auto_res))
+    vw_throw( ArgumentErr() << "Could not estimate the output resolution. "
+              << "Set it with --tr, --mpp, or --ppd.\n" );
 
   // Use auto-calculated ground resolution if that option was selected
   if (calc_target_res) opt.target_resolution = auto_res;
@@ -231,81 +253,432 @@ void calc_target_geom(// Inputs
   return;
 }
 
-int main( int argc, char* argv[] ) {
+/// The DEM all images are projected onto. It is opened once.
+struct DemInfo {
+  std::string file;
+  GeoReference georef;
+  ImageViewRef<PMaskT> dem;
+  // Finds where the cameras see the DEM
+  boost::shared_ptr<asp::DemRayCaster> caster;
+  Vector2 height_range; // only for the camera surrogate
+};
 
-  Options opt;
-  try {
-    handle_arguments( argc, argv, opt );
+/// Where one image is projected to
+struct ProjectionGeom {
+  GeoReference target_georef, dem_georef;
+  BBox2i target_image_size, croppedImageBB;
+  Vector2i image_size;
+};
 
-    // We create a stereo session where both of the cameras and images
-    // are the same, because we want to take advantage of the stereo
-    // pipeline's ability to generate camera models for various
-    // missions.  Hence, we create two identical camera models, but
-    // only one is used.
-    typedef boost::scoped_ptr<asp::StereoSession> SessionPtr;
-    SessionPtr session( asp::StereoSession::create(opt.stereo_session, // in-out
-                                                   opt,
-                                                   opt.image_file, opt.image_file,
-                                                   opt.camera_model_file,
-                                                   opt.camera_model_file,
-                                                   opt.output_file,
-                                                   opt.dem_file
-                                                   ) );
-
-    if (session->name() == "isis" && opt.output_file.empty() ){
-      // The user did not provide an output file. Then the camera
-      // information is contained within the image file and what is in
-      // the camera file is actually the output file.
-      opt.output_file = opt.camera_model_file;
-      opt.camera_model_file = opt.image_file;
-    }
-    if ( opt.output_file.empty() )
-      vw_throw( ArgumentErr() << "Missing output filename.\n" );
+/// Everything needed to write one map-projected image
+struct ProjectedImage {
+  Options opt; // per image, as the resolution may come from the camera
+  boost::shared_ptr<camera::CameraModel> camera_model;
+  bool multithreaded_camera;
+  GeoReference georef;
+  ProjectionGeom geom;
+  // Not formed for cameras which are not thread safe, as those are
+  // written by worker processes which form their own
+  ImageViewRef<float> view;
+  // Set with --projection-grid-tol, to report its error
+  boost::shared_ptr< asp::ApproxTransform<Map2CamTrans> > approx;
+  ProjectedImage(): multithreaded_camera(false) {}
+};
 
-    // Initialize a camera model
-    boost::shared_ptr<camera::CameraModel> camera_model =
-      session->camera_model(opt.image_file, opt.camera_model_file);
+/// Load the camera of the image in opt, with its bundle adjustment.
+/// Returns whether the camera may be used from several threads.
+bool load_camera( Options & opt, bool verbose,
+                  boost::shared_ptr<camera::CameraModel> & camera_model ) {
+
+  // We create a stereo session where both of the cameras and images
+  // are the same, because we want to take advantage of the stereo
+  // pipeline's ability to generate camera models for various
+  // missions.  Hence, we create two identical camera models, but
+  // only one is used.
+  typedef boost::scoped_ptr<asp::StereoSession> SessionPtr;
+  SessionPtr session( asp::StereoSession::create(opt.stereo_session, // in-out
+                                                 opt,
+                                                 opt.image_file, opt.image_file,
+                                                 opt.camera_model_file,
+                                                 opt.camera_model_file,
+                                                 opt.output_file,
+                                                 opt.dem_file
+                                                 ) );
+
+  if (session->name() == "isis" && opt.output_file.empty() ){
+    // The user did not provide an output file. Then the camera
+    // information is contained within the image file and what is in
+    // the camera file is actually the output file.
+    opt.output_file = opt.camera_model_file;
+    opt.camera_model_file = opt.image_file;
+  }
+  if ( opt.output_file.empty() )
+    vw_throw( ArgumentErr() << "Missing output filename.\n" );
+
+  // Initialize a camera model
+  camera_model = session->camera_model(opt.image_file, opt.camera_model_file);
 
 #if ASP_HAVE_PKG_VW_BUNDLEADJUSTMENT
-    std::string ba_pref = opt.bundle_adjust_prefix;
-    if (ba_pref != ""){
-      
-      // If the user has generated a set of position and pose
-      // corrections using the bundle_adjust program, we read them in
-      // here and incorporate them into our camera model.
-      Vector3 position_correction;
-      Quaternion<double> pose_correction;
-      // Left adjusted camera
-      std::string adjust_file = asp::bundle_adjust_file_name(ba_pref,
-                                                             opt.image_file);
-      if (fs::exists(adjust_file)) {
+  std::string ba_pref = opt.bundle_adjust_prefix;
+  if (ba_pref != ""){
+
+    // If the user has generated a set of position and pose
+    // corrections using the bundle_adjust program, we read them in
+    // here and incorporate them into our camera model.
+    Vector3 position_correction;
+    Quaternion<double> pose_correction;
+    // Left adjusted camera
+    std::string adjust_file = asp::bundle_adjust_file_name(ba_pref,
+                                                           opt.image_file);
+    if (fs::exists(adjust_file)) {
+      if (verbose)
         vw_out() << "Using adjusted camera model: "
                  << adjust_file << std::endl;
-        read_adjustments(adjust_file, position_correction, pose_correction);
-        camera_model =
-          boost::shared_ptr<camera::CameraModel>
-          (new camera::AdjustedCameraModel(camera_model,
-                                           position_correction,
-                                           pose_correction));
-      }else
-        vw_throw(InputErr() << "Missing adjusted camera model: " <<
-                 adjust_file << ".\n");
-    }
+      read_adjustments(adjust_file, position_correction, pose_correction);
+      camera_model =
+        boost::shared_ptr<camera::CameraModel>
+        (new camera::AdjustedCameraModel(camera_model,
+                                         position_correction,
+                                         pose_correction));
+    }else
+      vw_throw(InputErr() << "Missing adjusted camera model: " <<
+               adjust_file << ".\n");
+  }
 #endif
-      
-    // Safety check that the users are not trying to map project map projected images.
-    {
-      GeoReference dummy_georef;
-      VW_ASSERT( !read_georeference( dummy_georef, opt.image_file ),
-                 ArgumentErr() << "Your input camera image is already map "
-                 << "projected. The expected input is required to be "
-                 << "unprojected or raw camera imagery." );
+
+  return session->supports_multi_threading();
+}
+
+/// Have a copy of Map2CamTrans read the DEM under an output tile, as
+/// its reverse_bbox() would, without finding the input box.
+void cache_map2cam_tile( Map2CamTrans const& map2cam, BBox2i const& bbox ) {
+  map2cam.cache_dem(bbox);
+}
+
+/// Open the image in opt and form its map-projected view with
+/// camera_model, which the caller must keep alive.
+ImageViewRef<float>
+form_projected_view( Options const& opt, ProjectionGeom const& geom,
+                     boost::shared_ptr<camera::CameraModel> const& camera_model,
+                     boost::shared_ptr< asp::ApproxTransform<Map2CamTrans> > & approx ) {
+
+  // Create handle to input image to be projected on to the map
+  boost::shared_ptr<DiskImageResource>
+    img_rsrc( DiskImageResource::open( opt.image_file ) );
+
+  bool call_from_mapproject = true;
+  Map2CamTrans map2cam( // Converts coordinates in DEM
+                        // georeference to camera pixels
+                       camera_model.get(), geom.target_georef,
+                       geom.dem_georef, opt.dem_file, geom.image_size,
+                       call_from_mapproject
+                       );
+  if (opt.projection_grid_tol > 0){
+    approx.reset(new asp::ApproxTransform<Map2CamTrans>
+                 (map2cam, BBox2(0, 0, geom.image_size.x(), geom.image_size.y()),
+                  opt.projection_grid_tol, 32, &cache_map2cam_tile));
+    return projected_view(img_rsrc, *approx, geom.target_image_size,
+                          geom.croppedImageBB, opt.nodata_value);
+  }
+  return projected_view(img_rsrc, map2cam, geom.target_image_size,
+                        geom.croppedImageBB, opt.nodata_value);
+}
+
+/// Loads the camera and forms the map-projected view from scratch,
+/// for asp::process_write_image(), so that each worker process has
+/// its own camera, DEM, and image.
+struct ProjectedViewFactory {
+  typedef asp::OwnedView<float> result_type;
+  struct Owner {
+    boost::shared_ptr<camera::CameraModel> camera_model;
+    boost::shared_ptr< asp::ApproxTransform<Map2CamTrans> > approx;
+  };
+  Options m_opt;
+  ProjectionGeom m_geom;
+  ProjectedViewFactory( Options const& opt, ProjectionGeom const& geom ):
+    m_opt(opt), m_geom(geom) {}
+  result_type operator()() const {
+    Options opt = m_opt;
+    boost::shared_ptr<Owner> owner( new Owner );
+    load_camera(opt, false, owner->camera_model);
+    result_type result;
+    result.view  = form_projected_view(opt, m_geom, owner->camera_model,
+                                       owner->approx);
+    result.owner = owner;
+    return result;
+  }
+};
+
+/// Write one map-projected image. Cameras which are not thread safe,
+/// such as ISIS, are rasterized with worker processes rather than threads.
+void write_parallel_cond( ProjectedImage const& proj, bool has_nodata,
+                          TerminalProgressCallback const& tpc ) {
+
+  // Save the session type. Later in stereo we will check that we use
+  // only images written by mapproject with the -t rpc session.
+  Options const& opt = proj.opt;
+  std::map<std::string, std::string> keywords;
+  keywords["CAMERA_MODEL_TYPE" ] = opt.stereo_session;
+
+  std::string const& filename = opt.output_file;
+  vw_out() << "Writing: " << filename << "\n";
+  if ( !proj.multithreaded_camera ) {
+    ProjectedViewFactory make_view(opt, proj.geom);
+    if (has_nodata)
+      asp::process_write_gdal_image(filename, make_view, proj.georef,
+                                    opt.nodata_value, opt, tpc, keywords);
+    else
+      asp::process_write_gdal_image(filename, make_view, proj.georef,
+                                    opt, tpc, keywords);
+  }else{
+    if (has_nodata)
+      asp::block_write_gdal_image(filename, proj.view, proj.georef,
+                                  opt.nodata_value, opt, tpc, keywords);
+    else
+      asp::block_write_gdal_image(filename, proj.view, proj.georef,
+                                  opt, tpc, keywords);
+  }
+}
+
+/// Find the camera, the output georeference and size, and form the
+/// map-projected view of the image in opt. A query stops before the
+/// view.
+void prepare_image( Options & opt, DemInfo const& dem_info, ProjectedImage & proj ) {
+
+  boost::shared_ptr<camera::CameraModel> camera_model;
+  bool multithreaded_camera = load_camera(opt, true, camera_model);
+
+  // Safety check that the users are not trying to map project map projected images.
+  {
+    GeoReference dummy_georef;
+    VW_ASSERT( !read_georeference( dummy_georef, opt.image_file ),
+               ArgumentErr() << "Your input camera image is already map "
+               << "projected. The expected input is required to be "
+               << "unprojected or raw camera imagery." );
+  }
+
+  GeoReference const& dem_georef = dem_info.georef;
+
+  // Replace the camera with an interpolating surrogate covering the
+  // heights of the DEM.
+  Vector2i image_size = asp::file_image_size( opt.image_file );
+  if (opt.camera_surrogate_tol > 0){
+    boost::shared_ptr<asp::CameraSurrogate> surrogate
+      (new asp::CameraSurrogate(*camera_model, image_size, opt.camera_surrogate_tol,
+                                dem_georef.datum(), dem_info.height_range));
+    vw_out() << "Camera surrogate max error: " << surrogate->ground_error()
+             << " pixels.\n";
+    camera_model = surrogate;
+    multithreaded_camera = true;
+  }
+
+  // Find the target resolution based on mpp or ppd if provided. Do
+  // the math to convert pixel-per-degree to meter-per-pixel and vice-versa.
+  int sum = (!std::isnan(opt.target_resolution)) + (!std::isnan(opt.mpp))
+    + (!std::isnan(opt.ppd));
+  if (sum >= 2){
+    vw_throw( ArgumentErr() << "Must specify at most one of the options: "
+              << "--tr, --mpp, --ppd.\n" );
+  }
+  double radius = dem_georef.datum().semi_major_axis();
+  if ( !std::isnan(opt.mpp) ){ // Meters per pixel was set
+    opt.ppd = 2.0*M_PI*radius/(360.0*opt.mpp);
+  }else if ( !std::isnan(opt.ppd) ){ // Pixels per degree was set
+    opt.mpp = 2.0*M_PI*radius/(360.0*opt.ppd);
+  }
+  if ( !std::isnan(opt.ppd) ) { // pixels per degree now available
+    if (dem_georef.is_projected()) {
+      opt.target_resolution = opt.mpp; // Use units of meters
+    } else { // Not projected, GDC coordinates only.
+      opt.target_resolution = 1/opt.ppd; // Use units of degrees
+                                         // Lat/lon degrees are different so we never want to do this!
     }
+  }
+
+  // Read projection. Work out output bounding box in points using
+  // original camera model.
+  GeoReference target_georef = dem_georef;
+
+  // User specified the proj4 string for the output georeference
+  if (opt.target_srs_string != ""){
+    bool have_user_datum = false;
+    Datum user_datum;
+    asp::set_srs_string(opt.target_srs_string, have_user_datum,
+                        user_datum, target_georef);
+  }
+
+  // Cast the rays through the image edges onto the DEM once, and
+  // find their extent in target's coordinate system.
+  bool calc_target_res = std::isnan(opt.target_resolution);
+  asp::CameraFootprint footprint
+    = asp::camera_footprint(*dem_info.caster, *camera_model, image_size);
+  BBox2 cam_box;
+  calc_target_geom(// Inputs
+                   calc_target_res, footprint,
+                   // Outputs
+                   opt, cam_box, target_georef);
+
+  // Compute output image size in pixels using bounding box in output projected space
+  BBox2i target_image_size = target_georef.point_to_pixel_bbox( cam_box );
+  target_image_size.min() = Vector2(0, 0); // we count on this transform_nodata
+
+  vw_out() << "Cropping to projected coordinates: " << cam_box << std::endl;
+
+  // Shrink output image BB if an output image BB was passed in
+  GeoReference croppedGeoRef  = target_georef;
+  BBox2i       croppedImageBB = target_image_size;
+  if ( opt.target_pixelwin != BBox2() ) {
+    // Replace with passed in bounding box
+    croppedImageBB = opt.target_pixelwin;
+
+    // Update output georeference to match the reduced image size
+    croppedGeoRef = vw::cartography::crop(target_georef, croppedImageBB);
+  }
+
+  vw_out() << "Output georeference:\n"        << croppedGeoRef << std::endl;
+  vw_out() << "Output image bounding box:\n";
+  vw_out() << "(Origin: (" << croppedImageBB.min()[0] << ", " << croppedImageBB.min()[1] << ") width: "
+           << croppedImageBB.width() << " height: " << croppedImageBB.height() << ")" << std::endl;
+
+  if (opt.isQuery) // Quit before we do any image work
+    return;
+
+  // Use the nodata passed in by the user if it is not available in
+  // the input file.
+  {
+    boost::shared_ptr<DiskImageResource>
+      img_rsrc( DiskImageResource::open( opt.image_file ) );
+    if (img_rsrc->has_nodata_read()) opt.nodata_value = img_rsrc->nodata_read();
+  }
+
+  ProjectionGeom & geom = proj.geom;
+  geom.target_georef     = target_georef;
+  geom.dem_georef        = dem_georef;
+  geom.target_image_size = target_image_size;
+  geom.croppedImageBB    = croppedImageBB;
+  geom.image_size        = image_size;
+
+  proj.opt                  = opt;
+  proj.multithreaded_camera = multithreaded_camera;
+  proj.georef               = croppedGeoRef;
+
+  // Worker processes make their own camera and view, so this one
+  // is dropped here, with its files.
+  if (multithreaded_camera){
+    proj.view = form_projected_view(opt, geom, camera_model, proj.approx);
+    proj.camera_model = camera_model; // Map2CamTrans keeps only a raw pointer
+  }
+}
+
+/// Rasterize one tile of a map-projected image and write it
+class WriteTileTask: public Task, private boost::noncopyable {
+  ImageViewRef<float> m_view;
+  DiskImageResourceGDAL & m_rsrc;
+  Mutex & m_rsrc_mutex;
+  BBox2i m_bbox;
+  int & m_num_done;
+  int m_num_tiles;
+  std::string & m_error;
+  Mutex & m_mutex;
+  ProgressCallback const& m_progress;
+public:
+  WriteTileTask(ImageViewRef<float> const& view, DiskImageResourceGDAL & rsrc,
+                Mutex & rsrc_mutex, BBox2i const& bbox, int & num_done,
+                int num_tiles, std::string & error, Mutex & mutex,
+                ProgressCallback const& progress):
+    m_view(view), m_rsrc(rsrc), m_rsrc_mutex(rsrc_mutex), m_bbox(bbox),
+    m_num_done(num_done), m_num_tiles(num_tiles), m_error(error),
+    m_mutex(mutex), m_progress(progress){}
+
+  void operator()(){
+    try{
+      ImageView<float> tile = crop(m_view, m_bbox);
+      ImageBuffer buf;
+      buf.data    = &tile(0, 0);
+      buf.format  = tile.format();
+      buf.cstride = sizeof(float);
+      buf.rstride = sizeof(float) * tile.cols();
+      buf.pstride = sizeof(float) * tile.cols() * tile.rows();
+      {
+        Mutex::Lock lock(m_rsrc_mutex);
+        m_rsrc.write(buf, m_bbox);
+      }
+    }catch(const std::exception& e){
+      Mutex::Lock lock(m_mutex);
+      if (m_error.empty()) m_error = e.what();
+    }
+    Mutex::Lock lock(m_mutex);
+    m_num_done++;
+    m_progress.report_progress(double(m_num_done)/m_num_tiles);
+  }
+};
+
+/// Write several map-projected images, with the tiles of all of them
+/// sharing one pool of threads. The cameras must be thread-safe.
+void write_images_together( std::vector<ProjectedImage> const& images,
+                            Options const& opt ) {
+
+  std::vector< boost::shared_ptr<DiskImageResourceGDAL> > rsrcs;
+  std::vector< boost::shared_ptr<Mutex> > rsrc_mutexes;
+  std::vector< std::vector<BBox2i> > tiles;
+  int num_tiles = 0;
+  for (size_t i = 0; i < images.size(); i++){
+    ProjectedImage const& proj = images[i];
+    vw_out() << "Writing: " << proj.opt.output_file << "\n";
+    asp::create_out_dir(proj.opt.output_file);
+    boost::shared_ptr<DiskImageResourceGDAL>
+      rsrc(asp::build_gdal_rsrc(proj.opt.output_file, proj.view, proj.opt));
+    rsrc->set_nodata_write(proj.opt.nodata_value);
+    write_header_string(*rsrc, "CAMERA_MODEL_TYPE", proj.opt.stereo_session);
+    write_georeference(*rsrc, proj.georef);
+    Vector2i block_size = rsrc->block_write_size();
+    tiles.push_back(image_blocks(proj.view, block_size.x(), block_size.y()));
+    num_tiles += tiles.back().size();
+    rsrcs.push_back(rsrc);
+    rsrc_mutexes.push_back(boost::shared_ptr<Mutex>(new Mutex));
+  }
+
+  // Interleave the images, so that all of them progress at once and
+  // their DEM reads overlap.
+  TerminalProgressCallback tpc("", "");
+  tpc.report_progress(0);
+  int num_done = 0;
+  std::string error;
+  Mutex mutex;
+  int num_threads = opt.num_threads;
+  if (num_threads <= 0) num_threads = vw_settings().default_num_threads();
+  FifoWorkQueue queue(num_threads);
+  for (size_t k = 0; ; k++){
+    bool added = false;
+    for (size_t i = 0; i < images.size(); i++){
+      if (k >= tiles[i].size()) continue;
+      boost::shared_ptr<Task>
+        task(new WriteTileTask(images[i].view, *rsrcs[i], *rsrc_mutexes[i],
+                               tiles[i][k], num_done, num_tiles, error,
+                               mutex, tpc));
+      queue.add_task(task);
+      added = true;
+    }
+    if (!added) break;
+  }
+  queue.join_all();
+  tpc.report_finished();
+
+  if (!error.empty())
+    vw_throw( ArgumentErr() << "Failed to write the map-projected images: "
+              << error << "\n" );
+}
+
+int main( int argc, char* argv[] ) {
 
-    // Load the DEM
-    GeoReference dem_georef;
-    ImageViewRef<PMaskT> dem;
-    bool has_georef = read_georeference(dem_georef, opt.dem_file);
+  Options opt;
+  try {
+    handle_arguments( argc, argv, opt );
+
+    // Load the DEM, once for all images
+    DemInfo dem_info;
+    dem_info.file = opt.dem_file;
+    bool has_georef = read_georeference(dem_info.georef, opt.dem_file);
     if (!has_georef)
       vw_throw( ArgumentErr() << "There is no georeference information in: "
                 << opt.dem_file << ".\n" );
@@ -316,143 +689,52 @@ int main( int argc, char* argv[] ) {
     // If we have a nodata value, create a mask.
     DiskImageView<float> dem_disk_image(opt.dem_file);
     if (dem_rsrc->has_nodata_read()){
-      dem = create_mask(dem_disk_image, dem_rsrc->nodata_read());
+      dem_info.dem = create_mask(dem_disk_image, dem_rsrc->nodata_read());
     }else{
-      dem = pixel_cast<PMaskT>(dem_disk_image);
+      dem_info.dem = pixel_cast<PMaskT>(dem_disk_image);
     }
-
-    // Find the target resolution based on mpp or ppd if provided. Do
-    // the math to convert pixel-per-degree to meter-per-pixel and vice-versa.
-    int sum = (!std::isnan(opt.target_resolution)) + (!std::isnan(opt.mpp))
-      + (!std::isnan(opt.ppd));
-    if (sum >= 2){
-      vw_throw( ArgumentErr() << "Must specify at most one of the options: "
-                << "--tr, --mpp, --ppd.\n" );
-    }
-    double radius = dem_georef.datum().semi_major_axis();
-    if ( !std::isnan(opt.mpp) ){ // Meters per pixel was set
-      opt.ppd = 2.0*M_PI*radius/(360.0*opt.mpp);
-    }else if ( !std::isnan(opt.ppd) ){ // Pixels per degree was set
-      opt.mpp = 2.0*M_PI*radius/(360.0*opt.ppd);
-    }
-    if ( !std::isnan(opt.ppd) ) { // pixels per degree now available
-      if (dem_georef.is_projected()) {
-        opt.target_resolution = opt.mpp; // Use units of meters
-      } else { // Not projected, GDC coordinates only.
-        opt.target_resolution = 1/opt.ppd; // Use units of degrees
-                                           // Lat/lon degrees are different so we never want to do this!
-      }
+    dem_info.caster = asp::subsampled_dem_ray_caster(dem_info.dem, dem_info.georef);
+    if (opt.camera_surrogate_tol > 0)
+      dem_info.height_range = dem_height_range(*dem_info.caster);
+
+    std::vector<ProjectedImage> images(opt.image_files.size());
+    bool all_multithreaded = true;
+    for (size_t i = 0; i < images.size(); i++){
+      Options image_opt = opt;
+      image_opt.image_file        = opt.image_files[i];
+      image_opt.camera_model_file = opt.camera_model_files[i];
+      image_opt.output_file       = opt.output_files[i];
+      if (images.size() > 1)
+        vw_out() << "Preparing: " << image_opt.image_file << "\n";
+      prepare_image(image_opt, dem_info, images[i]);
+      all_multithreaded = all_multithreaded && images[i].multithreaded_camera;
     }
-
-    // Read projection. Work out output bounding box in points using
-    // original camera model.
-    GeoReference target_georef = dem_georef;
-
-    // User specified the proj4 string for the output georeference
-    if (opt.target_srs_string != ""){
-      bool have_user_datum = false;
-      Datum user_datum;
-      asp::set_srs_string(opt.target_srs_string, have_user_datum,
-                          user_datum, target_georef);
-    }
-
-    // We compute the target_georef and camera box in two passes,
-    // first in the DEM coordinate system and we rotate it to target's
-    // coordinate system (which makes it grow), and then we tighten it
-    // in target's coordinate system.
-    bool calc_target_res = std::isnan(opt.target_resolution);
-    Vector2i image_size = asp::file_image_size( opt.image_file );
-    BBox2 cam_box;
-    // First pass
-    bool first_pass = true;
-    calc_target_geom(// Inputs
-                     first_pass, calc_target_res, image_size, camera_model,
-                     dem, dem_georef,
-                     // Outputs
-                     opt, cam_box, target_georef);
-
-    // Second pass
-    first_pass = false;
-    
-    // Transformed view indexes DEM based on target georeference
-    ImageViewRef<PMaskT> trans_dem 
-      = geo_transform(dem, dem_georef, target_georef,
-                      ValueEdgeExtension<PMaskT>(PMaskT()),
-                      BilinearInterpolation());
-
-    calc_target_geom(// Inputs
-                     first_pass, calc_target_res, image_size, camera_model,
-                     trans_dem, target_georef,
-                     // Outputs
-                     opt, cam_box, target_georef);
-
-    // Compute output image size in pixels using bounding box in output projected space
-    BBox2i target_image_size = target_georef.point_to_pixel_bbox( cam_box );
-    target_image_size.min() = Vector2(0, 0); // we count on this transform_nodata
-    
-    vw_out() << "Cropping to projected coordinates: " << cam_box << std::endl;
-
-    // Shrink output image BB if an output image BB was passed in
-    GeoReference croppedGeoRef  = target_georef;
-    BBox2i       croppedImageBB = target_image_size;
-    if ( opt.target_pixelwin != BBox2() ) {
-      // Replace with passed in bounding box
-      croppedImageBB = opt.target_pixelwin;
-
-      // Update output georeference to match the reduced image size
-      croppedGeoRef = vw::cartography::crop(target_georef, croppedImageBB);
-    }
-
-    vw_out() << "Output georeference:\n"        << croppedGeoRef << std::endl;
-    vw_out() << "Output image bounding box:\n";
-    vw_out() << "(Origin: (" << croppedImageBB.min()[0] << ", " << croppedImageBB.min()[1] << ") width: "
-             << croppedImageBB.width() << " height: " << croppedImageBB.height() << ")" << std::endl;
-
-    if (opt.isQuery){ // Quit before we do any image work
+    if (opt.isQuery){
       vw_out() << "Query finished, exiting mapproject tool.\n";
       return 0;
     }
     
-
-    // Create handle to input image to be projected on to the map
-    boost::shared_ptr<DiskImageResource>
-      img_rsrc( DiskImageResource::open( opt.image_file ) );
-    
-    // Write the output image. Use the nodata passed in by the user
-    // if it is not available in the input file.
-    if (img_rsrc->has_nodata_read()) opt.nodata_value = img_rsrc->nodata_read();
-    asp::create_out_dir(opt.output_file);
+    // Write the output images
     bool has_img_nodata = true;
-    PMaskT nodata_mask = PMaskT(); // invalid value for a PixelMask
-    bool call_from_mapproject = true;
-    write_parallel_cond
-      ( // Write to the output file
-       opt.output_file,
-       crop( // Apply crop (only happens if --t_pixelwin was specified)
-            apply_mask
-            ( // Handle nodata
-             transform_nodata( // Apply the output from Map2CamTrans
-                              create_mask(DiskImageView<float>(img_rsrc),
-                                          opt.nodata_value), // Handle nodata
-                              Map2CamTrans
-                              ( // Converts coordinates in DEM
-                                // georeference to camera pixels
-                               camera_model.get(), target_georef,
-                               dem_georef, opt.dem_file, image_size,
-                               call_from_mapproject
-                               ),
-                              target_image_size.width(),
-                              target_image_size.height(),
-                              ValueEdgeExtension<PMaskT>(nodata_mask),
-                              BicubicInterpolation(), nodata_mask
-                              ),
-             opt.nodata_value
-             ),
-            croppedImageBB
-            ),
-       croppedGeoRef, has_img_nodata, opt.nodata_value, opt,
-       TerminalProgressCallback("","")
-       );
+    if (images.size() > 1 && all_multithreaded){
+      write_images_together(images, opt);
+    }else{
+      for (size_t i = 0; i < images.size(); i++){
+        ProjectedImage const& proj = images[i];
+        asp::create_out_dir(proj.opt.output_file);
+        write_parallel_cond(proj, has_img_nodata, TerminalProgressCallback("",""));
+      }
+    }
+
+    for (size_t i = 0; i < images.size(); i++){
+      // Worker processes, if used, keep their counts to themselves
+      if (!images[i].approx) continue;
+      asp::TransformGridStats stats = images[i].approx->stats();
+      if (stats.num_pixels > 0)
+        vw_out() << "Projection grid max error for " << images[i].opt.output_file
+                 << ": " << stats.max_error << " pixels. Exact projections: "
+                 << 100.0*stats.num_evals/stats.num_pixels << "% of pixels.\n";
+    }
     
   } ASP_STANDARD_CATCHES;
 
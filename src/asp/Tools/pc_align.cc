@@ -47,6 +47,7 @@
 // SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <vw/Core/Stopwatch.h>
+#include <vw/Core/ThreadPool.h>
 #include <vw/FileIO/DiskImageView.h>
 #include <vw/Math.h>
 #include <vw/Image.h>
@@ -60,12 +61,17 @@
 #include <liblas/liblas.hpp>
 
 #include <limits>
+#include <set>
 #include <cstring>
+#include <cstdio>
 
 #include <pointmatcher/PointMatcher.h>
+#include <Eigen/Eigenvalues>
 
 #include <boost/filesystem.hpp>
 #include <boost/algorithm/string.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_int_distribution.hpp>
 namespace fs = boost::filesystem;
 namespace po = boost::program_options;
 
@@ -82,6 +88,26 @@ using namespace PointMatcherSupport;
 // work with 2D point clouds. There are some Vector3's all over the place.
 const int DIM = 3;
 
+// Skip pyramid levels where a cloud has fewer points than this
+const int MIN_NUM_PYRAMID_PTS = 1000;
+
+// Below the coarsest pyramid level, matches further apart than this
+// many voxels of the previous level are outliers
+const double PYRAMID_MATCH_VOXELS = 3.0;
+
+// Without max-displacement, the part of the reference DEM read for
+// point-to-dem extends beyond the source by this fraction of its size
+const double DEM_GRID_MARGIN = 0.5;
+
+// Unless told otherwise, align at most this many sources at the same
+// time, as each holds its own sample of points in memory
+const int MAX_DEFAULT_PARALLEL_SOURCES = 4;
+
+// With max-displacement, load this many source points before
+// filtering gross outliers. In batch mode it is split among the
+// sources aligned at the same time.
+const int64 NUM_PRE_FILTER_SOURCE_PTS = 50000000;
+
 string UNSPECIFIED_DATUM = "unspecified_datum";
 
 // Allows FileIO to correctly read/write these pixel types
@@ -96,8 +122,10 @@ namespace vw {
 struct Options : public asp::BaseOptions {
   // Input
   string reference, source, init_transform_file, alignment_method, config_file, datum, csv_format_str;
+  vector<string> source_files;
   PointMatcher<RealT>::Matrix init_transform;
-  int num_iter, max_num_reference_points, max_num_source_points;
+  int num_iter, max_num_reference_points, max_num_source_points, num_parallel_sources;
+  int num_pyramid_levels;
   double diff_translation_err, diff_rotation_err, max_disp, outlier_ratio;
   double semi_major, semi_minor;
   bool compute_translation_only, save_trans_source, save_trans_ref, highest_accuracy, verbose;
@@ -106,6 +134,11 @@ struct Options : public asp::BaseOptions {
   Options():max_disp(-1.0), verbose(true){}
 };
 
+// The output prefix for the i-th of several source clouds
+string batch_out_prefix(Options const& opt, int i){
+  return opt.out_prefix + "-" + fs::basename(opt.source_files[i]);
+}
+
 void handle_arguments( int argc, char *argv[], Options& opt ) {
   po::options_description general_options("");
   general_options.add_options()
@@ -119,7 +152,11 @@ void handle_arguments( int argc, char *argv[], Options& opt ) {
     ("outlier-ratio", po::value(&opt.outlier_ratio)->default_value(0.75), "Fraction of source (movable) points considered inliers (after gross outliers further than max-displacement from reference points are removed).")
     ("max-num-reference-points", po::value(&opt.max_num_reference_points)->default_value(100000000), "Maximum number of (randomly picked) reference points to use.")
     ("max-num-source-points", po::value(&opt.max_num_source_points)->default_value(100000), "Maximum number of (randomly picked) source points to use (after discarding gross outliers).")
-    ("alignment-method", po::value(&opt.alignment_method)->default_value("point-to-plane"), "The type of iterative closest point method to use. [point-to-plane, point-to-point]")
+    ("alignment-method", po::value(&opt.alignment_method)->default_value("point-to-plane"), "The type of iterative closest point method to use. [point-to-plane, point-to-point, point-to-dem]. With point-to-dem the reference must be a DEM, and the errors, including those compared with max-displacement, are distances to the DEM tangent plane rather than to the closest reference point.")
+    ("num-pyramid-levels", po::value(&opt.num_pyramid_levels)->default_value(1),
+"Run ICP first on versions of the clouds downsampled in voxels, with the voxel size doubling at each level, then refine the result at the next finer level. This number includes the full-resolution level. The outlier ratio is the same at all levels. Below the coarsest level, matches further apart than 3 voxels of the previous level are also outliers.")
+    ("num-parallel-sources", po::value(&opt.num_parallel_sources)->default_value(0),
+     "When several source clouds are given, how many of them to align at the same time. The default is the number of threads, but no more than 4. Loading the sources and the point-to-dem alignment overlap fully, while with the other methods the steps using the reference tree are done by one source at a time.")
     ("highest-accuracy", po::bool_switch(&opt.highest_accuracy)->default_value(false)->implicit_value(true),
      "Compute with highest accuracy for point-to-plane (can be much slower).")
     ("csv-format", po::value(&opt.csv_format_str)->default_value(""), asp::csv_opt_caption().c_str())
@@ -144,14 +181,14 @@ void handle_arguments( int argc, char *argv[], Options& opt ) {
   positional.add_options()
     ("reference", po::value(&opt.reference),
      "The reference (fixed) point cloud/DEM")
-    ("source", po::value(&opt.source),
-     "The source (movable) point cloud/DEM");
+    ("source", po::value(&opt.source_files),
+     "The source (movable) point cloud/DEM, or several of them");
 
   po::positional_options_description positional_desc;
   positional_desc.add("reference", 1);
-  positional_desc.add("source", 1);
+  positional_desc.add("source", -1);
 
-  string usage("--max-displacement arg [other options] <reference cloud> <source cloud> -o <output prefix>");
+  string usage("--max-displacement arg [other options] <reference cloud> <source cloud> [<other source clouds>] -o <output prefix>");
   bool allow_unregistered = false;
   std::vector<std::string> unregistered;
   po::variables_map vm =
@@ -159,9 +196,10 @@ void handle_arguments( int argc, char *argv[], Options& opt ) {
                              positional, positional_desc, usage,
                              allow_unregistered, unregistered );
 
-  if ( opt.reference.empty() || opt.source.empty() )
+  if ( opt.reference.empty() || opt.source_files.empty() )
     vw_throw( ArgumentErr() << "Missing input files.\n"
               << usage << general_options );
+  opt.source = opt.source_files[0];
 
   if ( opt.out_prefix.empty() )
     vw_throw( ArgumentErr() << "Missing output prefix.\n"
@@ -175,6 +213,22 @@ void handle_arguments( int argc, char *argv[], Options& opt ) {
     vw_throw( ArgumentErr() << "The number of iterations must be non-negative.\n"
               << usage << general_options );
 
+  if ( opt.num_pyramid_levels < 1 )
+    vw_throw( ArgumentErr() << "The number of pyramid levels must be positive.\n"
+              << usage << general_options );
+
+  if ( opt.alignment_method != "point-to-plane" &&
+       opt.alignment_method != "point-to-point" &&
+       opt.alignment_method != "point-to-dem" )
+    vw_throw( ArgumentErr() << "Unknown alignment method: "
+              << opt.alignment_method << ".\n"
+              << usage << general_options );
+
+  if ( opt.alignment_method == "point-to-dem" && opt.config_file != "" )
+    vw_throw( ArgumentErr() << "A configuration file cannot be used with the "
+              << "point-to-dem alignment method.\n"
+              << usage << general_options );
+
   if ( (opt.semi_major != 0 && opt.semi_minor == 0)
        ||
        (opt.semi_minor != 0 && opt.semi_major == 0)       
@@ -196,6 +250,24 @@ void handle_arguments( int argc, char *argv[], Options& opt ) {
               << usage << general_options );
   }
   
+  // With several sources, the outputs for each go to a prefix
+  // made from its name, so the names must differ.
+  if ( opt.source_files.size() > 1 ){
+    set<string> prefixes;
+    for (size_t i = 0; i < opt.source_files.size(); i++){
+      if (!prefixes.insert(batch_out_prefix(opt, i)).second)
+        vw_throw( ArgumentErr() << "Source clouds must have distinct names, "
+                  << "without the extension. Repeated: "
+                  << opt.source_files[i] << ".\n" );
+    }
+  }
+
+  if ( opt.num_parallel_sources <= 0 ){
+    int num_threads = (opt.num_threads > 0) ? opt.num_threads :
+      vw_settings().default_num_threads();
+    opt.num_parallel_sources = std::min(num_threads, MAX_DEFAULT_PARALLEL_SOURCES);
+  }
+
   // Create the output directory 
   asp::create_out_dir(opt.out_prefix);
   
@@ -411,23 +483,145 @@ void random_pc_subsample(int m, typename PointMatcher<T>::DataPoints& points){
   points.features.conservativeResize(Eigen::NoChange, m);
 }
 
+// The integer coordinates of the voxel containing a point
+struct VoxelKey{
+  int64 x, y, z;
+  bool operator<(VoxelKey const& k) const{
+    if (x != k.x) return x < k.x;
+    if (y != k.y) return y < k.y;
+    return z < k.z;
+  }
+  bool operator==(VoxelKey const& k) const{
+    return x == k.x && y == k.y && z == k.z;
+  }
+};
+
+// Replace the points within each voxel (cube) of given size with
+// their centroid.
+DP voxel_downsample(DP const& points, double voxel_size){
+
+  PointMatcher<RealT>::Matrix const& features = points.features;
+  int numPts = features.cols();
+  vector< pair<VoxelKey, int> > keys(numPts);
+  for (int col = 0; col < numPts; col++){
+    VoxelKey & k = keys[col].first;
+    k.x = (int64)floor(features(0, col)/voxel_size);
+    k.y = (int64)floor(features(1, col)/voxel_size);
+    k.z = (int64)floor(features(2, col)/voxel_size);
+    keys[col].second = col;
+  }
+  sort(keys.begin(), keys.end());
+
+  PointMatcher<RealT>::Matrix out(DIM + 1, numPts);
+  int count = 0;
+  for (int beg = 0; beg < numPts; ){
+    int end = beg;
+    Eigen::VectorXd sum = Eigen::VectorXd::Zero(DIM + 1);
+    while (end < numPts && keys[end].first == keys[beg].first){
+      sum += features.col(keys[end].second);
+      end++;
+    }
+    out.col(count) = sum/(end - beg);
+    count++;
+    beg = end;
+  }
+  out.conservativeResize(Eigen::NoChange, count);
+
+  return DP(out, points.featureLabels);
+}
+
+// The spacing of num_points points spread evenly over the surface
+// sampled by a cloud centered at the origin. The surface is
+// approximated by the plane of the two largest principal axes.
+double calc_spacing(DP const& points, int num_points){
+  int numPts = points.features.cols();
+  if (numPts == 0 || num_points <= 0) return 0.0;
+  Eigen::MatrixXd P = points.features.topRows(DIM);
+  Eigen::Matrix3d cov = P*P.transpose()/numPts;
+  Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> solver(cov);
+  Eigen::Vector3d ev = solver.eigenvalues(); // in increasing order
+  // Points uniform in [-a/2, a/2] have variance a^2/12.
+  double area = 12.0*sqrt(std::max(ev[1], 0.0)*std::max(ev[2], 0.0));
+  return sqrt(area/num_points);
+}
+
+// Keep a uniform random sample of at most a given number of the
+// points seen in one pass over a cloud (reservoir sampling). As long
+// as no more points were seen than that, all are kept, in order.
+// Each reservoir has its own generator, with the same seed, so
+// samples are repeatable and clouds can be loaded in parallel.
+class PointReservoir{
+  int64 m_max_num, m_num_seen;
+  boost::random::mt19937_64 m_gen;
+public:
+  PointReservoir(int64 max_num): m_max_num(std::max(max_num, int64(0))),
+                                 m_num_seen(0){}
+
+  // The slot where to store the next point, or -1 if it is not kept
+  int64 next_slot(){
+    m_num_seen++;
+    if (m_num_seen <= m_max_num) return m_num_seen - 1;
+    boost::random::uniform_int_distribution<int64> dist(0, m_num_seen - 1);
+    int64 r = dist(m_gen);
+    return (r < m_max_num) ? r : -1;
+  }
+
+  int64 num_kept() const { return std::min(m_num_seen, m_max_num); }
+  int64 num_seen() const { return m_num_seen; }
+};
+
+// A sample of the points of a cloud, in Cartesian coordinates and not
+// shifted yet.
+struct CloudSample{
+  DP data;
+  bool has_all_points;      // no point was left out by sampling
+  bool is_lola_rdr_format;
+  double mean_longitude;    // to convert back from xyz to lonlat
+  CloudSample(): has_all_points(true), is_lola_rdr_format(false),
+                 mean_longitude(0.0){}
+};
+
+// Store a point in a slot of the reservoir
+inline void store_point(CloudSample & sample, int64 slot, Vector3 const& xyz){
+  for (int row = 0; row < DIM; row++)
+    sample.data.features(row, slot) = xyz[row];
+  sample.data.features(DIM, slot) = 1;
+}
+
+// Allocate room for the sample
 template<typename T>
-int load_csv_aux(string const& file_name, int num_points_to_load,
-                 BBox2 const& lonlat_box, bool verbose,
-                 bool calc_shift, Vector3 & shift,
-                 GeoReference const& geo, asp::CsvConv const& C,
-                 bool & is_lola_rdr_format, double & mean_longitude,
-                 typename PointMatcher<T>::DataPoints & data){
-  
+void init_sample(int64 max_num_points, int64 num_total_points,
+                 CloudSample & sample){
+  sample.data.features.conservativeResize
+    (DIM+1, std::max(int64(0), std::min(max_num_points, num_total_points)));
+  sample.data.featureLabels = form_labels<T>(DIM);
+}
+
+// The lon-lat of a point, with the longitude in the range of the
+// cloud, as given by its mean longitude.
+Vector2 point_to_lonlat(Vector3 const& xyz, GeoReference const& geo,
+                        double mean_longitude){
+  Vector3 llh = geo.datum().cartesian_to_geodetic(xyz);
+  llh[0] += 360.0*round((mean_longitude - llh[0])/360.0); // 360 deg adjust
+  return subvector(llh, 0, 2);
+}
+
+template<typename T>
+void load_csv(string const& file_name, int64 num_points_to_load,
+              BBox2 const& lonlat_box, bool verbose,
+              GeoReference const& geo, asp::CsvConv const& C,
+              CloudSample & sample){
+
   validateFile(file_name);
 
+  bool & is_lola_rdr_format = sample.is_lola_rdr_format;
   is_lola_rdr_format = false;
 
-  int num_total_points = asp::csv_file_size(file_name);
+  int64 num_total_points = asp::csv_file_size(file_name);
 
   std::string sep_str = asp::csv_separator();
   const char* sep = sep_str.c_str();
-  
+
   const int bufSize = 1024;
   char temp[bufSize];
   ifstream file( file_name.c_str() );
@@ -435,19 +629,14 @@ int load_csv_aux(string const& file_name, int num_points_to_load,
     vw_throw( vw::IOErr() << "Unable to open file \"" << file_name << "\"" );
   }
 
-  // We will randomly pick or not a point with probability load_ratio
-  double load_ratio
-    = (double)num_points_to_load/std::max(1.0, (double)num_total_points);
-
-  data.features.conservativeResize(DIM+1, std::min(num_points_to_load,
-                                                   num_total_points));
-  data.featureLabels = form_labels<T>(DIM);
+  init_sample<T>(num_points_to_load, num_total_points, sample);
+  PointReservoir reservoir(sample.data.features.cols());
 
   // Peek at the first valid line and see how many elements it has
   string line;
   while ( getline(file, line, '\n') )
     if (asp::is_valid_csv_line(line)) break;
-  
+
   file.clear(); file.seekg(0, ios_base::beg); // go back to start of file
   strncpy(temp, line.c_str(), bufSize);
   const char* token = strtok (temp, sep);
@@ -475,7 +664,7 @@ int load_csv_aux(string const& file_name, int num_points_to_load,
                  << "format.\n";
     }
   }
-  
+
   if (is_lola_rdr_format &&
       geo.datum().semi_major_axis() != geo.datum().semi_minor_axis() ){
     vw_throw( ArgumentErr() << "The CSV file was detected to be in the"
@@ -483,33 +672,27 @@ int load_csv_aux(string const& file_name, int num_points_to_load,
               << "as expected for the Moon.\n" );
   }
 
-  bool shift_was_calc = false;
   bool is_first_line = true;
-  int points_count = 0;
-  mean_longitude = 0.0;
+  double mean_longitude = 0.0;
+  int64 num_valid_points = 0;
   line = "";
   while ( getline(file, line, '\n') ){
-    
-    if (points_count >= num_points_to_load) break;
 
     if (!asp::is_valid_csv_line(line)) continue;
 
-    double r = (double)std::rand()/(double)RAND_MAX;
-    if (r > load_ratio) continue;
-
     // We went with C-style file reading instead of C++ in this instance
     // because we found it to be significantly faster on large files.
 
     Vector3 xyz;
     double lon = 0.0, lat = 0.0;
-    
+
     if (C.csv_format_str != ""){
 
       // Parse custom CSV file with given format string
       bool success;
       Vector3 vals = asp::parse_csv_line(is_first_line, success, line, C);
       if (!success) continue;
-      
+
       bool return_point_height = false; // will return xyz
       xyz = asp::csv_to_cartesian_or_point_height(vals, geo, C, return_point_height);
 
@@ -528,12 +711,12 @@ int load_csv_aux(string const& file_name, int num_points_to_load,
       // Skip points outside the given box
       if (!lonlat_box.empty() && !lonlat_box.contains(Vector2(lon, lat)))
         continue;
-      
+
     }else if (!is_lola_rdr_format){
 
       // lat,lon,height format
       double lat, height;
-      
+
       strncpy(temp, line.c_str(), bufSize);
       const char* token = strtok(temp, sep); null_check(token, line);
       int ret = sscanf(token, "%lg", &lat);
@@ -572,7 +755,7 @@ int load_csv_aux(string const& file_name, int num_points_to_load,
 
       int year, month, day, hour, min;
       double lat, rad, sec, is_invalid;
-      
+
       strncpy(temp, line.c_str(), bufSize);
       const char* token = strtok(temp, sep); null_check(token, line);
 
@@ -621,18 +804,6 @@ int load_csv_aux(string const& file_name, int num_points_to_load,
       xyz = rad*(xyz/norm_2(xyz));
     }
 
-    if (calc_shift && !shift_was_calc){
-      shift = xyz;
-      shift_was_calc = true;
-    }
-
-    for (int row = 0; row < DIM; row++)
-      data.features(row, points_count) = xyz[row] - shift[row];
-    data.features(DIM, points_count) = 1;
-
-    points_count++;
-    mean_longitude += lon;
-
     // Throw an error if the lon and lat are not within bounds.
     // Note that we allow some slack for lon, perhaps the point
     // cloud is say from 350 to 370 degrees.
@@ -642,64 +813,47 @@ int load_csv_aux(string const& file_name, int num_points_to_load,
     if (lon < -360.0 || lon > 2*360.0)
       vw_throw(ArgumentErr() << "Invalid longitude value: "
                << lon << " in " << file_name << "\n");
-  }
-  data.features.conservativeResize(Eigen::NoChange, points_count);
 
-  mean_longitude /= points_count;
+    mean_longitude += lon;
+    num_valid_points++;
 
-  return num_total_points;
+    int64 slot = reservoir.next_slot();
+    if (slot >= 0) store_point(sample, slot, xyz);
+  }
+
+  sample.data.features.conservativeResize(Eigen::NoChange, reservoir.num_kept());
+  sample.has_all_points = (reservoir.num_seen() == reservoir.num_kept());
+  sample.mean_longitude = mean_longitude/std::max(int64(1), num_valid_points);
 }
 
-// Load a csv file
-template<typename T>
-void load_csv(string const& file_name,
-                 int num_points_to_load,
-                 BBox2 const& lonlat_box,
-                 bool verbose,
-                 bool calc_shift,
-                 Vector3 & shift,
-                 GeoReference const& geo,
-                 asp::CsvConv const& C,
-                 bool & is_lola_rdr_format,
-                 double & mean_longitude,
-                 typename PointMatcher<T>::DataPoints & data){
-
-  int num_total_points = load_csv_aux<T>(file_name, num_points_to_load,  
-                                         lonlat_box, verbose,  
-                                         calc_shift, shift,  
-                                         geo, C, is_lola_rdr_format,  
-                                         mean_longitude, data
-                                         );
-
-  int num_loaded_points = data.features.cols();
-  if (!lonlat_box.empty()                    &&
-      num_loaded_points < num_points_to_load &&
-      num_loaded_points < num_total_points){
-    // We loaded too few points. Just load them all, as CSV files are
-    // not too large, we will drop extraneous points later.
-    load_csv_aux<T>(file_name, num_total_points, lonlat_box,
-                    false, // Skip repeating same messages
-                    calc_shift, shift,  
-                    geo, C, is_lola_rdr_format,  
-                    mean_longitude, data
-                    );
+// The box of DEM pixels whose centers can be within a lon-lat box. If
+// the lon-lat box is empty, that is the whole DEM.
+BBox2i dem_pixel_box(GeoReference const& dem_geo, BBox2 const& lonlat_box,
+                     BBox2i const& dem_box){
+  BBox2i pix_box;
+  if (!lonlat_box.empty()){
+    pix_box.grow(dem_geo.lonlat_to_pixel(lonlat_box.min()));
+    pix_box.grow(dem_geo.lonlat_to_pixel(lonlat_box.max()));
+    pix_box.grow(dem_geo.lonlat_to_pixel(Vector2(lonlat_box.min().x(),
+                                                 lonlat_box.max().y())));
+    pix_box.grow(dem_geo.lonlat_to_pixel(Vector2(lonlat_box.max().x(),
+                                                 lonlat_box.min().y())));
+    pix_box.expand(1); // to counteract casting to int
+    pix_box.crop(dem_box);
   }
-  
-  return;  
+  if (pix_box.empty())
+    pix_box = dem_box;
+  return pix_box;
 }
 
 // Load a DEM
 template<typename T>
 void load_dem(bool verbose, string const& file_name,
-              int num_points_to_load, BBox2 const& lonlat_box,
-              bool calc_shift, Vector3 & shift,
-              typename PointMatcher<T>::DataPoints & data){
+              int64 num_points_to_load, BBox2 const& lonlat_box,
+              CloudSample & sample){
 
   validateFile(file_name);
 
-  data.features.conservativeResize(DIM+1, num_points_to_load);
-  data.featureLabels = form_labels<T>(DIM);
-
   cartography::GeoReference dem_geo;
   bool is_good = cartography::read_georeference( dem_geo, file_name );
   if (!is_good) vw_throw(ArgumentErr() << "DEM: " << file_name
@@ -712,39 +866,18 @@ void load_dem(bool verbose, string const& file_name,
   if (dem_rsrc->has_nodata_read()) nodata = dem_rsrc->nodata_read();
 
   // Load only points within lonlat_box
-  BBox2i pix_box;
-  if (!lonlat_box.empty()){
-    pix_box.grow(dem_geo.lonlat_to_pixel(lonlat_box.min()));
-    pix_box.grow(dem_geo.lonlat_to_pixel(lonlat_box.max()));
-    pix_box.grow(dem_geo.lonlat_to_pixel(Vector2(lonlat_box.min().x(),
-                                                 lonlat_box.max().y())));
-    pix_box.grow(dem_geo.lonlat_to_pixel(Vector2(lonlat_box.max().x(),
-                                                 lonlat_box.min().y())));
-    pix_box.expand(1); // to counteract casting to int
-    pix_box.crop(bounding_box(dem));
-  }
-  if (pix_box.empty())
-    pix_box = bounding_box(dem);
-
-  // We will randomly pick or not a point with probability load_ratio
-  int num_points = pix_box.width()*pix_box.height();
-  double load_ratio = (double)num_points_to_load/std::max(1.0, (double)num_points);
+  BBox2i pix_box = dem_pixel_box(dem_geo, lonlat_box, bounding_box(dem));
 
-  bool shift_was_calc = false;
-  int points_count = 0;
+  int64 num_points = int64(pix_box.width())*pix_box.height();
+  init_sample<T>(num_points_to_load, num_points, sample);
+  PointReservoir reservoir(sample.data.features.cols());
 
   TerminalProgressCallback tpc("asp", "\t--> ");
   double inc_amount = 1.0 / double(pix_box.width() );
   if (verbose) tpc.report_progress(0);
-  
-  for (int i = pix_box.min().x(); i < pix_box.max().x(); i++ ) {
-    if (points_count >= num_points_to_load) break;
 
+  for (int i = pix_box.min().x(); i < pix_box.max().x(); i++ ) {
     for (int j = pix_box.min().y(); j < pix_box.max().y(); j++ ) {
-      if (points_count >= num_points_to_load) break;
-      
-      double r = (double)std::rand()/(double)RAND_MAX;
-      if (r > load_ratio) continue;
 
       if (dem(i, j) == nodata) continue;
 
@@ -752,145 +885,99 @@ void load_dem(bool verbose, string const& file_name,
 
       // Skip points outside the given box
       if (!lonlat_box.empty() && !lonlat_box.contains(lonlat)) continue;
-      
+
       Vector3 llh( lonlat.x(), lonlat.y(), dem(i,j) );
       Vector3 xyz = dem_geo.datum().geodetic_to_cartesian( llh );
       if ( xyz == Vector3() || !(xyz == xyz) ) continue; // invalid and NaN check
 
-      if (calc_shift && !shift_was_calc){
-        shift = xyz;
-        shift_was_calc = true;
-      }
-
-      for (int row = 0; row < DIM; row++)
-        data.features(row, points_count) = xyz[row] - shift[row];
-      data.features(DIM, points_count) = 1;
-
-      points_count++;
+      int64 slot = reservoir.next_slot();
+      if (slot >= 0) store_point(sample, slot, xyz);
     }
-    
+
     if (verbose) tpc.report_incremental_progress( inc_amount );
   }
   if (verbose) tpc.report_finished();
-  
-  data.features.conservativeResize(Eigen::NoChange, points_count);
 
+  sample.data.features.conservativeResize(Eigen::NoChange, reservoir.num_kept());
+  sample.has_all_points = (reservoir.num_seen() == reservoir.num_kept());
 }
 
 template<typename T>
-int64 load_pc_aux(bool verbose,
-                  string const& file_name,
-                  int num_points_to_load,
-                  BBox2 const& lonlat_box,
-                  bool calc_shift,
-                  Vector3 & shift,
-                  GeoReference const& geo,
-                  typename PointMatcher<T>::DataPoints & data){
-  
-  validateFile(file_name);
+void load_pc(bool verbose,
+             string const& file_name,
+             int64 num_points_to_load,
+             BBox2 const& lonlat_box,
+             GeoReference const& geo,
+             CloudSample & sample){
 
-  data.features.conservativeResize(DIM+1, num_points_to_load);
-  data.featureLabels = form_labels<T>(DIM);
+  validateFile(file_name);
 
   // To do: Is it faster to to do for_each?
   ImageViewRef<Vector3> point_cloud = asp::read_cloud<DIM>(file_name);
 
-  // We will randomly pick or not a point with probability load_ratio
-  int64 num_total_points = point_cloud.cols()*point_cloud.rows();
-  double load_ratio
-    = (double)num_points_to_load/std::max(1.0, (double)num_total_points);
-
-  bool shift_was_calc = false;
-  int64 points_count = 0;
+  int64 num_total_points = int64(point_cloud.cols())*point_cloud.rows();
+  init_sample<T>(num_points_to_load, num_total_points, sample);
+  PointReservoir reservoir(sample.data.features.cols());
 
   TerminalProgressCallback tpc("asp", "\t--> ");
   double inc_amount = 1.0 / double(point_cloud.rows() );
   if (verbose) tpc.report_progress(0);
-  
-  for (int j = 0; j < point_cloud.rows(); j++ ) {
 
-    if (points_count >= num_points_to_load) break;
-    
+  for (int j = 0; j < point_cloud.rows(); j++ ) {
     for ( int i = 0; i < point_cloud.cols(); i++ ) {
-      
-      if (points_count >= num_points_to_load) break;
-
-      double r = (double)std::rand()/(double)RAND_MAX;
-      if (r > load_ratio) continue;
 
       Vector3 xyz = point_cloud(i, j);
       if ( xyz == Vector3() || !(xyz == xyz) ) continue; // invalid and NaN check
 
-      if (calc_shift && !shift_was_calc){
-        shift = xyz;
-        shift_was_calc = true;
-      }
-      
       // Skip points outside the given box
-      if (!lonlat_box.empty()){
-        Vector3 llh = geo.datum().cartesian_to_geodetic(xyz);
-        if ( !lonlat_box.contains(subvector(llh, 0, 2)))
-          continue;
-      }
-      
-      for (int row = 0; row < DIM; row++)
-        data.features(row, points_count) = xyz[row] - shift[row];
-      data.features(DIM, points_count) = 1;
+      if (!lonlat_box.empty() &&
+          !lonlat_box.contains(point_to_lonlat(xyz, geo, sample.mean_longitude)))
+        continue;
 
-      points_count++;
+      int64 slot = reservoir.next_slot();
+      if (slot >= 0) store_point(sample, slot, xyz);
     }
     if (verbose) tpc.report_incremental_progress( inc_amount );
   }
   if (verbose) tpc.report_finished();
 
-  data.features.conservativeResize(Eigen::NoChange, points_count);
-  
-  return num_total_points;
+  sample.data.features.conservativeResize(Eigen::NoChange, reservoir.num_kept());
+  sample.has_all_points = (reservoir.num_seen() == reservoir.num_kept());
 }
 
 template<typename T>
-int64 load_las_aux(bool verbose,
-                  string const& file_name,
-                  int num_points_to_load,
-                  BBox2 const& lonlat_box,
-                  bool calc_shift,
-                  Vector3 & shift,
-                  GeoReference const& geo,
-                  typename PointMatcher<T>::DataPoints & data){
-  
-  validateFile(file_name);
+void load_las(bool verbose,
+              string const& file_name,
+              int64 num_points_to_load,
+              BBox2 const& lonlat_box,
+              GeoReference const& geo,
+              CloudSample & sample){
 
-  data.features.conservativeResize(DIM+1, num_points_to_load);
-  data.featureLabels = form_labels<T>(DIM);
+  validateFile(file_name);
 
   GeoReference las_georef;
   bool has_georef = asp::georef_from_las(file_name, las_georef);
-  
+
   std::ifstream ifs;
   ifs.open(file_name.c_str(), std::ios::in | std::ios::binary);
   liblas::ReaderFactory f;
   liblas::Reader reader = f.CreateWithStream(ifs);
 
-  // We will randomly pick or not a point with probability load_ratio
   int64 num_total_points = asp::las_file_size(file_name);
-  double load_ratio
-    = (double)num_points_to_load/std::max(1.0, (double)num_total_points);
+  init_sample<T>(num_points_to_load, num_total_points, sample);
+  PointReservoir reservoir(sample.data.features.cols());
 
-  bool shift_was_calc = false;
-  int64 points_count = 0;
-  
   TerminalProgressCallback tpc("asp", "\t--> ");
   int hundred = 100;
-  int spacing = num_total_points/hundred;
+  int64 spacing = std::max(num_total_points/hundred, int64(1));
   double inc_amount = 1.0 / hundred;
   if (verbose) tpc.report_progress(0);
-  
-  while (reader.ReadNextPoint()){
 
-    if (points_count >= num_points_to_load) break;
+  int64 count = 0;
+  while (reader.ReadNextPoint()){
 
-    double r = (double)std::rand()/(double)RAND_MAX;
-    if (r > load_ratio) continue;
+    if (verbose && count%spacing == 0) tpc.report_incremental_progress( inc_amount );
+    count++;
 
     liblas::Point const& p = reader.GetPoint();
     Vector3 xyz(p.GetX(), p.GetY(), p.GetZ());
@@ -898,156 +985,71 @@ int64 load_las_aux(bool verbose,
       Vector2 ll = las_georef.point_to_lonlat(subvector(xyz, 0, 2));
       xyz = las_georef.datum().geodetic_to_cartesian(Vector3(ll[0], ll[1], xyz[2]));
     }
-    
-    if (calc_shift && !shift_was_calc){
-      shift = xyz;
-      shift_was_calc = true;
-    }
-    
+
     // Skip points outside the given box
-    if (!lonlat_box.empty()){
-      Vector3 llh = geo.datum().cartesian_to_geodetic(xyz);
-      if ( !lonlat_box.contains(subvector(llh, 0, 2)))
-        continue;
-    }
-    
-    for (int row = 0; row < DIM; row++)
-      data.features(row, points_count) = xyz[row] - shift[row];
-    data.features(DIM, points_count) = 1;
-    
-    if (verbose && points_count%spacing == 0) tpc.report_incremental_progress( inc_amount );
+    if (!lonlat_box.empty() &&
+        !lonlat_box.contains(point_to_lonlat(xyz, geo, sample.mean_longitude)))
+      continue;
 
-    points_count++;
+    int64 slot = reservoir.next_slot();
+    if (slot >= 0) store_point(sample, slot, xyz);
   }
-  
-  if (verbose) tpc.report_finished();
 
-  data.features.conservativeResize(Eigen::NoChange, points_count);
-  
-  return num_total_points;
-}
-
-template<typename T>
-void load_pc(bool verbose,
-             string const& file_name,
-             int num_points_to_load,
-             BBox2 const& lonlat_box,
-             bool calc_shift,
-             Vector3 & shift,
-             GeoReference const& geo,
-             typename PointMatcher<T>::DataPoints & data
-             ){
-  
-  int64 num_total_points = load_pc_aux<T>(verbose,
-                                          file_name, num_points_to_load,
-                                          lonlat_box, calc_shift, shift,
-                                          geo, data);
-  
-  int num_loaded_points = data.features.cols();
-  if (!lonlat_box.empty()                    &&
-      num_loaded_points < num_points_to_load &&
-      num_loaded_points < num_total_points){
-    
-    // We loaded too few points. Try harder. Need some care here as to not run
-    // out of memory.
-    num_points_to_load = std::max(4*num_points_to_load, 10000000);
-    if (verbose)
-      vw_out() << "Too few points were loaded. Trying again." << endl;
-    load_pc_aux<T>(verbose,
-                   file_name, num_points_to_load, lonlat_box,  
-                   calc_shift, shift, geo, data);
-  }
-  
-}
+  if (verbose) tpc.report_finished();
 
-template<typename T>
-void load_las(bool verbose,
-             string const& file_name,
-             int num_points_to_load,
-             BBox2 const& lonlat_box,
-             bool calc_shift,
-             Vector3 & shift,
-             GeoReference const& geo,
-             typename PointMatcher<T>::DataPoints & data
-             ){
-  
-  int64 num_total_points = load_las_aux<T>(verbose,
-                                          file_name, num_points_to_load,
-                                          lonlat_box, calc_shift, shift,
-                                          geo, data);
-  
-  int num_loaded_points = data.features.cols();
-  if (!lonlat_box.empty()                    &&
-      num_loaded_points < num_points_to_load &&
-      num_loaded_points < num_total_points){
-    
-    // We loaded too few points. Try harder. Need some care here as to not run
-    // out of memory.
-    num_points_to_load = std::max(4*num_points_to_load, 10000000);
-    if (verbose)
-      vw_out() << "Too few points were loaded. Trying again." << endl;
-    load_las_aux<T>(verbose,
-                   file_name, num_points_to_load, lonlat_box,  
-                   calc_shift, shift, geo, data);
-  }
-  
+  sample.data.features.conservativeResize(Eigen::NoChange, reservoir.num_kept());
+  sample.has_all_points = (reservoir.num_seen() == reservoir.num_kept());
 }
 
-// Load file from disk and convert to libpointmatcher's format
+// Load a uniform random sample of at most the given number of points
+// of a file, in one pass, and convert them to libpointmatcher's
+// format. If the lon-lat box is not empty, only points within it are
+// considered.
 template<typename T>
 void load_file(string const& file_name,
-               int num_points_to_load,
+               int64 num_points_to_load,
                BBox2 const& lonlat_box,
-               bool calc_shift,
-               Vector3 & shift,
                GeoReference const& geo,
                asp::CsvConv const& csv_conv,
-               bool & is_lola_rdr_format,
-               double & mean_longitude,
                bool verbose,
-               typename PointMatcher<T>::DataPoints & data){
+               CloudSample & sample){
 
   if (verbose)
     vw_out() << "Reading: " << file_name << endl;
 
-  // We will over-write this below for CSV and DEM files where
-  // longitude is available.
-  mean_longitude = 0.0;
-  
+  // We will over-write this below for CSV files where longitude is
+  // available.
+  sample.mean_longitude = 0.0;
+
   string file_type = get_file_type(file_name);
   if (file_type == "DEM")
     load_dem<T>(verbose,
-                file_name, num_points_to_load, lonlat_box,
-                calc_shift, shift, data);
+                file_name, num_points_to_load, lonlat_box, sample);
   else if (file_type == "PC")
     load_pc<T>(verbose,
-               file_name, num_points_to_load, lonlat_box, calc_shift, shift,
-               geo, data);
+               file_name, num_points_to_load, lonlat_box, geo, sample);
   else if (file_type == "LAS")
     load_las<T>(verbose,
-                file_name, num_points_to_load, lonlat_box, calc_shift, shift,
-                geo, data);
+                file_name, num_points_to_load, lonlat_box, geo, sample);
   else if (file_type == "CSV"){
     bool verbose = true;
     load_csv<T>(file_name, num_points_to_load, lonlat_box, verbose,
-                calc_shift, shift, geo, csv_conv, is_lola_rdr_format,
-                mean_longitude, data
-                );
+                geo, csv_conv, sample);
   }else
     vw_throw( ArgumentErr() << "Unknown file type: " << file_name << "\n" );
 
   if (verbose)
-    vw_out() << "Loaded points: " << data.features.cols() << endl;
+    vw_out() << "Loaded points: " << sample.data.features.cols() << endl;
 
 }
 
 // Calculate the lon-lat bounding box of the points and bias it based
 // on max displacement (which is in meters). This is used to throw
-// away points in the other cloud which are not within this box.
+// away points in the other cloud which are not within this box. At
+// most num_sample_pts of the loaded points, spread evenly, are used.
 BBox2 calc_extended_lonlat_bbox(GeoReference const& geo,
                                 int num_sample_pts,
-                                asp::CsvConv const& C,
-                                string const& file_name,
+                                CloudSample const& sample,
                                 double max_disp){
 
   // If the user does not want to use the max-displacement parameter,
@@ -1055,45 +1057,80 @@ BBox2 calc_extended_lonlat_bbox(GeoReference const& geo,
   // there is not much we can do.
   if (max_disp < 0.0 || geo.datum().name() == UNSPECIFIED_DATUM)
     return BBox2();
-  
-  validateFile(file_name);
-  PointMatcher<RealT>::DataPoints points;
-
-  double mean_longitude = 0.0; // to convert back from xyz to lonlat
-  bool verbose = false;
-  bool calc_shift = false; // won't shift the points
-  Vector3 shift = Vector3(0, 0, 0);
-  BBox2 dummy_box;
-  bool is_lola_rdr_format;
-  // Load a sample of points, hopefully enough to estimate the box
-  // reliably.
-  load_file<RealT>(file_name, num_sample_pts, dummy_box,
-                   calc_shift, shift, geo, C, is_lola_rdr_format,
-                   mean_longitude, verbose, points);
 
   // Bias the xyz points in several directions by max_disp, then
   // convert to lon-lat and grow the box. This is a rough
   // overestimate, but should be good enough.
   BBox2 box;
-  for (int col = 0; col < points.features.cols(); col++){
+  int64 num_points = sample.data.features.cols();
+  double step = std::max(1.0, double(num_points)/std::max(num_sample_pts, 1));
+  for (double pos = 0; pos < num_points; pos += step){
+    int64 col = int64(pos);
     Vector3 p;
-    for (int row = 0; row < DIM; row++) p[row] = points.features(row, col);
+    for (int row = 0; row < DIM; row++) p[row] = sample.data.features(row, col);
 
     for (int x = -1; x <= 1; x += 2){
       for (int y = -1; y <= 1; y += 2){
         for (int z = -1; z <= 1; z += 2){
           Vector3 q = p + Vector3(x, y, z)*max_disp;
-          Vector3 llh = geo.datum().cartesian_to_geodetic(q);
-          llh[0] += 360.0*round((mean_longitude - llh[0])/360.0); // 360 deg adjust
-          box.grow(subvector(llh, 0, 2));
+          box.grow(point_to_lonlat(q, geo, sample.mean_longitude));
         }
       }
     }
   }
-  
+
   return box;
 }
 
+// Keep only the points of a sample within a lon-lat box
+void crop_sample(BBox2 const& lonlat_box, GeoReference const& geo,
+                 CloudSample & sample){
+  if (lonlat_box.empty()) return;
+
+  PointMatcher<RealT>::Matrix & features = sample.data.features;
+  int64 count = 0;
+  for (int64 col = 0; col < features.cols(); col++){
+    Vector3 xyz;
+    for (int row = 0; row < DIM; row++) xyz[row] = features(row, col);
+    if (!lonlat_box.contains(point_to_lonlat(xyz, geo, sample.mean_longitude)))
+      continue;
+    if (count != col) features.col(count) = features.col(col);
+    count++;
+  }
+  features.conservativeResize(Eigen::NoChange, count);
+}
+
+// Load a sample of at most num_points_to_load points of a file,
+// within the given box. Usually the sample was gathered already from
+// the whole file, when the box was not known yet, and it is only
+// cropped. What is left is still a uniform sample of the points in
+// the box, so it is kept unless it is much smaller than asked for,
+// and only then the file is read again.
+void load_cropped_sample(string const& file_name, int64 num_points_to_load,
+                         BBox2 const& lonlat_box, GeoReference const& geo,
+                         asp::CsvConv const& C, bool verbose,
+                         CloudSample & sample){
+  const double MIN_CROPPED_FRACTION = 0.5;
+  int64 num_before_crop = sample.data.features.cols();
+  crop_sample(lonlat_box, geo, sample);
+  int64 num_loaded_points = sample.data.features.cols();
+  if (num_loaded_points < MIN_CROPPED_FRACTION*num_points_to_load &&
+      !sample.has_all_points &&
+      num_loaded_points < num_before_crop){
+    if (verbose)
+      vw_out() << "Too few points were within the region of overlap. "
+               << "Reading " << file_name << " again." << endl;
+    double mean_longitude = sample.mean_longitude;
+    load_file<RealT>(file_name, num_points_to_load, lonlat_box, geo, C,
+                     verbose, sample);
+    if (get_file_type(file_name) != "CSV")
+      sample.mean_longitude = mean_longitude;
+  }else if (verbose){
+    vw_out() << "Points within the region of overlap: " << num_loaded_points
+             << endl;
+  }
+}
+
 double calc_mean(vector<double> const& errs, int len){
   double mean = 0.0;
   for (int i = 0; i < len; i++){
@@ -1140,7 +1177,9 @@ PointMatcher<RealT>::Matrix apply_shift(PointMatcher<RealT>::Matrix const& T,
   return T2;
 }
 
-void calc_stats(string label, PointMatcher<RealT>::Matrix const& dists){
+// Print error statistics. The prefix tells apart the sources of a batch.
+void calc_stats(string const& prefix, string const& label,
+                PointMatcher<RealT>::Matrix const& dists){
 
   vector<double> errs(dists.cols()*dists.rows());
   int count = 0;
@@ -1153,18 +1192,18 @@ void calc_stats(string label, PointMatcher<RealT>::Matrix const& dists){
   sort(errs.begin(), errs.end());
 
   int len = errs.size();
-  vw_out() << "Number of errors: " << len << endl;
+  vw_out() << prefix << "Number of errors: " << len << endl;
   if (len == 0) return;
 
   double p16 = errs[std::min(len-1, (int)round(len*0.16))];
   double p50 = errs[std::min(len-1, (int)round(len*0.50))];
   double p84 = errs[std::min(len-1, (int)round(len*0.84))];
-  vw_out() << label << ": error percentile of smallest errors:"
+  vw_out() << prefix << label << ": error percentile of smallest errors:"
            << " 16%: " << p16 << ", 50%: " << p50 << ", 84%: " << p84 << endl;
 
   double a25 = calc_mean(errs, len/4),   a50  = calc_mean(errs, len/2);
   double a75 = calc_mean(errs, 3*len/4), a100 = calc_mean(errs, len);
-  vw_out() << label << ": mean of smallest errors:"
+  vw_out() << prefix << label << ": mean of smallest errors:"
            << " 25%: " << a25 << ", 50%: " << a50
            << ", 75%: " << a75 << ", 100%: " << a100 << endl;
 }
@@ -1210,7 +1249,7 @@ void save_transforms(Options const& opt,
 }
 
 void calc_translation_vec(DP const& source, DP const& trans_source,
-                          Vector3 & shift, // from planet center to current origin
+                          Vector3 const& shift, // from planet center to current origin
                           Datum const& datum,
                           Vector3 & source_ctr_vec,
                           Vector3 & source_ctr_llh,
@@ -1243,7 +1282,8 @@ void calc_translation_vec(DP const& source, DP const& trans_source,
   trans_ned = M*trans_xyz;
 }
 
-void calc_max_displacment(DP const& source, DP const& trans_source){
+void calc_max_displacment(string const& prefix, DP const& source,
+                          DP const& trans_source){
 
   double max_obtained_disp = 0.0;
   int numPts = source.features.cols();
@@ -1256,7 +1296,7 @@ void calc_max_displacment(DP const& source, DP const& trans_source){
     max_obtained_disp = max(max_obtained_disp, norm_2(s - t));
   }
 
-  vw_out() << "Maximum displacement of source points: "
+  vw_out() << prefix << "Maximum displacement of source points: "
            << max_obtained_disp << " m" << endl;
 }
 
@@ -1326,20 +1366,23 @@ void save_errors(DP const& point_cloud,
 
 namespace asp{
   Vector3 apply_transform(PointMatcher<RealT>::Matrix const& T, Vector3 const& P){
-    
-    Eigen::VectorXd V(4);
-    V[0] = P[0]; V[1] = P[1]; V[2] = P[2]; V[3] = 1;
-    V = T*V;
     Vector3 Q;
-    Q[0] = V[0]; Q[1] = V[1]; Q[2] = V[2];
+    for (int row = 0; row < DIM; row++)
+      Q[row] = T(row, 0)*P[0] + T(row, 1)*P[1] + T(row, 2)*P[2] + T(row, 3);
     return Q;
   }
 }
 
 // Apply a transform to the first three coordinates of the cloud
 struct TransformPC: public UnaryReturnSameType {
-  PointMatcher<RealT>::Matrix m_T;
-  TransformPC(PointMatcher<RealT>::Matrix const& T):m_T(T){}
+  Matrix3x3 m_R;
+  Vector3 m_t;
+  TransformPC(PointMatcher<RealT>::Matrix const& T){
+    for (int row = 0; row < DIM; row++){
+      for (int col = 0; col < DIM; col++) m_R(row, col) = T(row, col);
+      m_t[row] = T(row, DIM);
+    }
+  }
   inline Vector<double> operator()(Vector<double> const& pt) const {
 
     Vector<double> P = pt; // local copy
@@ -1348,13 +1391,99 @@ struct TransformPC: public UnaryReturnSameType {
     if (xyz == Vector3())
       return P; // invalid point
     
-    Vector3 Q = asp::apply_transform(m_T, xyz);
-    subvector(P, 0, 3) = Q;
+    subvector(P, 0, 3) = m_R*xyz + m_t;
 
     return P;
   }
 };
 
+// The transformed points are written in chunks of this many points,
+// with several chunks processed in parallel.
+const int TRANS_CHUNK_SIZE = 100000;
+
+// Transform a chunk of points of a CSV file and format them as text,
+// the same as an ostream with precision 16 would, but faster.
+class CsvTransformTask: public Task, private boost::noncopyable{
+  PointMatcher<RealT>::Matrix const& m_features;
+  int m_beg, m_end;
+  PointMatcher<RealT>::Matrix const& m_T;
+  GeoReference const& m_geo;
+  asp::CsvConv const& m_C;
+  double m_mean_longitude;
+  bool m_is_lola_rdr_format;
+  string & m_text;
+public:
+  CsvTransformTask(PointMatcher<RealT>::Matrix const& features, int beg, int end,
+                   PointMatcher<RealT>::Matrix const& T, GeoReference const& geo,
+                   asp::CsvConv const& C, double mean_longitude,
+                   bool is_lola_rdr_format, string & text):
+    m_features(features), m_beg(beg), m_end(end), m_T(T), m_geo(geo), m_C(C),
+    m_mean_longitude(mean_longitude), m_is_lola_rdr_format(is_lola_rdr_format),
+    m_text(text){}
+
+  void operator()(){
+
+    // Apply the transform to all points at once
+    PointMatcher<RealT>::Matrix trans = m_T*m_features.middleCols(m_beg, m_end - m_beg);
+
+    m_text.clear();
+    char line[256];
+    for (int col = 0; col < trans.cols(); col++){
+
+      Vector3 P;
+      for (int row = 0; row < DIM; row++) P[row] = trans(row, col);
+
+      Vector3 vals;
+      if (m_C.csv_format_str != ""){
+        vals = cartesian_to_csv(P, m_geo, m_mean_longitude, m_C);
+      }else{
+        Vector3 llh = m_geo.datum().cartesian_to_geodetic(P); // lon-lat-height
+        llh[0] += 360.0*round((m_mean_longitude - llh[0])/360.0); // 360 deg adjustment
+        if (m_is_lola_rdr_format)
+          vals = Vector3(llh[0], llh[1], norm_2(P)/1000.0);
+        else
+          vals = Vector3(llh[1], llh[0], llh[2]);
+      }
+
+      int len = snprintf(line, sizeof(line), "%.16g,%.16g,%.16g\n",
+                         vals[0], vals[1], vals[2]);
+      m_text.append(line, len);
+    }
+  }
+};
+
+// Transform a chunk of points of a LAS file, in projected coordinates
+// if the file has a georeference.
+class LasTransformTask: public Task, private boost::noncopyable{
+  vector<Vector3> & m_points;
+  int m_beg, m_end;
+  PointMatcher<RealT>::Matrix const& m_T;
+  GeoReference const* m_las_georef;
+public:
+  LasTransformTask(vector<Vector3> & points, int beg, int end,
+                   PointMatcher<RealT>::Matrix const& T,
+                   GeoReference const* las_georef):
+    m_points(points), m_beg(beg), m_end(end), m_T(T), m_las_georef(las_georef){}
+
+  void operator()(){
+    for (int i = m_beg; i < m_end; i++){
+      Vector3 & P = m_points[i];
+      if (m_las_georef){
+        // Go from projected space to xyz
+        Vector2 ll = m_las_georef->point_to_lonlat(subvector(P, 0, 2));
+        P = m_las_georef->datum().geodetic_to_cartesian(Vector3(ll[0], ll[1], P[2]));
+      }
+      P = asp::apply_transform(m_T, P);
+      if (m_las_georef){
+        // Go from xyz to projected space
+        Vector3 llh = m_las_georef->datum().cartesian_to_geodetic(P);
+        subvector(P, 0, 2) = m_las_georef->lonlat_to_point(subvector(llh, 0, 2));
+        P[2] = llh[2];
+      }
+    }
+  }
+};
+
 template<int n>
 void save_trans_point_cloud_n(Options const& opt,
                               string input_file,
@@ -1450,35 +1579,42 @@ void save_trans_point_cloud(Options const& opt,
     ofs.open(output_file.c_str(), std::ios::out | std::ios::binary);
     liblas::Writer writer(ofs, header);
 
+    // Read a few chunks of points, transform them in parallel, and
+    // write them in order.
+    int num_threads = vw_settings().default_num_threads();
+    int64 block_size = int64(num_threads)*TRANS_CHUNK_SIZE;
+    vector<Vector3> points;
+    points.reserve(block_size);
     TerminalProgressCallback tpc("asp", "\t--> ");
-    int hundred = 100;
-    int spacing = num_total_points/hundred;
-    double inc_amount = 1.0 / hundred;
-    int64 count = 0;
-    while (reader.ReadNextPoint()){
-      
-      liblas::Point const& in_las_pt = reader.GetPoint();
-      Vector3 P(in_las_pt.GetX(), in_las_pt.GetY(), in_las_pt.GetZ());
-      if (has_georef){
-        // Go from projected space to xyz
-        Vector2 ll = las_georef.point_to_lonlat(subvector(P, 0, 2));
-        P = las_georef.datum().geodetic_to_cartesian(Vector3(ll[0], ll[1], P[2]));
+    double inc_amount = double(block_size)/std::max(num_total_points, int64(1));
+    bool has_points = true;
+    while (has_points){
+
+      points.clear();
+      while ((int64)points.size() < block_size &&
+             (has_points = reader.ReadNextPoint())){
+        liblas::Point const& in_las_pt = reader.GetPoint();
+        points.push_back(Vector3(in_las_pt.GetX(), in_las_pt.GetY(),
+                                 in_las_pt.GetZ()));
       }
-      P = asp::apply_transform(T, P);
-      if (has_georef){
-        // Go from xyz to projected space
-        Vector3 llh = las_georef.datum().cartesian_to_geodetic(P);
-        subvector(P, 0, 2) = las_georef.lonlat_to_point(subvector(llh, 0, 2));
-        P[2] = llh[2];
+
+      FifoWorkQueue queue(num_threads);
+      for (int beg = 0; beg < (int)points.size(); beg += TRANS_CHUNK_SIZE){
+        int end = std::min(beg + TRANS_CHUNK_SIZE, (int)points.size());
+        boost::shared_ptr<Task>
+          task(new LasTransformTask(points, beg, end, T,
+                                    has_georef ? &las_georef : NULL));
+        queue.add_task(task);
       }
+      queue.join_all();
 
-      liblas::Point out_las_pt(&header);
-      out_las_pt.SetCoordinates(P[0], P[1], P[2]);
-      writer.WritePoint(out_las_pt);
-      
-      if (count%spacing == 0) tpc.report_incremental_progress( inc_amount );
-      
-      count++;
+      for (size_t i = 0; i < points.size(); i++){
+        liblas::Point out_las_pt(&header);
+        out_las_pt.SetCoordinates(points[i][0], points[i][1], points[i][2]);
+        writer.WritePoint(out_las_pt);
+      }
+
+      tpc.report_incremental_progress( inc_amount );
     }
     tpc.report_finished();
 
@@ -1488,18 +1624,14 @@ void save_trans_point_cloud(Options const& opt,
 
     BBox2 empty_box;
     bool verbose = false;
-    bool calc_shift = true;
-    Vector3 shift;
-    bool is_lola_rdr_format;
-    double mean_longitude;
-    DP point_cloud;
-    load_csv<RealT>(input_file, numeric_limits<int>::max(),
-                    empty_box, verbose, calc_shift, shift,
-                    geo, C, is_lola_rdr_format,
-                    mean_longitude, point_cloud);
+    CloudSample sample;
+    load_csv<RealT>(input_file, numeric_limits<int64>::max(),
+                    empty_box, verbose, geo, C, sample);
+    DP const& point_cloud = sample.data;
+    bool is_lola_rdr_format = sample.is_lola_rdr_format;
+    double mean_longitude = sample.mean_longitude;
 
     ofstream outfile( output_file.c_str() );
-    outfile.precision(16);
     
     // Write the header line
     if (C.csv_format_str != ""){
@@ -1516,40 +1648,32 @@ void save_trans_point_cloud(Options const& opt,
         outfile << "# latitude,longitude,height above datum (meters)" << endl;
     }
     
+    // Transform and format a few chunks of points in parallel, then
+    // write them in order.
     int numPts = point_cloud.features.cols();
+    int num_threads = vw_settings().default_num_threads();
+    vector<string> texts(num_threads);
     TerminalProgressCallback tpc("asp", "\t--> ");
-    int hundred = 100;
-    int spacing = numPts/hundred;
-    double inc_amount = 1.0 / hundred;
-    for (int col = 0; col < numPts; col++){
-      
-      Eigen::VectorXd V(DIM + 1);
-      for (int row = 0; row < DIM; row++)
-        V[row] = point_cloud.features(row, col) + shift[row];
-      V[DIM] = 1;
-      
-      // Apply the transform
-      V = T*V;
-      
-      Vector3 P;
-      for (int row = 0; row < DIM; row++) P[row] = V[row];
-      
-      if (C.csv_format_str != ""){
-        
-        Vector3 csv = cartesian_to_csv(P, geo, mean_longitude, C);
-        outfile << csv[0] << ',' << csv[1] << ',' << csv[2] << endl;
-        
-      }else{
-        Vector3 llh = geo.datum().cartesian_to_geodetic(P); // lon-lat-height
-        llh[0] += 360.0*round((mean_longitude - llh[0])/360.0); // 360 deg adjustment
-        
-        if (is_lola_rdr_format)
-          outfile << llh[0] << ',' << llh[1] << ',' << norm_2(P)/1000.0 << endl;
-        else
-          outfile << llh[1] << ',' << llh[0] << ',' << llh[2] << endl;
+    double inc_amount = double(num_threads)*TRANS_CHUNK_SIZE/std::max(numPts, 1);
+    for (int block_beg = 0; block_beg < numPts;
+         block_beg += num_threads*TRANS_CHUNK_SIZE){
+
+      FifoWorkQueue queue(num_threads);
+      int num_chunks = 0;
+      for (int beg = block_beg; beg < numPts && num_chunks < num_threads;
+           beg += TRANS_CHUNK_SIZE){
+        int end = std::min(beg + TRANS_CHUNK_SIZE, numPts);
+        boost::shared_ptr<Task>
+          task(new CsvTransformTask(point_cloud.features, beg, end, T, geo, C,
+                                    mean_longitude, is_lola_rdr_format,
+                                    texts[num_chunks]));
+        queue.add_task(task);
+        num_chunks++;
       }
-      
-      if (col%spacing == 0) tpc.report_incremental_progress( inc_amount );
+      queue.join_all();
+
+      for (int i = 0; i < num_chunks; i++) outfile << texts[i];
+      tpc.report_incremental_progress( inc_amount );
     }
     tpc.report_finished();
     outfile.close();
@@ -1581,6 +1705,673 @@ void debug_save_point_cloud(DP const& point_cloud, GeoReference const& geo,
   }
 }
 
+// A reference DEM kept as a raster. Instead of finding the nearest
+// reference point in a tree, a source point is matched with the DEM
+// surface right below or above it, found by bilinear interpolation,
+// and the DEM normal there. All points are shifted by the same
+// vector as the clouds.
+class DemGrid{
+  ImageView<float> m_dem;   // nodata values are NaN
+  GeoReference m_geo;
+  Vector2 m_offset;         // of m_dem within the DEM on disk
+  Vector3 m_shift;
+  double m_mean_longitude;  // to bring lon-lat values to the DEM range
+
+  // A point on the DEM surface, in Cartesian coordinates
+  Vector3 point_at(Vector2 const& pix, double height) const{
+    Vector2 lonlat = m_geo.pixel_to_lonlat(pix + m_offset);
+    return m_geo.datum().geodetic_to_cartesian(Vector3(lonlat.x(), lonlat.y(),
+                                                       height));
+  }
+
+  // Bilinear interpolation of the DEM height and its derivatives in
+  // x and y. Returns false unless all four neighbors are valid.
+  bool interp(Vector2 const& pix, double & h, double & dhdx, double & dhdy) const{
+    if (!(pix.x() >= 0 && pix.x() < m_dem.cols() - 1 &&
+          pix.y() >= 0 && pix.y() < m_dem.rows() - 1)) return false;
+    int i = (int)pix.x(), j = (int)pix.y();
+    double fx = pix.x() - i, fy = pix.y() - j;
+    double h00 = m_dem(i, j),     h10 = m_dem(i + 1, j);
+    double h01 = m_dem(i, j + 1), h11 = m_dem(i + 1, j + 1);
+    dhdx = (h10 - h00)*(1 - fy) + (h11 - h01)*fy;
+    dhdy = (h01 - h00)*(1 - fx) + (h11 - h10)*fx;
+    h    = (h00*(1 - fx) + h10*fx)*(1 - fy) + (h01*(1 - fx) + h11*fx)*fy;
+    return h == h; // NaN check
+  }
+
+public:
+
+  // Read the part of the DEM within the given lon-lat box
+  DemGrid(string const& file_name, BBox2 const& lonlat_box,
+          Vector3 const& shift): m_shift(shift){
+
+    validateFile(file_name);
+    bool is_good = cartography::read_georeference( m_geo, file_name );
+    if (!is_good) vw_throw(ArgumentErr() << "DEM: " << file_name
+                           << " does not have a georeference.\n");
+
+    DiskImageView<float> dem(file_name);
+    double nodata = numeric_limits<double>::quiet_NaN();
+    boost::shared_ptr<DiskImageResource> dem_rsrc
+      ( new DiskImageResourceGDAL(file_name) );
+    if (dem_rsrc->has_nodata_read()) nodata = dem_rsrc->nodata_read();
+
+    BBox2i pix_box = dem_pixel_box(m_geo, lonlat_box, bounding_box(dem));
+    pix_box.expand(1); // interpolation needs the neighbors
+    pix_box.crop(bounding_box(dem));
+    m_offset = pix_box.min();
+    m_dem = crop(dem, pix_box);
+    for (int col = 0; col < m_dem.cols(); col++){
+      for (int row = 0; row < m_dem.rows(); row++){
+        if (m_dem(col, row) == nodata)
+          m_dem(col, row) = numeric_limits<float>::quiet_NaN();
+      }
+    }
+
+    m_mean_longitude = m_geo.pixel_to_lonlat(m_offset + Vector2(pix_box.width(),
+                                                              pix_box.height())/2.0).x();
+  }
+
+  // Find the DEM point below or above a given point, and the unit
+  // normal to the DEM there. Returns false if the point does not
+  // project onto a valid part of the DEM.
+  bool find_match(Vector3 const& xyz, Vector3 & dem_xyz, Vector3 & normal) const{
+
+    Vector3 llh = m_geo.datum().cartesian_to_geodetic(xyz + m_shift);
+    llh[0] += 360.0*round((m_mean_longitude - llh[0])/360.0); // 360 deg adjust
+    Vector2 pix = m_geo.lonlat_to_pixel(subvector(llh, 0, 2)) - m_offset;
+
+    double h, dhdx, dhdy;
+    if (!interp(pix, h, dhdx, dhdy)) return false;
+
+    // The tangent plane is spanned by the changes of the DEM point
+    // when moving by one pixel in x and in y.
+    Vector3 p = point_at(pix, h);
+    normal = cross_prod(point_at(pix + Vector2(1, 0), h + dhdx) - p,
+                        point_at(pix + Vector2(0, 1), h + dhdy) - p);
+    double len = norm_2(normal);
+    if (len == 0.0) return false;
+    normal /= len;
+    dem_xyz = p - m_shift;
+    return true;
+  }
+};
+
+// A source point, its match on the DEM, and the signed distance
+// from the DEM along the normal.
+struct DemMatch{
+  Vector3 src, normal;
+  double dist;
+};
+
+// Match the source points with the DEM. Points without a match are
+// skipped, and the index of the source point of each match is kept.
+void find_dem_matches(DemGrid const& dem, PointMatcher<RealT>::Matrix const& features,
+                      vector<DemMatch> & matches, vector<int> & indices){
+  int numPts = features.cols();
+  matches.clear();
+  indices.clear();
+  matches.reserve(numPts);
+  indices.reserve(numPts);
+  for (int col = 0; col < numPts; col++){
+    DemMatch m;
+    for (int row = 0; row < DIM; row++) m.src[row] = features(row, col);
+    Vector3 dem_xyz;
+    if (!dem.find_match(m.src, dem_xyz, m.normal)) continue;
+    m.dist = dot_prod(m.normal, m.src - dem_xyz);
+    matches.push_back(m);
+    indices.push_back(col);
+  }
+}
+
+// The counterpart of filterGrossOutliersAndCalcErrors() when the
+// reference is a DEM grid. The error of a source point is its distance
+// to the DEM tangent plane. Points not projecting onto the DEM, and
+// those with errors bigger than max_disp, are removed.
+void filter_gross_outliers_and_calc_dem_errors(DemGrid const& dem, double max_disp,
+                                               DP & source,
+                                               PointMatcher<RealT>::Matrix & errors){
+  vector<DemMatch> matches;
+  vector<int> indices;
+  find_dem_matches(dem, source.features, matches, indices);
+
+  PointMatcher<RealT>::Matrix & features = source.features;
+  errors.resize(1, matches.size());
+  int count = 0;
+  for (size_t k = 0; k < matches.size(); k++){
+    double err = std::abs(matches[k].dist);
+    if (err > max_disp) continue;
+    if (count != indices[k]) features.col(count) = features.col(indices[k]);
+    errors(0, count) = err;
+    count++;
+  }
+  features.conservativeResize(Eigen::NoChange, count);
+  errors.conservativeResize(Eigen::NoChange, count);
+}
+
+// Point-to-plane ICP against a DEM grid, starting from initT. At each
+// iteration the best outlier_ratio fraction of matches is used to
+// solve the linearized problem for a small rotation and a
+// translation, the same as in libpointmatcher's point-to-plane error
+// minimizer.
+PointMatcher<RealT>::Matrix dem_icp(DemGrid const& dem, DP const& source,
+                                    PointMatcher<RealT>::Matrix const& initT,
+                                    int num_iter, double outlier_ratio,
+                                    double diff_rotation_err, // radians
+                                    double diff_translation_err,
+                                    double max_match_dist,
+                                    bool compute_translation_only,
+                                    double & match_ratio){
+
+  typedef Eigen::Matrix<double, 6, 6> Matrix6;
+  typedef Eigen::Matrix<double, 6, 1> Vector6d;
+
+  PointMatcher<RealT>::Matrix T = initT;
+  int numPts = source.features.cols();
+  match_ratio = 0.0;
+  if (numPts == 0) return T;
+
+  int num_params = compute_translation_only ? DIM : 2*DIM;
+  vector<DemMatch> matches;
+  vector<int> indices;
+  vector<double> dists;
+  for (int iter = 0; iter < num_iter; iter++){
+
+    PointMatcher<RealT>::Matrix features = T*source.features;
+    find_dem_matches(dem, features, matches, indices);
+    if (matches.empty())
+      vw_throw( ArgumentErr() << "No source points project onto the reference DEM.\n" );
+
+    // Keep the matches with the smallest distances, and within
+    // max_match_dist, if positive
+    dists.resize(matches.size());
+    for (size_t k = 0; k < matches.size(); k++) dists[k] = std::abs(matches[k].dist);
+    int num_kept = std::max(1, (int)round(outlier_ratio*matches.size()));
+    num_kept = std::min(num_kept, (int)matches.size());
+    nth_element(dists.begin(), dists.begin() + num_kept - 1, dists.end());
+    double max_dist = dists[num_kept - 1];
+    if (max_match_dist > 0 && max_dist > max_match_dist){
+      max_dist = max_match_dist;
+      num_kept = 0;
+      for (size_t k = 0; k < dists.size(); k++) num_kept += (dists[k] <= max_dist);
+      if (num_kept == 0)
+        vw_throw( ArgumentErr() << "No source points are within " << max_match_dist
+                  << " m of the reference DEM.\n" );
+    }
+    match_ratio = double(num_kept)/numPts;
+
+    // Normal equations for the parameters: the rotation vector, if
+    // any, followed by the translation.
+    Matrix6  A = Matrix6::Zero();
+    Vector6d b = Vector6d::Zero();
+    int num_used = 0;
+    for (size_t k = 0; k < matches.size() && num_used < num_kept; k++){
+      DemMatch const& m = matches[k];
+      if (std::abs(m.dist) > max_dist) continue;
+      Vector6d a;
+      Vector3 c = cross_prod(m.src, m.normal);
+      for (int row = 0; row < DIM; row++){
+        if (compute_translation_only){
+          a[row] = m.normal[row];
+        }else{
+          a[row]       = c[row];
+          a[row + DIM] = m.normal[row];
+        }
+      }
+      A.topLeftCorner(num_params, num_params)
+        += a.head(num_params)*a.head(num_params).transpose();
+      b.head(num_params) -= a.head(num_params)*m.dist;
+      num_used++;
+    }
+
+    // A flat DEM does not constrain all parameters, so find the
+    // smallest solution rather than inverting the matrix.
+    Eigen::VectorXd x = A.topLeftCorner(num_params, num_params)
+      .jacobiSvd(Eigen::ComputeFullU | Eigen::ComputeFullV)
+      .solve(b.head(num_params));
+
+    Eigen::Vector3d omega = Eigen::Vector3d::Zero(), t;
+    if (compute_translation_only){
+      t = x.head(DIM);
+    }else{
+      omega = x.head(DIM);
+      t     = x.tail(DIM);
+    }
+    PointMatcher<RealT>::Matrix dT
+      = PointMatcher<RealT>::Matrix::Identity(DIM + 1, DIM + 1);
+    double angle = omega.norm();
+    if (angle > 0.0)
+      dT.topLeftCorner(DIM, DIM) = Eigen::AngleAxisd(angle, omega/angle).toRotationMatrix();
+    dT.block(0, DIM, DIM, 1) = t;
+    T = dT*T;
+
+    if (angle < diff_rotation_err && t.norm() < diff_translation_err) break;
+  }
+
+  return T;
+}
+
+// Set the ICP parameters, from the command line or from the
+// configuration file. The stopping criteria are passed in, as they
+// depend on the pyramid level.
+// Configure ICP. If max_match_dist is positive, matches further apart
+// than that are outliers, on top of those removed with the outlier
+// ratio.
+void set_icp_params(Options const& opt, double diff_rotation_err, // radians
+                    double diff_translation_err, double max_match_dist,
+                    PM::ICP & icp){
+  if (opt.config_file == ""){
+    // Read the options from the command line
+    icp.setParams(opt.out_prefix, opt.num_iter, opt.outlier_ratio,
+                  diff_rotation_err, diff_translation_err,
+                  opt.alignment_method, false/*opt.verbose*/);
+  }else{
+    vw_out() << "Will read the options from: " << opt.config_file << endl;
+    ifstream ifs(opt.config_file.c_str());
+    if (!ifs.good())
+      vw_throw( ArgumentErr() << "Cannot open configuration file: "
+                << opt.config_file << "\n" );
+    icp.loadFromYaml(ifs);
+  }
+
+  // Both of the above rebuild the filter chain from scratch, so this
+  // filter does not carry over to the next call.
+  if (max_match_dist > 0){
+    PM::Parameters params;
+    params["maxDist"] = toParam(max_match_dist);
+    icp.outlierFilters.push_back
+      (PM::get().OutlierFilterRegistrar.create("MaxDistOutlierFilter", params));
+  }
+}
+
+// The root mean square distance of the points from their centroid
+double calc_radius(DP const& points){
+  int numPts = points.features.cols();
+  if (numPts == 0) return 0.0;
+  Eigen::MatrixXd P = points.features.topRows(DIM);
+  Eigen::VectorXd ctr = P.rowwise().sum()/numPts;
+  P.colwise() -= ctr;
+  return sqrt(P.squaredNorm()/numPts);
+}
+
+// The reference cloud, shifted, and the structure used to find the
+// matches of source points in it. It is shared by all sources
+// aligned against it.
+struct Reference{
+  CloudSample sample;
+  BBox2 box;           // extended lon-lat box, to bound the sources
+  Vector3 shift;       // subtracted from all points
+  PM::ICP icp;         // holds the tree, unless the DEM grid is used
+  boost::shared_ptr<DemGrid> dem_grid;
+
+  // The voxel sizes of the coarser pyramid levels 1, 2, etc., and
+  // the reference downsampled to them with its own tree, unless the
+  // DEM grid is used. Level 0 is the reference itself.
+  vector<double> voxel_sizes;
+  vector< boost::shared_ptr<DP> > coarse_refs;
+  vector< boost::shared_ptr<PM::ICP> > coarse_icps;
+
+  // The ICP objects keep state, and each holds the only copy of its
+  // tree, which is too big to duplicate per source. So each is used
+  // by one source at a time, for the duration of a call, and batch
+  // mode overlaps only the loading, subsampling and saving of the
+  // sources, and the point-to-dem alignment. There is one mutex per
+  // pyramid level, so sources at different levels do not wait for
+  // each other.
+  vector< boost::shared_ptr<Mutex> > icp_mutexes;
+};
+
+// If ref points are offset by 360 degrees in longitude in respect to
+// source points, adjust the ref box to be aligned with the source points,
+// and vice versa. Keep only the common area.
+void intersect_lonlat_boxes(BBox2 & ref_box, BBox2 & source_box){
+  if (ref_box.empty() || source_box.empty()) return;
+  double lon_offset = (source_box.min().x() + source_box.max().x())/2.0
+    - (ref_box.min().x() + ref_box.max().x())/2.0;
+  lon_offset = 360.0*round(lon_offset/360.0);
+  ref_box    += Vector2(lon_offset, 0);
+  ref_box.crop(source_box); source_box.crop(ref_box); // common area
+  source_box -= Vector2(lon_offset, 0);
+}
+
+// Shift the reference to bring it close to the origin, and build the
+// structure used to find matches in it. The DEM grid, if used, is read
+// only within dem_box.
+void prepare_reference(Options const& opt, BBox2 const& dem_box,
+                       Reference & ref_data){
+
+  DP & ref = ref_data.sample.data;
+  if (ref.features.cols() == 0)
+    vw_throw( ArgumentErr() << "No points were loaded from the reference "
+              << "cloud, or it has no area in common with the source.\n" );
+
+  // Shift the point cloud by the first reference point to bring
+  // it closer to origin.
+  Vector3 & shift = ref_data.shift;
+  for (int row = 0; row < DIM; row++) shift[row] = ref.features(row, 0);
+  Eigen::Vector3d shift_vec(shift[0], shift[1], shift[2]);
+  ref.features.topRows(DIM).colwise() -= shift_vec;
+
+  // So far we shifted by first point in first point cloud to reduce
+  // the magnitude of all loaded points. Now that we have loaded all
+  // points, shift one more time, to place the centroid of the
+  // reference at the origin.
+  // Note: If this code is ever converting to using floats,
+  // the operation below needs to be re-implemented to be accurate.
+  int numRefPts = ref.features.cols();
+  Eigen::VectorXd meanRef = ref.features.rowwise().sum() / numRefPts;
+  ref.features.topRows(DIM).colwise() -= meanRef.head(DIM);
+  for (int row = 0; row < DIM; row++) shift[row] += meanRef(row);
+  if (opt.verbose) vw_out() << "Data shifted internally by subtracting: "
+                            << shift << std::endl;
+
+  // Filter the reference and initialize the reference tree, or
+  // read the reference DEM grid.
+  Stopwatch sw3;
+  sw3.start();
+  bool use_dem_grid = (opt.alignment_method == "point-to-dem");
+  if (use_dem_grid)
+    ref_data.dem_grid.reset(new DemGrid(opt.reference, dem_box, shift));
+  else
+    ref_data.icp.initRefTree(ref, opt.alignment_method, opt.highest_accuracy,
+                             false /*opt.verbose*/);
+
+  // The pyramid levels. At level 1 the voxels are twice the spacing
+  // of the source points, if those covered all the reference, and
+  // they double at each next level. Stop when the reference gets
+  // too coarse.
+  double voxel_size = calc_spacing(ref, opt.max_num_source_points);
+  for (int level = 1; level < opt.num_pyramid_levels && voxel_size > 0; level++){
+    voxel_size *= 2.0;
+    if (!use_dem_grid){
+      boost::shared_ptr<DP> coarse_ref(new DP(voxel_downsample(ref, voxel_size)));
+      if (coarse_ref->features.cols() < MIN_NUM_PYRAMID_PTS) break;
+      boost::shared_ptr<PM::ICP> coarse_icp(new PM::ICP);
+      coarse_icp->initRefTree(*coarse_ref, opt.alignment_method,
+                              opt.highest_accuracy, false /*opt.verbose*/);
+      ref_data.coarse_refs.push_back(coarse_ref);
+      ref_data.coarse_icps.push_back(coarse_icp);
+    }
+    ref_data.voxel_sizes.push_back(voxel_size);
+  }
+  if (opt.num_pyramid_levels > 1)
+    vw_out() << "Number of pyramid levels: " << ref_data.voxel_sizes.size() + 1
+             << endl;
+  for (size_t level = 0; level <= ref_data.voxel_sizes.size(); level++)
+    ref_data.icp_mutexes.push_back(boost::shared_ptr<Mutex>(new Mutex));
+  sw3.stop();
+  if (opt.verbose) vw_out() << "Reference point cloud processing took "
+                            << sw3.elapsed_seconds() << " [s]" << endl;
+}
+
+// Align a source sample, already cropped to the area in common with
+// the reference, and save the results with the prefix in opt.
+void align_source(Options const& opt, GeoReference const& geo,
+                  asp::CsvConv const& C, CloudSample & source_sample,
+                  Reference & ref_data){
+
+  DP & ref = ref_data.sample.data;
+  DP & source = source_sample.data;
+  Vector3 const& shift = ref_data.shift;
+  PM::ICP & icp = ref_data.icp;
+  DemGrid const* dem_grid = ref_data.dem_grid.get();
+  bool use_dem_grid = (dem_grid != NULL);
+  bool is_lola_rdr_format      = source_sample.is_lola_rdr_format;
+  double mean_source_longitude = source_sample.mean_longitude;
+  if (source.features.cols() == 0)
+    vw_throw( ArgumentErr() << "No points were loaded from the source "
+              << "cloud, or it has no area in common with the reference.\n" );
+
+  // Shift the source the same way as the reference
+  Eigen::Vector3d shift_vec(shift[0], shift[1], shift[2]);
+  source.features.topRows(DIM).colwise() -= shift_vec;
+
+  // The point clouds are shifted, so shift the initial transform as well.
+  PointMatcher<RealT>::Matrix initT = apply_shift(opt.init_transform, shift);
+
+  // Apply the initial guess transform to the source point cloud.
+  source.features = initT*source.features;
+
+  // With several sources their output is interleaved, so tell it apart
+  string tag = (opt.source_files.size() > 1) ? opt.source + ": " : "";
+
+  PointMatcher<RealT>::Matrix beg_errors;
+  if (opt.max_disp > 0.0){
+    // Filter gross outliers
+    Stopwatch sw4;
+    sw4.start();
+    if (use_dem_grid)
+      filter_gross_outliers_and_calc_dem_errors(*dem_grid, opt.max_disp,
+                                                source, beg_errors); //in-out
+    else{
+      Mutex::Lock lock(*ref_data.icp_mutexes[0]);
+      icp.filterGrossOutliersAndCalcErrors(ref, opt.max_disp*opt.max_disp,
+                                            source, beg_errors); //in-out
+    }
+    sw4.stop();
+    if (opt.verbose) vw_out() << "Filter gross outliers took "
+                              << sw4.elapsed_seconds() << " [s]" << endl;
+  }
+  
+  random_pc_subsample<RealT>(opt.max_num_source_points, source);
+  vw_out() << tag << "Reducing number of source points to "
+           << source.features.cols() << endl;
+
+  //dump_llh("ref.csv", datum, ref,    shift);
+  //dump_llh("src.csv", datum, source, shift);
+  
+  // Calculate the errors before doing ICP
+  Stopwatch sw5;
+  sw5.start();
+  double big = 1e+300;
+  if (use_dem_grid)
+    filter_gross_outliers_and_calc_dem_errors(*dem_grid, big,
+                                              source, beg_errors); //in-out
+  else{
+    Mutex::Lock lock(*ref_data.icp_mutexes[0]);
+    icp.filterGrossOutliersAndCalcErrors(ref, big,
+                                          source, beg_errors); //in-out
+  }
+  calc_stats(tag, "Input", beg_errors);
+  sw5.stop();
+  if (opt.verbose) vw_out() << "Initial error computation took "
+                            << sw5.elapsed_seconds() << " [s]" << endl;
+
+  // Compute the transformation to align the source to reference,
+  // from the coarsest pyramid level to the full resolution, each
+  // level starting from the transform found at the previous one.
+  // We bypass calling ICP if the user explicitely asks for 0 iterations.
+  Stopwatch sw6;
+  sw6.start();
+  PointMatcher<RealT>::Matrix T
+    = PointMatcher<RealT>::Matrix::Identity(DIM + 1, DIM + 1);
+  double source_radius = calc_radius(source);
+  double prev_voxel_size = 0.0; // of the last level that was run
+  for (int level = ref_data.voxel_sizes.size(); level >= 0 && opt.num_iter > 0;
+       level--){
+
+    // The outlier ratio is a fraction of the points, and voxels thin
+    // out inliers and outliers alike, so it is the same at all levels.
+    // The coarsest level must recover offsets of many voxels, so its
+    // matches are not limited in distance, the gross outliers having
+    // been removed with max_disp. After it, the clouds are aligned to
+    // within about a voxel of the previous level, so matches further
+    // apart than a few of those are outliers.
+    DP level_source = source;
+    double diff_rotation_err    = (2.0*M_PI/360.0)*opt.diff_rotation_err; // radians
+    double diff_translation_err = opt.diff_translation_err;
+    double max_match_dist = PYRAMID_MATCH_VOXELS*prev_voxel_size;
+    double voxel_size = 0.0;
+    if (level > 0){
+      // At coarse levels it is enough to stop when the points move
+      // by less than a small fraction of a voxel.
+      voxel_size = ref_data.voxel_sizes[level - 1];
+      level_source = voxel_downsample(source, voxel_size);
+      if (level_source.features.cols() < MIN_NUM_PYRAMID_PTS) continue;
+      diff_translation_err = std::max(diff_translation_err, voxel_size/100.0);
+      if (source_radius > 0)
+        diff_rotation_err = std::max(diff_rotation_err,
+                                     (voxel_size/100.0)/source_radius);
+      vw_out() << tag << "Pyramid level " << level << ": voxel size " << voxel_size
+               << " m, " << level_source.features.cols() << " source points"
+               << endl;
+    }
+
+    double match_ratio = 0.0;
+    if (use_dem_grid){
+      T = dem_icp(*dem_grid, level_source, T, opt.num_iter, opt.outlier_ratio,
+                  diff_rotation_err, diff_translation_err, max_match_dist,
+                  opt.compute_translation_only, match_ratio);
+    }else{
+      Mutex::Lock lock(*ref_data.icp_mutexes[level]);
+      PM::ICP & level_icp = (level > 0) ? *ref_data.coarse_icps[level - 1] : icp;
+      DP const& level_ref = (level > 0) ? *ref_data.coarse_refs[level - 1] : ref;
+      set_icp_params(opt, diff_rotation_err, diff_translation_err, max_match_dist,
+                     level_icp);
+      T = level_icp(level_source, level_ref, T, opt.compute_translation_only);
+      match_ratio = level_icp.errorMinimizer->getWeightedPointUsedRatio();
+    }
+    if (level == 0) vw_out() << tag << "Match ratio: " << match_ratio << endl;
+    prev_voxel_size = voxel_size;
+  }
+  sw6.stop();
+  if (opt.verbose) vw_out() << "ICP took "
+                            << sw6.elapsed_seconds() << " [s]" << endl;
+
+  // Transform the source to make it close to reference.
+  DP trans_source(source);
+  trans_source.features = T*source.features;
+
+  // Calculate by how much points move as result of T
+  calc_max_displacment(tag, source, trans_source);
+  Vector3 source_ctr_vec, source_ctr_llh;
+  Vector3 trans_xyz, trans_ned, trans_llh;
+  calc_translation_vec(source, trans_source, shift, geo.datum(),
+                       source_ctr_vec, source_ctr_llh,
+                       trans_xyz, trans_ned, trans_llh);
+  
+  // Calculate the errors after doing ICP
+  PointMatcher<RealT>::Matrix end_errors;
+  Stopwatch sw7;
+  sw7.start();
+  if (use_dem_grid)
+    filter_gross_outliers_and_calc_dem_errors(*dem_grid, big,
+                                              trans_source, end_errors); // in-out
+  else{
+    Mutex::Lock lock(*ref_data.icp_mutexes[0]);
+    icp.filterGrossOutliersAndCalcErrors(ref, big,
+                                          trans_source, end_errors); // in-out
+  }
+  calc_stats(tag, "Output", end_errors);
+  sw7.stop();
+  if (opt.verbose) vw_out() << "Final error computation took "
+                            << sw7.elapsed_seconds() << " [s]" << endl;
+
+  // We must apply to T the initial guess transform
+  PointMatcher<RealT>::Matrix combinedT = T*initT;
+
+  // Go back to the original coordinate system, undoing the shift
+  PointMatcher<RealT>::Matrix globalT = apply_shift(combinedT, -shift);
+
+  // Print statistics
+  vw_out() << tag << "Alignment transform (rotation + translation, "
+       << "origin is planet center):" << endl << globalT << endl;
+  vw_out() << tag << "Centroid of source points (Cartesian, meters): " << source_ctr_vec << std::endl;
+  // Swap lat and lon, as we want to print lat first
+  std::swap(source_ctr_llh[0], source_ctr_llh[1]);
+  vw_out() << tag << "Centroid of source points (lat,lon,z): " << source_ctr_llh << std::endl;
+  vw_out() << std::endl;
+  
+  vw_out() << tag << "Translation vector (Cartesian, meters): " << trans_xyz << std::endl;
+  vw_out() << tag << "Translation vector (North-East-Down, meters): "
+       << trans_ned << std::endl;
+  vw_out() << tag << "Translation vector magnitude (meters): " << norm_2(trans_xyz)
+       << std::endl;
+  // Swap lat and lon, as we want to print lat first
+  std::swap(trans_llh[0], trans_llh[1]);
+  vw_out() << tag << "Translation vector (lat,lon,z): " << trans_llh << std::endl;
+  vw_out() << std::endl;
+  
+  Matrix3x3 rot;
+  for (int r = 0; r < DIM; r++) for (int c = 0; c < DIM; c++)
+    rot(r, c) = globalT(r, c);
+  Vector3 euler_angles = math::rotation_matrix_to_euler_xyz(rot) * 180/M_PI;
+  Vector3 axis_angles = math::matrix_to_axis_angle(rot) * 180/M_PI;
+  vw_out() << tag << "Euler angles (degrees): " << euler_angles  << endl;
+  vw_out() << tag << "Axis of rotation and angle (degrees): "
+       << axis_angles/norm_2(axis_angles) << ' '
+       << norm_2(axis_angles) << endl;
+  
+  Stopwatch sw8;
+  sw8.start();
+  save_transforms(opt, globalT);
+
+  if (opt.save_trans_ref){
+    string trans_ref_prefix = opt.out_prefix + "-trans_reference";
+    save_trans_point_cloud(opt, opt.reference, trans_ref_prefix,
+                           geo, C, globalT.inverse());
+  }
+  
+  if (opt.save_trans_source){
+    string trans_source_prefix = opt.out_prefix + "-trans_source";
+    save_trans_point_cloud(opt, opt.source, trans_source_prefix,
+                           geo, C, globalT);
+  }
+  
+  save_errors(source, beg_errors,  opt.out_prefix + "-beg_errors.csv",
+              shift, geo, C, is_lola_rdr_format, mean_source_longitude);
+  save_errors(trans_source, end_errors,  opt.out_prefix + "-end_errors.csv",
+              shift, geo, C, is_lola_rdr_format, mean_source_longitude);
+
+  if (opt.verbose && !use_dem_grid) vw_out() << "Writing: " << opt.out_prefix
+    + "-iterationInfo.csv" << std::endl;
+  
+  sw8.stop();
+  if (opt.verbose) vw_out() << "Saving to disk took "
+                            << sw8.elapsed_seconds() << " [s]" << endl;
+}
+
+// Load one of several sources, crop it to the area in common with
+// the reference, and align it.
+class AlignSourceTask: public Task, private boost::noncopyable{
+  Options m_opt;
+  GeoReference const& m_geo;
+  asp::CsvConv const& m_C;
+  int64 m_num_source_pts;
+  int m_num_sample_pts;
+  Reference & m_ref_data;
+  int & m_num_failed;
+  Mutex & m_mutex;
+public:
+  AlignSourceTask(Options const& opt, GeoReference const& geo,
+                  asp::CsvConv const& C, int64 num_source_pts,
+                  int num_sample_pts, Reference & ref_data,
+                  int & num_failed, Mutex & mutex):
+    m_opt(opt), m_geo(geo), m_C(C), m_num_source_pts(num_source_pts),
+    m_num_sample_pts(num_sample_pts), m_ref_data(ref_data),
+    m_num_failed(num_failed), m_mutex(mutex){}
+
+  void operator()(){
+    try{
+      vw_out() << "Aligning: " << m_opt.source << endl;
+      CloudSample source_sample;
+      load_file<RealT>(m_opt.source, m_num_source_pts, BBox2(),
+                       m_geo, m_C, m_opt.verbose, source_sample);
+      BBox2 ref_box = m_ref_data.box;
+      BBox2 source_box = calc_extended_lonlat_bbox(m_geo, m_num_sample_pts,
+                                                   source_sample, m_opt.max_disp);
+      intersect_lonlat_boxes(ref_box, source_box);
+      load_cropped_sample(m_opt.source, m_num_source_pts, ref_box,
+                          m_geo, m_C, m_opt.verbose, source_sample);
+      align_source(m_opt, m_geo, m_C, source_sample, m_ref_data);
+    }catch(const std::exception& e){
+      vw_out() << "Failed to align " << m_opt.source << ": " << e.what() << endl;
+      Mutex::Lock lock(m_mutex);
+      m_num_failed++;
+    }
+  }
+};
+
 int main( int argc, char *argv[] ) {
 
   // Mandatory line for Eigen
@@ -1609,252 +2400,112 @@ int main( int argc, char *argv[] ) {
       }
     }
     
-    // We will use ref_box to bound the source points, and vice-versa. 
-    // Decide how many samples to pick to estimate these boxes.
-    Stopwatch sw0;
-    sw0.start();
+    // With the point-to-dem method the reference DEM is used as a
+    // grid, rather than as a cloud of points in a tree.
+    bool use_dem_grid = (opt.alignment_method == "point-to-dem");
+    if (use_dem_grid && get_file_type(opt.reference) != "DEM")
+      vw_throw( ArgumentErr() << "The point-to-dem alignment method "
+                << "requires the reference to be a DEM.\n" );
+
+    // We will use ref_box to bound the source points, and vice-versa.
+    // Decide how many samples to use to estimate these boxes.
     int num_sample_pts = std::max(4000000,
                                   std::max(opt.max_num_source_points,
                                            opt.max_num_reference_points)/4);
-    BBox2 ref_box, source_box;
-    ref_box = calc_extended_lonlat_bbox(geo, num_sample_pts,
-                                        C, opt.reference, opt.max_disp);
-    source_box = calc_extended_lonlat_bbox(geo, num_sample_pts,
-                                           C, opt.source, opt.max_disp);
-    // If ref points are offset by 360 degrees in longitude in respect to
-    // source points, adjust the ref box to be aligned with the source points,
-    // and vice versa.
-    double lon_offset = 0.0;
-    if (!ref_box.empty() && !source_box.empty()){
-      lon_offset = (source_box.min().x() + source_box.max().x())/2.0
-        - (ref_box.min().x() + ref_box.max().x())/2.0;
-      lon_offset = 360.0*round(lon_offset/360.0);
-      ref_box    += Vector2(lon_offset, 0);
-      ref_box.crop(source_box); source_box.crop(ref_box); // common area
-      source_box -= Vector2(lon_offset, 0);
+
+    // Load a sample of each cloud in one pass. If the user wants to
+    // filter gross outliers in the source points based on max_disp,
+    // load a lot more source points than asked, filter based on
+    // max_disp, then resample to the number desired by the user.
+    // Sources aligned at the same time share that budget.
+    // Reference points are only used to find the region of overlap
+    // when the reference is used as a grid.
+    int64 num_source_pts = opt.max_num_source_points;
+    if (opt.max_disp > 0.0){
+      int64 num_pre_filter_pts = NUM_PRE_FILTER_SOURCE_PTS;
+      if (opt.source_files.size() > 1)
+        num_pre_filter_pts /= std::min(int64(opt.num_parallel_sources),
+                                       int64(opt.source_files.size()));
+      num_source_pts = max(num_source_pts, num_pre_filter_pts);
     }
-    sw0.stop();
-    if (opt.verbose) vw_out() << "Determination of the intersection "
-                              << "of bounding boxes of the reference"
-                              << " and source points took "
-                              << sw0.elapsed_seconds() << " [s]" << endl;
-    
-    // Load the point clouds. We will shift both point clouds by the
-    // centroid of the first one to bring them closer to origin.
-    
-    // Load the subsampled reference point cloud.
-    Vector3 shift;
-    bool calc_shift = true;
-    bool is_lola_rdr_format = false;     // may get overwritten
-    double mean_ref_longitude    = 0.0;  // may get overwritten
-    double mean_source_longitude = 0.0;  // may get overwritten
+    int64 num_ref_pts = opt.max_num_reference_points;
+    if (use_dem_grid) num_ref_pts = min(num_ref_pts, int64(num_sample_pts));
     Stopwatch sw1;
     sw1.start();
-    DP ref;
-    load_file<RealT>(opt.reference, opt.max_num_reference_points,
-                     source_box, // source box is used to bound reference
-                     calc_shift, shift, geo, C, is_lola_rdr_format,
-                     mean_ref_longitude, opt.verbose, ref);
+    Reference ref_data;
+    load_file<RealT>(opt.reference, num_ref_pts, BBox2(),
+                     geo, C, opt.verbose, ref_data.sample);
     sw1.stop();
     if (opt.verbose) vw_out() << "Loading the reference point cloud took "
                               << sw1.elapsed_seconds() << " [s]" << endl;
-    //ref.save(outputBaseFile + "_ref.vtk");
+    ref_data.box = calc_extended_lonlat_bbox(geo, num_sample_pts, ref_data.sample,
+                                             opt.max_disp);
+
+    if (opt.source_files.size() > 1){
+
+      // The reference is prepared once, over all its area, and the
+      // sources are aligned against it in parallel.
+      prepare_reference(opt, BBox2(), ref_data);
+
+      int num_failed = 0;
+      Mutex mutex;
+      FifoWorkQueue queue(opt.num_parallel_sources);
+      for (size_t i = 0; i < opt.source_files.size(); i++){
+        Options source_opt = opt;
+        source_opt.source = opt.source_files[i];
+        source_opt.out_prefix = batch_out_prefix(opt, i);
+        boost::shared_ptr<Task>
+          task(new AlignSourceTask(source_opt, geo, C, num_source_pts,
+                                   num_sample_pts, ref_data, num_failed, mutex));
+        queue.add_task(task);
+      }
+      queue.join_all();
+
+      if (num_failed > 0)
+        vw_throw( ArgumentErr() << "Failed to align " << num_failed << " out of "
+                  << opt.source_files.size() << " source clouds.\n" );
+      return 0;
+    }
 
-    // Load the subsampled source point cloud. If the user wants
-    // to filter gross outliers in the source points based on
-    // max_disp, load a lot more points than asked, filter based on
-    // max_disp, then resample to the number desired by the user.
-    int num_source_pts = opt.max_num_source_points;
-    if (opt.max_disp > 0.0) num_source_pts = max(num_source_pts, 50000000);
-    calc_shift = false;
     Stopwatch sw2;
     sw2.start();
-    DP source;
-    load_file<RealT>(opt.source, num_source_pts,
-                     ref_box, // ref box is used to bound source
-                     calc_shift, shift, geo, C, is_lola_rdr_format,
-                     mean_source_longitude, opt.verbose, source);
+    CloudSample source_sample;
+    load_file<RealT>(opt.source, num_source_pts, BBox2(),
+                     geo, C, opt.verbose, source_sample);
     sw2.stop();
     if (opt.verbose) vw_out() << "Loading the source point cloud took "
                               << sw2.elapsed_seconds() << " [s]" << endl;
-    
-    // So far we shifted by first point in first point cloud to reduce
-    // the magnitude of all loaded points. Now that we have loaded all
-    // points, shift one more time, to place the centroid of the
-    // reference at the origin.
-    // Note: If this code is ever converting to using floats,
-    // the operation below needs to be re-implemented to be accurate.
-    int numRefPts = ref.features.cols();
-    Eigen::VectorXd meanRef = ref.features.rowwise().sum() / numRefPts;
-    ref.features.topRows(DIM).colwise()    -= meanRef.head(DIM);
-    source.features.topRows(DIM).colwise() -= meanRef.head(DIM);
-    for (int row = 0; row < DIM; row++) shift[row] += meanRef(row);
-    if (opt.verbose) vw_out() << "Data shifted internally by subtracting: "
-                              << shift << std::endl;
-
-
-    // The point clouds are shifted, so shift the initial transform as well.
-    PointMatcher<RealT>::Matrix initT = apply_shift(opt.init_transform, shift);
-
-    // Filter the reference and initialize the reference tree
-    PM::ICP icp;
-    Stopwatch sw3;
-    sw3.start();
-    icp.initRefTree(ref, opt.alignment_method, opt.highest_accuracy,
-                    false /*opt.verbose*/);
-    sw3.stop();
-    if (opt.verbose) vw_out() << "Reference point cloud processing took "
-                              << sw3.elapsed_seconds() << " [s]" << endl;
-
-    // Apply the initial guess transform to the source point cloud.
-    icp.transformations.apply(source, initT);
-
-    PointMatcher<RealT>::Matrix beg_errors;
-    if (opt.max_disp > 0.0){
-      // Filter gross outliers
-      Stopwatch sw4;
-      sw4.start();
-      icp.filterGrossOutliersAndCalcErrors(ref, opt.max_disp*opt.max_disp,
-                                            source, beg_errors); //in-out
-      sw4.stop();
-      if (opt.verbose) vw_out() << "Filter gross outliers took "
-                                << sw4.elapsed_seconds() << " [s]" << endl;
-    }
-    
-    random_pc_subsample<RealT>(opt.max_num_source_points, source);
-    vw_out() << "Reducing number of source points to " << source.features.cols()
-             << endl;
 
-    //dump_llh("ref.csv", datum, ref,    shift);
-    //dump_llh("src.csv", datum, source, shift);
-    
-    // Calculate the errors before doing ICP
-    Stopwatch sw5;
-    sw5.start();
-    double big = 1e+300;
-    icp.filterGrossOutliersAndCalcErrors(ref, big,
-                                          source, beg_errors); //in-out
-    calc_stats("Input", beg_errors);
-    sw5.stop();
-    if (opt.verbose) vw_out() << "Initial error computation took "
-                              << sw5.elapsed_seconds() << " [s]" << endl;
-
-    // Compute the transformation to align the source to reference.
-    Stopwatch sw6;
-    sw6.start();
-    PointMatcher<RealT>::Matrix Id
-      = PointMatcher<RealT>::Matrix::Identity(DIM + 1, DIM + 1);
-    if (opt.config_file == ""){
-      // Read the options from the command line
-      icp.setParams(opt.out_prefix, opt.num_iter, opt.outlier_ratio,
-                    (2.0*M_PI/360.0)*opt.diff_rotation_err, // convert to radians
-                    opt.diff_translation_err, opt.alignment_method,
-                    false/*opt.verbose*/);
-    }else{
-      vw_out() << "Will read the options from: " << opt.config_file << endl;
-      ifstream ifs(opt.config_file.c_str());
-      if (!ifs.good())
-        vw_throw( ArgumentErr() << "Cannot open configuration file: "
-                  << opt.config_file << "\n" );
-      icp.loadFromYaml(ifs);
-    }
-    // We bypass calling ICP if the user explicitely asks for 0 iterations.
-    PointMatcher<RealT>::Matrix T = Id;
-    if (opt.num_iter > 0){
-      T = icp(source, ref, Id,
-              opt.compute_translation_only);
-      vw_out() << "Match ratio: "
-               << icp.errorMinimizer->getWeightedPointUsedRatio() << endl;
-    }
-    sw6.stop();
-    if (opt.verbose) vw_out() << "ICP took "
-                              << sw6.elapsed_seconds() << " [s]" << endl;
-
-    // Transform the source to make it close to reference.
-    DP trans_source(source);
-    icp.transformations.apply(trans_source, T);
-
-    // Calculate by how much points move as result of T
-    calc_max_displacment(source, trans_source);
-    Vector3 source_ctr_vec, source_ctr_llh;
-    Vector3 trans_xyz, trans_ned, trans_llh;
-    calc_translation_vec(source, trans_source, shift, geo.datum(),
-                         source_ctr_vec, source_ctr_llh,
-                         trans_xyz, trans_ned, trans_llh);
-    
-    // Calculate the errors after doing ICP
-    PointMatcher<RealT>::Matrix end_errors;
-    Stopwatch sw7;
-    sw7.start();
-    icp.filterGrossOutliersAndCalcErrors(ref, big,
-                                          trans_source, end_errors); // in-out
-    calc_stats("Output", end_errors);
-    sw7.stop();
-    if (opt.verbose) vw_out() << "Final error computation took "
-                              << sw7.elapsed_seconds() << " [s]" << endl;
-
-    // We must apply to T the initial guess transform
-    PointMatcher<RealT>::Matrix combinedT = T*initT;
-
-    // Go back to the original coordinate system, undoing the shift
-    PointMatcher<RealT>::Matrix globalT = apply_shift(combinedT, -shift);
-
-    // Print statistics
-    vw_out() << "Alignment transform (rotation + translation, "
-         << "origin is planet center):" << endl << globalT << endl;
-    vw_out() << "Centroid of source points (Cartesian, meters): " << source_ctr_vec << std::endl;
-    // Swap lat and lon, as we want to print lat first
-    std::swap(source_ctr_llh[0], source_ctr_llh[1]);
-    vw_out() << "Centroid of source points (lat,lon,z): " << source_ctr_llh << std::endl;
-    vw_out() << std::endl;
-    
-    vw_out() << "Translation vector (Cartesian, meters): " << trans_xyz << std::endl;
-    vw_out() << "Translation vector (North-East-Down, meters): "
-         << trans_ned << std::endl;
-    vw_out() << "Translation vector magnitude (meters): " << norm_2(trans_xyz)
-         << std::endl;
-    // Swap lat and lon, as we want to print lat first
-    std::swap(trans_llh[0], trans_llh[1]);
-    vw_out() << "Translation vector (lat,lon,z): " << trans_llh << std::endl;
-    vw_out() << std::endl;
-    
-    Matrix3x3 rot;
-    for (int r = 0; r < DIM; r++) for (int c = 0; c < DIM; c++)
-      rot(r, c) = globalT(r, c);
-    Vector3 euler_angles = math::rotation_matrix_to_euler_xyz(rot) * 180/M_PI;
-    Vector3 axis_angles = math::matrix_to_axis_angle(rot) * 180/M_PI;
-    vw_out() << "Euler angles (degrees): " << euler_angles  << endl;
-    vw_out() << "Axis of rotation and angle (degrees): "
-         << axis_angles/norm_2(axis_angles) << ' '
-         << norm_2(axis_angles) << endl;
-    
-    Stopwatch sw8;
-    sw8.start();
-    save_transforms(opt, globalT);
-
-    if (opt.save_trans_ref){
-      string trans_ref_prefix = opt.out_prefix + "-trans_reference";
-      save_trans_point_cloud(opt, opt.reference, trans_ref_prefix,
-                             geo, C, globalT.inverse());
-    }
-    
-    if (opt.save_trans_source){
-      string trans_source_prefix = opt.out_prefix + "-trans_source";
-      save_trans_point_cloud(opt, opt.source, trans_source_prefix,
-                             geo, C, globalT);
+    Stopwatch sw0;
+    sw0.start();
+    BBox2 ref_box = ref_data.box;
+    BBox2 source_box = calc_extended_lonlat_bbox(geo, num_sample_pts, source_sample,
+                                                 opt.max_disp);
+    intersect_lonlat_boxes(ref_box, source_box);
+
+    // The source box is used to bound the reference, and vice versa
+    load_cropped_sample(opt.reference, num_ref_pts, source_box,
+                        geo, C, opt.verbose, ref_data.sample);
+    load_cropped_sample(opt.source, num_source_pts, ref_box,
+                        geo, C, opt.verbose, source_sample);
+    sw0.stop();
+    if (opt.verbose) vw_out() << "Determination of the intersection "
+                              << "of bounding boxes of the reference"
+                              << " and source points took "
+                              << sw0.elapsed_seconds() << " [s]" << endl;
+
+    // The DEM grid is read only around the source. Without max_disp
+    // the source box is not known yet, so use the box of the source
+    // points, padded on each side by a fraction of its size.
+    BBox2 dem_box = source_box;
+    if (use_dem_grid && dem_box.empty()){
+      dem_box = calc_extended_lonlat_bbox(geo, num_sample_pts, source_sample, 0.0);
+      if (!dem_box.empty())
+        dem_box.expand(DEM_GRID_MARGIN*std::max(dem_box.width(), dem_box.height()));
     }
-    
-    save_errors(source, beg_errors,  opt.out_prefix + "-beg_errors.csv",
-                shift, geo, C, is_lola_rdr_format, mean_source_longitude);
-    save_errors(trans_source, end_errors,  opt.out_prefix + "-end_errors.csv",
-                shift, geo, C, is_lola_rdr_format, mean_source_longitude);
 
-    if (opt.verbose) vw_out() << "Writing: " << opt.out_prefix
-      + "-iterationInfo.csv" << std::endl;
-    
-    sw8.stop();
-    if (opt.verbose) vw_out() << "Saving to disk took "
-                              << sw8.elapsed_seconds() << " [s]" << endl;
+    prepare_reference(opt, dem_box, ref_data);
+    align_source(opt, geo, C, source_sample, ref_data);
 
   } ASP_STANDARD_CATCHES;
 
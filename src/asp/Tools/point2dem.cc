@@ -21,9 +21,10 @@
 
 #include <asp/Core/PointUtils.h>
 #include <asp/Core/OrthoRasterizer.h>
+#include <asp/Core/Point2Grid.h>
 #include <asp/Core/Macros.h>
 #include <asp/Core/Common.h>
-#include <asp/Core/AntiAliasing.h>
+#include <asp/Core/Overviews.h>
 
 #include <vw/Core/Stopwatch.h>
 #include <vw/Mosaic/ImageComposite.h>
@@ -64,6 +65,7 @@ struct Options : asp::BaseOptions {
 
   // Settings
   float dem_spacing, nodata_value;
+  std::vector<double> extra_dem_spacings; // coarser DEMs made in the same run
   double semi_major, semi_minor;
   std::string reference_spheroid;
   double phi_rot, omega_rot, kappa_rot;
@@ -86,6 +88,12 @@ struct Options : asp::BaseOptions {
   double search_radius_factor;
   bool use_surface_sampling;
   bool has_las_or_csv;
+  bool no_pc_index;
+  bool build_overviews;
+  std::string filter;
+  vw::stereo::FilterType filter_type;
+  double filter_percentile;
+  std::string pc_index_file, pc_index_key, pc_projection_key;
   
   // Output
   std::string  out_prefix, output_file_type;
@@ -98,7 +106,8 @@ struct Options : asp::BaseOptions {
               dem_hole_fill_len(0), ortho_hole_fill_len(0),
               remove_outliers_with_pct(true), max_valid_triangulation_error(0),
               search_radius_factor(0),  use_surface_sampling(false),
-              has_las_or_csv(false){}
+              has_las_or_csv(false), no_pc_index(false), build_overviews(false),
+              filter_type(vw::stereo::f_weighted_average), filter_percentile(50.0){}
 };
 
 void parse_input_clouds_textures(std::vector<std::string> const& files,
@@ -278,9 +287,39 @@ void las_or_csv_to_tifs(Options& opt, vw::cartography::GeoReference const& geore
   
 }
 
+// Parse one or more DEM spacings, and sort them in increasing order.
+// Zero spacing means we'll set it internally, and is allowed only
+// by itself.
+std::vector<double> parse_dem_spacings(std::string const& str,
+                                       std::string const& usage,
+                                       po::options_description const& general_options){
+  std::string spacing_str = str;
+  std::replace(spacing_str.begin(), spacing_str.end(), ',', ' ');
+  std::istringstream is(spacing_str);
+  std::vector<double> spacings;
+  double val;
+  while (is >> val){
+    if (val < 0.0)
+      vw_throw( ArgumentErr() << "The DEM spacing cannot be negative.\n"
+                << usage << general_options );
+    spacings.push_back(val);
+  }
+  if (!is.eof())
+    vw_throw( ArgumentErr() << "Could not parse the DEM spacing: " << str << "\n"
+              << usage << general_options );
+  if (spacings.empty()) spacings.push_back(0.0);
+
+  std::sort(spacings.begin(), spacings.end());
+  spacings.erase(std::unique(spacings.begin(), spacings.end()), spacings.end());
+  if (spacings.size() > 1 && spacings[0] == 0.0)
+    vw_throw( ArgumentErr() << "When more than one DEM spacing is specified, "
+              << "all must be positive.\n" << usage << general_options );
+  return spacings;
+}
+
 void handle_arguments( int argc, char *argv[], Options& opt ) {
 
-  float dem_spacing1, dem_spacing2;
+  std::string dem_spacing1, dem_spacing2;
 
   po::options_description manipulation_options("Manipulation options");
   manipulation_options.add_options()
@@ -297,9 +336,9 @@ void handle_arguments( int argc, char *argv[], Options& opt ) {
     ("t_srs", po::value(&opt.target_srs_string)->default_value(""),
      "Specify the projection (PROJ.4 string).")
     ("t_projwin", po::value(&opt.target_projwin), "Selects a subwindow from the source image for copying but with the corners given in georeferenced coordinates. Max is exclusive.")
-    ("dem-spacing,s", po::value(&dem_spacing1)->default_value(0.0),
-     "Set output DEM resolution (in target georeferenced units per pixel). If not specified, it will be computed automatically (except for LAS and CSV files). This is the same as the --tr option.")
-    ("tr", po::value(&dem_spacing2)->default_value(0.0),
+    ("dem-spacing,s", po::value(&dem_spacing1)->default_value("0"),
+     "Set output DEM resolution (in target georeferenced units per pixel). If not specified, it will be computed automatically (except for LAS and CSV files). If given a list of values in quotes, such as '1 2 10', a DEM is created at each of them, finding the bounds of the cloud only once. This is the same as the --tr option.")
+    ("tr", po::value(&dem_spacing2)->default_value("0"),
      "Set output DEM resolution (in target georeferenced units per pixel). If not specified, it will be computed automatically (except for LAS and CSV files). This is the same as the --dem-spacing option.")
     ("reference-spheroid,r", po::value(&opt.reference_spheroid),"Set the reference spheroid [Earth, Moon, Mars]. This will override manually set datum information.")
     ("semi-major-axis", po::value(&opt.semi_major)->default_value(0), "Explicitly set the datum semi-major axis in meters.")
@@ -346,7 +385,13 @@ void handle_arguments( int argc, char *argv[], Options& opt ) {
     ("use-surface-sampling", po::bool_switch(&opt.use_surface_sampling)->default_value(false),
      "Use the older algorithm, interpret the point cloud as a surface made up of triangles and interpolate into it (prone to aliasing).")
     ("fsaa", po::value(&opt.fsaa)->implicit_value(3), "Oversampling amount to perform antialiasing (obsolete).")
-    ("no-dem", po::bool_switch(&opt.no_dem)->default_value(false), "Skip writing a DEM.");
+    ("no-dem", po::bool_switch(&opt.no_dem)->default_value(false), "Skip writing a DEM.")
+    ("filter", po::value(&opt.filter)->default_value("weighted_average"),
+     "How to combine the heights of the points within the search radius of each DEM grid point. Options: weighted_average (Gaussian weights), min, max, mean, median, stddev, count, or a percentile such as 75pct. Except for weighted_average, all points within the radius count the same, and median and percentiles are approximate beyond five points.")
+    ("no-point-cloud-index", po::bool_switch(&opt.no_pc_index)->default_value(false),
+     "Do not read or write the index of point cloud block bounds kept next to the input point cloud.")
+    ("build-overviews", po::bool_switch(&opt.build_overviews)->default_value(false),
+     "Store reduced-resolution overviews inside the output DEMs, computed while they are written. Applies to tif output only.");
   
   general_options.add( manipulation_options );
   general_options.add( projection_options );
@@ -375,16 +420,26 @@ void handle_arguments( int argc, char *argv[], Options& opt ) {
   
   // A fix to the unfortunate fact that the user can specify the DEM
   // spacing in two ways on the command line.
-  if (dem_spacing1 < 0.0 || dem_spacing2 < 0.0 ){
-    // Note: Zero spacing means we'll set it internally.
-    vw_throw( ArgumentErr() << "The DEM spacing cannot be negative.\n"
-              << usage << general_options );
-  }
-  if (dem_spacing1 != 0 && dem_spacing2 != 0){
+  std::vector<double> spacings1 = parse_dem_spacings(dem_spacing1, usage, general_options);
+  std::vector<double> spacings2 = parse_dem_spacings(dem_spacing2, usage, general_options);
+  if (spacings1[0] != 0 && spacings2[0] != 0){
     vw_throw( ArgumentErr() << "The DEM spacing was specified twice.\n"
               << usage << general_options );
   }
-  opt.dem_spacing = std::max(dem_spacing1, dem_spacing2);
+  std::vector<double> spacings = (spacings1[0] != 0) ? spacings1 : spacings2;
+
+  opt.filter_type = vw::stereo::parse_filter(opt.filter, opt.filter_percentile);
+  if (opt.filter_type != vw::stereo::f_weighted_average && opt.use_surface_sampling)
+    vw_throw( ArgumentErr() << "The --filter option cannot be used "
+              << "with surface sampling.\n" );
+
+  // The finest DEM is made with the orthoimage and error image. The
+  // others are made after it, from the same cloud bounds.
+  opt.dem_spacing = spacings[0];
+  opt.extra_dem_spacings.assign(spacings.begin() + 1, spacings.end());
+  if (!opt.extra_dem_spacings.empty() && opt.target_projwin != BBox2())
+    vw_throw( ArgumentErr() << "Cannot create DEMs at multiple spacings "
+              << "when cropping with --t_projwin.\n" );
 
   if (opt.has_las_or_csv && opt.dem_spacing <= 0){
     vw_throw( ArgumentErr() << "When inputs are LAS or CSV files, the "
@@ -454,132 +509,20 @@ void handle_arguments( int argc, char *argv[], Options& opt ) {
   opt.has_nodata_value = vm.count("nodata-value");
 }
 
-// If a pixel has invalid data, fill its value with the average of
-// valid pixel values within a given window around the pixel.
-template <class ImageT>
-class FillNoDataWithAvg:
-  public ImageViewBase< FillNoDataWithAvg<ImageT> > {
-  ImageT m_img;
-  int m_kernel_size;
-  typedef typename ImageT::pixel_type PixelT;
-
-public:
-
-  typedef PixelT pixel_type;
-  typedef PixelT result_type;
-  typedef ProceduralPixelAccessor<FillNoDataWithAvg> pixel_accessor;
-
-  FillNoDataWithAvg( ImageViewBase<ImageT> const& img,
-                     int kernel_size) :
-    m_img(img.impl()), m_kernel_size(kernel_size) {
-    VW_ASSERT(m_kernel_size%2 == 1 && m_kernel_size > 0,
-              ArgumentErr() << "Expecting odd and positive kernel size.");
-  }
-
-  inline int32 cols() const { return m_img.cols(); }
-  inline int32 rows() const { return m_img.rows(); }
-  inline int32 planes() const { return 1; }
-
-  inline pixel_accessor origin() const { return pixel_accessor(*this); }
-
-  inline result_type operator()( size_t i, size_t j, size_t p=0 ) const {
-    if (is_valid(m_img(i, j)))
-      return m_img(i, j);
-
-    pixel_type val; val.validate();
-    int nvalid = 0;
-    int c0 = i, r0 = j; // convert to int from size_t
-    int k2 = m_kernel_size/2, nc = m_img.cols(), nr = m_img.rows();
-    for (int c = std::max(0, c0-k2); c <= std::min(nc-1, c0+k2); c++){
-      for (int r = std::max(0, r0-k2); r <= std::min(nr-1, r0+k2); r++){
-        if (!is_valid(m_img(c, r))) continue;
-        val += m_img(c, r);
-        nvalid++;
-      }
-    }
-
-    if (nvalid == 0) return m_img(i, j); // could not find valid points
-    return val/nvalid; // average of valid values within window
-  }
-
-  typedef FillNoDataWithAvg<CropView<ImageView<PixelT> > > prerasterize_type;
-  inline prerasterize_type prerasterize( BBox2i const& bbox ) const {
-
-    // Crop into an expanded box as to have enough pixels to do
-    // averaging with given window at every pixel in the current box.
-    BBox2i biased_box = bbox;
-    biased_box.expand(m_kernel_size/2);
-    biased_box.crop(bounding_box(m_img));
-    ImageView<PixelT> dest( crop( m_img, biased_box ) );
- 
-    return prerasterize_type( crop( dest, -biased_box.min().x(), -biased_box.min().y(), cols(), rows() ), m_kernel_size );
-    
-}
-  template <class DestT> inline void rasterize( DestT const& dest, BBox2i const& bbox ) const { vw::rasterize( prerasterize(bbox), dest, bbox ); }
-  
-};
-template <class ImgT>
-FillNoDataWithAvg<ImgT>
-fill_nodata_with_avg( ImageViewBase<ImgT> const& img,
-                      int kernel_size) {
-  typedef FillNoDataWithAvg<ImgT> result_type;
-  return result_type( img.impl(), kernel_size);
-}
-
+// Apply the user-specified crop, if any. Supersampling, if requested,
+// happens in the rasterizer itself.
 template <class ImageT>
 ImageViewRef< PixelGray<float> >
 generate_fsaa_raster( ImageViewBase<ImageT> const& rasterizer,
                       Options const& opt ) {
-  // This probably needs a lanczos filter. Sinc filter is the ideal
-  // since it is the ideal brick filter.
-  // ... or ...
-  // possibly apply the blur on a linear scale (pow(0,2.2), blur, then exp).
-
-  float fsaa_sigma = 1.0f * float(opt.fsaa)/2.0f;
-  int kernel_size = vw::compute_kernel_size(fsaa_sigma);
-  
   ImageViewRef< PixelGray<float> > rasterizer_fsaa;
   if ( opt.target_projwin != BBox2() ) {
     typedef ValueEdgeExtension< PixelGray<float> > ValExtend;
-    if ( opt.fsaa > 1 ) {
-      // subsample .. samples from the corner.
-      rasterizer_fsaa =
-        crop(edge_extend
-             (apply_mask
-              (asp::resample_aa
-               (translate
-                (gaussian_filter
-                 (fill_nodata_with_avg
-                  (create_mask(rasterizer.impl(),opt.nodata_value),
-                   kernel_size),
-                  fsaa_sigma),
-                 -double(opt.fsaa-1)/2., double(opt.fsaa-1)/2.,
-                 ConstantEdgeExtension()), 1.0/opt.fsaa),
-               opt.nodata_value),
-              ValExtend(opt.nodata_value)), opt.target_projwin_pixels );
-    } else {
-      rasterizer_fsaa =
-        crop(edge_extend(rasterizer.impl(),
-                         ValExtend(opt.nodata_value)), opt.target_projwin_pixels );
-    }
+    rasterizer_fsaa =
+      crop(edge_extend(rasterizer.impl(),
+                       ValExtend(opt.nodata_value)), opt.target_projwin_pixels );
   } else {
-    if ( opt.fsaa > 1 ) {
-      // subsample .. samples from the corner.
-      rasterizer_fsaa =
-        apply_mask
-        (asp::resample_aa
-         (translate
-          (gaussian_filter
-           (fill_nodata_with_avg
-            (create_mask(rasterizer.impl(),opt.nodata_value),
-             kernel_size),
-            fsaa_sigma),
-           -double(opt.fsaa-1)/2., double(opt.fsaa-1)/2.,
-           ConstantEdgeExtension()), 1.0/opt.fsaa),
-         opt.nodata_value);
-    } else {
-      rasterizer_fsaa = rasterizer.impl();
-    }
+    rasterizer_fsaa = rasterizer.impl();
   }
   return rasterizer_fsaa;
 }
@@ -626,11 +569,16 @@ namespace asp{
 
   template<class ImageT>
   void save_image(Options const& opt, ImageT img, GeoReference const& georef,
-                  std::string const& imgName){
+                  std::string const& imgName, bool build_overviews = false){
 
     std::string output_file = opt.out_prefix + "-" + imgName + "." + opt.output_file_type;
     vw_out() << "Writing: " << output_file << "\n";
-    if ( opt.output_file_type == "tif" ) {
+    if ( opt.output_file_type == "tif" && build_overviews ) {
+      asp::block_write_gdal_image_with_overviews(output_file, img, georef,
+                                                 opt.nodata_value, opt,
+                                                 TerminalProgressCallback("asp", imgName + ": ")
+                                                 );
+    } else if ( opt.output_file_type == "tif" ) {
       block_write_gdal_image(output_file, img, georef, opt.nodata_value, opt,
                              TerminalProgressCallback("asp", imgName + ": ")
                              );
@@ -897,6 +845,89 @@ namespace asp{
   
 } // end namespace asp
 
+// The point cloud index is kept next to the first input cloud. Its key
+// captures the input files, so the index is recomputed when any of
+// them change. Within it, the sub-block bounds are kept for each of the
+// last few projections, keyed by everything that goes into projecting
+// the points.
+std::string point_cloud_index_file(Options const& opt){
+  return fs::path(opt.pointcloud_files[0]).replace_extension("").string()
+    + "-index.bin";
+}
+
+std::string point_cloud_index_key(Options const& opt){
+  std::ostringstream os;
+  for (size_t i = 0; i < opt.pointcloud_files.size(); i++){
+    std::string const& file = opt.pointcloud_files[i];
+    os << fs::absolute(file).string() << ' ' << fs::file_size(file) << ' '
+       << fs::last_write_time(file) << "\n";
+  }
+  return os.str();
+}
+
+std::string point_cloud_projection_key(Options const& opt,
+                                       cartography::GeoReference const& georef,
+                                       double avg_lon){
+  std::ostringstream os;
+  os.precision(17);
+  os << georef.proj4_str() << "\n" << georef.datum() << "\n"
+     << opt.rot_order << ' ' << opt.phi_rot << ' ' << opt.omega_rot << ' '
+     << opt.kappa_rot << ' ' << opt.x_offset << ' ' << opt.y_offset << ' '
+     << opt.z_offset << ' ' << avg_lon;
+  return os.str();
+}
+
+// The name of the DEM at given spacing. The spacing is part of the name
+// only if more than one DEM is made.
+std::string dem_tag(Options const& opt, double spacing){
+  if (opt.extra_dem_spacings.empty()) return "DEM";
+  std::ostringstream os;
+  os << "DEM-" << spacing;
+  return os.str();
+}
+
+// Round the DEM heights, fill holes, and save it.
+void write_dem(Options const& opt, ImageViewRef< PixelGray<float> > const& raster,
+               cartography::GeoReference const& georef, std::string const& tag){
+  Stopwatch sw2;
+  sw2.start();
+  Vector2 tile_size(vw_settings().default_tile_size(),
+                    vw_settings().default_tile_size());
+  ImageViewRef< PixelGray<float> > dem
+    = asp::round_image_pixels_skip_nodata(raster, opt.rounding_error,
+                                          opt.nodata_value);
+  if (opt.dem_hole_fill_len > 0){
+    // Note that we first cache the tiles of the rasterized DEM, and fill holes
+    // later. This greatly improves the performance.
+    dem = apply_mask(fill_holes(create_mask
+                                (block_cache(dem, tile_size, opt.num_threads),
+                                 opt.nodata_value),
+                                opt.hole_fill_mode, opt.hole_fill_num_smooth_iter,
+                                opt.dem_hole_fill_len),
+                     opt.nodata_value);
+  }
+
+  vw_out()<< "Creating output file that is " << bounding_box(dem).size()
+          << " px.\n";
+
+  save_image(opt, dem, georef, tag, opt.build_overviews);
+  sw2.stop();
+  vw_out(DebugMessage,"asp") << "DEM render time: "
+                             << sw2.elapsed_seconds() << std::endl;
+}
+
+// Fix have pixel offset required if pixel_interpretation is
+// PixelAsArea.
+void apply_pixel_interpretation(cartography::GeoReference & georef){
+  if ( georef.pixel_interpretation() ==
+       cartography::GeoReference::PixelAsArea ) {
+    Matrix3x3 transform = georef.transform();
+    transform(0,2) -= 0.5 * transform(0,0);
+    transform(1,2) -= 0.5 * transform(1,1);
+    georef.set_transform( transform );
+  }
+}
+
 void do_software_rasterization( const ImageViewRef<Vector3>& proj_point_input,
                                 Options& opt,
                                 cartography::GeoReference& georef,
@@ -912,7 +943,8 @@ void do_software_rasterization( const ImageViewRef<Vector3>& proj_point_input,
                opt.remove_outliers_with_pct, opt.remove_outliers_params,
                error_image, estim_max_error, opt.max_valid_triangulation_error,
                opt.has_las_or_csv,
-               TerminalProgressCallback("asp","QuadTree: ") );
+               TerminalProgressCallback("asp","QuadTree: "),
+               opt.pc_index_file, opt.pc_index_key, opt.pc_projection_key );
 
   sw1.stop();
   vw_out(DebugMessage,"asp") << "Quad time: " << sw1.elapsed_seconds()
@@ -933,10 +965,9 @@ void do_software_rasterization( const ImageViewRef<Vector3>& proj_point_input,
   // Now we are ready to specify the affine transform.
   georef.set_transform(rasterizer.geo_transform());
 
-  // If the user requested FSAA .. tell the rasterer to increase
-  // its sampling rate
-  if ( opt.fsaa > 1 )
-    rasterizer.set_spacing( rasterizer.spacing() / double(opt.fsaa) );
+  // If the user requested FSAA, the rasterizer averages this many
+  // samples per pixel along each axis.
+  rasterizer.set_fsaa(opt.fsaa);
 
   // If the user specified the ULLR .. update the georeference
   // transform here. The generate_fsaa_raster will be responsible
@@ -964,13 +995,7 @@ void do_software_rasterization( const ImageViewRef<Vector3>& proj_point_input,
   // Fix have pixel offset required if pixel_interpretation is
   // PixelAsArea. We could have done that earlier ... but it makes
   // the above easier to not think about it.
-  if ( georef.pixel_interpretation() ==
-       cartography::GeoReference::PixelAsArea ) {
-    Matrix3x3 transform = georef.transform();
-    transform(0,2) -= 0.5 * transform(0,0);
-    transform(1,2) -= 0.5 * transform(1,1);
-    georef.set_transform( transform );
-  }
+  apply_pixel_interpretation(georef);
 
   vw_out() << "\nOutput georeference: \n\t" << georef << std::endl;
 
@@ -984,38 +1009,32 @@ void do_software_rasterization( const ImageViewRef<Vector3>& proj_point_input,
   // rather than filling holes in the cloud first. This is faster.
   rasterizer.set_hole_fill_len(0);
   
+  // Only the DEM is subject to the filter
+  rasterizer.set_filter(opt.filter_type, opt.filter_percentile);
+
   ImageViewRef< PixelGray<float> > rasterizer_fsaa =
     generate_fsaa_raster( rasterizer, opt );
 
   // Write out the DEM. We've set the texture to be the height.
   Vector2 tile_size(vw_settings().default_tile_size(),
                     vw_settings().default_tile_size());
-  if ( !opt.no_dem ){
-    Stopwatch sw2;
-    sw2.start();
-    ImageViewRef< PixelGray<float> > dem
-      = asp::round_image_pixels_skip_nodata(rasterizer_fsaa, opt.rounding_error,
-                                            opt.nodata_value);
-    if (opt.dem_hole_fill_len > 0){
-      // Note that we first cache the tiles of the rasterized DEM, and fill holes
-      // later. This greatly improves the performance.
-      dem = apply_mask(fill_holes(create_mask
-                                  (block_cache(dem, tile_size, opt.num_threads),
-                                   opt.nodata_value),
-                                  opt.hole_fill_mode, opt.hole_fill_num_smooth_iter,
-                                  opt.dem_hole_fill_len),
-                       opt.nodata_value);
-    }
-
-    vw_out()<< "Creating output file that is " << bounding_box(dem).size()
-            << " px.\n";
-    
-    save_image(opt, dem, georef, "DEM");
-    sw2.stop();
-    vw_out(DebugMessage,"asp") << "DEM render time: "
-                               << sw2.elapsed_seconds() << std::endl;
+  if ( !opt.no_dem )
+    write_dem(opt, rasterizer_fsaa, georef, dem_tag(opt, rasterizer.spacing()));
+
+  // Each DEM at another spacing is rasterized tile by tile from a
+  // copy of the rasterizer, which shares the bounds of the cloud
+  // blocks found above, but reads the cloud again.
+  for (int i = 0; i < (int)opt.extra_dem_spacings.size(); i++){
+    asp::OrthoRasterizerView extra_rasterizer = rasterizer;
+    extra_rasterizer.set_spacing(opt.extra_dem_spacings[i]);
+    cartography::GeoReference extra_georef = georef;
+    extra_georef.set_transform(extra_rasterizer.geo_transform());
+    apply_pixel_interpretation(extra_georef);
+    write_dem(opt, extra_rasterizer, extra_georef, dem_tag(opt, opt.extra_dem_spacings[i]));
   }
 
+  rasterizer.set_filter(vw::stereo::f_weighted_average);
+
   // Write triangulation error image if requested
   if ( opt.do_error ) {
     int num_channels = asp::num_channels(opt.pointcloud_files);
@@ -1082,7 +1101,8 @@ void do_software_rasterization( const ImageViewRef<Vector3>& proj_point_input,
   // Write out a normalized version of the DEM, if requested (for debugging)
   if (opt.do_normalize) {
     DiskImageView< PixelGray<float> >
-      dem_image(opt.out_prefix + "-DEM." + opt.output_file_type);
+      dem_image(opt.out_prefix + "-" + dem_tag(opt, rasterizer.spacing()) + "."
+                + opt.output_file_type);
     save_image(opt,
                apply_mask
                (channel_cast<uint8>
@@ -1240,26 +1260,26 @@ int main( int argc, char *argv[] ) {
       }
     }
 
-    // We trade off readability here to avoid ImageViewRef dereferences
-    if (opt.x_offset != 0 || opt.y_offset != 0 || opt.z_offset != 0) {
+    // LAS and CSV files are converted to temporary clouds on each
+    // run, there is no point in indexing those.
+    if (!opt.no_pc_index && !opt.has_las_or_csv){
+      opt.pc_index_file = point_cloud_index_file(opt);
+      opt.pc_index_key  = point_cloud_index_key(opt);
+      opt.pc_projection_key = point_cloud_projection_key(opt, georef, avg_lon);
+    }
+
+    // Convert the points to the projected space in batches, one tile
+    // at a time.
+    Vector3 offset(opt.x_offset, opt.y_offset, opt.z_offset);
+    if (offset != Vector3())
       vw_out() << "\t--> Applying offset: " << opt.x_offset
                << " " << opt.y_offset << " " << opt.z_offset << "\n";
-      do_software_rasterization
-        (geodetic_to_point
-         (asp::point_image_offset
-          (asp::recenter_longitude(cartesian_to_geodetic(point_image,georef),
-                              avg_lon),
-           Vector3(opt.x_offset,
-                   opt.y_offset,
-                   opt.z_offset)),georef),
-         opt, georef, error_image, estim_max_error);
-    } else {
-      do_software_rasterization
-        (geodetic_to_point
-         (asp::recenter_longitude
-          (cartesian_to_geodetic(point_image,georef), avg_lon),georef),
-         opt, georef, error_image, estim_max_error);
-    }
+    asp::BatchPointProjector projector(georef, avg_lon, offset);
+    vw_out(DebugMessage,"asp") << "Point projection: " << projector.kernel_name()
+                               << std::endl;
+    do_software_rasterization
+      (asp::ProjectPointsView< ImageViewRef<Vector3> >(point_image, projector),
+       opt, georef, error_image, estim_max_error);
 
     // Wipe the temporary files
     for (int i = 0; i < (int)tmp_tifs.size(); i++)
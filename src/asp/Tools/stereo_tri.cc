@@ -23,9 +23,12 @@
 #include <asp/Sessions/RPC/RPCModel.h>
 #include <asp/Sessions/RPC/RPCStereoModel.h>
 #include <asp/Core/BundleAdjustUtils.h>
+#include <asp/Core/ProcessPool.h>
+#include <asp/Core/CameraSurrogate.h>
 #include <vw/Cartography.h>
 #include <vw/Camera/CameraModel.h>
 #include <vw/Stereo/StereoView.h>
+#include <boost/bind.hpp>
 #include <ctime>
 
 using namespace vw;
@@ -220,21 +223,33 @@ namespace asp{
 
     vw_out() << "Writing point cloud: " << point_cloud_file << "\n";
 
-    if ( opt.session->name() == "isis" ){
-      // ISIS does not support multi-threading
-      asp::write_approx_gdal_image
-        ( point_cloud_file, shift,
-          stereo_settings().point_cloud_rounding_error,
-          point_cloud, opt,
-          TerminalProgressCallback("asp", "\t--> Triangulating: "));
-    }else{
+    double rounding_error = stereo_settings().point_cloud_rounding_error;
+    TerminalProgressCallback tpc("asp", "\t--> Triangulating: ");
+    if ( stereo_settings().quantize_point_cloud )
+      asp::block_write_quantized_gdal_image
+        ( point_cloud_file, shift, rounding_error, point_cloud, opt, tpc );
+    else
       asp::block_write_approx_gdal_image
-        ( point_cloud_file, shift,
-          stereo_settings().point_cloud_rounding_error,
-          point_cloud, opt,
-          TerminalProgressCallback("asp", "\t--> Triangulating: "));
-    }
+        ( point_cloud_file, shift, rounding_error, point_cloud, opt, tpc );
+  }
+
+  // The same, with worker processes, each of which forms its own
+  // cloud with make_cloud.
+  template <class FactoryT>
+  void process_save_point_cloud(Vector3 const& shift, FactoryT const& make_cloud,
+                                string const& point_cloud_file,
+                                Options const& opt, asp::ViewCounters * counters){
 
+    vw_out() << "Writing point cloud: " << point_cloud_file << "\n";
+
+    double rounding_error = stereo_settings().point_cloud_rounding_error;
+    TerminalProgressCallback tpc("asp", "\t--> Triangulating: ");
+    if ( stereo_settings().quantize_point_cloud )
+      asp::process_write_quantized_gdal_image
+        ( point_cloud_file, shift, rounding_error, make_cloud, opt, tpc, counters );
+    else
+      asp::process_write_approx_gdal_image
+        ( point_cloud_file, shift, rounding_error, make_cloud, opt, tpc, counters );
   }
 
   Vector3 find_approx_points_median(vector<Vector3> const& points){
@@ -337,122 +352,247 @@ namespace asp{
 
 }
 
+/// The triangulated cloud of a set of stereo pairs, with the cameras
+/// it refers to.
+struct Triangulation {
+  vector< boost::shared_ptr<camera::CameraModel> > cameras;
+  stereo::UniverseRadiusFunc universe_radius_func;
+  ImageViewRef<Vector6> point_cloud;
+  Triangulation(): universe_radius_func(Vector3(),0,0){}
+};
+
+/// Make the cameras and form the point cloud. Nothing is shared with
+/// the sessions in opt_vec but file names, so a worker process may
+/// call this for its own copy.
 template <class SessionT>
-void stereo_triangulation( string const& output_prefix,
-                           vector<Options> const& opt_vec ) {
+void form_point_cloud( vector<Options> const& opt_vec, bool verbose,
+                       Triangulation & tri ) {
 
   typedef ImageViewRef<PixelMask<Vector2f> > PVImageT;
   typedef typename SessionT::stereo_model_type StereoModelT;
-  
-  try {
 
-    // Collect the images, cameras, and transforms. The left image is
-    // the same in all n-1 stereo pairs forming the n images multiview
-    // system. Same for cameras and transforms.
-    vector<string> images;
-    vector< boost::shared_ptr<camera::CameraModel> > cameras;
-    vector<typename SessionT::tx_type> transforms;
-    for (int p = 0; p < (int)opt_vec.size(); p++){
-      boost::shared_ptr<camera::CameraModel> camera_model1, camera_model2;
-      opt_vec[p].session->camera_models(camera_model1, camera_model2);
-      boost::shared_ptr<SessionT> sPtr
-        = boost::dynamic_pointer_cast<SessionT>(opt_vec[p].session);
-      
-      if (p == 0){
-        images.push_back(opt_vec[p].in_file1);
-        cameras.push_back(camera_model1);
-        transforms.push_back(sPtr->tx_left());
-      }
-      images.push_back(opt_vec[p].in_file2);
-      cameras.push_back(camera_model2);
-      transforms.push_back(sPtr->tx_right());      
+  // Collect the images, cameras, and transforms. The left image is
+  // the same in all n-1 stereo pairs forming the n images multiview
+  // system. Same for cameras and transforms.
+  vector<string> images;
+  vector< boost::shared_ptr<camera::CameraModel> > & cameras = tri.cameras;
+  vector<typename SessionT::tx_type> transforms;
+  for (int p = 0; p < (int)opt_vec.size(); p++){
+    boost::shared_ptr<camera::CameraModel> camera_model1, camera_model2;
+    opt_vec[p].session->camera_models(camera_model1, camera_model2);
+    boost::shared_ptr<SessionT> sPtr
+      = boost::dynamic_pointer_cast<SessionT>(opt_vec[p].session);
+    
+    if (p == 0){
+      images.push_back(opt_vec[p].in_file1);
+      cameras.push_back(camera_model1);
+      transforms.push_back(sPtr->tx_left());
     }
+    images.push_back(opt_vec[p].in_file2);
+    cameras.push_back(camera_model2);
+    transforms.push_back(sPtr->tx_right());      
+  }
 
-    int num_cams = cameras.size();
-    
+  int num_cams = cameras.size();
+  
 #if ASP_HAVE_PKG_VW_BUNDLEADJUSTMENT
-    // If the user has generated a set of position and pose
-    // corrections using the bundle_adjust program, we read them in
-    // here and incorporate them into our camera models.
-    string ba_pref = stereo_settings().bundle_adjust_prefix;
-    if (ba_pref != ""){
-      for (int c = 0; c < num_cams; c++){
-        Vector3 position_correction;
-        Quaternion<double> pose_correction;
-        string adjust_file = asp::bundle_adjust_file_name(ba_pref, images[c]);
-        if (fs::exists(adjust_file)) {
+  // If the user has generated a set of position and pose
+  // corrections using the bundle_adjust program, we read them in
+  // here and incorporate them into our camera models.
+  string ba_pref = stereo_settings().bundle_adjust_prefix;
+  if (ba_pref != ""){
+    for (int c = 0; c < num_cams; c++){
+      Vector3 position_correction;
+      Quaternion<double> pose_correction;
+      string adjust_file = asp::bundle_adjust_file_name(ba_pref, images[c]);
+      if (fs::exists(adjust_file)) {
+        if (verbose)
           vw_out() << "Using adjusted left camera model: "
                    << adjust_file << endl;
-          read_adjustments(adjust_file, position_correction, pose_correction);
-        cameras[c] =
-          boost::shared_ptr<camera::CameraModel>
-          (new camera::AdjustedCameraModel(cameras[c],
-                                           position_correction,
-                                           pose_correction));
-        }else
-          vw_throw(InputErr() << "Missing adjusted camera model: " <<
-                   adjust_file << ".\n");
-      }
+        read_adjustments(adjust_file, position_correction, pose_correction);
+      cameras[c] =
+        boost::shared_ptr<camera::CameraModel>
+        (new camera::AdjustedCameraModel(cameras[c],
+                                         position_correction,
+                                         pose_correction));
+      }else
+        vw_throw(InputErr() << "Missing adjusted camera model: " <<
+                 adjust_file << ".\n");
     }
+  }
 #endif
 
-    // If the distance from the left camera center to a point is
-    // greater than the universe radius, we remove that pixel and
-    // replace it with a zero vector, which is the missing pixel value
-    // in the point_image.
-    //
-    // We apply the universe radius here and then write the result
-    // directly to a file on disk.
-    stereo::UniverseRadiusFunc universe_radius_func(Vector3(),0,0);
-    try{
-      if ( stereo_settings().universe_center == "camera" ) {
-        if (opt_vec[0].session->name() == "rpc")
-          vw_throw(InputErr() << "Stereo with RPC cameras cannot "
-                   << "have the camera as the universe center.\n");
-        
-        universe_radius_func =
-          stereo::UniverseRadiusFunc(cameras[0]->camera_center(Vector2()),
-                                     stereo_settings().near_universe_radius,
-                                     stereo_settings().far_universe_radius);
-      } else if ( stereo_settings().universe_center == "zero" ) {
-        universe_radius_func =
-          stereo::UniverseRadiusFunc(Vector3(),
-                                     stereo_settings().near_universe_radius,
-                                     stereo_settings().far_universe_radius);
-      }
-    } catch (std::exception &e) {
+  // Triangulation needs only rays, so a surrogate without a ground
+  // grid will do.
+  double surrogate_tol = stereo_settings().camera_surrogate_tol;
+  if (surrogate_tol > 0){
+    // The RPC stereo model needs the RPC cameras themselves
+    if (opt_vec[0].session->name() == "rpc")
+      vw_throw(ArgumentErr() << "Stereo with RPC cameras cannot use "
+               << "camera surrogates. Do not set --camera-surrogate-tol.\n");
+    for (int c = 0; c < num_cams; c++){
+      boost::shared_ptr<asp::CameraSurrogate> surrogate
+        (new asp::CameraSurrogate(*cameras[c], asp::file_image_size(images[c]),
+                                  surrogate_tol));
+      vw_out() << "Camera surrogate for " << images[c] << " has max error "
+               << surrogate->ray_error() << " pixels.\n";
+      cameras[c] = surrogate;
+    }
+  }
+
+  // If the distance from the left camera center to a point is
+  // greater than the universe radius, we remove that pixel and
+  // replace it with a zero vector, which is the missing pixel value
+  // in the point_image.
+  //
+  // We apply the universe radius here and then write the result
+  // directly to a file on disk.
+  stereo::UniverseRadiusFunc & universe_radius_func = tri.universe_radius_func;
+  try{
+    if ( stereo_settings().universe_center == "camera" ) {
+      if (opt_vec[0].session->name() == "rpc")
+        vw_throw(InputErr() << "Stereo with RPC cameras cannot "
+                 << "have the camera as the universe center.\n");
+      
+      universe_radius_func =
+        stereo::UniverseRadiusFunc(cameras[0]->camera_center(Vector2()),
+                                   stereo_settings().near_universe_radius,
+                                   stereo_settings().far_universe_radius);
+    } else if ( stereo_settings().universe_center == "zero" ) {
+      universe_radius_func =
+        stereo::UniverseRadiusFunc(Vector3(),
+                                   stereo_settings().near_universe_radius,
+                                   stereo_settings().far_universe_radius);
+    }
+  } catch (std::exception &e) {
+    if (verbose){
       std::cout << e.what() << std::endl;
       vw_out(WarningMessage) << "Could not find the camera center. "
                              << "Will not be able to filter triangulated "
                              << "points by radius.\n";
     }
+  }
 
-    // Strip the smart pointers and form the stereo model
-    std::vector<const vw::camera::CameraModel *> camera_ptrs;
-    for (int c = 0; c < num_cams; c++)
-      camera_ptrs.push_back(cameras[c].get());
-    StereoModelT stereo_model( camera_ptrs, stereo_settings().use_least_squares );
-    
-    vector<PVImageT> disparity_maps;
-    for (int p = 0; p < (int)opt_vec.size(); p++){
-      disparity_maps.push_back
-        (opt_vec[p].session->pre_pointcloud_hook(opt_vec[p].out_prefix+"-F.tif")); 
-    }
+  // Strip the smart pointers and form the stereo model
+  std::vector<const vw::camera::CameraModel *> camera_ptrs;
+  for (int c = 0; c < num_cams; c++)
+    camera_ptrs.push_back(cameras[c].get());
+  StereoModelT stereo_model( camera_ptrs, stereo_settings().use_least_squares );
+  
+  vector<PVImageT> disparity_maps;
+  for (int p = 0; p < (int)opt_vec.size(); p++){
+    disparity_maps.push_back
+      (opt_vec[p].session->pre_pointcloud_hook(opt_vec[p].out_prefix+"-F.tif")); 
+  }
+
+  // Apply radius function and stereo model in one go
+  tri.point_cloud
+    = per_pixel_filter
+    (stereo_error_triangulate( disparity_maps, transforms, 
+                               stereo_model ), universe_radius_func );
+}
 
-    // Apply radius function and stereo model in one go
+// We are supposed to do the triangulation in trans_crop_win only.
+// So force rasterization in that box only using crop(), then pad
+// with zeros, as we want to have the point cloud to have the same
+// dimensions as L.tif, for the sake of point2dem.
+void cloud_to_save( ImageViewRef<Vector6> const& point_cloud,
+                    ImageViewRef<Vector6> & result ) {
+  BBox2i cbox = stereo_settings().trans_crop_win;
+  ImageViewRef<Vector6> crop_pc = crop(point_cloud, cbox);
+  result = crop(edge_extend(crop_pc, ZeroEdgeExtension()),
+                bounding_box(point_cloud) - cbox.min());
+}
+void cloud_to_save( ImageViewRef<Vector6> const& point_cloud,
+                    ImageViewRef<Vector4> & result ) {
+  BBox2i cbox = stereo_settings().trans_crop_win;
+  ImageViewRef<Vector4> crop_pc = crop(point_and_error_norm(point_cloud), cbox);
+  result = crop(edge_extend(crop_pc, ZeroEdgeExtension()),
+                bounding_box(point_cloud) - cbox.min());
+}
+
+// The points rejected by the universe radius, and all points seen
+asp::ViewCounters universe_radius_counters(Triangulation const* tri){
+  return asp::ViewCounters(tri->universe_radius_func.rejected_points(),
+                           tri->universe_radius_func.total_points(), 0, 0);
+}
+
+/// Forms the cloud to save from scratch, for asp::process_write_image(),
+/// so that each worker process makes its own cameras and opens its
+/// own disparities.
+template <class SessionT, class PixelT>
+struct PointCloudFactory {
+  typedef asp::OwnedView<PixelT> result_type;
+  vector<Options> m_opt_vec;
+  PointCloudFactory( vector<Options> const& opt_vec ): m_opt_vec(opt_vec) {}
+  result_type operator()() const {
+    boost::shared_ptr<Triangulation> tri( new Triangulation );
+    form_point_cloud<SessionT>(m_opt_vec, false, *tri);
+    result_type result;
+    cloud_to_save(tri->point_cloud, result.view);
+    result.owner    = tri;
+    result.counters = boost::bind(&universe_radius_counters, tri.get());
+    return result;
+  }
+};
+
+// Camera surrogates are thread safe even if the cameras are not
+bool use_worker_processes(vector<Options> const& opt_vec){
+  return !opt_vec[0].session->supports_multi_threading() &&
+    stereo_settings().camera_surrogate_tol <= 0;
+}
+
+template <class SessionT, class PixelT>
+void save_cloud( Vector3 const& cloud_center, boost::shared_ptr<Triangulation> & tri,
+                 string const& point_cloud_file, vector<Options> const& opt_vec ) {
+
+  if (use_worker_processes(opt_vec)){
+    // The workers make their own. Close the files of this one, if
+    // it was made for the cloud center.
+    tri.reset();
+    asp::ViewCounters counters;
+    process_save_point_cloud(cloud_center, PointCloudFactory<SessionT, PixelT>(opt_vec),
+                             point_cloud_file, opt_vec[0], &counters);
+
+    // The same statistics the filter prints, summed over the workers
+    vw_out() << "\t--> -- UniverseRadiusFunc --\n"
+             << "\tRejected " << counters[0] << "/" << counters[1] << " vertices ("
+             << 100.0*counters[0]/std::max(counters[1], vw::int64(1)) << "%).\n";
+  }else{
+    ImageViewRef<PixelT> cloud;
+    cloud_to_save(tri->point_cloud, cloud);
+    save_point_cloud(cloud_center, cloud, point_cloud_file, opt_vec[0]);
+  }
+}
+
+template <class SessionT>
+void stereo_triangulation( string const& output_prefix,
+                           vector<Options> const& opt_vec ) {
+
+  try {
+
+    // With worker processes, each forms its own cloud, so it is
+    // formed here only if the cloud center is needed.
+    boost::shared_ptr<Triangulation> tri;
+    bool verbose = true;
+    if (!use_worker_processes(opt_vec)){
+      tri.reset( new Triangulation );
+      form_point_cloud<SessionT>(opt_vec, verbose, *tri);
+    }
+    int num_cams = opt_vec.size() + 1;
     vw_out() << "\t--> Generating a 3D point cloud." << endl;
-    ImageViewRef<Vector6> point_cloud
-      = per_pixel_filter
-      (stereo_error_triangulate( disparity_maps, transforms, 
-                                 stereo_model ), universe_radius_func );
     
     // Compute the point cloud center, unless done by now
     Vector3 cloud_center = Vector3();
     if (!stereo_settings().save_double_precision_point_cloud){
       string cloud_center_file = output_prefix + "-PC-center.txt";
       if (!read_point(cloud_center_file, cloud_center)){
+        if (!tri){
+          tri.reset( new Triangulation );
+          form_point_cloud<SessionT>(opt_vec, verbose, *tri);
+        }
         cloud_center = find_point_cloud_center(opt_vec[0].raster_tile_size,
-                                               point_cloud);
+                                               tri->point_cloud);
         write_point(cloud_center_file, cloud_center);
       }
     }
@@ -461,11 +601,6 @@ void stereo_triangulation( string const& output_prefix,
       return;
     }
 
-    // We are supposed to do the triangulation in trans_crop_win only.
-    // So force rasterization in that box only using crop(), then pad
-    // with zeros, as we want to have the point cloud to have the same
-    // dimensions as L.tif, for the sake of point2dem.
-    BBox2i cbox = stereo_settings().trans_crop_win;
     string point_cloud_file = output_prefix + "-PC.tif";
     if (stereo_settings().compute_error_vector){
 
@@ -474,23 +609,15 @@ void stereo_triangulation( string const& output_prefix,
                                << "vector between rays is not meaningful. "
                                << "Setting it to (err_len, 0, 0)." << endl;
       
-      ImageViewRef<Vector6> crop_pc = crop(point_cloud, cbox);
-      save_point_cloud(cloud_center,
-                       crop(edge_extend(crop_pc, ZeroEdgeExtension()),
-                            bounding_box(point_cloud) - cbox.min()),
-                       point_cloud_file, opt_vec[0]);
+      save_cloud<SessionT, Vector6>(cloud_center, tri, point_cloud_file, opt_vec);
     }else{
-      ImageViewRef<Vector4> crop_pc
-        = crop(point_and_error_norm(point_cloud), cbox);
-      save_point_cloud(cloud_center,
-                       crop(edge_extend(crop_pc, ZeroEdgeExtension()),
-                            bounding_box(point_cloud) - cbox.min()),
-                       point_cloud_file, opt_vec[0]);
+      save_cloud<SessionT, Vector4>(cloud_center, tri, point_cloud_file, opt_vec);
     }
 
     // Must print this at the end, as it contains statistics on the number of
-    // rejected points.
-    vw_out() << "\t--> " << universe_radius_func;
+    // rejected points. Those of worker processes were printed by now.
+    if (tri)
+      vw_out() << "\t--> " << tri->universe_radius_func;
     
   } catch (IOErr const& e) {
     vw_throw( ArgumentErr() << "\nUnable to start at point cloud stage "